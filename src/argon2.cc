@@ -0,0 +1,649 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "argon2.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include <openssl/crypto.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KEEPASS_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#include "cpu.hh"
+#include "exception.hh"
+#include "thread_pool.hh"
+
+namespace {
+
+constexpr uint32_t kSyncPoints = 4;
+constexpr std::size_t kBlockWords = 128;
+constexpr std::size_t kBlockSize = kBlockWords * sizeof(uint64_t);
+constexpr std::size_t kAddressesPerBlock = kBlockWords;
+constexpr std::size_t kPrehashSize = 64;
+constexpr std::size_t kPrehashSeedSize = kPrehashSize + 8;
+
+struct Block {
+  uint64_t v[kBlockWords];
+};
+
+/**
+ * @brief BLAKE2b hash function (RFC 7693), without key support.
+ */
+class Blake2b final {
+ private:
+  static constexpr std::size_t kBlockBytes = 128;
+
+  uint64_t h_[8];
+  uint64_t t_[2] = { 0, 0 };
+  uint8_t buffer_[kBlockBytes];
+  std::size_t buffer_size_ = 0;
+  const std::size_t out_size_;
+
+  static inline uint64_t RotateRight(uint64_t v, uint32_t n) {
+    return (v >> n) | (v << (64 - n));
+  }
+
+  void Compress(const uint8_t* block, bool last);
+
+ public:
+  explicit Blake2b(std::size_t out_size);
+  ~Blake2b();
+
+  void Update(const void* data, std::size_t size);
+  void UpdateLe32(uint32_t value);
+  void Final(uint8_t* out);
+};
+
+constexpr uint64_t kBlake2bInitVec[8] = {
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+  0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+  0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+constexpr uint8_t kBlake2bSigma[12][16] = {
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+  { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+  {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+  {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+  {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+  { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+  { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+  {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+  { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+Blake2b::Blake2b(std::size_t out_size) :
+    out_size_(out_size) {
+  assert(out_size > 0 && out_size <= 64);
+  std::copy(kBlake2bInitVec, kBlake2bInitVec + 8, h_);
+  h_[0] ^= 0x01010000 ^ out_size;
+}
+
+Blake2b::~Blake2b() {
+  OPENSSL_cleanse(h_, sizeof(h_));
+  OPENSSL_cleanse(buffer_, sizeof(buffer_));
+}
+
+void Blake2b::Compress(const uint8_t* block, bool last) {
+  uint64_t m[16];
+  std::memcpy(m, block, sizeof(m));
+
+  uint64_t v[16];
+  std::copy(h_, h_ + 8, v);
+  std::copy(kBlake2bInitVec, kBlake2bInitVec + 8, v + 8);
+  v[12] ^= t_[0];
+  v[13] ^= t_[1];
+  if (last)
+    v[14] = ~v[14];
+
+  auto g = [&](int a, int b, int c, int d, uint64_t x, uint64_t y) {
+    v[a] = v[a] + v[b] + x;
+    v[d] = RotateRight(v[d] ^ v[a], 32);
+    v[c] = v[c] + v[d];
+    v[b] = RotateRight(v[b] ^ v[c], 24);
+    v[a] = v[a] + v[b] + y;
+    v[d] = RotateRight(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];
+    v[b] = RotateRight(v[b] ^ v[c], 63);
+  };
+
+  for (const uint8_t* s : kBlake2bSigma) {
+    g(0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+    g(1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+    g(2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+    g(3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+    g(0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+    g(1, 6, 11, 12, m[s[10]], m[s[11]]);
+    g(2, 7,  8, 13, m[s[12]], m[s[13]]);
+    g(3, 4,  9, 14, m[s[14]], m[s[15]]);
+  }
+
+  for (std::size_t i = 0; i < 8; ++i)
+    h_[i] ^= v[i] ^ v[i + 8];
+
+  OPENSSL_cleanse(m, sizeof(m));
+  OPENSSL_cleanse(v, sizeof(v));
+}
+
+void Blake2b::Update(const void* data, std::size_t size) {
+  const uint8_t* src = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    // The last block must be compressed with the final flag set, so a full
+    // buffer is only compressed once more data arrives.
+    if (buffer_size_ == kBlockBytes) {
+      t_[0] += kBlockBytes;
+      if (t_[0] < kBlockBytes)
+        ++t_[1];
+      Compress(buffer_, false);
+      buffer_size_ = 0;
+    }
+
+    std::size_t count = std::min(kBlockBytes - buffer_size_, size);
+    std::memcpy(buffer_ + buffer_size_, src, count);
+    buffer_size_ += count;
+    src += count;
+    size -= count;
+  }
+}
+
+void Blake2b::UpdateLe32(uint32_t value) {
+  uint8_t bytes[4] = {
+    static_cast<uint8_t>(value),
+    static_cast<uint8_t>(value >> 8),
+    static_cast<uint8_t>(value >> 16),
+    static_cast<uint8_t>(value >> 24)
+  };
+  Update(bytes, sizeof(bytes));
+}
+
+void Blake2b::Final(uint8_t* out) {
+  t_[0] += buffer_size_;
+  if (t_[0] < buffer_size_)
+    ++t_[1];
+  std::fill(buffer_ + buffer_size_, buffer_ + kBlockBytes, 0);
+  Compress(buffer_, true);
+
+  uint8_t digest[64];
+  std::memcpy(digest, h_, sizeof(digest));
+  std::copy(digest, digest + out_size_, out);
+  OPENSSL_cleanse(digest, sizeof(digest));
+}
+
+/** Variable length hash function H' from the Argon2 specification. */
+void blake2b_long(uint8_t* out, std::size_t out_size,
+                  const uint8_t* src, std::size_t src_size) {
+  if (out_size <= 64) {
+    Blake2b hash(out_size);
+    hash.UpdateLe32(static_cast<uint32_t>(out_size));
+    hash.Update(src, src_size);
+    hash.Final(out);
+    return;
+  }
+
+  uint8_t v[64];
+  Blake2b first(64);
+  first.UpdateLe32(static_cast<uint32_t>(out_size));
+  first.Update(src, src_size);
+  first.Final(v);
+  std::copy(v, v + 32, out);
+  out += 32;
+
+  std::size_t remaining = out_size - 32;
+  while (remaining > 64) {
+    Blake2b next(64);
+    next.Update(v, sizeof(v));
+    next.Final(v);
+    std::copy(v, v + 32, out);
+    out += 32;
+    remaining -= 32;
+  }
+
+  Blake2b last(remaining);
+  last.Update(v, sizeof(v));
+  last.Final(out);
+  OPENSSL_cleanse(v, sizeof(v));
+}
+
+inline uint64_t blamka(uint64_t x, uint64_t y) {
+  return x + y + 2 * (x & 0xffffffff) * (y & 0xffffffff);
+}
+
+inline uint64_t rotate_right(uint64_t v, uint32_t n) {
+  return (v >> n) | (v << (64 - n));
+}
+
+inline void blamka_g(uint64_t& a, uint64_t& b, uint64_t& c, uint64_t& d) {
+  a = blamka(a, b);
+  d = rotate_right(d ^ a, 32);
+  c = blamka(c, d);
+  b = rotate_right(b ^ c, 24);
+  a = blamka(a, b);
+  d = rotate_right(d ^ a, 16);
+  c = blamka(c, d);
+  b = rotate_right(b ^ c, 63);
+}
+
+/** The permutation P, applied to 16 words. */
+void blamka_round(uint64_t* v) {
+  blamka_g(v[0], v[4], v[ 8], v[12]);
+  blamka_g(v[1], v[5], v[ 9], v[13]);
+  blamka_g(v[2], v[6], v[10], v[14]);
+  blamka_g(v[3], v[7], v[11], v[15]);
+  blamka_g(v[0], v[5], v[10], v[15]);
+  blamka_g(v[1], v[6], v[11], v[12]);
+  blamka_g(v[2], v[7], v[ 8], v[13]);
+  blamka_g(v[3], v[4], v[ 9], v[14]);
+}
+
+typedef void (*CompressFunction)(const Block&, const Block&, Block&, bool);
+
+/**
+ * The compression function G. Computes @a next from @a prev and @a ref, if
+ * @a with_xor is set the result is xorred into the old content of @a next.
+ * @a next may alias @a ref.
+ */
+void compress_portable(const Block& prev, const Block& ref, Block& next,
+                       bool with_xor) {
+  Block r, tmp;
+  for (std::size_t i = 0; i < kBlockWords; ++i)
+    r.v[i] = prev.v[i] ^ ref.v[i];
+  tmp = r;
+  if (with_xor) {
+    for (std::size_t i = 0; i < kBlockWords; ++i)
+      tmp.v[i] ^= next.v[i];
+  }
+
+  // Rows.
+  for (std::size_t i = 0; i < 8; ++i)
+    blamka_round(r.v + 16 * i);
+
+  // Columns, two words from each row.
+  for (std::size_t i = 0; i < 8; ++i) {
+    uint64_t column[16];
+    for (std::size_t j = 0; j < 8; ++j) {
+      column[2 * j] = r.v[2 * i + 16 * j];
+      column[2 * j + 1] = r.v[2 * i + 16 * j + 1];
+    }
+    blamka_round(column);
+    for (std::size_t j = 0; j < 8; ++j) {
+      r.v[2 * i + 16 * j] = column[2 * j];
+      r.v[2 * i + 16 * j + 1] = column[2 * j + 1];
+    }
+  }
+
+  for (std::size_t i = 0; i < kBlockWords; ++i)
+    next.v[i] = tmp.v[i] ^ r.v[i];
+}
+
+#ifdef KEEPASS_HAVE_AVX2
+#define KEEPASS_TARGET_AVX2 __attribute__((target("avx2")))
+
+KEEPASS_TARGET_AVX2
+inline __m256i avx2_blamka(__m256i x, __m256i y) {
+  __m256i xy = _mm256_mul_epu32(x, y);
+  return _mm256_add_epi64(_mm256_add_epi64(x, y), _mm256_add_epi64(xy, xy));
+}
+
+KEEPASS_TARGET_AVX2
+inline __m256i avx2_rotate_right(__m256i v, int n) {
+  return _mm256_or_si256(_mm256_srli_epi64(v, n), _mm256_slli_epi64(v, 64 - n));
+}
+
+KEEPASS_TARGET_AVX2
+inline void avx2_blamka_g(__m256i& a, __m256i& b, __m256i& c, __m256i& d) {
+  a = avx2_blamka(a, b);
+  d = _mm256_shuffle_epi32(_mm256_xor_si256(d, a), _MM_SHUFFLE(2, 3, 0, 1));
+  c = avx2_blamka(c, d);
+  b = avx2_rotate_right(_mm256_xor_si256(b, c), 24);
+  a = avx2_blamka(a, b);
+  d = avx2_rotate_right(_mm256_xor_si256(d, a), 16);
+  c = avx2_blamka(c, d);
+  b = avx2_rotate_right(_mm256_xor_si256(b, c), 63);
+}
+
+/**
+ * The permutation P on a 4x4 matrix of words held in four registers, one row
+ * per register. The diagonal step rotates the rows into columns and back.
+ */
+KEEPASS_TARGET_AVX2
+inline void avx2_blamka_round(__m256i& a, __m256i& b, __m256i& c,
+                              __m256i& d) {
+  avx2_blamka_g(a, b, c, d);
+  b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1));
+  c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+  d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3));
+  avx2_blamka_g(a, b, c, d);
+  b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3));
+  c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+  d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1));
+}
+
+/** Loads two pairs of words, 16 words apart, into one register. */
+KEEPASS_TARGET_AVX2
+inline __m256i avx2_load_pairs(const uint64_t* src) {
+  return _mm256_inserti128_si256(
+      _mm256_castsi128_si256(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(src))),
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16)), 1);
+}
+
+KEEPASS_TARGET_AVX2
+inline void avx2_store_pairs(uint64_t* dst, __m256i v) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst),
+                   _mm256_castsi256_si128(v));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16),
+                   _mm256_extracti128_si256(v, 1));
+}
+
+KEEPASS_TARGET_AVX2
+void compress_avx2(const Block& prev, const Block& ref, Block& next,
+                   bool with_xor) {
+  __m256i r[32], tmp[32];
+  for (std::size_t i = 0; i < 32; ++i) {
+    r[i] = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev.v) + i),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ref.v) + i));
+    tmp[i] = r[i];
+    if (with_xor) {
+      tmp[i] = _mm256_xor_si256(tmp[i], _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(next.v) + i));
+    }
+  }
+
+  // Rows, each row is four consecutive registers.
+  for (std::size_t i = 0; i < 8; ++i)
+    avx2_blamka_round(r[4 * i], r[4 * i + 1], r[4 * i + 2], r[4 * i + 3]);
+
+  // Columns, two words from each row. Go through memory to regroup them.
+  alignas(32) uint64_t words[kBlockWords];
+  for (std::size_t i = 0; i < 32; ++i)
+    _mm256_store_si256(reinterpret_cast<__m256i*>(words) + i, r[i]);
+
+  for (std::size_t i = 0; i < 8; ++i) {
+    uint64_t* column = words + 2 * i;
+    __m256i a = avx2_load_pairs(column);
+    __m256i b = avx2_load_pairs(column + 32);
+    __m256i c = avx2_load_pairs(column + 64);
+    __m256i d = avx2_load_pairs(column + 96);
+    avx2_blamka_round(a, b, c, d);
+    avx2_store_pairs(column, a);
+    avx2_store_pairs(column + 32, b);
+    avx2_store_pairs(column + 64, c);
+    avx2_store_pairs(column + 96, d);
+  }
+
+  for (std::size_t i = 0; i < 32; ++i) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(next.v) + i,
+        _mm256_xor_si256(tmp[i], _mm256_load_si256(
+            reinterpret_cast<const __m256i*>(words) + i)));
+  }
+}
+#endif
+
+CompressFunction select_compress() {
+#ifdef KEEPASS_HAVE_AVX2
+  if (keepass::cpu_has(keepass::CpuFeature::kAvx2))
+    return compress_avx2;
+#endif
+  return compress_portable;
+}
+
+/**
+ * @brief Memory matrix of a single hash computation, wiped on destruction.
+ */
+struct Memory {
+  uint32_t lanes;
+  uint32_t lane_length;
+  uint32_t segment_length;
+  uint32_t passes;
+  uint32_t type;
+  CompressFunction compress;
+  std::vector<Block> blocks;
+
+  ~Memory() {
+    if (!blocks.empty())
+      OPENSSL_cleanse(blocks.data(), blocks.size() * sizeof(Block));
+  }
+};
+
+/** Generates the next block of pseudo random reference addresses. */
+void next_addresses(const Memory& memory, Block& address, Block& input) {
+  static const Block kZeroBlock = { { 0 } };
+  ++input.v[6];
+  memory.compress(kZeroBlock, input, address, false);
+  memory.compress(kZeroBlock, address, address, false);
+}
+
+/** Maps a pseudo random value onto a block index in the reference lane. */
+uint32_t index_alpha(const Memory& memory, uint32_t pass, uint32_t slice,
+                     uint32_t index, uint32_t pseudo_rand, bool same_lane) {
+  uint64_t area_size;
+  if (pass == 0) {
+    if (slice == 0) {
+      area_size = index - 1;
+    } else if (same_lane) {
+      area_size = slice * memory.segment_length + index - 1;
+    } else {
+      area_size = slice * memory.segment_length - (index == 0 ? 1 : 0);
+    }
+  } else {
+    if (same_lane) {
+      area_size = memory.lane_length - memory.segment_length + index - 1;
+    } else {
+      area_size = memory.lane_length - memory.segment_length -
+          (index == 0 ? 1 : 0);
+    }
+  }
+
+  uint64_t relative_pos = pseudo_rand;
+  relative_pos = (relative_pos * relative_pos) >> 32;
+  relative_pos = area_size - 1 - ((area_size * relative_pos) >> 32);
+
+  uint64_t start_pos = 0;
+  if (pass != 0 && slice != kSyncPoints - 1)
+    start_pos = (slice + 1) * memory.segment_length;
+
+  return static_cast<uint32_t>((start_pos + relative_pos) %
+                               memory.lane_length);
+}
+
+void fill_segment(Memory& memory, uint32_t pass, uint32_t lane,
+                  uint32_t slice) {
+  const bool data_independent =
+      memory.type == static_cast<uint32_t>(keepass::Argon2::Type::kArgon2id) &&
+      pass == 0 && slice < kSyncPoints / 2;
+
+  Block address = { { 0 } };
+  Block input = { { 0 } };
+  if (data_independent) {
+    input.v[0] = pass;
+    input.v[1] = lane;
+    input.v[2] = slice;
+    input.v[3] = static_cast<uint64_t>(memory.lanes) * memory.lane_length;
+    input.v[4] = memory.passes;
+    input.v[5] = memory.type;
+  }
+
+  // The first two blocks of each lane are computed from the initial hash.
+  uint32_t start = 0;
+  if (pass == 0 && slice == 0) {
+    start = 2;
+    if (data_independent)
+      next_addresses(memory, address, input);
+  }
+
+  std::size_t lane_offset =
+      static_cast<std::size_t>(lane) * memory.lane_length;
+  uint32_t curr = slice * memory.segment_length + start;
+
+  for (uint32_t i = start; i < memory.segment_length; ++i, ++curr) {
+    uint32_t prev = curr == 0 ? memory.lane_length - 1 : curr - 1;
+
+    uint64_t pseudo_rand;
+    if (data_independent) {
+      if (i % kAddressesPerBlock == 0)
+        next_addresses(memory, address, input);
+      pseudo_rand = address.v[i % kAddressesPerBlock];
+    } else {
+      pseudo_rand = memory.blocks[lane_offset + prev].v[0];
+    }
+
+    uint32_t ref_lane = static_cast<uint32_t>((pseudo_rand >> 32) %
+                                              memory.lanes);
+    if (pass == 0 && slice == 0)
+      ref_lane = lane;
+
+    uint32_t ref_index = index_alpha(memory, pass, slice, i,
+                                     static_cast<uint32_t>(pseudo_rand),
+                                     ref_lane == lane);
+
+    memory.compress(
+        memory.blocks[lane_offset + prev],
+        memory.blocks[static_cast<std::size_t>(ref_lane) *
+                      memory.lane_length + ref_index],
+        memory.blocks[lane_offset + curr],
+        pass != 0);
+  }
+
+  OPENSSL_cleanse(&address, sizeof(address));
+}
+
+}   // namespace
+
+namespace keepass {
+
+constexpr uint32_t Argon2::kVersion;
+constexpr uint32_t Argon2::kMinMemoryPerLane;
+constexpr uint32_t Argon2::kMaxParallelism;
+
+Argon2::Argon2(Type type, uint32_t iterations, uint32_t memory,
+               uint32_t parallelism) :
+    type_(type),
+    iterations_(iterations),
+    memory_(memory),
+    parallelism_(parallelism) {
+  if (type != Type::kArgon2d && type != Type::kArgon2id)
+    throw InternalError("Unknown Argon2 type.");
+  if (iterations < 1)
+    throw InternalError("Argon2 requires at least one iteration.");
+  if (parallelism < 1 || parallelism > kMaxParallelism)
+    throw InternalError("Argon2 parallelism out of range.");
+  if (memory / kMinMemoryPerLane < parallelism)
+    throw InternalError("Too little memory for Argon2 parallelism.");
+}
+
+std::array<uint8_t, 32> Argon2::Hash(const std::array<uint8_t, 32>& password,
+                                     const std::vector<uint8_t>& salt) const {
+  return Hash(password, salt, Progress());
+}
+
+std::array<uint8_t, 32> Argon2::Hash(const std::array<uint8_t, 32>& password,
+                                     const std::vector<uint8_t>& salt,
+                                     const Progress& progress) const {
+  std::array<uint8_t, 32> tag;
+
+  // Initial hash H0, followed by space for the block and lane indices.
+  uint8_t seed[kPrehashSeedSize];
+  {
+    Blake2b hash(kPrehashSize);
+    hash.UpdateLe32(parallelism_);
+    hash.UpdateLe32(static_cast<uint32_t>(tag.size()));
+    hash.UpdateLe32(memory_);
+    hash.UpdateLe32(iterations_);
+    hash.UpdateLe32(kVersion);
+    hash.UpdateLe32(static_cast<uint32_t>(type_));
+    hash.UpdateLe32(static_cast<uint32_t>(password.size()));
+    hash.Update(password.data(), password.size());
+    hash.UpdateLe32(static_cast<uint32_t>(salt.size()));
+    hash.Update(salt.data(), salt.size());
+    hash.UpdateLe32(static_cast<uint32_t>(secret_.size()));
+    hash.Update(secret_.data(), secret_.size());
+    hash.UpdateLe32(static_cast<uint32_t>(associated_data_.size()));
+    hash.Update(associated_data_.data(), associated_data_.size());
+    hash.Final(seed);
+  }
+
+  Memory memory;
+  memory.lanes = parallelism_;
+  memory.segment_length = memory_ / (parallelism_ * kSyncPoints);
+  memory.lane_length = memory.segment_length * kSyncPoints;
+  memory.passes = iterations_;
+  memory.type = static_cast<uint32_t>(type_);
+  memory.compress = select_compress();
+  memory.blocks.resize(static_cast<std::size_t>(memory.lanes) *
+                       memory.lane_length);
+
+  uint8_t block_bytes[kBlockSize];
+  for (uint32_t lane = 0; lane < memory.lanes; ++lane) {
+    for (uint32_t i = 0; i < 2; ++i) {
+      uint32_t le_index[2] = { i, lane };
+      std::memcpy(seed + kPrehashSize, le_index, sizeof(le_index));
+      blake2b_long(block_bytes, sizeof(block_bytes), seed, sizeof(seed));
+      std::memcpy(memory.blocks[static_cast<std::size_t>(lane) *
+                                memory.lane_length + i].v,
+                  block_bytes, sizeof(block_bytes));
+    }
+  }
+  OPENSSL_cleanse(seed, sizeof(seed));
+
+  // Lanes are independent within a slice, so each slice is filled in parallel
+  // on the shared thread pool, which returns once all lanes are done.
+  ThreadPool& pool = shared_thread_pool();
+  const uint64_t total_slices = static_cast<uint64_t>(iterations_) *
+      kSyncPoints;
+
+  for (uint32_t pass = 0; pass < iterations_; ++pass) {
+    for (uint32_t slice = 0; slice < kSyncPoints; ++slice) {
+      pool.ParallelFor(memory.lanes, [&memory, pass, slice](std::size_t lane) {
+        fill_segment(memory, pass, static_cast<uint32_t>(lane), slice);
+      });
+
+      progress.Report(Progress::Phase::kTransformKey,
+                      static_cast<uint64_t>(pass) * kSyncPoints + slice + 1,
+                      total_slices);
+    }
+  }
+
+  // Xor the last block of each lane together and hash it into the tag.
+  Block final_block = memory.blocks[memory.lane_length - 1];
+  for (uint32_t lane = 1; lane < memory.lanes; ++lane) {
+    const Block& last = memory.blocks[static_cast<std::size_t>(lane) *
+                                      memory.lane_length +
+                                      memory.lane_length - 1];
+    for (std::size_t i = 0; i < kBlockWords; ++i)
+      final_block.v[i] ^= last.v[i];
+  }
+
+  std::memcpy(block_bytes, final_block.v, sizeof(block_bytes));
+  blake2b_long(tag.data(), tag.size(), block_bytes, sizeof(block_bytes));
+  OPENSSL_cleanse(block_bytes, sizeof(block_bytes));
+  OPENSSL_cleanse(&final_block, sizeof(final_block));
+
+  return tag;
+}
+
+}   // namespace keepass
@@ -0,0 +1,99 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "progress.hh"
+
+namespace keepass {
+
+/**
+ * @brief Argon2 memory-hard key derivation function, version 1.3 (RFC 9106).
+ *
+ * The memory is split into lanes that are filled in parallel, one thread per
+ * lane up to the number of hardware threads. The block compression function
+ * uses AVX2 when the CPU supports it.
+ */
+class Argon2 final {
+ public:
+  enum class Type : uint32_t {
+    kArgon2d = 0,
+    kArgon2id = 2
+  };
+
+  static constexpr uint32_t kVersion = 0x13;
+
+  /** Minimum amount of memory, in KiB, per lane. */
+  static constexpr uint32_t kMinMemoryPerLane = 8;
+  static constexpr uint32_t kMaxParallelism = 0xffffff;
+
+ private:
+  Type type_;
+  uint32_t iterations_;
+  uint32_t memory_;
+  uint32_t parallelism_;
+  std::vector<uint8_t> secret_;
+  std::vector<uint8_t> associated_data_;
+
+ public:
+  /**
+   * Constructs an Argon2 instance.
+   * @param [in] type Argon2 variant.
+   * @param [in] iterations Number of passes over the memory, at least one.
+   * @param [in] memory Amount of memory in KiB, at least eight KiB per lane.
+   * @param [in] parallelism Number of lanes.
+   * @throws InternalError If any of the parameters are out of range.
+   */
+  Argon2(Type type, uint32_t iterations, uint32_t memory,
+         uint32_t parallelism);
+
+  Type type() const { return type_; }
+  uint32_t iterations() const { return iterations_; }
+  uint32_t memory() const { return memory_; }
+  uint32_t parallelism() const { return parallelism_; }
+
+  const std::vector<uint8_t>& secret() const { return secret_; }
+  void set_secret(const std::vector<uint8_t>& secret) { secret_ = secret; }
+
+  const std::vector<uint8_t>& associated_data() const {
+    return associated_data_;
+  }
+  void set_associated_data(const std::vector<uint8_t>& associated_data) {
+    associated_data_ = associated_data;
+  }
+
+  std::array<uint8_t, 32> Hash(const std::array<uint8_t, 32>& password,
+                               const std::vector<uint8_t>& salt) const;
+  /**
+   * Derives a 32 byte key from a password.
+   * @param [in] password Password.
+   * @param [in] salt Salt, should be at least 8 bytes.
+   * @param [in] progress Progress is reported in quarter passes under the
+   *                      key transformation phase.
+   * @return Derived key.
+   * @throws CancelledError If the operation was cancelled.
+   */
+  std::array<uint8_t, 32> Hash(const std::array<uint8_t, 32>& password,
+                               const std::vector<uint8_t>& salt,
+                               const Progress& progress) const;
+};
+
+}   // namespace keepass
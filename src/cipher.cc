@@ -21,78 +21,1051 @@
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <limits>
+#include <utility>
 
+#include <openssl/crypto.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KEEPASS_HAVE_AESNI
+#include <immintrin.h>
+#endif
+
+#include "cpu.hh"
 #include "exception.hh"
+#include "io.hh"
 #include "stream.hh"
+#include "thread_pool.hh"
 #include "util.hh"
 
 namespace {
 
-template <std::size_t N>
-using BlockOperation = std::function<std::size_t(const std::array<uint8_t, N>&,
-                                                 std::array<uint8_t, N>&,
-                                                 std::size_t,
-                                                 bool)>;
+/**
+ * Operation applied to a buffer of blocks. Only the last buffer may end with
+ * a partial block. Returns the number of bytes written to the destination
+ * buffer, which has room for one block more than the source buffer.
+ */
+using BlockOperation = std::function<std::size_t(const uint8_t* src,
+                                                 uint8_t* dst,
+                                                 std::size_t src_len,
+                                                 bool last)>;
+
+/** Number of bytes passed to the block operation at a time. */
+constexpr std::size_t kBlockBufferSize = 64 * 1024;
+
+/**
+ * Number of bytes passed to the CBC decryption operation at a time. Large
+ * enough to be split between several threads.
+ */
+constexpr std::size_t kParallelBlockBufferSize = 4 * 1024 * 1024;
+
+/** Minimum number of blocks worth handing to a separate thread. */
+constexpr std::size_t kMinBlocksPerThread = 16 * 1024;
+
+/** Number of bytes between each progress report in block_transform(). */
+constexpr uint64_t kProgressInterval = 1024 * 1024;
 
 template <std::size_t N>
 void block_transform(
     std::istream& src, std::ostream& dst,
-    BlockOperation<N> op) {
-  std::array<uint8_t, N> src_block, dst_block;
-
-  std::streampos pos = src.tellg();
-  src.seekg(0, std::ios::end);
-  std::streampos end = src.tellg();
-  src.seekg(pos, std::ios::beg);
-
-  std::streamsize remaining = end - pos;
+    BlockOperation op,
+    const keepass::Progress& progress = keepass::Progress(),
+    keepass::Progress::Phase phase = keepass::Progress::Phase::kDecrypt,
+    std::size_t buffer_size = kBlockBufferSize) {
+  assert(buffer_size % N == 0);
+
+  // The total size is only known for seekable streams. It's only used for
+  // progress reporting, the last buffer is found by looking ahead.
+  const uint64_t total = keepass::remaining_size(src);
+
+  // Don't allocate more than what is needed for small payloads.
+  if (total > 0)
+    buffer_size = std::min<std::size_t>(buffer_size, (total / N + 1) * N);
+  std::vector<uint8_t> src_buf(buffer_size);
+  std::vector<uint8_t> dst_buf(buffer_size + N);
+  uint64_t done = 0;
+  uint64_t next_report = 0;
 
   while (src.good()) {
-    src.read(reinterpret_cast<char *>(src_block.data()), src_block.size());
-    if (src.eof() && src.gcount() == 0)
-      break;
+    if (done >= next_report) {
+      progress.Report(phase, done, total);
+      next_report += kProgressInterval;
+    }
 
+    src.read(reinterpret_cast<char *>(src_buf.data()), src_buf.size());
     std::streamsize read_bytes = src.gcount();
-    remaining -= read_bytes;
+    if (read_bytes == 0)
+      break;
+
+    done += read_bytes;
+    bool last = src.peek() == std::char_traits<char>::eof();
 
-    std::size_t dst_bytes = op(
-        src_block, dst_block, read_bytes, remaining == 0);
+    std::size_t dst_bytes = op(src_buf.data(), dst_buf.data(), read_bytes,
+                               last);
 
-    dst.write(reinterpret_cast<const char*>(dst_block.data()), dst_bytes);
+    dst.write(reinterpret_cast<const char*>(dst_buf.data()), dst_bytes);
   }
+
+  OPENSSL_cleanse(src_buf.data(), src_buf.size());
+  OPENSSL_cleanse(dst_buf.data(), dst_buf.size());
+
+  progress.Report(phase, done, total > 0 ? total : done);
+}
+
+/**
+ * Splits @a num_blocks blocks into contiguous ranges and calls @a fn for each
+ * range, on the shared thread pool if there are enough blocks to make it pay
+ * off.
+ */
+void parallel_for_blocks(
+    std::size_t num_blocks,
+    const std::function<void(std::size_t, std::size_t)>& fn) {
+  keepass::ThreadPool& pool = keepass::shared_thread_pool();
+  std::size_t num_ranges = std::min(pool.concurrency(),
+                                    num_blocks / kMinBlocksPerThread);
+  if (num_ranges <= 1) {
+    fn(0, num_blocks);
+    return;
+  }
+
+  std::size_t blocks_per_range = (num_blocks + num_ranges - 1) / num_ranges;
+  pool.ParallelFor(num_ranges, [&](std::size_t i) {
+    std::size_t first = std::min(i * blocks_per_range, num_blocks);
+    fn(first, std::min(first + blocks_per_range, num_blocks));
+  });
 }
 
+/** Fixed 8x8 permutation S-boxes of Twofish. */
+constexpr uint8_t kTwofishP8x8[2][256] = {
+  { 0xa9, 0x67, 0xb3, 0xe8, 0x04, 0xfd, 0xa3, 0x76, 0x9a, 0x92, 0x80, 0x78,
+    0xe4, 0xdd, 0xd1, 0x38, 0x0d, 0xc6, 0x35, 0x98, 0x18, 0xf7, 0xec, 0x6c,
+    0x43, 0x75, 0x37, 0x26, 0xfa, 0x13, 0x94, 0x48, 0xf2, 0xd0, 0x8b, 0x30,
+    0x84, 0x54, 0xdf, 0x23, 0x19, 0x5b, 0x3d, 0x59, 0xf3, 0xae, 0xa2, 0x82,
+    0x63, 0x01, 0x83, 0x2e, 0xd9, 0x51, 0x9b, 0x7c, 0xa6, 0xeb, 0xa5, 0xbe,
+    0x16, 0x0c, 0xe3, 0x61, 0xc0, 0x8c, 0x3a, 0xf5, 0x73, 0x2c, 0x25, 0x0b,
+    0xbb, 0x4e, 0x89, 0x6b, 0x53, 0x6a, 0xb4, 0xf1, 0xe1, 0xe6, 0xbd, 0x45,
+    0xe2, 0xf4, 0xb6, 0x66, 0xcc, 0x95, 0x03, 0x56, 0xd4, 0x1c, 0x1e, 0xd7,
+    0xfb, 0xc3, 0x8e, 0xb5, 0xe9, 0xcf, 0xbf, 0xba, 0xea, 0x77, 0x39, 0xaf,
+    0x33, 0xc9, 0x62, 0x71, 0x81, 0x79, 0x09, 0xad, 0x24, 0xcd, 0xf9, 0xd8,
+    0xe5, 0xc5, 0xb9, 0x4d, 0x44, 0x08, 0x86, 0xe7, 0xa1, 0x1d, 0xaa, 0xed,
+    0x06, 0x70, 0xb2, 0xd2, 0x41, 0x7b, 0xa0, 0x11, 0x31, 0xc2, 0x27, 0x90,
+    0x20, 0xf6, 0x60, 0xff, 0x96, 0x5c, 0xb1, 0xab, 0x9e, 0x9c, 0x52, 0x1b,
+    0x5f, 0x93, 0x0a, 0xef, 0x91, 0x85, 0x49, 0xee, 0x2d, 0x4f, 0x8f, 0x3b,
+    0x47, 0x87, 0x6d, 0x46, 0xd6, 0x3e, 0x69, 0x64, 0x2a, 0xce, 0xcb, 0x2f,
+    0xfc, 0x97, 0x05, 0x7a, 0xac, 0x7f, 0xd5, 0x1a, 0x4b, 0x0e, 0xa7, 0x5a,
+    0x28, 0x14, 0x3f, 0x29, 0x88, 0x3c, 0x4c, 0x02, 0xb8, 0xda, 0xb0, 0x17,
+    0x55, 0x1f, 0x8a, 0x7d, 0x57, 0xc7, 0x8d, 0x74, 0xb7, 0xc4, 0x9f, 0x72,
+    0x7e, 0x15, 0x22, 0x12, 0x58, 0x07, 0x99, 0x34, 0x6e, 0x50, 0xde, 0x68,
+    0x65, 0xbc, 0xdb, 0xf8, 0xc8, 0xa8, 0x2b, 0x40, 0xdc, 0xfe, 0x32, 0xa4,
+    0xca, 0x10, 0x21, 0xf0, 0xd3, 0x5d, 0x0f, 0x00, 0x6f, 0x9d, 0x36, 0x42,
+    0x4a, 0x5e, 0xc1, 0xe0 },
+  { 0x75, 0xf3, 0xc6, 0xf4, 0xdb, 0x7b, 0xfb, 0xc8, 0x4a, 0xd3, 0xe6, 0x6b,
+    0x45, 0x7d, 0xe8, 0x4b, 0xd6, 0x32, 0xd8, 0xfd, 0x37, 0x71, 0xf1, 0xe1,
+    0x30, 0x0f, 0xf8, 0x1b, 0x87, 0xfa, 0x06, 0x3f, 0x5e, 0xba, 0xae, 0x5b,
+    0x8a, 0x00, 0xbc, 0x9d, 0x6d, 0xc1, 0xb1, 0x0e, 0x80, 0x5d, 0xd2, 0xd5,
+    0xa0, 0x84, 0x07, 0x14, 0xb5, 0x90, 0x2c, 0xa3, 0xb2, 0x73, 0x4c, 0x54,
+    0x92, 0x74, 0x36, 0x51, 0x38, 0xb0, 0xbd, 0x5a, 0xfc, 0x60, 0x62, 0x96,
+    0x6c, 0x42, 0xf7, 0x10, 0x7c, 0x28, 0x27, 0x8c, 0x13, 0x95, 0x9c, 0xc7,
+    0x24, 0x46, 0x3b, 0x70, 0xca, 0xe3, 0x85, 0xcb, 0x11, 0xd0, 0x93, 0xb8,
+    0xa6, 0x83, 0x20, 0xff, 0x9f, 0x77, 0xc3, 0xcc, 0x03, 0x6f, 0x08, 0xbf,
+    0x40, 0xe7, 0x2b, 0xe2, 0x79, 0x0c, 0xaa, 0x82, 0x41, 0x3a, 0xea, 0xb9,
+    0xe4, 0x9a, 0xa4, 0x97, 0x7e, 0xda, 0x7a, 0x17, 0x66, 0x94, 0xa1, 0x1d,
+    0x3d, 0xf0, 0xde, 0xb3, 0x0b, 0x72, 0xa7, 0x1c, 0xef, 0xd1, 0x53, 0x3e,
+    0x8f, 0x33, 0x26, 0x5f, 0xec, 0x76, 0x2a, 0x49, 0x81, 0x88, 0xee, 0x21,
+    0xc4, 0x1a, 0xeb, 0xd9, 0xc5, 0x39, 0x99, 0xcd, 0xad, 0x31, 0x8b, 0x01,
+    0x18, 0x23, 0xdd, 0x1f, 0x4e, 0x2d, 0xf9, 0x48, 0x4f, 0xf2, 0x65, 0x8e,
+    0x78, 0x5c, 0x58, 0x19, 0x8d, 0xe5, 0x98, 0x57, 0x67, 0x7f, 0x05, 0x64,
+    0xaf, 0x63, 0xb6, 0xfe, 0xf5, 0xb7, 0x3c, 0xa5, 0xce, 0xe9, 0x68, 0x44,
+    0xe0, 0x4d, 0x43, 0x69, 0x29, 0x2e, 0xac, 0x15, 0x59, 0xa8, 0x0a, 0x9e,
+    0x6e, 0x47, 0xdf, 0x34, 0x35, 0x6a, 0xcf, 0xdc, 0x22, 0xc9, 0xc0, 0x9b,
+    0x89, 0xd4, 0xed, 0xab, 0x12, 0xa2, 0x0d, 0x52, 0xbb, 0x02, 0x2f, 0xa9,
+    0xd7, 0x61, 0x1e, 0xb4, 0x50, 0x04, 0xf6, 0xc2, 0x16, 0x25, 0x86, 0x56,
+    0x55, 0x09, 0xbe, 0x91 }
+};
+
+inline uint32_t rotate_left_32(uint32_t v, uint32_t n) {
+  return (v << n) | (v >> (32 - n));
+}
+
+#define KEEPASS_CHACHA20_QUARTER_ROUND(a, b, c, d) \
+  a += b; d ^= a; d = rotate_left_32(d, 16); \
+  c += d; b ^= c; b = rotate_left_32(b, 12); \
+  a += b; d ^= a; d = rotate_left_32(d, 8); \
+  c += d; b ^= c; b = rotate_left_32(b, 7);
+
+/** Generates a single ChaCha20 key stream block. */
+void chacha20_block(const uint32_t* input, uint8_t* dst) {
+  uint32_t x[16];
+  std::copy(input, input + 16, x);
+
+  for (std::size_t i = 0; i < 10; ++i) {
+    KEEPASS_CHACHA20_QUARTER_ROUND(x[0], x[4], x[ 8], x[12]);
+    KEEPASS_CHACHA20_QUARTER_ROUND(x[1], x[5], x[ 9], x[13]);
+    KEEPASS_CHACHA20_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+    KEEPASS_CHACHA20_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+    KEEPASS_CHACHA20_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+    KEEPASS_CHACHA20_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+    KEEPASS_CHACHA20_QUARTER_ROUND(x[2], x[7], x[ 8], x[13]);
+    KEEPASS_CHACHA20_QUARTER_ROUND(x[3], x[4], x[ 9], x[14]);
+  }
+
+  for (std::size_t i = 0; i < 16; ++i)
+    x[i] += input[i];
+
+  std::memcpy(dst, x, sizeof(x));
+  OPENSSL_cleanse(x, sizeof(x));
+}
+
+/**
+ * Computes the block counter, low and high word, of each of @a num_blocks
+ * consecutive blocks.
+ */
+void chacha20_lane_counters(const uint32_t* input, std::size_t num_blocks,
+                            uint32_t* lo, uint32_t* hi) {
+  for (std::size_t i = 0; i < num_blocks; ++i) {
+    lo[i] = input[12] + static_cast<uint32_t>(i);
+    hi[i] = input[13] + (lo[i] < input[12] ? 1 : 0);
+  }
+}
+
+/** Xors @a size bytes of @a src with @a key_stream into @a dst. */
+void xor_key_stream(const uint8_t* src, const uint8_t* key_stream,
+                    uint8_t* dst, std::size_t size) {
+  std::size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(key_stream + i)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+  }
+#endif
+  for (; i < size; ++i)
+    dst[i] = src[i] ^ key_stream[i];
+}
+
+#ifdef KEEPASS_HAVE_AESNI
+#define KEEPASS_TARGET_AESNI __attribute__((target("aes,sse2")))
+#define KEEPASS_TARGET_VAES __attribute__((target("vaes,avx2,aes")))
+
+#define KEEPASS_TARGET_SSE2 __attribute__((target("sse2")))
+#define KEEPASS_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define KEEPASS_TARGET_AVX2 __attribute__((target("avx2")))
+
+KEEPASS_TARGET_SSE2
+inline __m128i sse2_rotate_left_32(__m128i v, int n) {
+  return _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - n));
+}
+
+KEEPASS_TARGET_SSE2
+inline void sse2_chacha20_quarter_round(__m128i& a, __m128i& b, __m128i& c,
+                                        __m128i& d) {
+  a = _mm_add_epi32(a, b); d = sse2_rotate_left_32(_mm_xor_si128(d, a), 16);
+  c = _mm_add_epi32(c, d); b = sse2_rotate_left_32(_mm_xor_si128(b, c), 12);
+  a = _mm_add_epi32(a, b); d = sse2_rotate_left_32(_mm_xor_si128(d, a), 8);
+  c = _mm_add_epi32(c, d); b = sse2_rotate_left_32(_mm_xor_si128(b, c), 7);
+}
+
+/**
+ * Generates four consecutive ChaCha20 key stream blocks. Each register holds
+ * the same state word of all four blocks.
+ */
+KEEPASS_TARGET_SSE2
+void sse2_chacha20_blocks_4(const uint32_t* input, uint8_t* dst) {
+  alignas(16) uint32_t words[16][4];
+  chacha20_lane_counters(input, 4, words[12], words[13]);
+
+  __m128i x[16], orig[16];
+  for (std::size_t i = 0; i < 16; ++i) {
+    orig[i] = i == 12 || i == 13 ?
+        _mm_load_si128(reinterpret_cast<const __m128i*>(words[i])) :
+        _mm_set1_epi32(static_cast<int>(input[i]));
+    x[i] = orig[i];
+  }
+
+  for (std::size_t i = 0; i < 10; ++i) {
+    sse2_chacha20_quarter_round(x[0], x[4], x[ 8], x[12]);
+    sse2_chacha20_quarter_round(x[1], x[5], x[ 9], x[13]);
+    sse2_chacha20_quarter_round(x[2], x[6], x[10], x[14]);
+    sse2_chacha20_quarter_round(x[3], x[7], x[11], x[15]);
+    sse2_chacha20_quarter_round(x[0], x[5], x[10], x[15]);
+    sse2_chacha20_quarter_round(x[1], x[6], x[11], x[12]);
+    sse2_chacha20_quarter_round(x[2], x[7], x[ 8], x[13]);
+    sse2_chacha20_quarter_round(x[3], x[4], x[ 9], x[14]);
+  }
+
+  for (std::size_t i = 0; i < 16; ++i) {
+    _mm_store_si128(reinterpret_cast<__m128i*>(words[i]),
+                    _mm_add_epi32(x[i], orig[i]));
+  }
+
+  // Transpose the words back into consecutive blocks.
+  uint32_t* dst_words = reinterpret_cast<uint32_t*>(dst);
+  for (std::size_t b = 0; b < 4; ++b) {
+    for (std::size_t i = 0; i < 16; ++i)
+      dst_words[16 * b + i] = words[i][b];
+  }
+  OPENSSL_cleanse(words, sizeof(words));
+}
+
+KEEPASS_TARGET_SSSE3
+inline void ssse3_chacha20_quarter_round(__m128i& a, __m128i& b, __m128i& c,
+                                         __m128i& d) {
+  // Rotations by whole bytes are done with a byte shuffle.
+  const __m128i rot16 = _mm_setr_epi8(
+      2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  const __m128i rot8 = _mm_setr_epi8(
+      3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+  a = _mm_add_epi32(a, b);
+  d = _mm_shuffle_epi8(_mm_xor_si128(d, a), rot16);
+  c = _mm_add_epi32(c, d);
+  b = sse2_rotate_left_32(_mm_xor_si128(b, c), 12);
+  a = _mm_add_epi32(a, b);
+  d = _mm_shuffle_epi8(_mm_xor_si128(d, a), rot8);
+  c = _mm_add_epi32(c, d);
+  b = sse2_rotate_left_32(_mm_xor_si128(b, c), 7);
+}
+
+/** Same as sse2_chacha20_blocks_4() but rotates with byte shuffles. */
+KEEPASS_TARGET_SSSE3
+void ssse3_chacha20_blocks_4(const uint32_t* input, uint8_t* dst) {
+  alignas(16) uint32_t words[16][4];
+  chacha20_lane_counters(input, 4, words[12], words[13]);
+
+  __m128i x[16], orig[16];
+  for (std::size_t i = 0; i < 16; ++i) {
+    orig[i] = i == 12 || i == 13 ?
+        _mm_load_si128(reinterpret_cast<const __m128i*>(words[i])) :
+        _mm_set1_epi32(static_cast<int>(input[i]));
+    x[i] = orig[i];
+  }
+
+  for (std::size_t i = 0; i < 10; ++i) {
+    ssse3_chacha20_quarter_round(x[0], x[4], x[ 8], x[12]);
+    ssse3_chacha20_quarter_round(x[1], x[5], x[ 9], x[13]);
+    ssse3_chacha20_quarter_round(x[2], x[6], x[10], x[14]);
+    ssse3_chacha20_quarter_round(x[3], x[7], x[11], x[15]);
+    ssse3_chacha20_quarter_round(x[0], x[5], x[10], x[15]);
+    ssse3_chacha20_quarter_round(x[1], x[6], x[11], x[12]);
+    ssse3_chacha20_quarter_round(x[2], x[7], x[ 8], x[13]);
+    ssse3_chacha20_quarter_round(x[3], x[4], x[ 9], x[14]);
+  }
+
+  for (std::size_t i = 0; i < 16; ++i) {
+    _mm_store_si128(reinterpret_cast<__m128i*>(words[i]),
+                    _mm_add_epi32(x[i], orig[i]));
+  }
+
+  uint32_t* dst_words = reinterpret_cast<uint32_t*>(dst);
+  for (std::size_t b = 0; b < 4; ++b) {
+    for (std::size_t i = 0; i < 16; ++i)
+      dst_words[16 * b + i] = words[i][b];
+  }
+  OPENSSL_cleanse(words, sizeof(words));
+}
+
+KEEPASS_TARGET_AVX2
+inline __m256i avx2_rotate_left_32(__m256i v, int n) {
+  return _mm256_or_si256(_mm256_slli_epi32(v, n),
+                         _mm256_srli_epi32(v, 32 - n));
+}
+
+KEEPASS_TARGET_AVX2
+inline void avx2_chacha20_quarter_round(__m256i& a, __m256i& b, __m256i& c,
+                                        __m256i& d) {
+  // Rotations by whole bytes are done with a byte shuffle.
+  const __m256i rot16 = _mm256_setr_epi8(
+      2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+      2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  const __m256i rot8 = _mm256_setr_epi8(
+      3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+      3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+  a = _mm256_add_epi32(a, b);
+  d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16);
+  c = _mm256_add_epi32(c, d);
+  b = avx2_rotate_left_32(_mm256_xor_si256(b, c), 12);
+  a = _mm256_add_epi32(a, b);
+  d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);
+  c = _mm256_add_epi32(c, d);
+  b = avx2_rotate_left_32(_mm256_xor_si256(b, c), 7);
+}
+
+/** Same as sse2_chacha20_blocks_4() but generates eight blocks. */
+KEEPASS_TARGET_AVX2
+void avx2_chacha20_blocks_8(const uint32_t* input, uint8_t* dst) {
+  alignas(32) uint32_t words[16][8];
+  chacha20_lane_counters(input, 8, words[12], words[13]);
+
+  __m256i x[16], orig[16];
+  for (std::size_t i = 0; i < 16; ++i) {
+    orig[i] = i == 12 || i == 13 ?
+        _mm256_load_si256(reinterpret_cast<const __m256i*>(words[i])) :
+        _mm256_set1_epi32(static_cast<int>(input[i]));
+    x[i] = orig[i];
+  }
+
+  for (std::size_t i = 0; i < 10; ++i) {
+    avx2_chacha20_quarter_round(x[0], x[4], x[ 8], x[12]);
+    avx2_chacha20_quarter_round(x[1], x[5], x[ 9], x[13]);
+    avx2_chacha20_quarter_round(x[2], x[6], x[10], x[14]);
+    avx2_chacha20_quarter_round(x[3], x[7], x[11], x[15]);
+    avx2_chacha20_quarter_round(x[0], x[5], x[10], x[15]);
+    avx2_chacha20_quarter_round(x[1], x[6], x[11], x[12]);
+    avx2_chacha20_quarter_round(x[2], x[7], x[ 8], x[13]);
+    avx2_chacha20_quarter_round(x[3], x[4], x[ 9], x[14]);
+  }
+
+  for (std::size_t i = 0; i < 16; ++i) {
+    _mm256_store_si256(reinterpret_cast<__m256i*>(words[i]),
+                       _mm256_add_epi32(x[i], orig[i]));
+  }
+
+  uint32_t* dst_words = reinterpret_cast<uint32_t*>(dst);
+  for (std::size_t b = 0; b < 8; ++b) {
+    for (std::size_t i = 0; i < 16; ++i)
+      dst_words[16 * b + i] = words[i][b];
+  }
+  OPENSSL_cleanse(words, sizeof(words));
+}
+
+KEEPASS_TARGET_SSE2
+inline void sse2_salsa20_step(__m128i& a, __m128i b, __m128i c, int n) {
+  a = _mm_xor_si128(a, sse2_rotate_left_32(_mm_add_epi32(b, c), n));
+}
+
+/**
+ * Generates four consecutive Salsa20 key stream blocks. Each register holds
+ * the same state word of all four blocks.
+ */
+KEEPASS_TARGET_SSE2
+void sse2_salsa20_blocks_4(const uint32_t* input, uint8_t* dst) {
+  alignas(16) uint32_t words[16][4];
+  for (std::size_t i = 0; i < 4; ++i) {
+    words[8][i] = input[8] + static_cast<uint32_t>(i);
+    words[9][i] = input[9] + (words[8][i] < input[8] ? 1 : 0);
+  }
+
+  __m128i x[16], orig[16];
+  for (std::size_t i = 0; i < 16; ++i) {
+    orig[i] = i == 8 || i == 9 ?
+        _mm_load_si128(reinterpret_cast<const __m128i*>(words[i])) :
+        _mm_set1_epi32(static_cast<int>(input[i]));
+    x[i] = orig[i];
+  }
+
+  for (std::size_t i = 0; i < 10; ++i) {
+    sse2_salsa20_step(x[ 4], x[ 0], x[12],  7);
+    sse2_salsa20_step(x[ 8], x[ 4], x[ 0],  9);
+    sse2_salsa20_step(x[12], x[ 8], x[ 4], 13);
+    sse2_salsa20_step(x[ 0], x[12], x[ 8], 18);
+    sse2_salsa20_step(x[ 9], x[ 5], x[ 1],  7);
+    sse2_salsa20_step(x[13], x[ 9], x[ 5],  9);
+    sse2_salsa20_step(x[ 1], x[13], x[ 9], 13);
+    sse2_salsa20_step(x[ 5], x[ 1], x[13], 18);
+    sse2_salsa20_step(x[14], x[10], x[ 6],  7);
+    sse2_salsa20_step(x[ 2], x[14], x[10],  9);
+    sse2_salsa20_step(x[ 6], x[ 2], x[14], 13);
+    sse2_salsa20_step(x[10], x[ 6], x[ 2], 18);
+    sse2_salsa20_step(x[ 3], x[15], x[11],  7);
+    sse2_salsa20_step(x[ 7], x[ 3], x[15],  9);
+    sse2_salsa20_step(x[11], x[ 7], x[ 3], 13);
+    sse2_salsa20_step(x[15], x[11], x[ 7], 18);
+    sse2_salsa20_step(x[ 1], x[ 0], x[ 3],  7);
+    sse2_salsa20_step(x[ 2], x[ 1], x[ 0],  9);
+    sse2_salsa20_step(x[ 3], x[ 2], x[ 1], 13);
+    sse2_salsa20_step(x[ 0], x[ 3], x[ 2], 18);
+    sse2_salsa20_step(x[ 6], x[ 5], x[ 4],  7);
+    sse2_salsa20_step(x[ 7], x[ 6], x[ 5],  9);
+    sse2_salsa20_step(x[ 4], x[ 7], x[ 6], 13);
+    sse2_salsa20_step(x[ 5], x[ 4], x[ 7], 18);
+    sse2_salsa20_step(x[11], x[10], x[ 9],  7);
+    sse2_salsa20_step(x[ 8], x[11], x[10],  9);
+    sse2_salsa20_step(x[ 9], x[ 8], x[11], 13);
+    sse2_salsa20_step(x[10], x[ 9], x[ 8], 18);
+    sse2_salsa20_step(x[12], x[15], x[14],  7);
+    sse2_salsa20_step(x[13], x[12], x[15],  9);
+    sse2_salsa20_step(x[14], x[13], x[12], 13);
+    sse2_salsa20_step(x[15], x[14], x[13], 18);
+  }
+
+  for (std::size_t i = 0; i < 16; ++i) {
+    _mm_store_si128(reinterpret_cast<__m128i*>(words[i]),
+                    _mm_add_epi32(x[i], orig[i]));
+  }
+
+  uint32_t* dst_words = reinterpret_cast<uint32_t*>(dst);
+  for (std::size_t b = 0; b < 4; ++b) {
+    for (std::size_t i = 0; i < 16; ++i)
+      dst_words[16 * b + i] = words[i][b];
+  }
+  OPENSSL_cleanse(words, sizeof(words));
+}
+
+KEEPASS_TARGET_AVX2
+inline void avx2_salsa20_step(__m256i& a, __m256i b, __m256i c, int n) {
+  a = _mm256_xor_si256(a, avx2_rotate_left_32(_mm256_add_epi32(b, c), n));
+}
+
+/** Same as sse2_salsa20_blocks_4() but generates eight blocks. */
+KEEPASS_TARGET_AVX2
+void avx2_salsa20_blocks_8(const uint32_t* input, uint8_t* dst) {
+  alignas(32) uint32_t words[16][8];
+  for (std::size_t i = 0; i < 8; ++i) {
+    words[8][i] = input[8] + static_cast<uint32_t>(i);
+    words[9][i] = input[9] + (words[8][i] < input[8] ? 1 : 0);
+  }
+
+  __m256i x[16], orig[16];
+  for (std::size_t i = 0; i < 16; ++i) {
+    orig[i] = i == 8 || i == 9 ?
+        _mm256_load_si256(reinterpret_cast<const __m256i*>(words[i])) :
+        _mm256_set1_epi32(static_cast<int>(input[i]));
+    x[i] = orig[i];
+  }
+
+  for (std::size_t i = 0; i < 10; ++i) {
+    avx2_salsa20_step(x[ 4], x[ 0], x[12],  7);
+    avx2_salsa20_step(x[ 8], x[ 4], x[ 0],  9);
+    avx2_salsa20_step(x[12], x[ 8], x[ 4], 13);
+    avx2_salsa20_step(x[ 0], x[12], x[ 8], 18);
+    avx2_salsa20_step(x[ 9], x[ 5], x[ 1],  7);
+    avx2_salsa20_step(x[13], x[ 9], x[ 5],  9);
+    avx2_salsa20_step(x[ 1], x[13], x[ 9], 13);
+    avx2_salsa20_step(x[ 5], x[ 1], x[13], 18);
+    avx2_salsa20_step(x[14], x[10], x[ 6],  7);
+    avx2_salsa20_step(x[ 2], x[14], x[10],  9);
+    avx2_salsa20_step(x[ 6], x[ 2], x[14], 13);
+    avx2_salsa20_step(x[10], x[ 6], x[ 2], 18);
+    avx2_salsa20_step(x[ 3], x[15], x[11],  7);
+    avx2_salsa20_step(x[ 7], x[ 3], x[15],  9);
+    avx2_salsa20_step(x[11], x[ 7], x[ 3], 13);
+    avx2_salsa20_step(x[15], x[11], x[ 7], 18);
+    avx2_salsa20_step(x[ 1], x[ 0], x[ 3],  7);
+    avx2_salsa20_step(x[ 2], x[ 1], x[ 0],  9);
+    avx2_salsa20_step(x[ 3], x[ 2], x[ 1], 13);
+    avx2_salsa20_step(x[ 0], x[ 3], x[ 2], 18);
+    avx2_salsa20_step(x[ 6], x[ 5], x[ 4],  7);
+    avx2_salsa20_step(x[ 7], x[ 6], x[ 5],  9);
+    avx2_salsa20_step(x[ 4], x[ 7], x[ 6], 13);
+    avx2_salsa20_step(x[ 5], x[ 4], x[ 7], 18);
+    avx2_salsa20_step(x[11], x[10], x[ 9],  7);
+    avx2_salsa20_step(x[ 8], x[11], x[10],  9);
+    avx2_salsa20_step(x[ 9], x[ 8], x[11], 13);
+    avx2_salsa20_step(x[10], x[ 9], x[ 8], 18);
+    avx2_salsa20_step(x[12], x[15], x[14],  7);
+    avx2_salsa20_step(x[13], x[12], x[15],  9);
+    avx2_salsa20_step(x[14], x[13], x[12], 13);
+    avx2_salsa20_step(x[15], x[14], x[13], 18);
+  }
+
+  for (std::size_t i = 0; i < 16; ++i) {
+    _mm256_store_si256(reinterpret_cast<__m256i*>(words[i]),
+                       _mm256_add_epi32(x[i], orig[i]));
+  }
+
+  uint32_t* dst_words = reinterpret_cast<uint32_t*>(dst);
+  for (std::size_t b = 0; b < 8; ++b) {
+    for (std::size_t i = 0; i < 16; ++i)
+      dst_words[16 * b + i] = words[i][b];
+  }
+  OPENSSL_cleanse(words, sizeof(words));
+}
+
+/** Vector form of TwofishCipher::G(), one table lookup per byte and lane. */
+KEEPASS_TARGET_AVX2
+inline __m256i avx2_twofish_g(const uint32_t (*sbox_mds)[256], __m256i x) {
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  __m256i t = _mm256_i32gather_epi32(
+      reinterpret_cast<const int*>(sbox_mds[0]),
+      _mm256_and_si256(x, mask), 4);
+  t = _mm256_xor_si256(t, _mm256_i32gather_epi32(
+      reinterpret_cast<const int*>(sbox_mds[1]),
+      _mm256_and_si256(_mm256_srli_epi32(x, 8), mask), 4));
+  t = _mm256_xor_si256(t, _mm256_i32gather_epi32(
+      reinterpret_cast<const int*>(sbox_mds[2]),
+      _mm256_and_si256(_mm256_srli_epi32(x, 16), mask), 4));
+  return _mm256_xor_si256(t, _mm256_i32gather_epi32(
+      reinterpret_cast<const int*>(sbox_mds[3]),
+      _mm256_srli_epi32(x, 24), 4));
+}
+
+/**
+ * Loads eight Twofish blocks and adds whitening. Each register holds the same
+ * word of all eight blocks.
+ */
+KEEPASS_TARGET_AVX2
+inline void avx2_twofish_load_8(const uint8_t* src, const uint32_t* whitening,
+                                __m256i* x) {
+  const __m256i index = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+  for (std::size_t i = 0; i < 4; ++i) {
+    x[i] = _mm256_xor_si256(
+        _mm256_i32gather_epi32(reinterpret_cast<const int*>(src) + i, index,
+                               4),
+        _mm256_set1_epi32(static_cast<int>(whitening[i])));
+  }
+}
+
+/** Adds whitening and stores eight blocks loaded by avx2_twofish_load_8(). */
+KEEPASS_TARGET_AVX2
+inline void avx2_twofish_store_8(const __m256i* x, const uint32_t* whitening,
+                                 uint8_t* dst) {
+  alignas(32) uint32_t words[4][8];
+  for (std::size_t i = 0; i < 4; ++i) {
+    _mm256_store_si256(reinterpret_cast<__m256i*>(words[i]),
+                       _mm256_xor_si256(x[i], _mm256_set1_epi32(
+                           static_cast<int>(whitening[i]))));
+  }
+
+  for (std::size_t b = 0; b < 8; ++b) {
+    for (std::size_t i = 0; i < 4; ++i)
+      std::memcpy(dst + 16 * b + 4 * i, &words[i][b], 4);
+  }
+  OPENSSL_cleanse(words, sizeof(words));
+}
+
+/** Decrypts eight Twofish blocks, see TwofishCipher::DecryptBlock(). */
+KEEPASS_TARGET_AVX2
+void avx2_twofish_decrypt_blocks_8(const uint32_t* sub_keys,
+                                   const uint32_t (*sbox_mds)[256],
+                                   const uint8_t* src, uint8_t* dst) {
+  __m256i x[4];
+  avx2_twofish_load_8(src, sub_keys + 4, x);
+
+  for (std::size_t r = 16; r-- > 0;) {
+    __m256i t0 = avx2_twofish_g(sbox_mds, x[0]);
+    __m256i t1 = avx2_twofish_g(sbox_mds, avx2_rotate_left_32(x[1], 8));
+
+    x[2] = avx2_rotate_left_32(x[2], 1);
+    x[2] = _mm256_xor_si256(x[2], _mm256_add_epi32(
+        _mm256_add_epi32(t0, t1),
+        _mm256_set1_epi32(static_cast<int>(sub_keys[8 + 2 * r]))));
+    x[3] = _mm256_xor_si256(x[3], _mm256_add_epi32(
+        _mm256_add_epi32(t0, _mm256_add_epi32(t1, t1)),
+        _mm256_set1_epi32(static_cast<int>(sub_keys[8 + 2 * r + 1]))));
+    x[3] = avx2_rotate_left_32(x[3], 31);
+
+    if (r) {
+      std::swap(x[0], x[2]);
+      std::swap(x[1], x[3]);
+    }
+  }
+
+  avx2_twofish_store_8(x, sub_keys, dst);
+}
+
+/** Encrypts eight Twofish blocks, see TwofishCipher::EncryptBlock(). */
+KEEPASS_TARGET_AVX2
+void avx2_twofish_encrypt_blocks_8(const uint32_t* sub_keys,
+                                   const uint32_t (*sbox_mds)[256],
+                                   const uint8_t* src, uint8_t* dst) {
+  __m256i x[4];
+  avx2_twofish_load_8(src, sub_keys, x);
+
+  for (std::size_t r = 0; r < 16; ++r) {
+    __m256i t0 = avx2_twofish_g(sbox_mds, x[0]);
+    __m256i t1 = avx2_twofish_g(sbox_mds, avx2_rotate_left_32(x[1], 8));
+
+    x[3] = avx2_rotate_left_32(x[3], 1);
+    x[2] = _mm256_xor_si256(x[2], _mm256_add_epi32(
+        _mm256_add_epi32(t0, t1),
+        _mm256_set1_epi32(static_cast<int>(sub_keys[8 + 2 * r]))));
+    x[3] = _mm256_xor_si256(x[3], _mm256_add_epi32(
+        _mm256_add_epi32(t0, _mm256_add_epi32(t1, t1)),
+        _mm256_set1_epi32(static_cast<int>(sub_keys[8 + 2 * r + 1]))));
+    x[2] = avx2_rotate_left_32(x[2], 31);
+
+    if (r < 15) {
+      std::swap(x[0], x[2]);
+      std::swap(x[1], x[3]);
+    }
+  }
+
+  avx2_twofish_store_8(x, sub_keys + 4, dst);
+}
+
+/** Computes w0, w0^w1, w0^w1^w2, w0^w1^w2^w3 of the 32-bit words in @a v. */
+KEEPASS_TARGET_AESNI
+inline __m128i aes256_prefix_xor(__m128i v) {
+  __m128i t = _mm_slli_si128(v, 4);
+  v = _mm_xor_si128(v, t);
+  t = _mm_slli_si128(t, 4);
+  v = _mm_xor_si128(v, t);
+  t = _mm_slli_si128(t, 4);
+  return _mm_xor_si128(v, t);
+}
+
+KEEPASS_TARGET_AESNI
+inline __m128i aes256_expand_even(__m128i key, __m128i assist) {
+  assist = _mm_shuffle_epi32(assist, 0xff);
+  return _mm_xor_si128(aes256_prefix_xor(key), assist);
+}
+
+KEEPASS_TARGET_AESNI
+inline __m128i aes256_expand_odd(__m128i even_key, __m128i odd_key) {
+  __m128i assist = _mm_shuffle_epi32(
+      _mm_aeskeygenassist_si128(even_key, 0x00), 0xaa);
+  return _mm_xor_si128(aes256_prefix_xor(odd_key), assist);
+}
+
+/**
+ * Expands a 256-bit AES key into the 15 round keys used for encryption.
+ * _mm_aeskeygenassist_si128 requires its round constant to be an immediate,
+ * hence the unrolled expansion.
+ */
+KEEPASS_TARGET_AESNI
+void aesni_expand_key_256(const uint8_t* key, uint8_t (*round_keys)[16]) {
+  __m128i k[15];
+  k[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+  k[1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + 16));
+
+#define KEEPASS_AES256_EXPAND(i, rcon) \
+  k[i] = aes256_expand_even(k[i - 2], \
+                            _mm_aeskeygenassist_si128(k[i - 1], rcon)); \
+  k[i + 1] = aes256_expand_odd(k[i], k[i - 1]);
+
+  KEEPASS_AES256_EXPAND(2, 0x01);
+  KEEPASS_AES256_EXPAND(4, 0x02);
+  KEEPASS_AES256_EXPAND(6, 0x04);
+  KEEPASS_AES256_EXPAND(8, 0x08);
+  KEEPASS_AES256_EXPAND(10, 0x10);
+  KEEPASS_AES256_EXPAND(12, 0x20);
+#undef KEEPASS_AES256_EXPAND
+  k[14] = aes256_expand_even(k[12], _mm_aeskeygenassist_si128(k[13], 0x40));
+
+  for (std::size_t i = 0; i < 15; ++i)
+    _mm_store_si128(reinterpret_cast<__m128i*>(round_keys[i]), k[i]);
+}
+
+/**
+ * Derives the decryption round keys, for use with AESDEC, from the encryption
+ * round keys.
+ */
+KEEPASS_TARGET_AESNI
+void aesni_invert_key_256(const uint8_t (*enc_round_keys)[16],
+                          uint8_t (*dec_round_keys)[16]) {
+  for (std::size_t i = 0; i < 15; ++i) {
+    __m128i k = _mm_load_si128(
+        reinterpret_cast<const __m128i*>(enc_round_keys[14 - i]));
+    if (i != 0 && i != 14)
+      k = _mm_aesimc_si128(k);
+    _mm_store_si128(reinterpret_cast<__m128i*>(dec_round_keys[i]), k);
+  }
+}
+
+/** Number of independent blocks kept in flight by the ECB kernels. */
+constexpr std::size_t kAesniParallelBlocks = 8;
+
+/**
+ * Encrypts independent blocks, eight at a time so that the AESENC latency is
+ * hidden behind the other blocks in flight.
+ */
+KEEPASS_TARGET_AESNI
+void aesni_encrypt_blocks(const uint8_t (*round_keys)[16], const uint8_t* src,
+                          uint8_t* dst, std::size_t num_blocks) {
+  __m128i k[15];
+  for (std::size_t i = 0; i < 15; ++i)
+    k[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(round_keys[i]));
+
+  const __m128i* src_blocks = reinterpret_cast<const __m128i*>(src);
+  __m128i* dst_blocks = reinterpret_cast<__m128i*>(dst);
+
+  std::size_t i = 0;
+  for (; i + kAesniParallelBlocks <= num_blocks; i += kAesniParallelBlocks) {
+    __m128i b[kAesniParallelBlocks];
+    for (std::size_t j = 0; j < kAesniParallelBlocks; ++j)
+      b[j] = _mm_xor_si128(_mm_loadu_si128(src_blocks + i + j), k[0]);
+    for (std::size_t r = 1; r < 14; ++r) {
+      for (std::size_t j = 0; j < kAesniParallelBlocks; ++j)
+        b[j] = _mm_aesenc_si128(b[j], k[r]);
+    }
+    for (std::size_t j = 0; j < kAesniParallelBlocks; ++j)
+      _mm_storeu_si128(dst_blocks + i + j, _mm_aesenclast_si128(b[j], k[14]));
+  }
+
+  for (; i < num_blocks; ++i) {
+    __m128i b = _mm_xor_si128(_mm_loadu_si128(src_blocks + i), k[0]);
+    for (std::size_t r = 1; r < 14; ++r)
+      b = _mm_aesenc_si128(b, k[r]);
+    _mm_storeu_si128(dst_blocks + i, _mm_aesenclast_si128(b, k[14]));
+  }
+}
+
+/** Same as aesni_encrypt_blocks() but decrypts, using inverted round keys. */
+KEEPASS_TARGET_AESNI
+void aesni_decrypt_blocks(const uint8_t (*round_keys)[16], const uint8_t* src,
+                          uint8_t* dst, std::size_t num_blocks) {
+  __m128i k[15];
+  for (std::size_t i = 0; i < 15; ++i)
+    k[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(round_keys[i]));
+
+  const __m128i* src_blocks = reinterpret_cast<const __m128i*>(src);
+  __m128i* dst_blocks = reinterpret_cast<__m128i*>(dst);
+
+  std::size_t i = 0;
+  for (; i + kAesniParallelBlocks <= num_blocks; i += kAesniParallelBlocks) {
+    __m128i b[kAesniParallelBlocks];
+    for (std::size_t j = 0; j < kAesniParallelBlocks; ++j)
+      b[j] = _mm_xor_si128(_mm_loadu_si128(src_blocks + i + j), k[0]);
+    for (std::size_t r = 1; r < 14; ++r) {
+      for (std::size_t j = 0; j < kAesniParallelBlocks; ++j)
+        b[j] = _mm_aesdec_si128(b[j], k[r]);
+    }
+    for (std::size_t j = 0; j < kAesniParallelBlocks; ++j)
+      _mm_storeu_si128(dst_blocks + i + j, _mm_aesdeclast_si128(b[j], k[14]));
+  }
+
+  for (; i < num_blocks; ++i) {
+    __m128i b = _mm_xor_si128(_mm_loadu_si128(src_blocks + i), k[0]);
+    for (std::size_t r = 1; r < 14; ++r)
+      b = _mm_aesdec_si128(b, k[r]);
+    _mm_storeu_si128(dst_blocks + i, _mm_aesdeclast_si128(b, k[14]));
+  }
+}
+
+/** CBC encryption is inherently serial, but keeps the chain in a register. */
+KEEPASS_TARGET_AESNI
+void aesni_encrypt_blocks_cbc(const uint8_t (*round_keys)[16],
+                              const uint8_t* src, uint8_t* dst,
+                              std::size_t num_blocks, uint8_t* iv) {
+  __m128i k[15];
+  for (std::size_t i = 0; i < 15; ++i)
+    k[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(round_keys[i]));
+
+  const __m128i* src_blocks = reinterpret_cast<const __m128i*>(src);
+  __m128i* dst_blocks = reinterpret_cast<__m128i*>(dst);
+
+  __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv));
+  for (std::size_t i = 0; i < num_blocks; ++i) {
+    b = _mm_xor_si128(b, _mm_loadu_si128(src_blocks + i));
+    b = _mm_xor_si128(b, k[0]);
+    for (std::size_t r = 1; r < 14; ++r)
+      b = _mm_aesenc_si128(b, k[r]);
+    b = _mm_aesenclast_si128(b, k[14]);
+    _mm_storeu_si128(dst_blocks + i, b);
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(iv), b);
+}
+
+/**
+ * Encrypts two independent blocks @a rounds times. The blocks are
+ * interleaved so that the latency of one AESENC is hidden behind the other.
+ */
+KEEPASS_TARGET_AESNI
+void aesni_transform_256(const uint8_t (*round_keys)[16], uint8_t* data,
+                         uint64_t rounds) {
+  __m128i k[15];
+  for (std::size_t i = 0; i < 15; ++i)
+    k[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(round_keys[i]));
+
+  __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+  __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+
+  for (uint64_t r = 0; r < rounds; ++r) {
+    b0 = _mm_xor_si128(b0, k[0]);
+    b1 = _mm_xor_si128(b1, k[0]);
+    for (std::size_t i = 1; i < 14; ++i) {
+      b0 = _mm_aesenc_si128(b0, k[i]);
+      b1 = _mm_aesenc_si128(b1, k[i]);
+    }
+    b0 = _mm_aesenclast_si128(b0, k[14]);
+    b1 = _mm_aesenclast_si128(b1, k[14]);
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(data), b0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(data + 16), b1);
+}
+
+/**
+ * Signature of the multi-lane transformation kernels. Each lane has its own
+ * 15 round keys and its own 32 bytes of data.
+ */
+typedef void (*LaneKernel)(const uint8_t* const* round_keys,
+                           uint8_t* const* data,
+                           uint64_t rounds);
+
+KEEPASS_TARGET_AESNI
+inline __m128i lane_key_128(const uint8_t* const* round_keys, std::size_t l,
+                            std::size_t i) {
+  return _mm_load_si128(
+      reinterpret_cast<const __m128i*>(round_keys[l] + 16 * i));
+}
+
+KEEPASS_TARGET_VAES
+inline __m256i lane_key_256(const uint8_t* const* round_keys, std::size_t l,
+                            std::size_t i) {
+  return _mm256_broadcastsi128_si256(_mm_load_si128(
+      reinterpret_cast<const __m128i*>(round_keys[l] + 16 * i)));
+}
+
+/** Transforms four keys, eight independent blocks, at a time using AES-NI. */
+KEEPASS_TARGET_AESNI
+void aesni_transform_lanes_4(const uint8_t* const* round_keys,
+                             uint8_t* const* data,
+                             uint64_t rounds) {
+  static constexpr std::size_t kLanes = 4;
+
+  __m128i b[kLanes * 2];
+  for (std::size_t l = 0; l < kLanes; ++l) {
+    b[2 * l] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data[l]));
+    b[2 * l + 1] =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data[l] + 16));
+  }
+
+  for (uint64_t r = 0; r < rounds; ++r) {
+    for (std::size_t l = 0; l < kLanes; ++l) {
+      __m128i k = lane_key_128(round_keys, l, 0);
+      b[2 * l] = _mm_xor_si128(b[2 * l], k);
+      b[2 * l + 1] = _mm_xor_si128(b[2 * l + 1], k);
+    }
+    for (std::size_t i = 1; i < 14; ++i) {
+      for (std::size_t l = 0; l < kLanes; ++l) {
+        __m128i k = lane_key_128(round_keys, l, i);
+        b[2 * l] = _mm_aesenc_si128(b[2 * l], k);
+        b[2 * l + 1] = _mm_aesenc_si128(b[2 * l + 1], k);
+      }
+    }
+    for (std::size_t l = 0; l < kLanes; ++l) {
+      __m128i k = lane_key_128(round_keys, l, 14);
+      b[2 * l] = _mm_aesenclast_si128(b[2 * l], k);
+      b[2 * l + 1] = _mm_aesenclast_si128(b[2 * l + 1], k);
+    }
+  }
+
+  for (std::size_t l = 0; l < kLanes; ++l) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data[l]), b[2 * l]);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data[l] + 16), b[2 * l + 1]);
+  }
+}
+
+/**
+ * Transforms eight keys at a time using VAES. Both halves of a key share a
+ * 256-bit register, and thereby a single round instruction.
+ */
+KEEPASS_TARGET_VAES
+void vaes_transform_lanes_8(const uint8_t* const* round_keys,
+                            uint8_t* const* data,
+                            uint64_t rounds) {
+  static constexpr std::size_t kLanes = 8;
+
+  __m256i b[kLanes];
+  for (std::size_t l = 0; l < kLanes; ++l)
+    b[l] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data[l]));
+
+  for (uint64_t r = 0; r < rounds; ++r) {
+    for (std::size_t l = 0; l < kLanes; ++l)
+      b[l] = _mm256_xor_si256(b[l], lane_key_256(round_keys, l, 0));
+    for (std::size_t i = 1; i < 14; ++i) {
+      for (std::size_t l = 0; l < kLanes; ++l)
+        b[l] = _mm256_aesenc_epi128(b[l], lane_key_256(round_keys, l, i));
+    }
+    for (std::size_t l = 0; l < kLanes; ++l)
+      b[l] = _mm256_aesenclast_epi128(b[l], lane_key_256(round_keys, l, 14));
+  }
+
+  for (std::size_t l = 0; l < kLanes; ++l)
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data[l]), b[l]);
+}
+
+/**
+ * Feeds jobs through a @a W lane kernel. Lanes run in lock step for as many
+ * rounds as the shortest active job needs, after which finished lanes are
+ * refilled with new jobs. Idle lanes operate on scratch data.
+ */
+template <std::size_t W, typename Job>
+void transform_lanes(std::vector<Job>& jobs,
+                     const std::vector<const uint8_t*>& job_keys,
+                     LaneKernel kernel) {
+  static constexpr std::size_t kIdle = static_cast<std::size_t>(-1);
+
+  alignas(32) std::array<uint8_t, 32> scratch = { { 0 } };
+
+  std::array<std::size_t, W> lane_job;
+  std::array<uint64_t, W> lane_remaining;
+  const uint8_t* lane_keys[W];
+  uint8_t* lane_data[W];
+
+  std::size_t next_job = 0;
+  std::size_t active = 0;
+
+  auto assign = [&](std::size_t l) {
+    // Jobs without any rounds are already done.
+    while (next_job < jobs.size() && jobs[next_job].rounds == 0)
+      ++next_job;
+
+    if (next_job < jobs.size()) {
+      lane_job[l] = next_job;
+      lane_remaining[l] = jobs[next_job].rounds;
+      lane_keys[l] = job_keys[next_job];
+      lane_data[l] = jobs[next_job].data.data();
+      ++next_job;
+      ++active;
+    } else {
+      lane_job[l] = kIdle;
+      lane_remaining[l] = 0;
+      lane_keys[l] = job_keys.front();
+      lane_data[l] = scratch.data();
+    }
+  };
+
+  for (std::size_t l = 0; l < W; ++l)
+    assign(l);
+
+  while (active > 0) {
+    uint64_t step = std::numeric_limits<uint64_t>::max();
+    for (std::size_t l = 0; l < W; ++l) {
+      if (lane_job[l] != kIdle)
+        step = std::min(step, lane_remaining[l]);
+    }
+
+    kernel(lane_keys, lane_data, step);
+
+    for (std::size_t l = 0; l < W; ++l) {
+      if (lane_job[l] == kIdle)
+        continue;
+
+      lane_remaining[l] -= step;
+      if (lane_remaining[l] == 0) {
+        --active;
+        assign(l);
+      }
+    }
+  }
+
+  OPENSSL_cleanse(scratch.data(), scratch.size());
+}
+#endif
+
 }
 
 namespace keepass {
 
 void encrypt_ecb(std::istream& src, std::ostream& dst, const Cipher<16>& cipher) {
-  block_transform<16>(src, dst, [&](const std::array<uint8_t, 16>& src,
-                                    std::array<uint8_t, 16>& dst,
+  block_transform<16>(src, dst, [&](const uint8_t* src, uint8_t* dst,
                                     std::size_t src_len,
                                     bool) -> std::size_t {
-    if (src_len != 16) {
+    if (src_len % 16 != 0) {
       assert(false);
       throw InternalError("ECB can only encrypt an even number of blocks.");
     }
 
-    cipher.Encrypt(src, dst);
-    return 16;
+    cipher.EncryptBlocks(src, dst, src_len / 16);
+    return src_len;
   });
 }
 
 void decrypt_ecb(std::istream& src, std::ostream& dst, const Cipher<16>& cipher) {
-  block_transform<16>(src, dst, [&](const std::array<uint8_t, 16>& src,
-                                    std::array<uint8_t, 16>& dst,
+  block_transform<16>(src, dst, [&](const uint8_t* src, uint8_t* dst,
                                     std::size_t src_len,
                                     bool) -> std::size_t {
-    if (src_len != 16) {
+    if (src_len % 16 != 0) {
       assert(false);
       throw InternalError("ECB can only decrypt an even number of blocks.");
     }
 
-    cipher.Decrypt(src, dst);
-    return 16;
+    cipher.DecryptBlocks(src, dst, src_len / 16);
+    return src_len;
   });
 }
 
@@ -127,85 +1100,114 @@ std::array<uint8_t, 32> decrypt_ecb(const std::array<uint8_t, 32>& src,
 }
 
 void encrypt_cbc(std::istream& src, std::ostream& dst,
-                 const Cipher<16>& cipher) {
+                 const Cipher<16>& cipher, const Progress& progress) {
   std::array<uint8_t, 16> prv = cipher.InitializationVector();
 
   uint32_t pad_len = 0;
-  block_transform<16>(src, dst, [&](const std::array<uint8_t, 16>& src,
-                                    std::array<uint8_t, 16>& dst,
+  block_transform<16>(src, dst, [&](const uint8_t* src, uint8_t* dst,
                                     std::size_t src_len,
                                     bool) -> std::size_t {
-    std::array<uint8_t, 16> src_xor_iv;
-    std::transform(src.begin(), src.end(),
-                   prv.begin(), src_xor_iv.begin(),
-                   std::bit_xor<uint8_t>());
+    std::size_t full_len = src_len - src_len % 16;
+    cipher.EncryptBlocksCbc(src, dst, full_len / 16, prv);
 
-    if (src_len != 16) {
+    if (full_len != src_len) {
       // Handle PKCS #7 padding for the last block.
-      assert(src_len <= 16);
-      pad_len = 16 - src_len;
-      assert(pad_len > 0 && pad_len <= 16);
+      pad_len = 16 - (src_len - full_len);
+      assert(pad_len > 0 && pad_len < 16);
 
-      for (std::size_t i = 16 - pad_len; i < 16; i++) {
-        src_xor_iv[i] = static_cast<uint8_t>(pad_len) ^ prv[i];
-      }
+      std::array<uint8_t, 16> src_block;
+      std::copy(src + full_len, src + src_len, src_block.begin());
+      std::fill(src_block.begin() + 16 - pad_len, src_block.end(),
+                static_cast<uint8_t>(pad_len));
+
+      cipher.EncryptBlocksCbc(src_block.data(), dst + full_len, 1, prv);
+      return full_len + 16;
     }
 
-    cipher.Encrypt(src_xor_iv, dst);
-    prv = dst;
-
-    return 16;
-  });
+    return full_len;
+  }, progress, Progress::Phase::kEncrypt);
 
   // We must always apply padding.
   if (pad_len == 0) {
     std::array<uint8_t, 16> src_block, dst_block;
-    std::array<uint8_t, 16> src_block_xor_iv;
-
     std::fill(src_block.begin(), src_block.end(), 16);
-    std::transform(src_block.begin(), src_block.end(),
-                   prv.begin(), src_block_xor_iv.begin(),
-                   std::bit_xor<uint8_t>());
 
-    cipher.Encrypt(src_block_xor_iv, dst_block);
+    cipher.EncryptBlocksCbc(src_block.data(), dst_block.data(), 1, prv);
     dst.write(reinterpret_cast<const char*>(dst_block.data()),
               dst_block.size());
   }
 }
 
-void decrypt_cbc(std::istream& src, std::ostream& dst, const Cipher<16>& cipher) {
+void decrypt_cbc_blocks(const uint8_t* src, uint8_t* dst,
+                        std::size_t num_blocks, const Cipher<16>& cipher,
+                        std::array<uint8_t, 16>& iv) {
+  if (num_blocks == 0)
+    return;
+
+  // Each plain text block only depends on its own and the previous cipher
+  // text block, so the buffer is split into ranges that are decrypted and
+  // chained independently.
+  parallel_for_blocks(num_blocks, [&](std::size_t first, std::size_t last) {
+    cipher.DecryptBlocks(src + 16 * first, dst + 16 * first, last - first);
+
+    const uint8_t* chain = first == 0 ? iv.data() : src + 16 * (first - 1);
+    for (std::size_t i = 0; i < 16; ++i)
+      dst[16 * first + i] ^= chain[i];
+    for (std::size_t i = 16 * (first + 1); i < 16 * last; ++i)
+      dst[i] ^= src[i - 16];
+  });
+
+  std::copy(src + 16 * (num_blocks - 1), src + 16 * num_blocks, iv.begin());
+}
+
+void decrypt_cbc(std::istream& src, std::ostream& dst,
+                 const Cipher<16>& cipher, const Progress& progress) {
   std::array<uint8_t, 16> prv = cipher.InitializationVector();
 
-  block_transform<16>(src, dst, [&](const std::array<uint8_t, 16>& src,
-                                    std::array<uint8_t, 16>& dst,
+  block_transform<16>(src, dst, [&](const uint8_t* src, uint8_t* dst,
                                     std::size_t src_len,
                                     bool last) -> std::size_t {
-    if (src_len != 16)
+    if (src_len % 16 != 0)
       throw IoError("Decryption error.");
 
-    cipher.Decrypt(src, dst);
-
-    std::transform(dst.begin(), dst.end(),
-                   prv.begin(), dst.begin(),
-                   std::bit_xor<uint8_t>());
+    decrypt_cbc_blocks(src, dst, src_len / 16, cipher, prv);
 
     if (last) {
       // Handle PKCS #7 padding for the last block.
-      uint32_t pad_len = dst[15];
+      uint32_t pad_len = dst[src_len - 1];
       if (pad_len > 16)
         throw IoError("Decryption error.");
 
-      for (std::size_t i = 16 - pad_len; i < 16; ++i) {
+      for (std::size_t i = src_len - pad_len; i < src_len; ++i) {
         if (dst[i] != pad_len)
           throw IoError("Decryption error.");
       }
 
-      return 16 - pad_len;
+      return src_len - pad_len;
     }
 
-    prv = src;
-    return 16;
-  });
+    return src_len;
+  }, progress, Progress::Phase::kDecrypt, kParallelBlockBufferSize);
+}
+
+void encrypt_stream(std::istream& src, std::ostream& dst,
+                    StreamCipher& cipher, const Progress& progress) {
+  block_transform<64>(src, dst, [&](const uint8_t* src, uint8_t* dst,
+                                    std::size_t src_len,
+                                    bool) -> std::size_t {
+    cipher.Process(src, dst, src_len);
+    return src_len;
+  }, progress, Progress::Phase::kEncrypt);
+}
+
+void decrypt_stream(std::istream& src, std::ostream& dst,
+                    StreamCipher& cipher, const Progress& progress) {
+  block_transform<64>(src, dst, [&](const uint8_t* src, uint8_t* dst,
+                                    std::size_t src_len,
+                                    bool) -> std::size_t {
+    cipher.Process(src, dst, src_len);
+    return src_len;
+  }, progress, Progress::Phase::kDecrypt);
 }
 
 AesCipher::AesCipher(const std::array<uint8_t, 32>& key,
@@ -217,6 +1219,23 @@ AesCipher::AesCipher(const std::array<uint8_t, 32>& key,
   if (AES_set_encrypt_key(key.data(), 256, &key_enc_) != 0) {
     assert(false);
   }
+
+  std::memset(enc_round_keys_, 0, sizeof(enc_round_keys_));
+  std::memset(dec_round_keys_, 0, sizeof(dec_round_keys_));
+#ifdef KEEPASS_HAVE_AESNI
+  use_aesni_ = cpu_has(CpuFeature::kAesni);
+  if (use_aesni_) {
+    aesni_expand_key_256(key.data(), enc_round_keys_);
+    aesni_invert_key_256(enc_round_keys_, dec_round_keys_);
+  }
+#endif
+}
+
+AesCipher::~AesCipher() {
+  OPENSSL_cleanse(enc_round_keys_, sizeof(enc_round_keys_));
+  OPENSSL_cleanse(dec_round_keys_, sizeof(dec_round_keys_));
+  OPENSSL_cleanse(&key_enc_, sizeof(key_enc_));
+  OPENSSL_cleanse(&key_dec_, sizeof(key_dec_));
 }
 
 void AesCipher::Decrypt(const std::array<uint8_t, 16>& src,
@@ -229,6 +1248,130 @@ void AesCipher::Encrypt(const std::array<uint8_t, 16>& src,
   AES_encrypt(src.data(), dst.data(), &key_enc_);
 }
 
+void AesCipher::DecryptBlocks(const uint8_t* src, uint8_t* dst,
+                              std::size_t num_blocks) const {
+#ifdef KEEPASS_HAVE_AESNI
+  if (use_aesni_) {
+    aesni_decrypt_blocks(dec_round_keys_, src, dst, num_blocks);
+    return;
+  }
+#endif
+
+  for (std::size_t i = 0; i < num_blocks; ++i)
+    AES_decrypt(src + 16 * i, dst + 16 * i, &key_dec_);
+}
+
+void AesCipher::EncryptBlocks(const uint8_t* src, uint8_t* dst,
+                              std::size_t num_blocks) const {
+#ifdef KEEPASS_HAVE_AESNI
+  if (use_aesni_) {
+    aesni_encrypt_blocks(enc_round_keys_, src, dst, num_blocks);
+    return;
+  }
+#endif
+
+  for (std::size_t i = 0; i < num_blocks; ++i)
+    AES_encrypt(src + 16 * i, dst + 16 * i, &key_enc_);
+}
+
+void AesCipher::EncryptBlocksCbc(const uint8_t* src, uint8_t* dst,
+                                 std::size_t num_blocks,
+                                 std::array<uint8_t, 16>& iv) const {
+#ifdef KEEPASS_HAVE_AESNI
+  if (use_aesni_) {
+    aesni_encrypt_blocks_cbc(enc_round_keys_, src, dst, num_blocks,
+                             iv.data());
+    return;
+  }
+#endif
+
+  for (std::size_t i = 0; i < num_blocks; ++i) {
+    for (std::size_t j = 0; j < 16; ++j)
+      iv[j] ^= src[16 * i + j];
+    AES_encrypt(iv.data(), iv.data(), &key_enc_);
+    std::copy(iv.begin(), iv.end(), dst + 16 * i);
+  }
+}
+
+AesTransformer::AesTransformer(const std::array<uint8_t, 32>& key) {
+  std::memset(round_keys_, 0, sizeof(round_keys_));
+  if (AES_set_encrypt_key(key.data(), 256, &key_enc_) != 0) {
+    assert(false);
+  }
+
+#ifdef KEEPASS_HAVE_AESNI
+  use_aesni_ = cpu_has(CpuFeature::kAesni);
+  if (use_aesni_)
+    aesni_expand_key_256(key.data(), round_keys_);
+#endif
+}
+
+AesTransformer::~AesTransformer() {
+  OPENSSL_cleanse(round_keys_, sizeof(round_keys_));
+  OPENSSL_cleanse(&key_enc_, sizeof(key_enc_));
+}
+
+void AesTransformer::Transform(std::array<uint8_t, 32>& data,
+                               uint64_t rounds) const {
+#ifdef KEEPASS_HAVE_AESNI
+  if (use_aesni_) {
+    aesni_transform_256(round_keys_, data.data(), rounds);
+    return;
+  }
+#endif
+
+  uint8_t* lo = data.data();
+  uint8_t* hi = data.data() + 16;
+  for (uint64_t r = 0; r < rounds; ++r) {
+    AES_encrypt(lo, lo, &key_enc_);
+    AES_encrypt(hi, hi, &key_enc_);
+  }
+}
+
+void AesTransformer::Transform(std::array<uint8_t, 32>& data, uint64_t rounds,
+                               const Progress& progress) const {
+  // Small enough for cancellation to be responsive, large enough for the
+  // progress reporting to be negligible.
+  static constexpr uint64_t kRoundsPerStep = 1 << 16;
+
+  uint64_t done = 0;
+  progress.Report(Progress::Phase::kTransformKey, done, rounds);
+  while (done < rounds) {
+    uint64_t step = std::min(rounds - done, kRoundsPerStep);
+    Transform(data, step);
+    done += step;
+
+    progress.Report(Progress::Phase::kTransformKey, done, rounds);
+  }
+}
+
+void AesTransformer::TransformBatch(std::vector<Job>& jobs) {
+  if (jobs.empty())
+    return;
+
+#ifdef KEEPASS_HAVE_AESNI
+  bool use_aesni = std::all_of(jobs.begin(), jobs.end(), [](const Job& job) {
+    return job.transformer->use_aesni_;
+  });
+
+  if (use_aesni) {
+    std::vector<const uint8_t*> job_keys;
+    job_keys.reserve(jobs.size());
+    for (const Job& job : jobs)
+      job_keys.push_back(&job.transformer->round_keys_[0][0]);
+
+    if (cpu_has(CpuFeature::kVaes))
+      transform_lanes<8>(jobs, job_keys, vaes_transform_lanes_8);
+    else
+      transform_lanes<4>(jobs, job_keys, aesni_transform_lanes_4);
+    return;
+  }
+#endif
+
+  for (Job& job : jobs)
+    job.transformer->Transform(job.data, job.rounds);
+}
+
 uint32_t TwofishCipher::ReedSolomonEncode(uint32_t k0, uint32_t k1) const {
   static const uint32_t kRsGfFdbk = 0x14d;
 
@@ -249,78 +1392,29 @@ uint32_t TwofishCipher::ReedSolomonEncode(uint32_t k0, uint32_t k1) const {
   return r;
 }
 
-uint32_t TwofishCipher::F32(uint32_t x, const uint32_t* k32) const {
-  static auto p8 = [&](std::size_t x, std::size_t y) -> const uint8_t* {
-    // Fixed 8x8 permutation S-boxes.
-    static constexpr uint8_t p8x8[2][256] = {
-      { 0xa9, 0x67, 0xb3, 0xe8, 0x04, 0xfd, 0xa3, 0x76, 0x9a, 0x92, 0x80, 0x78,
-        0xe4, 0xdd, 0xd1, 0x38, 0x0d, 0xc6, 0x35, 0x98, 0x18, 0xf7, 0xec, 0x6c,
-        0x43, 0x75, 0x37, 0x26, 0xfa, 0x13, 0x94, 0x48, 0xf2, 0xd0, 0x8b, 0x30,
-        0x84, 0x54, 0xdf, 0x23, 0x19, 0x5b, 0x3d, 0x59, 0xf3, 0xae, 0xa2, 0x82,
-        0x63, 0x01, 0x83, 0x2e, 0xd9, 0x51, 0x9b, 0x7c, 0xa6, 0xeb, 0xa5, 0xbe,
-        0x16, 0x0c, 0xe3, 0x61, 0xc0, 0x8c, 0x3a, 0xf5, 0x73, 0x2c, 0x25, 0x0b,
-        0xbb, 0x4e, 0x89, 0x6b, 0x53, 0x6a, 0xb4, 0xf1, 0xe1, 0xe6, 0xbd, 0x45,
-        0xe2, 0xf4, 0xb6, 0x66, 0xcc, 0x95, 0x03, 0x56, 0xd4, 0x1c, 0x1e, 0xd7,
-        0xfb, 0xc3, 0x8e, 0xb5, 0xe9, 0xcf, 0xbf, 0xba, 0xea, 0x77, 0x39, 0xaf,
-        0x33, 0xc9, 0x62, 0x71, 0x81, 0x79, 0x09, 0xad, 0x24, 0xcd, 0xf9, 0xd8,
-        0xe5, 0xc5, 0xb9, 0x4d, 0x44, 0x08, 0x86, 0xe7, 0xa1, 0x1d, 0xaa, 0xed,
-        0x06, 0x70, 0xb2, 0xd2, 0x41, 0x7b, 0xa0, 0x11, 0x31, 0xc2, 0x27, 0x90,
-        0x20, 0xf6, 0x60, 0xff, 0x96, 0x5c, 0xb1, 0xab, 0x9e, 0x9c, 0x52, 0x1b,
-        0x5f, 0x93, 0x0a, 0xef, 0x91, 0x85, 0x49, 0xee, 0x2d, 0x4f, 0x8f, 0x3b,
-        0x47, 0x87, 0x6d, 0x46, 0xd6, 0x3e, 0x69, 0x64, 0x2a, 0xce, 0xcb, 0x2f,
-        0xfc, 0x97, 0x05, 0x7a, 0xac, 0x7f, 0xd5, 0x1a, 0x4b, 0x0e, 0xa7, 0x5a,
-        0x28, 0x14, 0x3f, 0x29, 0x88, 0x3c, 0x4c, 0x02, 0xb8, 0xda, 0xb0, 0x17,
-        0x55, 0x1f, 0x8a, 0x7d, 0x57, 0xc7, 0x8d, 0x74, 0xb7, 0xc4, 0x9f, 0x72,
-        0x7e, 0x15, 0x22, 0x12, 0x58, 0x07, 0x99, 0x34, 0x6e, 0x50, 0xde, 0x68,
-        0x65, 0xbc, 0xdb, 0xf8, 0xc8, 0xa8, 0x2b, 0x40, 0xdc, 0xfe, 0x32, 0xa4,
-        0xca, 0x10, 0x21, 0xf0, 0xd3, 0x5d, 0x0f, 0x00, 0x6f, 0x9d, 0x36, 0x42,
-        0x4a, 0x5e, 0xc1, 0xe0 },
-      { 0x75, 0xf3, 0xc6, 0xf4, 0xdb, 0x7b, 0xfb, 0xc8, 0x4a, 0xd3, 0xe6, 0x6b,
-        0x45, 0x7d, 0xe8, 0x4b, 0xd6, 0x32, 0xd8, 0xfd, 0x37, 0x71, 0xf1, 0xe1,
-        0x30, 0x0f, 0xf8, 0x1b, 0x87, 0xfa, 0x06, 0x3f, 0x5e, 0xba, 0xae, 0x5b,
-        0x8a, 0x00, 0xbc, 0x9d, 0x6d, 0xc1, 0xb1, 0x0e, 0x80, 0x5d, 0xd2, 0xd5,
-        0xa0, 0x84, 0x07, 0x14, 0xb5, 0x90, 0x2c, 0xa3, 0xb2, 0x73, 0x4c, 0x54,
-        0x92, 0x74, 0x36, 0x51, 0x38, 0xb0, 0xbd, 0x5a, 0xfc, 0x60, 0x62, 0x96,
-        0x6c, 0x42, 0xf7, 0x10, 0x7c, 0x28, 0x27, 0x8c, 0x13, 0x95, 0x9c, 0xc7,
-        0x24, 0x46, 0x3b, 0x70, 0xca, 0xe3, 0x85, 0xcb, 0x11, 0xd0, 0x93, 0xb8,
-        0xa6, 0x83, 0x20, 0xff, 0x9f, 0x77, 0xc3, 0xcc, 0x03, 0x6f, 0x08, 0xbf,
-        0x40, 0xe7, 0x2b, 0xe2, 0x79, 0x0c, 0xaa, 0x82, 0x41, 0x3a, 0xea, 0xb9,
-        0xe4, 0x9a, 0xa4, 0x97, 0x7e, 0xda, 0x7a, 0x17, 0x66, 0x94, 0xa1, 0x1d,
-        0x3d, 0xf0, 0xde, 0xb3, 0x0b, 0x72, 0xa7, 0x1c, 0xef, 0xd1, 0x53, 0x3e,
-        0x8f, 0x33, 0x26, 0x5f, 0xec, 0x76, 0x2a, 0x49, 0x81, 0x88, 0xee, 0x21,
-        0xc4, 0x1a, 0xeb, 0xd9, 0xc5, 0x39, 0x99, 0xcd, 0xad, 0x31, 0x8b, 0x01,
-        0x18, 0x23, 0xdd, 0x1f, 0x4e, 0x2d, 0xf9, 0x48, 0x4f, 0xf2, 0x65, 0x8e,
-        0x78, 0x5c, 0x58, 0x19, 0x8d, 0xe5, 0x98, 0x57, 0x67, 0x7f, 0x05, 0x64,
-        0xaf, 0x63, 0xb6, 0xfe, 0xf5, 0xb7, 0x3c, 0xa5, 0xce, 0xe9, 0x68, 0x44,
-        0xe0, 0x4d, 0x43, 0x69, 0x29, 0x2e, 0xac, 0x15, 0x59, 0xa8, 0x0a, 0x9e,
-        0x6e, 0x47, 0xdf, 0x34, 0x35, 0x6a, 0xcf, 0xdc, 0x22, 0xc9, 0xc0, 0x9b,
-        0x89, 0xd4, 0xed, 0xab, 0x12, 0xa2, 0x0d, 0x52, 0xbb, 0x02, 0x2f, 0xa9,
-        0xd7, 0x61, 0x1e, 0xb4, 0x50, 0x04, 0xf6, 0xc2, 0x16, 0x25, 0x86, 0x56,
-        0x55, 0x09, 0xbe, 0x91 }
-    };
-
-    static constexpr std::size_t p[4][5] = {
-      { 1, 0, 0, 1, 1 },
-      { 0, 0, 1, 1, 0 },
-      { 1, 1, 0, 0, 0 },
-      { 0, 1, 1, 0, 1 }
-    };
-
-    return p8x8[p[x][y]];
+uint8_t TwofishCipher::SboxByte(std::size_t i, uint8_t v,
+                                const uint32_t* k32) const {
+  // Each byte goes through a different combination of S-boxes.
+  static constexpr std::size_t p[4][5] = {
+    { 1, 0, 0, 1, 1 },
+    { 0, 0, 1, 1, 0 },
+    { 1, 1, 0, 0, 0 },
+    { 0, 1, 1, 0, 1 }
   };
 
-  // Run each byte thru 8x8 S-boxes, xoring with key byte at each stage. Note
-  // that each byte goes through a different combination of S-boxes.
-  uint8_t* b = reinterpret_cast<uint8_t*>(&x);
-  for (std::size_t i = 0; i < 4; ++i) {
-    b[i] = p8(i, 4)[b[i]] ^ reinterpret_cast<const uint8_t*>(&k32[3])[i];
-    b[i] = p8(i, 3)[b[i]] ^ reinterpret_cast<const uint8_t*>(&k32[2])[i];
-    b[i] = p8(i, 0)[p8(i, 1)[p8(i, 2)[b[i]] ^
-        reinterpret_cast<const uint8_t*>(&k32[1])[i]] ^
-        reinterpret_cast<const uint8_t*>(&k32[0])[i]];
-  }
+  auto p8 = [&](std::size_t y) -> const uint8_t* {
+    return kTwofishP8x8[p[i][y]];
+  };
+
+  // Run the byte thru 8x8 S-boxes, xoring with key byte at each stage.
+  v = p8(4)[v] ^ reinterpret_cast<const uint8_t*>(&k32[3])[i];
+  v = p8(3)[v] ^ reinterpret_cast<const uint8_t*>(&k32[2])[i];
+  return p8(0)[p8(1)[p8(2)[v] ^
+      reinterpret_cast<const uint8_t*>(&k32[1])[i]] ^
+      reinterpret_cast<const uint8_t*>(&k32[0])[i]];
+}
 
-  // Now perform the MDS matrix multiply inline.
+uint32_t TwofishCipher::MdsColumn(std::size_t i, uint8_t v) const {
   static constexpr uint32_t kMdsGfFdbk = 0x169;
 
   auto lfsr1 = [](uint8_t x) -> uint8_t {
@@ -331,25 +1425,32 @@ uint32_t TwofishCipher::F32(uint32_t x, const uint32_t* k32) const {
         ((x & 0x01) ? kMdsGfFdbk / 4 : 0);
   };
 
-  auto mx_x = [lfsr2](uint8_t x) -> uint8_t {
-    return x ^ lfsr2(x);
-  };
-  auto mx_y = [lfsr1, lfsr2](uint8_t x) -> uint8_t {
-    return x ^ lfsr1(x) ^ lfsr2(x);
+  // Multiples of v by the MDS matrix elements 01, 5b and ef.
+  const uint8_t mx[3] = {
+    v,
+    static_cast<uint8_t>(v ^ lfsr2(v)),
+    static_cast<uint8_t>(v ^ lfsr1(v) ^ lfsr2(v))
   };
 
-  uint8_t m[4][4] = {
-    {      b[0] , mx_y(b[1]), mx_x(b[2]), mx_x(b[3]) },
-    { mx_x(b[0]), mx_y(b[1]), mx_y(b[2]),      b[3]  },
-    { mx_y(b[0]), mx_x(b[1]),      b[2] , mx_y(b[3]) },
-    { mx_y(b[0]),      b[1] , mx_y(b[2]), mx_x(b[3]) }
+  // MDS matrix, indexing the multiples above.
+  static constexpr std::size_t m[4][4] = {
+    { 0, 2, 1, 1 },
+    { 1, 2, 2, 0 },
+    { 2, 1, 0, 2 },
+    { 2, 0, 2, 1 }
   };
 
   uint32_t res = 0;
-  for (std::size_t i = 0; i < 4; ++i) {
-    for (std::size_t j = 0; j < 4; ++j)
-      res ^= m[i][j] << (i * 8);
-  }
+  for (std::size_t j = 0; j < 4; ++j)
+    res |= static_cast<uint32_t>(mx[m[j][i]]) << (j * 8);
+
+  return res;
+}
+
+uint32_t TwofishCipher::F32(uint32_t x, const uint32_t* k32) const {
+  uint32_t res = 0;
+  for (std::size_t i = 0; i < 4; ++i)
+    res ^= MdsColumn(i, SboxByte(i, static_cast<uint8_t>(x >> (i * 8)), k32));
 
   return res;
 }
@@ -379,77 +1480,143 @@ void TwofishCipher::InitializeKey(const std::array<uint8_t, 32>& key) {
     key_.sub_keys[2 * i] = a + b;   // Combine with a PHT.
     key_.sub_keys[2 * i + 1] = RotateLeft(a + 2 * b, 9);
   }
+
+  // Fold the key dependent S-boxes and the MDS matrix into lookup tables, so
+  // that F32 with the S-box keys becomes four lookups.
+  for (std::size_t i = 0; i < 4; ++i) {
+    for (std::size_t v = 0; v < 256; ++v) {
+      key_.sbox_mds[i][v] = MdsColumn(
+          i, SboxByte(i, static_cast<uint8_t>(v), key_.sbox_keys));
+    }
+  }
 }
 
 TwofishCipher::TwofishCipher(const std::array<uint8_t, 32>& key,
                              const std::array<uint8_t, 16>& init_vec) :
     init_vec_(init_vec) {
   InitializeKey(key);
+
+#ifdef KEEPASS_HAVE_AESNI
+  use_avx2_ = cpu_has(CpuFeature::kAvx2);
+#endif
 }
 
-void TwofishCipher::Decrypt(const std::array<uint8_t, 16>& src,
-                            std::array<uint8_t, 16>& dst) const {
-  uint32_t* dst_ptr = reinterpret_cast<uint32_t*>(dst.data());
+TwofishCipher::~TwofishCipher() {
+  OPENSSL_cleanse(&key_, sizeof(key_));
+}
 
-  // Copy in the block, add whitening.
-  for (std::size_t i = 0; i < 4; ++i) {
-    dst_ptr[i] = reinterpret_cast<const uint32_t*>(src.data())[i] ^
-        key_.sub_keys[i + 4];
-  }
+void TwofishCipher::DecryptBlock(const uint8_t* src, uint8_t* dst) const {
+  uint32_t x[4];
+  std::memcpy(x, src, sizeof(x));
+
+  // Add whitening.
+  for (std::size_t i = 0; i < 4; ++i)
+    x[i] ^= key_.sub_keys[i + 4];
 
   // Main Twofish decryption loop.
   for (std::size_t r = kNumRounds; r-- > 0;) {
-    uint32_t t0 = F32(dst_ptr[0],key_.sbox_keys);
-    uint32_t t1 = F32(RotateLeft(dst_ptr[1], 8), key_.sbox_keys);
+    uint32_t t0 = G(x[0]);
+    uint32_t t1 = G(RotateLeft(x[1], 8));
 
-    dst_ptr[2] = RotateLeft(dst_ptr[2], 1);
-    dst_ptr[2] ^= t0 + t1 + key_.sub_keys[8 + 2 * r];   // PHT, round keys.
-    dst_ptr[3] ^= t0 + 2 * t1 + key_.sub_keys[8 + 2 * r + 1];
-    dst_ptr[3] = RotateRight(dst_ptr[3], 1);
+    x[2] = RotateLeft(x[2], 1);
+    x[2] ^= t0 + t1 + key_.sub_keys[8 + 2 * r];   // PHT, round keys.
+    x[3] ^= t0 + 2 * t1 + key_.sub_keys[8 + 2 * r + 1];
+    x[3] = RotateRight(x[3], 1);
 
     // Unswap, except for last round.
     if (r) {
-      t0 = dst_ptr[0]; dst_ptr[0] = dst_ptr[2]; dst_ptr[2] = t0;
-      t1 = dst_ptr[1]; dst_ptr[1] = dst_ptr[3]; dst_ptr[3] = t1;
+      t0 = x[0]; x[0] = x[2]; x[2] = t0;
+      t1 = x[1]; x[1] = x[3]; x[3] = t1;
     }
   }
 
   // Copy out, with whitening.
   for (std::size_t i = 0; i < 4; ++i)
-    dst_ptr[i] ^= key_.sub_keys[i];
+    x[i] ^= key_.sub_keys[i];
+  std::memcpy(dst, x, sizeof(x));
 }
 
-void TwofishCipher::Encrypt(const std::array<uint8_t, 16>& src,
-                            std::array<uint8_t, 16>& dst) const {
-  uint32_t* dst_ptr = reinterpret_cast<uint32_t*>(dst.data());
+void TwofishCipher::EncryptBlock(const uint8_t* src, uint8_t* dst) const {
+  uint32_t x[4];
+  std::memcpy(x, src, sizeof(x));
 
-  // Copy in the block, add whitening.
-  for (std::size_t i = 0; i < 4; ++i) {
-    dst_ptr[i] = reinterpret_cast<const uint32_t*>(src.data())[i] ^
-        key_.sub_keys[i];
-  }
+  // Add whitening.
+  for (std::size_t i = 0; i < 4; ++i)
+    x[i] ^= key_.sub_keys[i];
 
   // Main Twofish encryption loop.
   uint32_t tmp = 0;
   for (std::size_t r = 0; r < kNumRounds; ++r) {
-    uint32_t t0 = F32(dst_ptr[0], key_.sbox_keys);
-    uint32_t t1 = F32(RotateLeft(dst_ptr[1], 8), key_.sbox_keys);
+    uint32_t t0 = G(x[0]);
+    uint32_t t1 = G(RotateLeft(x[1], 8));
 
-    dst_ptr[3] = RotateLeft(dst_ptr[3], 1);
-    dst_ptr[2] ^= t0 + t1 + key_.sub_keys[8 + 2 * r];   // PHT, round keys.
-    dst_ptr[3] ^= t0 + 2 * t1 + key_.sub_keys[8 + 2 * r + 1];
-    dst_ptr[2] = RotateRight(dst_ptr[2], 1);
+    x[3] = RotateLeft(x[3], 1);
+    x[2] ^= t0 + t1 + key_.sub_keys[8 + 2 * r];   // PHT, round keys.
+    x[3] ^= t0 + 2 * t1 + key_.sub_keys[8 + 2 * r + 1];
+    x[2] = RotateRight(x[2], 1);
 
     // Swap for next round.
     if (r < kNumRounds-1) {
-      tmp = dst_ptr[0]; dst_ptr[0] = dst_ptr[2]; dst_ptr[2] = tmp;
-      tmp = dst_ptr[1]; dst_ptr[1] = dst_ptr[3]; dst_ptr[3] = tmp;
+      tmp = x[0]; x[0] = x[2]; x[2] = tmp;
+      tmp = x[1]; x[1] = x[3]; x[3] = tmp;
     }
   }
 
   // Copy out, with whitening.
   for (std::size_t i = 0; i < 4; ++i)
-    dst_ptr[i] ^= key_.sub_keys[i + 4];
+    x[i] ^= key_.sub_keys[i + 4];
+  std::memcpy(dst, x, sizeof(x));
+}
+
+void TwofishCipher::Decrypt(const std::array<uint8_t, 16>& src,
+                            std::array<uint8_t, 16>& dst) const {
+  DecryptBlock(src.data(), dst.data());
+}
+
+void TwofishCipher::Encrypt(const std::array<uint8_t, 16>& src,
+                            std::array<uint8_t, 16>& dst) const {
+  EncryptBlock(src.data(), dst.data());
+}
+
+void TwofishCipher::DecryptBlocks(const uint8_t* src, uint8_t* dst,
+                                  std::size_t num_blocks) const {
+  std::size_t i = 0;
+#ifdef KEEPASS_HAVE_AESNI
+  if (use_avx2_) {
+    for (; i + 8 <= num_blocks; i += 8) {
+      avx2_twofish_decrypt_blocks_8(key_.sub_keys, key_.sbox_mds,
+                                    src + 16 * i, dst + 16 * i);
+    }
+  }
+#endif
+  for (; i < num_blocks; ++i)
+    DecryptBlock(src + 16 * i, dst + 16 * i);
+}
+
+void TwofishCipher::EncryptBlocks(const uint8_t* src, uint8_t* dst,
+                                  std::size_t num_blocks) const {
+  std::size_t i = 0;
+#ifdef KEEPASS_HAVE_AESNI
+  if (use_avx2_) {
+    for (; i + 8 <= num_blocks; i += 8) {
+      avx2_twofish_encrypt_blocks_8(key_.sub_keys, key_.sbox_mds,
+                                    src + 16 * i, dst + 16 * i);
+    }
+  }
+#endif
+  for (; i < num_blocks; ++i)
+    EncryptBlock(src + 16 * i, dst + 16 * i);
+}
+
+void TwofishCipher::EncryptBlocksCbc(const uint8_t* src, uint8_t* dst,
+                                     std::size_t num_blocks,
+                                     std::array<uint8_t, 16>& iv) const {
+  for (std::size_t i = 0; i < num_blocks; ++i) {
+    for (std::size_t j = 0; j < 16; ++j)
+      iv[j] ^= src[16 * i + j];
+    EncryptBlock(iv.data(), iv.data());
+    std::copy(iv.begin(), iv.end(), dst + 16 * i);
+  }
 }
 
 Salsa20Cipher::Salsa20Cipher(const std::array<uint8_t, 32>& key,
@@ -476,6 +1643,20 @@ Salsa20Cipher::Salsa20Cipher(const std::array<uint8_t, 32>& key,
   input_[7] = *reinterpret_cast<const uint32_t*>(init_vec.data() + 4);
   input_[8] = 0;
   input_[9] = 0;
+
+#ifdef KEEPASS_HAVE_AESNI
+  use_sse2_ = cpu_has(CpuFeature::kSse2);
+  use_avx2_ = cpu_has(CpuFeature::kAvx2);
+#endif
+}
+
+Salsa20Cipher::~Salsa20Cipher() {
+  OPENSSL_cleanse(input_.data(), sizeof(input_));
+}
+
+void Salsa20Cipher::Seek(uint64_t block) {
+  input_[8] = static_cast<uint32_t>(block);
+  input_[9] = static_cast<uint32_t>(block >> 32);
 }
 
 std::array<uint8_t, 64> Salsa20Cipher::WordToByte(
@@ -532,14 +1713,119 @@ std::array<uint8_t, 64> Salsa20Cipher::WordToByte(
 
 void Salsa20Cipher::Process(const std::array<uint8_t, 64>& src,
                             std::array<uint8_t, 64>& dst) {
-  std::array<uint8_t, 64> output = WordToByte(input_);
+  Process(src.data(), dst.data(), src.size());
+}
+
+void Salsa20Cipher::Process(const uint8_t* src, uint8_t* dst,
+                            std::size_t size) {
+  alignas(32) uint8_t key_stream[8 * 64];
+
+  while (size > 0) {
+    std::size_t num_blocks = 1;
+#ifdef KEEPASS_HAVE_AESNI
+    if (use_avx2_ && size > 4 * 64) {
+      avx2_salsa20_blocks_8(input_.data(), key_stream);
+      num_blocks = 8;
+    } else if (use_sse2_ && size > 64) {
+      sse2_salsa20_blocks_4(input_.data(), key_stream);
+      num_blocks = 4;
+    } else {
+      std::array<uint8_t, 64> output = WordToByte(input_);
+      std::copy(output.begin(), output.end(), key_stream);
+    }
+#else
+    std::array<uint8_t, 64> output = WordToByte(input_);
+    std::copy(output.begin(), output.end(), key_stream);
+#endif
+
+    std::size_t count = std::min(size, num_blocks * 64);
+    xor_key_stream(src, key_stream, dst, count);
+
+    uint64_t counter = (static_cast<uint64_t>(input_[9]) << 32) | input_[8];
+    counter += (count + 63) / 64;
+    input_[8] = static_cast<uint32_t>(counter);
+    input_[9] = static_cast<uint32_t>(counter >> 32);
+
+    src += count;
+    dst += count;
+    size -= count;
+  }
+
+  OPENSSL_cleanse(key_stream, sizeof(key_stream));
+}
+
+ChaCha20Cipher::ChaCha20Cipher(const std::array<uint8_t, 32>& key,
+                               const std::array<uint8_t, 12>& init_vec) {
+  static const char* kSigma = "expand 32-byte k";
+
+  std::memcpy(&input_[0], kSigma, 16);
+  std::memcpy(&input_[4], key.data(), key.size());
+  input_[12] = 0;
+  std::memcpy(&input_[13], init_vec.data(), init_vec.size());
+  initial_counter_ = static_cast<uint64_t>(input_[13]) << 32;
+
+#ifdef KEEPASS_HAVE_AESNI
+  use_sse2_ = cpu_has(CpuFeature::kSse2);
+  use_ssse3_ = cpu_has(CpuFeature::kSsse3);
+  use_avx2_ = cpu_has(CpuFeature::kAvx2);
+#endif
+}
+
+ChaCha20Cipher::~ChaCha20Cipher() {
+  OPENSSL_cleanse(input_.data(), sizeof(input_));
+}
+
+void ChaCha20Cipher::Seek(uint64_t block) {
+  uint64_t counter = initial_counter_ + block;
+  input_[12] = static_cast<uint32_t>(counter);
+  input_[13] = static_cast<uint32_t>(counter >> 32);
+}
 
-  input_[8]++;
-  if (!input_[8])
-    input_[9]++;
+void ChaCha20Cipher::NextCounter(uint64_t blocks) {
+  uint64_t counter = (static_cast<uint64_t>(input_[13]) << 32) | input_[12];
+  counter += blocks;
+  input_[12] = static_cast<uint32_t>(counter);
+  input_[13] = static_cast<uint32_t>(counter >> 32);
+}
+
+void ChaCha20Cipher::Process(const std::array<uint8_t, 64>& src,
+                             std::array<uint8_t, 64>& dst) {
+  Process(src.data(), dst.data(), src.size());
+}
+
+void ChaCha20Cipher::Process(const uint8_t* src, uint8_t* dst,
+                             std::size_t size) {
+  alignas(32) uint8_t key_stream[8 * 64];
+
+  while (size > 0) {
+    std::size_t num_blocks = 1;
+#ifdef KEEPASS_HAVE_AESNI
+    if (use_avx2_ && size > 4 * 64) {
+      avx2_chacha20_blocks_8(input_.data(), key_stream);
+      num_blocks = 8;
+    } else if (use_ssse3_ && size > 64) {
+      ssse3_chacha20_blocks_4(input_.data(), key_stream);
+      num_blocks = 4;
+    } else if (use_sse2_ && size > 64) {
+      sse2_chacha20_blocks_4(input_.data(), key_stream);
+      num_blocks = 4;
+    } else {
+      chacha20_block(input_.data(), key_stream);
+    }
+#else
+    chacha20_block(input_.data(), key_stream);
+#endif
+
+    std::size_t count = std::min(size, num_blocks * 64);
+    xor_key_stream(src, key_stream, dst, count);
+
+    NextCounter((count + 63) / 64);
+    src += count;
+    dst += count;
+    size -= count;
+  }
 
-  for (std::size_t i = 0; i < src.size(); ++i)
-    dst[i] = src[i] ^ output[i];
+  OPENSSL_cleanse(key_stream, sizeof(key_stream));
 }
 
 }   // namespace keepass
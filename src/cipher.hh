@@ -17,27 +17,55 @@
  */
 
 #pragma once
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstdint>
 #include <memory>
 #include <iostream>
+#include <vector>
 
 #include <openssl/aes.h>
 
+#include "progress.hh"
+
 namespace keepass {
 
 template <std::size_t N>
 class Cipher;
+class StreamCipher;
 
 std::array<uint8_t, 32> encrypt_ecb(const std::array<uint8_t, 32>& src,
                                     const Cipher<16>& cipher);
 std::array<uint8_t, 32> decrypt_ecb(const std::array<uint8_t, 32>& src,
                                     const Cipher<16>& cipher);
 void encrypt_cbc(std::istream& src, std::ostream& dst,
-                 const Cipher<16>& cipher);
+                 const Cipher<16>& cipher,
+                 const Progress& progress = Progress());
 void decrypt_cbc(std::istream& src, std::ostream& dst,
-                 const Cipher<16>& cipher);
+                 const Cipher<16>& cipher,
+                 const Progress& progress = Progress());
+
+/**
+ * Decrypts consecutive CBC blocks, on several threads if there are enough
+ * blocks to make it pay off.
+ * @param [in] src Cipher text blocks.
+ * @param [out] dst Plain text blocks, must not overlap @a src.
+ * @param [in] num_blocks Number of blocks to decrypt.
+ * @param [in] cipher Cipher to decrypt with.
+ * @param [in,out] iv Cipher text block preceding @a src. Updated to the last
+ *                    block of @a src.
+ */
+void decrypt_cbc_blocks(const uint8_t* src, uint8_t* dst,
+                        std::size_t num_blocks, const Cipher<16>& cipher,
+                        std::array<uint8_t, 16>& iv);
+
+void encrypt_stream(std::istream& src, std::ostream& dst,
+                    StreamCipher& cipher,
+                    const Progress& progress = Progress());
+void decrypt_stream(std::istream& src, std::ostream& dst,
+                    StreamCipher& cipher,
+                    const Progress& progress = Progress());
 
 template <std::size_t N>
 class Cipher {
@@ -50,19 +78,78 @@ class Cipher {
                        std::array<uint8_t, N>& dst) const = 0;
   virtual void Encrypt(const std::array<uint8_t, N>& src,
                        std::array<uint8_t, N>& dst) const = 0;
+
+  /**
+   * Decrypts consecutive blocks independently of each other, like ECB. The
+   * default implementation calls Decrypt() once per block, ciphers override
+   * it to process a whole buffer without per-block dispatch.
+   * @param [in] src Source blocks.
+   * @param [out] dst Destination blocks, may be equal to @a src.
+   * @param [in] num_blocks Number of blocks to decrypt.
+   */
+  virtual void DecryptBlocks(const uint8_t* src, uint8_t* dst,
+                             std::size_t num_blocks) const {
+    std::array<uint8_t, N> src_block, dst_block;
+    for (std::size_t i = 0; i < num_blocks; ++i) {
+      std::copy(src + N * i, src + N * (i + 1), src_block.begin());
+      Decrypt(src_block, dst_block);
+      std::copy(dst_block.begin(), dst_block.end(), dst + N * i);
+    }
+  }
+  virtual void EncryptBlocks(const uint8_t* src, uint8_t* dst,
+                             std::size_t num_blocks) const {
+    std::array<uint8_t, N> src_block, dst_block;
+    for (std::size_t i = 0; i < num_blocks; ++i) {
+      std::copy(src + N * i, src + N * (i + 1), src_block.begin());
+      Encrypt(src_block, dst_block);
+      std::copy(dst_block.begin(), dst_block.end(), dst + N * i);
+    }
+  }
+
+  /**
+   * Encrypts consecutive blocks in CBC mode.
+   * @param [in] src Source blocks.
+   * @param [out] dst Destination blocks, may be equal to @a src.
+   * @param [in] num_blocks Number of blocks to encrypt.
+   * @param [in,out] iv Block to chain the first block with. On return it
+   *                    holds the last encrypted block.
+   */
+  virtual void EncryptBlocksCbc(const uint8_t* src, uint8_t* dst,
+                                std::size_t num_blocks,
+                                std::array<uint8_t, N>& iv) const {
+    for (std::size_t i = 0; i < num_blocks; ++i) {
+      std::array<uint8_t, N> block;
+      for (std::size_t j = 0; j < N; ++j)
+        block[j] = src[N * i + j] ^ iv[j];
+      Encrypt(block, iv);
+      std::copy(iv.begin(), iv.end(), dst + N * i);
+    }
+  }
 };
 
+/**
+ * @brief AES-256 block cipher.
+ *
+ * The bulk block methods use AES-NI when the CPU supports it, keeping eight
+ * independent blocks in flight for ECB and CBC decryption.
+ */
 class AesCipher final : public Cipher<16> {
  private:
   const std::array<uint8_t, 16> init_vec_;
   AES_KEY key_dec_;
   AES_KEY key_enc_;
 
+  /** Round keys in the byte order expected by AES-NI. */
+  alignas(16) uint8_t enc_round_keys_[15][16];
+  alignas(16) uint8_t dec_round_keys_[15][16];
+  bool use_aesni_ = false;
+
  public:
   AesCipher(const std::array<uint8_t, 32>& key) :
     AesCipher(key, { 0 }) {}
   AesCipher(const std::array<uint8_t, 32>& key,
             const std::array<uint8_t, 16>& init_vec);
+  ~AesCipher();
 
   const std::array<uint8_t, 16>& InitializationVector() const override {
     return init_vec_;
@@ -72,6 +159,75 @@ class AesCipher final : public Cipher<16> {
                        std::array<uint8_t, 16>& dst) const override;
   virtual void Encrypt(const std::array<uint8_t, 16>& src,
                        std::array<uint8_t, 16>& dst) const override;
+
+  virtual void DecryptBlocks(const uint8_t* src, uint8_t* dst,
+                             std::size_t num_blocks) const override;
+  virtual void EncryptBlocks(const uint8_t* src, uint8_t* dst,
+                             std::size_t num_blocks) const override;
+  virtual void EncryptBlocksCbc(const uint8_t* src, uint8_t* dst,
+                                std::size_t num_blocks,
+                                std::array<uint8_t, 16>& iv) const override;
+};
+
+/**
+ * @brief AES-256 engine dedicated to the KeePass key transformation.
+ *
+ * The key transformation encrypts both 16 byte halves of a 32 byte key with
+ * the same key schedule, over and over again, in ECB mode. Since the halves are
+ * independent of each other they are kept in registers and interleaved through
+ * the AES-NI round instructions when the CPU supports them. Otherwise OpenSSL
+ * is called directly on the two halves.
+ */
+class AesTransformer final {
+ private:
+  static constexpr std::size_t kNumRoundKeys = 15;
+
+  /** Encryption round keys in the byte order expected by AES-NI. */
+  alignas(16) uint8_t round_keys_[kNumRoundKeys][16];
+  AES_KEY key_enc_;
+  bool use_aesni_ = false;
+
+ public:
+  /**
+   * @brief A single transformation in a batch.
+   */
+  struct Job {
+    const AesTransformer* transformer;
+    std::array<uint8_t, 32> data;
+    uint64_t rounds;
+  };
+
+  AesTransformer(const std::array<uint8_t, 32>& key);
+  ~AesTransformer();
+
+  AesTransformer(const AesTransformer&) = delete;
+  AesTransformer& operator=(const AesTransformer&) = delete;
+
+  /**
+   * Encrypts both halves of @a data @a rounds times.
+   * @param [in,out] data Data to transform.
+   * @param [in] rounds Number of encryption rounds to apply.
+   */
+  void Transform(std::array<uint8_t, 32>& data, uint64_t rounds) const;
+  /**
+   * Same as above but in steps, reporting progress in between.
+   * @throws CancelledError If the operation is cancelled through
+   *                        @a progress.
+   */
+  void Transform(std::array<uint8_t, 32>& data, uint64_t rounds,
+                 const Progress& progress) const;
+
+  /**
+   * Runs several independent transformations, each with its own key and
+   * number of rounds. A single transformation is bound by the latency of the
+   * AES round instruction, so several jobs are interleaved to make use of the
+   * CPU's AES issue width: four jobs at a time with AES-NI and eight with
+   * VAES. Jobs with different round counts are allowed, a lane is refilled
+   * with the next job as soon as its current job is finished.
+   * @param [in,out] jobs Jobs to run. The result of each job is written back
+   *                      to its data member.
+   */
+  static void TransformBatch(std::vector<Job>& jobs);
 };
 
 class TwofishCipher final : public Cipher<16> {
@@ -83,9 +239,13 @@ class TwofishCipher final : public Cipher<16> {
     uint32_t sbox_keys[4];
     /** Round subkeys, input/output whitening bits. */
     uint32_t sub_keys[40];
+    /** Key dependent S-boxes combined with the MDS matrix, one table per
+     * input byte. */
+    uint32_t sbox_mds[4][256];
   } key_;
 
   const std::array<uint8_t, 16> init_vec_;
+  bool use_avx2_ = false;
 
   inline uint32_t RotateLeft(uint32_t v, uint32_t n) const {
     return (v << (n & 0x1f)) | (v >> (32 - (n & 0x1f)));
@@ -96,15 +256,29 @@ class TwofishCipher final : public Cipher<16> {
   }
 
   uint32_t ReedSolomonEncode(uint32_t k0, uint32_t k1) const;
+  uint8_t SboxByte(std::size_t i, uint8_t v, const uint32_t* k32) const;
+  uint32_t MdsColumn(std::size_t i, uint8_t v) const;
   uint32_t F32(uint32_t x, const uint32_t* k32) const;
 
+  /** Same as F32() with the S-box keys, using the precomputed tables. */
+  inline uint32_t G(uint32_t x) const {
+    return key_.sbox_mds[0][x & 0xff] ^
+        key_.sbox_mds[1][(x >> 8) & 0xff] ^
+        key_.sbox_mds[2][(x >> 16) & 0xff] ^
+        key_.sbox_mds[3][x >> 24];
+  }
+
   void InitializeKey(const std::array<uint8_t, 32>& key);
 
+  void DecryptBlock(const uint8_t* src, uint8_t* dst) const;
+  void EncryptBlock(const uint8_t* src, uint8_t* dst) const;
+
  public:
   TwofishCipher(const std::array<uint8_t, 32>& key) :
     TwofishCipher(key, { 0 }) {}
   TwofishCipher(const std::array<uint8_t, 32>& key,
                 const std::array<uint8_t, 16>& init_vec);
+  ~TwofishCipher();
 
   const std::array<uint8_t, 16>& InitializationVector() const override {
     return init_vec_;
@@ -114,14 +288,52 @@ class TwofishCipher final : public Cipher<16> {
                        std::array<uint8_t, 16>& dst) const override;
   virtual void Encrypt(const std::array<uint8_t, 16>& src,
                        std::array<uint8_t, 16>& dst) const override;
+
+  virtual void DecryptBlocks(const uint8_t* src, uint8_t* dst,
+                             std::size_t num_blocks) const override;
+  virtual void EncryptBlocks(const uint8_t* src, uint8_t* dst,
+                             std::size_t num_blocks) const override;
+  virtual void EncryptBlocksCbc(const uint8_t* src, uint8_t* dst,
+                                std::size_t num_blocks,
+                                std::array<uint8_t, 16>& iv) const override;
+};
+
+/**
+ * @brief Stream cipher producing a key stream in 64 byte blocks.
+ */
+class StreamCipher {
+ public:
+  virtual ~StreamCipher() = default;
+
+  /**
+   * Xors the next @a size bytes of key stream with @a src. A partially used
+   * key stream block is discarded, so only the last call in a sequence may
+   * process a size that is not a multiple of 64.
+   * @param [in] src Source data.
+   * @param [out] dst Destination data, may be equal to @a src.
+   * @param [in] size Number of bytes to process.
+   */
+  virtual void Process(const uint8_t* src, uint8_t* dst, std::size_t size) = 0;
+
+  /**
+   * Positions the key stream at the start of a block, allowing random access
+   * into the key stream.
+   * @param [in] block Index of the key stream block to continue from.
+   */
+  virtual void Seek(uint64_t block) = 0;
 };
 
 /**
  * @brief Salsa20 stream cipher implementation.
+ *
+ * Several blocks are generated in parallel with SSE2 or AVX2 when the CPU
+ * supports it.
  */
-class Salsa20Cipher final {
+class Salsa20Cipher final : public StreamCipher {
  private:
   std::array<uint32_t, 16> input_ = { { 0 } };
+  bool use_sse2_ = false;
+  bool use_avx2_ = false;
 
   inline uint32_t RotateLeft(uint32_t v, uint32_t n) const {
     return (v << (n & 0x1f)) | (v >> (32 - (n & 0x1f)));
@@ -135,9 +347,44 @@ class Salsa20Cipher final {
     Salsa20Cipher(key, { 0 }) {}
   Salsa20Cipher(const std::array<uint8_t, 32>& key,
                 const std::array<uint8_t, 8>& init_vec);
+  ~Salsa20Cipher();
+
+  void Process(const std::array<uint8_t, 64>& src,
+               std::array<uint8_t, 64>& dst);
+  virtual void Process(const uint8_t* src, uint8_t* dst,
+                       std::size_t size) override;
+  virtual void Seek(uint64_t block) override;
+};
+
+/**
+ * @brief ChaCha20 stream cipher implementation (RFC 7539).
+ *
+ * Uses a 96-bit nonce. Like KeePass, the 32-bit block counter carries over
+ * into the first nonce word instead of wrapping. Several blocks are
+ * generated in parallel with SSE2, SSSE3 or AVX2 when the CPU supports it.
+ */
+class ChaCha20Cipher final : public StreamCipher {
+ private:
+  std::array<uint32_t, 16> input_ = { { 0 } };
+  /** Counter of the first block, the nonce word that the counter carries
+   * into is included in the upper half. */
+  uint64_t initial_counter_ = 0;
+  bool use_sse2_ = false;
+  bool use_ssse3_ = false;
+  bool use_avx2_ = false;
+
+  void NextCounter(uint64_t blocks);
+
+ public:
+  ChaCha20Cipher(const std::array<uint8_t, 32>& key,
+                 const std::array<uint8_t, 12>& init_vec);
+  ~ChaCha20Cipher();
 
   void Process(const std::array<uint8_t, 64>& src,
                std::array<uint8_t, 64>& dst);
+  virtual void Process(const uint8_t* src, uint8_t* dst,
+                       std::size_t size) override;
+  virtual void Seek(uint64_t block) override;
 };
 
 }
@@ -0,0 +1,103 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cpu.hh"
+
+#include <cstdlib>
+#include <sstream>
+
+namespace keepass {
+
+namespace {
+
+constexpr uint32_t bit(CpuFeature feature) {
+  return static_cast<uint32_t>(feature);
+}
+
+/**
+ * Removes features whose kernels depend on other features that are missing.
+ */
+uint32_t normalize_cpu_features(uint32_t features) {
+  if (!(features & bit(CpuFeature::kSse2)))
+    features &= ~(bit(CpuFeature::kSsse3) | bit(CpuFeature::kAesni));
+  if (!(features & bit(CpuFeature::kAesni)) ||
+      !(features & bit(CpuFeature::kAvx2))) {
+    features &= ~bit(CpuFeature::kVaes);
+  }
+
+  return features;
+}
+
+uint32_t resolve_cpu_features() {
+  uint32_t features = detect_cpu_features();
+
+  const char* env = std::getenv(kCpuFeaturesEnv);
+  if (env != nullptr)
+    features &= parse_cpu_features(env);
+
+  return normalize_cpu_features(features);
+}
+
+}   // namespace
+
+uint32_t detect_cpu_features() {
+  uint32_t features = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    features |= bit(CpuFeature::kSse2);
+  if (__builtin_cpu_supports("ssse3"))
+    features |= bit(CpuFeature::kSsse3);
+  if (__builtin_cpu_supports("avx2"))
+    features |= bit(CpuFeature::kAvx2);
+  if (__builtin_cpu_supports("aes"))
+    features |= bit(CpuFeature::kAesni);
+  if (__builtin_cpu_supports("vaes"))
+    features |= bit(CpuFeature::kVaes);
+#endif
+
+  return normalize_cpu_features(features);
+}
+
+uint32_t parse_cpu_features(const std::string& names) {
+  uint32_t features = 0;
+
+  std::istringstream stream(names);
+  std::string name;
+  while (std::getline(stream, name, ',')) {
+    if (name == "sse2")
+      features |= bit(CpuFeature::kSse2);
+    else if (name == "ssse3")
+      features |= bit(CpuFeature::kSsse3);
+    else if (name == "avx2")
+      features |= bit(CpuFeature::kAvx2);
+    else if (name == "aesni")
+      features |= bit(CpuFeature::kAesni);
+    else if (name == "vaes")
+      features |= bit(CpuFeature::kVaes);
+  }
+
+  return features;
+}
+
+bool cpu_has(CpuFeature feature) {
+  static const uint32_t features = resolve_cpu_features();
+  return (features & bit(feature)) != 0;
+}
+
+}   // namespace keepass
@@ -0,0 +1,68 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace keepass {
+
+/** CPU features that the crypto kernels are selected by. */
+enum class CpuFeature : uint32_t {
+  kSse2 = 1 << 0,
+  kSsse3 = 1 << 1,
+  kAvx2 = 1 << 2,
+  kAesni = 1 << 3,
+  kVaes = 1 << 4
+};
+
+/**
+ * Environment variable restricting the CPU features that the crypto kernels
+ * may use, for benchmarking and testing the kernels against each other. It
+ * holds a comma separated list of the feature names "sse2", "ssse3", "avx2",
+ * "aesni" and "vaes", or "portable" for none of them. Unknown names are
+ * ignored. Features not supported by the CPU are never used.
+ *
+ * SHA-256 is computed by OpenSSL, which selects its own kernels. Those can be
+ * restricted with the OPENSSL_ia32cap environment variable.
+ */
+constexpr const char* kCpuFeaturesEnv = "KEEPASS_CPU_FEATURES";
+
+/**
+ * Detects the features of the running CPU.
+ * @return Bit mask of CpuFeature values.
+ */
+uint32_t detect_cpu_features();
+
+/**
+ * Parses a list of CPU features as described for kCpuFeaturesEnv.
+ * @param [in] names Comma separated list of feature names.
+ * @return Bit mask of CpuFeature values.
+ */
+uint32_t parse_cpu_features(const std::string& names);
+
+/**
+ * Checks if the crypto kernels may use a CPU feature. The features are
+ * resolved once, on first use, from detect_cpu_features() and
+ * kCpuFeaturesEnv.
+ * @param [in] feature Feature to check.
+ * @return true if kernels using @a feature may be used and false otherwise.
+ */
+bool cpu_has(CpuFeature feature);
+
+}   // namespace keepass
@@ -17,6 +17,7 @@
  */
 
 #pragma once
+#include <algorithm>
 #include <array>
 #include <memory>
 #include <vector>
@@ -31,9 +32,34 @@ class Database final {
  public:
   enum class Cipher {
     kAes,
-    kTwofish
+    kTwofish,
+    kChaCha20
   };
 
+  /**
+   * Key derivation functions. The transform seed is used as salt for Argon2.
+   */
+  enum class Kdf {
+    kAes,
+    kArgon2d,
+    kArgon2id
+  };
+
+  enum class InnerRandomStream {
+    kSalsa20,
+    kChaCha20
+  };
+
+  /** Trade-offs between compression speed and compressed size. */
+  enum class CompressionProfile {
+    kFastest,
+    kDefault,
+    kSmallest
+  };
+
+  static constexpr std::size_t kMinCompressionChunkSize = 128 * 1024;
+  static constexpr std::size_t kMaxCompressionChunkSize = 1024 * 1024;
+
  private:
   std::shared_ptr<Group> root_;
   Cipher cipher_ = Cipher::kAes;
@@ -41,8 +67,17 @@ class Database final {
   std::array<uint8_t, 16> init_vector_ = { { 0 } };
   std::array<uint8_t, 32> transform_seed_ { { 0 } };
   std::array<uint8_t, 32> inner_random_stream_key_ = { { 0 } };
+  std::vector<uint8_t> chacha20_inner_random_stream_key_ =
+      std::vector<uint8_t>(64, 0);
+  InnerRandomStream inner_random_stream_ = InnerRandomStream::kSalsa20;
   uint64_t transform_rounds_ = 8192;
+  Kdf kdf_ = Kdf::kAes;
+  uint64_t argon2_memory_ = 64 * 1024 * 1024;
+  uint64_t argon2_iterations_ = 2;
+  uint32_t argon2_parallelism_ = 2;
   bool compress_ = false;
+  CompressionProfile compression_profile_ = CompressionProfile::kDefault;
+  std::size_t compression_chunk_size_ = kMinCompressionChunkSize;
   std::shared_ptr<Metadata> meta_;
 
  public:
@@ -61,6 +96,7 @@ class Database final {
     master_seed_ = master_seed;
   }
 
+  /** Initialization vector, only the first 12 bytes are used by ChaCha20. */
   const std::array<uint8_t, 16>& init_vector() const { return init_vector_; }
   void set_init_vector(const std::array<uint8_t, 16>& init_vector) {
     init_vector_ = init_vector;
@@ -73,6 +109,7 @@ class Database final {
     transform_seed_ = transform_seed;
   }
 
+  /** Inner random stream key used with Salsa20. */
   const std::array<uint8_t, 32>& inner_random_stream_key() const {
     return inner_random_stream_key_;
   }
@@ -80,14 +117,71 @@ class Database final {
     inner_random_stream_key_ = key;
   }
 
+  /** Inner random stream key used with ChaCha20, usually 64 bytes. */
+  const std::vector<uint8_t>& chacha20_inner_random_stream_key() const {
+    return chacha20_inner_random_stream_key_;
+  }
+  void set_chacha20_inner_random_stream_key(const std::vector<uint8_t>& key) {
+    chacha20_inner_random_stream_key_ = key;
+  }
+
+  InnerRandomStream inner_random_stream() const {
+    return inner_random_stream_;
+  }
+  void set_inner_random_stream(InnerRandomStream inner_random_stream) {
+    inner_random_stream_ = inner_random_stream;
+  }
+
   uint64_t transform_rounds() const { return transform_rounds_; }
   void set_transform_rounds(uint64_t transform_rounds) {
     transform_rounds_ = transform_rounds;
   }
 
+  Kdf kdf() const { return kdf_; }
+  void set_kdf(Kdf kdf) { kdf_ = kdf; }
+
+  /** Argon2 memory in bytes, must be a multiple of 1024. */
+  uint64_t argon2_memory() const { return argon2_memory_; }
+  void set_argon2_memory(uint64_t argon2_memory) {
+    argon2_memory_ = argon2_memory;
+  }
+
+  uint64_t argon2_iterations() const { return argon2_iterations_; }
+  void set_argon2_iterations(uint64_t argon2_iterations) {
+    argon2_iterations_ = argon2_iterations;
+  }
+
+  uint32_t argon2_parallelism() const { return argon2_parallelism_; }
+  void set_argon2_parallelism(uint32_t argon2_parallelism) {
+    argon2_parallelism_ = argon2_parallelism;
+  }
+
   bool compress() const { return compress_; }
   void set_compress(bool compress) { compress_ = compress; }
 
+  CompressionProfile compression_profile() const {
+    return compression_profile_;
+  }
+  void set_compression_profile(CompressionProfile compression_profile) {
+    compression_profile_ = compression_profile;
+  }
+
+  /** Size in bytes of the chunks that are compressed in parallel. */
+  std::size_t compression_chunk_size() const {
+    return compression_chunk_size_;
+  }
+  /**
+   * Sets the size of the chunks that are compressed in parallel. Sizes outside
+   * the range from kMinCompressionChunkSize to kMaxCompressionChunkSize are
+   * clamped to it.
+   * @param [in] compression_chunk_size Chunk size in bytes.
+   */
+  void set_compression_chunk_size(std::size_t compression_chunk_size) {
+    compression_chunk_size_ = std::min(
+        std::max(compression_chunk_size, kMinCompressionChunkSize),
+        kMaxCompressionChunkSize);
+  }
+
   std::shared_ptr<Metadata> meta() const { return meta_; }
   void set_meta(std::shared_ptr<Metadata> meta) { meta_ = meta; }
 };
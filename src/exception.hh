@@ -17,6 +17,8 @@
  */
 
 #pragma once
+#include <exception>
+#include <string>
 
 namespace keepass {
 
@@ -29,6 +31,15 @@ class PasswordError final : public std::exception {
   }
 };
 
+class CancelledError final : public std::exception {
+ public:
+  explicit CancelledError() {}
+
+  virtual const char* what() const throw() override {
+    return "Operation was cancelled.";
+  }
+};
+
 class FormatError final : public std::exception {
  private:
   const std::string msg_;
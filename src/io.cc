@@ -18,8 +18,156 @@
 
 #include "io.hh"
 
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "random.hh"
+
 namespace keepass {
 
+namespace {
+
+/** Number of names tried before giving up on creating a temporary file. */
+constexpr int kMaxTmpFileAttempts = 100;
+
+/**
+ * Creates a new file with a random suffix appended to @a path, like mkstemp()
+ * but letting the process umask apply to mode 0666 as with any new file.
+ * @param [in] path Path to add the suffix to.
+ * @param [out] tmp_path Path of the created file.
+ * @return File descriptor, or -1 if the file couldn't be created.
+ */
+int create_tmp_file(const std::string& path, std::string& tmp_path) {
+  static const char kChars[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+
+  for (int i = 0; i < kMaxTmpFileAttempts; ++i) {
+    tmp_path = path + ".";
+    for (uint8_t c : random_array<6>())
+      tmp_path.push_back(kChars[c % (sizeof(kChars) - 1)]);
+
+    int fd = open(tmp_path.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC,
+                  0666);
+    if (fd != -1 || errno != EEXIST)
+      return fd;
+  }
+
+  return -1;
+}
+
+}   // namespace
+
+MappedFile::MappedFile(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    throw FileNotFoundError();
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ == 0) {
+      // Empty files can't be mapped but are trivially in memory.
+      mapped_ = true;
+    } else {
+      void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const uint8_t*>(data);
+        mapped_ = true;
+      } else {
+        size_ = 0;
+      }
+    }
+  }
+
+  // The mapping stays valid after the file is closed.
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr)
+    munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+AtomicFile::AtomicFile(const std::string& path) : path_(path) {
+  // Replace the file a symbolic link points to rather than the link itself.
+  char* real_path = realpath(path.c_str(), nullptr);
+  if (real_path != nullptr) {
+    path_ = real_path;
+    free(real_path);
+  }
+
+  // New files get their mode from the umask, as if written directly.
+  fd_ = create_tmp_file(path_, tmp_path_);
+  if (fd_ == -1)
+    throw IoError("Unable to open database for writing.");
+
+  struct stat st;
+  if (stat(path_.c_str(), &st) == 0) {
+    // Keeping the owner requires privileges we usually don't have, in which
+    // case the file will be owned by the current user.
+    if (fchown(fd_, st.st_uid, st.st_gid) != 0)
+      static_cast<void>(fchown(fd_, static_cast<uid_t>(-1), st.st_gid));
+    if (fchmod(fd_, st.st_mode & 07777) != 0) {
+      close(fd_);
+      unlink(tmp_path_.c_str());
+      throw IoError("Unable to open database for writing.");
+    }
+  }
+}
+
+AtomicFile::~AtomicFile() {
+  if (fd_ != -1)
+    close(fd_);
+  if (!committed_)
+    unlink(tmp_path_.c_str());
+}
+
+void AtomicFile::Commit() {
+  if (fsync(fd_) != 0)
+    throw IoError("Write error.");
+
+  int fd = fd_;
+  fd_ = -1;
+  if (close(fd) != 0)
+    throw IoError("Write error.");
+
+  if (rename(tmp_path_.c_str(), path_.c_str()) != 0)
+    throw IoError("Unable to replace database.");
+  committed_ = true;
+
+  std::string::size_type sep = path_.find_last_of('/');
+  std::string dir = sep == std::string::npos ? "." :
+      sep == 0 ? "/" : path_.substr(0, sep);
+  int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd != -1) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+}
+
+uint64_t remaining_size(std::istream& src) {
+  std::streampos pos = src.tellg();
+  if (pos == std::streampos(-1))
+    return 0;
+
+  src.seekg(0, std::ios::end);
+  std::streampos end = src.tellg();
+  src.seekg(pos, std::ios::beg);
+  if (end == std::streampos(-1) || !src.good()) {
+    src.clear(src.rdstate() & ~std::ios::failbit);
+    return 0;
+  }
+
+  return end > pos ? static_cast<uint64_t>(end - pos) : 0;
+}
+
 template<>
 std::string consume<std::string>(std::istream& src) {
   // Don't read the stream into a string directly. We want to make sure that we
@@ -17,6 +17,7 @@
  */
 
 #pragma once
+#include <cstdint>
 #include <istream>
 #include <memory>
 #include <ostream>
@@ -27,6 +28,87 @@
 
 namespace keepass {
 
+/**
+ * @brief Read-only memory mapping of a file.
+ *
+ * Files that can't be mapped, like pipes, are left unmapped so that the
+ * caller can fall back to reading them as streams.
+ */
+class MappedFile final {
+ private:
+  const uint8_t* data_ = nullptr;
+  std::size_t size_ = 0;
+  bool mapped_ = false;
+
+ public:
+  /**
+   * Maps a file into memory.
+   * @param [in] path Path to the file.
+   * @throws FileNotFoundError If the file can't be opened.
+   */
+  explicit MappedFile(const std::string& path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  /** @return true if the file is mapped and false otherwise. */
+  bool mapped() const { return mapped_; }
+
+  const uint8_t* data() const { return data_; }
+  std::size_t size() const { return size_; }
+};
+
+/**
+ * @brief Temporary file that atomically replaces a target file on commit.
+ *
+ * The temporary file is created in the same directory as the target so that
+ * it can be renamed over it. If the object is destroyed without being
+ * committed, the temporary file is removed and the target is left untouched.
+ */
+class AtomicFile final {
+ private:
+  std::string path_;
+  std::string tmp_path_;
+  int fd_ = -1;
+  bool committed_ = false;
+
+ public:
+  /**
+   * Creates a temporary file next to the target. If @a path is a symbolic
+   * link, the file it points to is the target. The temporary file gets the
+   * permissions of the target if it exists, and its owner and group as far
+   * as the process is permitted to change them. Otherwise it gets mode 0666
+   * less the process umask, as if created with open().
+   * @param [in] path Path to the file to replace.
+   * @throws IoError If the temporary file can't be created or its
+   *                 permissions can't be set.
+   */
+  explicit AtomicFile(const std::string& path);
+  ~AtomicFile();
+
+  AtomicFile(const AtomicFile&) = delete;
+  AtomicFile& operator=(const AtomicFile&) = delete;
+
+  /** @return File descriptor of the temporary file. */
+  int fd() const { return fd_; }
+
+  /**
+   * Flushes the temporary file to disk and renames it over the target. The
+   * directory is flushed as well so that the rename survives a crash.
+   * @throws IoError If the file can't be flushed or renamed.
+   */
+  void Commit();
+};
+
+/**
+ * Computes the number of bytes left to read from a stream.
+ * @param [in] src Stream to measure.
+ * @return Number of bytes left, or zero if @a src isn't seekable and the size
+ *         therefore is unknown.
+ */
+uint64_t remaining_size(std::istream& src);
+
 template <typename T>
 inline T consume(std::istream& src) {
   T val;
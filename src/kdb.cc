@@ -21,6 +21,8 @@
 #include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <limits>
+#include <sstream>
 #include <unordered_map>
 
 #include <openssl/sha.h>
@@ -33,6 +35,7 @@
 #include "group.hh"
 #include "io.hh"
 #include "key.hh"
+#include "stream.hh"
 #include "util.hh"
 
 namespace keepass {
@@ -190,14 +193,12 @@ std::shared_ptr<Group> KdbFile::ReadGroup(std::istream& src, uint32_t& id,
     // This is to guard against reading outside the field as well as for making
     // sure to read the complete field regardless of how much of it that we
     // parse.
-    std::stringstream field;
-    std::generate_n(std::ostreambuf_iterator<char>(field),
-                    field_size,
-                    [&src]() { return src.get(); });
+    std::string field_data(field_size, '\0');
+    src.read(&field_data[0], field_data.size());
     if (!src.good())
       throw IoError("Read error.");
 
-    assert(field.str().size() == field_size);
+    std::istringstream field(field_data);
 
     // Parse the group field.
     switch (static_cast<KdbGroupFieldType>(field_type)) {
@@ -301,14 +302,12 @@ std::shared_ptr<Entry> KdbFile::ReadEntry(std::istream& src,
     // This is to guard against reading outside the field as well as for making
     // sure to read the complete field regardless of how much of it that we
     // parse.
-    std::stringstream field;
-    std::generate_n(std::ostreambuf_iterator<char>(field),
-                    field_size,
-                    [&src]() { return src.get(); });
+    std::string field_data(field_size, '\0');
+    src.read(&field_data[0], field_data.size());
     if (!src.good())
       throw IoError("Read error.");
 
-    assert(field.str().size() == field_size);
+    std::istringstream field(field_data);
 
     // Parse the entry field.
     switch (static_cast<KdbEntryFieldType>(field_type)) {
@@ -482,10 +481,47 @@ void KdbFile::WriteEntry(std::ostream& dst,
 
 std::unique_ptr<Database> KdbFile::Import(const std::string& path,
                                           const Key& key) {
+  return Import(path, key, Progress());
+}
+
+std::unique_ptr<Database> KdbFile::Import(const std::string& path,
+                                          const Key& key,
+                                          const Progress& progress) {
+  // Regular files are mapped and parsed in place.
+  MappedFile file(path);
+  if (file.mapped())
+    return Import(file.data(), file.size(), key, progress);
+
   std::ifstream src(path, std::ios::in | std::ios::binary);
   if (!src.is_open())
     throw FileNotFoundError();
 
+  return Import(src, key, progress);
+}
+
+std::unique_ptr<Database> KdbFile::Import(const uint8_t* data,
+                                          std::size_t size,
+                                          const Key& key) {
+  return Import(data, size, key, Progress());
+}
+
+std::unique_ptr<Database> KdbFile::Import(const uint8_t* data,
+                                          std::size_t size,
+                                          const Key& key,
+                                          const Progress& progress) {
+  span_istreambuf streambuf(data, size);
+  std::istream src(&streambuf);
+  return Import(src, key, progress);
+}
+
+std::unique_ptr<Database> KdbFile::Import(std::istream& src,
+                                          const Key& key) {
+  return Import(src, key, Progress());
+}
+
+std::unique_ptr<Database> KdbFile::Import(std::istream& src,
+                                          const Key& key,
+                                          const Progress& progress) {
   // Read header.
   KdbHeader header;
   try {
@@ -524,7 +560,7 @@ std::unique_ptr<Database> KdbFile::Import(const std::string& path,
   // Produce the final key used for decrypting the contents.
   std::array<uint8_t, 32> transformed_key = key.Transform(
       header.transform_seed, header.transform_rounds,
-      Key::SubKeyResolution::kHashSubKeysOnlyIfCompositeKey);
+      Key::SubKeyResolution::kHashSubKeysOnlyIfCompositeKey, progress);
   std::array<uint8_t, 32> final_key;
 
   SHA256_CTX sha256;
@@ -546,40 +582,59 @@ std::unique_ptr<Database> KdbFile::Import(const std::string& path,
     throw FormatError("Unknown cipher in KDB.");
   }
 
-  // Decrypt the content.
-  std::stringstream content;
-
-  try {
-    decrypt_cbc(src, content, *cipher);
-  } catch (std::exception& e) {
-    throw PasswordError();
+  // The content hash, used for verifying the password, is needed before the
+  // content can be trusted. The content is therefore decrypted twice as it's
+  // read, once for computing the hash and once for parsing it.
+  // Streams that can't be seeked are spooled to memory.
+  std::stringstream spool;
+  std::istream* content_src = &src;
+  std::streampos content_begin = src.tellg();
+  if (content_begin == std::streampos(-1)) {
+    spool << src.rdbuf();
+    content_src = &spool;
+    content_begin = 0;
   }
+  uint64_t content_size = remaining_size(*content_src);
 
   std::array<uint8_t, 32> content_hash;
-  SHA256_Init(&sha256);
+  {
+    cbc_istreambuf content_streambuf(
+        *content_src, *cipher,
+        SourceProgress(progress, Progress::Phase::kDecrypt, content_size));
+    std::istream content(&content_streambuf);
+
+    SHA256_Init(&sha256);
+
+    std::array<char, 65536> buffer;
+    while (content.good()) {
+      content.read(buffer.data(), buffer.size());
+      SHA256_Update(&sha256, buffer.data(), content.gcount());
+    }
 
-  uint8_t buffer[1024];
-  while (content.good()) {
-    content.read(reinterpret_cast<char *>(buffer), sizeof(buffer));
-    std::streamsize read_bytes = content.gcount();
+    SHA256_Final(content_hash.data(), &sha256);
+    progress.CheckCancelled();
 
-    SHA256_Update(&sha256, buffer, read_bytes);
+    // Check if contents was successfully decrypted using the specified
+    // password.
+    if (content.bad() || content_hash != header.content_hash)
+      throw PasswordError();
   }
 
-  SHA256_Final(content_hash.data(), &sha256);
-
-  // Reset stream.
-  content.clear();
-  content.seekg(0, std::ios::beg);
+  content_src->clear();
+  content_src->seekg(content_begin, std::ios::beg);
 
-  // Check if contents was successfully decrypted using the specified password.
-  if (content_hash != header.content_hash)
-    throw PasswordError();
+  cbc_istreambuf content_streambuf(*content_src, *cipher);
+  std::istream content(&content_streambuf);
 
   // Read groups and entries.
+  const uint64_t num_records =
+      static_cast<uint64_t>(header.num_groups) + header.num_entries;
+
   std::vector<std::tuple<std::shared_ptr<Group>, uint16_t>> groups;
   std::unordered_map<uint32_t, std::shared_ptr<Group>> group_map;
   for (decltype(header.num_groups) i = 0; i < header.num_groups; ++i) {
+    progress.Report(Progress::Phase::kParse, i, num_records);
+
     uint32_t group_id = 0;
     uint16_t group_level = 0;
     std::shared_ptr<Group> group = ReadGroup(content, group_id, group_level);
@@ -591,11 +646,16 @@ std::unique_ptr<Database> KdbFile::Import(const std::string& path,
 
   std::vector<std::tuple<std::shared_ptr<Entry>, uint32_t>> entries;
   for (decltype(header.num_entries) i = 0; i < header.num_entries; ++i) {
+    progress.Report(Progress::Phase::kParse, header.num_groups + i,
+                    num_records);
+
     uint32_t entry_group_id = 0;
     entries.push_back(std::make_tuple(
         ReadEntry(content, entry_group_id), entry_group_id));
   }
 
+  progress.Report(Progress::Phase::kParse, num_records, num_records);
+
   // Construct the group and entry tree.
   std::shared_ptr<Group> group_root = std::make_shared<Group>();
 
@@ -642,20 +702,65 @@ std::unique_ptr<Database> KdbFile::Import(const std::string& path,
 
 void KdbFile::Export(const std::string& path, const Database& db,
                      const Key& key) {
+  Export(path, db, key, Progress());
+}
+
+void KdbFile::Export(const std::string& path, const Database& db,
+                     const Key& key, const Progress& progress) {
+  // Write to a temporary file and rename it over the target once complete so
+  // that a failed export never leaves a partially written database behind.
+  AtomicFile file(path);
+  Export(file.fd(), db, key, progress);
+  file.Commit();
+}
+
+void KdbFile::Export(int fd, const Database& db, const Key& key) {
+  Export(fd, db, key, Progress());
+}
+
+void KdbFile::Export(int fd, const Database& db, const Key& key,
+                     const Progress& progress) {
+  fd_ostreambuf streambuf(fd);
+  std::ostream dst(&streambuf);
+  Export(dst, db, key, progress);
+
+  dst.flush();
+  if (!dst.good())
+    throw IoError("Write error.");
+}
+
+void KdbFile::Export(std::vector<uint8_t>& dst, const Database& db,
+                     const Key& key) {
+  Export(dst, db, key, Progress());
+}
+
+void KdbFile::Export(std::vector<uint8_t>& dst, const Database& db,
+                     const Key& key, const Progress& progress) {
+  vector_ostreambuf streambuf(dst);
+  std::ostream stream(&streambuf);
+  Export(stream, db, key, progress);
+}
+
+void KdbFile::Export(std::ostream& dst, const Database& db,
+                     const Key& key) {
+  Export(dst, db, key, Progress());
+}
+
+void KdbFile::Export(std::ostream& dst, const Database& db,
+                     const Key& key, const Progress& progress) {
+  if (db.cipher() == Database::Cipher::kChaCha20)
+    throw InternalError("ChaCha20 is not supported by KDB.");
+
   // Extract database values in compatible formats.
   assert(db.master_seed().size() == 16);
   std::array<uint8_t, 16> master_seed;
   std::copy(db.master_seed().begin(), db.master_seed().end(),
             master_seed.begin());
 
-  std::ofstream dst(path, std::ios::out | std::ios::binary);
-  if (!dst.is_open())
-    throw IoError("Unable to open database for writing.");
-
   // Produce the final key used for encrypting the contents.
   std::array<uint8_t, 32> transformed_key = key.Transform(
       db.transform_seed(), db.transform_rounds(),
-      Key::SubKeyResolution::kHashSubKeysOnlyIfCompositeKey);
+      Key::SubKeyResolution::kHashSubKeysOnlyIfCompositeKey, progress);
   std::array<uint8_t, 32> final_key;
 
   SHA256_CTX sha256;
@@ -674,11 +779,34 @@ void KdbFile::Export(const std::string& path, const Database& db,
       break;
     default:
       assert(false);
-      break;
+      throw InternalError("Cipher not supported by KDB.");
   }
 
-  // Write unencrypted content to temporary stream.
-  std::stringstream content;
+  // The header holds the content hash and record counts, so a placeholder
+  // is written first and replaced once the content has been written. Streams
+  // that can't be seeked get the content spooled to memory instead.
+  std::stringstream spool;
+  std::ostream* content_dst = &dst;
+  std::streampos header_begin = dst.tellp();
+  if (header_begin == std::streampos(-1))
+    content_dst = &spool;
+  else
+    conserve<KdbHeader>(dst, KdbHeader());
+
+  // Write content, one record at a time so that it can be hashed before
+  // being encrypted.
+  cbc_ostreambuf content_streambuf(*content_dst, *cipher);
+  std::ostream content(&content_streambuf);
+  std::stringstream record;
+
+  SHA256_Init(&sha256);
+  auto flush_record = [&]() {
+    std::string record_data = record.str();
+    SHA256_Update(&sha256, record_data.data(), record_data.size());
+    content.write(record_data.data(), record_data.size());
+    record.str(std::string());
+  };
+
   decltype(KdbHeader::num_groups) num_groups = 0;
   decltype(KdbHeader::num_entries) num_entries = 0;
 
@@ -690,7 +818,9 @@ void KdbFile::Export(const std::string& path, const Database& db,
       throw InternalError("Group hierarchy exceeds KDB maximum.");
     }
 
-    WriteGroup(content, group, num_groups, static_cast<uint16_t>(level));
+    progress.Report(Progress::Phase::kSerialize, num_groups, 0);
+    WriteGroup(record, group, num_groups, static_cast<uint16_t>(level));
+    flush_record();
 
     if (num_groups == std::numeric_limits<decltype(num_groups)>::max()) {
       assert(false);
@@ -699,12 +829,17 @@ void KdbFile::Export(const std::string& path, const Database& db,
     ++num_groups;
   });
 
+  const uint64_t written_groups = num_groups;
+
   num_groups = 0;
   dfs<Group, &Group::Groups>(db.root(),
                              [&](const std::shared_ptr<Group>& group,
                                  std::size_t) {
     for (const auto& entry : group->Entries()) {
-      WriteEntry(content, entry, num_groups);
+      progress.Report(Progress::Phase::kSerialize,
+                      written_groups + num_entries, 0);
+      WriteEntry(record, entry, num_groups);
+      flush_record();
 
       if (num_entries == std::numeric_limits<decltype(num_entries)>::max()) {
         assert(false);
@@ -716,24 +851,19 @@ void KdbFile::Export(const std::string& path, const Database& db,
     ++num_groups;
   });
 
-  // Compute hash of content stream.
-  std::array<uint8_t, 32> content_hash;
-  SHA256_Init(&sha256);
-
-  uint8_t buffer[1024];
-  while (content.good()) {
-    content.read(reinterpret_cast<char *>(buffer), sizeof(buffer));
-    std::streamsize read_bytes = content.gcount();
+  // Encrypt the last block.
+  std::streampos content_begin = content_dst == &spool ? std::streampos(0) :
+      header_begin + static_cast<std::streamoff>(sizeof(KdbHeader));
+  content.flush();
+  if (!content.good())
+    throw IoError("Write error.");
 
-    SHA256_Update(&sha256, buffer, read_bytes);
-  }
+  uint64_t content_size = content_dst->tellp() - content_begin;
+  progress.Report(Progress::Phase::kEncrypt, content_size, content_size);
 
+  std::array<uint8_t, 32> content_hash;
   SHA256_Final(content_hash.data(), &sha256);
 
-  // Reset stream.
-  content.clear();
-  content.seekg(0, std::ios::beg);
-
   // Write header.
   KdbHeader header;
   header.signature0 = kKdbSignature0;
@@ -749,10 +879,35 @@ void KdbFile::Export(const std::string& path, const Database& db,
   header.transform_seed = db.transform_seed();
   header.transform_rounds = db.transform_rounds();
 
-  conserve<KdbHeader>(dst, header);
+  if (content_dst == &spool) {
+    conserve<KdbHeader>(dst, header);
+    dst << spool.rdbuf();
+  } else {
+    dst.seekp(header_begin);
+    conserve<KdbHeader>(dst, header);
+    dst.seekp(0, std::ios::end);
+  }
+  dst.flush();
+  if (!dst.good())
+    throw IoError("Write error.");
+}
 
-  // Encrypt the content.
-  encrypt_cbc(content, dst, *cipher);
+std::future<std::unique_ptr<Database>> KdbFile::ImportAsync(
+    const std::string& path, const Key& key, const Progress& progress) const {
+  KdbFile file(*this);
+  return std::async(std::launch::async, [file, path, key, progress]() mutable {
+    return file.Import(path, key, progress);
+  });
+}
+
+std::future<void> KdbFile::ExportAsync(const std::string& path,
+                                       const Database& db, const Key& key,
+                                       const Progress& progress) const {
+  KdbFile file(*this);
+  return std::async(std::launch::async,
+                    [file, path, db, key, progress]() mutable {
+    file.Export(path, db, key, progress);
+  });
 }
 
 }   // namespace keepass
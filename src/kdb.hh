@@ -18,10 +18,15 @@
 
 #pragma once
 #include <cstdint>
+#include <future>
+#include <istream>
 #include <memory>
+#include <ostream>
 #include <string>
+#include <vector>
 
 #include "database.hh"
+#include "progress.hh"
 
 namespace keepass {
 
@@ -46,7 +51,61 @@ class KdbFile final {
 
  public:
   std::unique_ptr<Database> Import(const std::string& path, const Key& key);
+  std::unique_ptr<Database> Import(const std::string& path, const Key& key,
+                                   const Progress& progress);
+  /**
+   * Exports a database to a file. See KdbxFile::Export().
+   */
   void Export(const std::string& path, const Database& db, const Key& key);
+  void Export(const std::string& path, const Database& db, const Key& key,
+              const Progress& progress);
+
+  /**
+   * Imports a database from a stream. See KdbxFile::Import(). Streams that
+   * can't be seeked are buffered in memory since the content is read twice.
+   */
+  std::unique_ptr<Database> Import(std::istream& src, const Key& key);
+  std::unique_ptr<Database> Import(std::istream& src, const Key& key,
+                                   const Progress& progress);
+  /**
+   * Imports a database held in memory. See KdbxFile::Import().
+   */
+  std::unique_ptr<Database> Import(const uint8_t* data, std::size_t size,
+                                   const Key& key);
+  std::unique_ptr<Database> Import(const uint8_t* data, std::size_t size,
+                                   const Key& key, const Progress& progress);
+  /**
+   * Exports a database to a stream. See KdbxFile::Export(). For streams that
+   * can't be seeked, the content is buffered in memory since the header
+   * depends on it.
+   */
+  void Export(std::ostream& dst, const Database& db, const Key& key);
+  void Export(std::ostream& dst, const Database& db, const Key& key,
+              const Progress& progress);
+  /**
+   * Exports a database to a file descriptor. See KdbxFile::Export(). The
+   * content is buffered in memory if the descriptor can't be seeked.
+   */
+  void Export(int fd, const Database& db, const Key& key);
+  void Export(int fd, const Database& db, const Key& key,
+              const Progress& progress);
+  /**
+   * Exports a database to memory. See KdbxFile::Export().
+   */
+  void Export(std::vector<uint8_t>& dst, const Database& db, const Key& key);
+  void Export(std::vector<uint8_t>& dst, const Database& db, const Key& key,
+              const Progress& progress);
+
+  /**
+   * Imports a database on a separate thread. See KdbxFile::ImportAsync().
+   */
+  std::future<std::unique_ptr<Database>> ImportAsync(
+      const std::string& path, const Key& key, const Progress& progress) const;
+  /**
+   * Exports a database on a separate thread. See KdbxFile::ExportAsync().
+   */
+  std::future<void> ExportAsync(const std::string& path, const Database& db,
+                                const Key& key, const Progress& progress) const;
 };
 
 }   // namespace keepass
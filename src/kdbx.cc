@@ -20,14 +20,21 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <map>
 #include <sstream>
 #ifdef DEBUG
 #include <iostream>
 #endif
 
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/sha.h>
 
+#include "argon2.hh"
 #include "base64.hh"
 #include "cipher.hh"
 #include "exception.hh"
@@ -42,6 +49,7 @@
 #include "security.hh"
 #include "stream.hh"
 #include "util.hh"
+#include "xml.hh"
 
 namespace keepass {
 
@@ -49,12 +57,38 @@ constexpr uint32_t kKdbxSignature0 = 0x9aa2d903;
 constexpr uint32_t kKdbxSignature1 = 0xb54bfb67;
 constexpr uint32_t kKdbxVersionCriticalMask = 0xffff0000;
 constexpr uint32_t kKdbxVersionCriticalMin = 0x00030001;
+constexpr uint32_t kKdbxVersion4 = 0x00040000;
+
+/** Seconds from 0001-01-01, where KDBX 4 times start, to the Unix epoch. */
+constexpr int64_t kKdbxTimeOffset = 62135596800;
+/** Unix time of the KeePass "never" timestamp, 2999-12-28T22:59:59Z. */
+constexpr int64_t kKdbxNeverTime = 32503417199;
 
 constexpr std::array<uint8_t, 16> kKdbxCipherAes = { {
   0x31, 0xc1, 0xf2, 0xe6, 0xbf, 0x71, 0x43, 0x50,
   0xbe, 0x58, 0x05, 0x21, 0x6a, 0xfc, 0x5a, 0xff 
 } };
 
+constexpr std::array<uint8_t, 16> kKdbxCipherChaCha20 = { {
+  0xd6, 0x03, 0x8a, 0x2b, 0x8b, 0x6f, 0x4c, 0xb5,
+  0xa5, 0x24, 0x33, 0x9a, 0x31, 0xdb, 0xb5, 0x9a
+} };
+
+constexpr std::array<uint8_t, 16> kKdbxKdfAes = { {
+  0xc9, 0xd9, 0xf3, 0x9a, 0x62, 0x8a, 0x44, 0x60,
+  0xbf, 0x74, 0x0d, 0x08, 0xc1, 0x8a, 0x4f, 0xea
+} };
+
+constexpr std::array<uint8_t, 16> kKdbxKdfArgon2d = { {
+  0xef, 0x63, 0x6d, 0xdf, 0x8c, 0x29, 0x44, 0x4b,
+  0x91, 0xf7, 0xa9, 0xa4, 0x03, 0xe3, 0x0a, 0x0c
+} };
+
+constexpr std::array<uint8_t, 16> kKdbxKdfArgon2id = { {
+  0x9e, 0x29, 0x8b, 0x19, 0x56, 0xdb, 0x47, 0x73,
+  0xb2, 0x3d, 0xfc, 0x3e, 0xc6, 0xf0, 0xa1, 0xe6
+} };
+
 constexpr std::array<uint8_t, 8> kKdbxInnerRandomStreamInitVec = {
   0xe8, 0x30, 0x09, 0x4b, 0x97, 0x20, 0x5d, 0x2a
 };
@@ -70,10 +104,28 @@ enum class kKdbxRandomStream : uint32_t {
   kNone,
   kArcFourVariant,
   kSalsa20,
+  kChaCha20,
 
   kCount
 };
 
+/** Header fields not in a span are read in chunks of at most this size. */
+constexpr std::size_t kKdbxHeaderFieldChunkSize = 64 * 1024;
+
+constexpr uint16_t kKdbxVariantMapVersion = 0x0100;
+constexpr uint16_t kKdbxVariantMapVersionCriticalMask = 0xff00;
+
+enum class kKdbxVariantType : uint8_t {
+  kEnd = 0x00,
+  kUInt32 = 0x04,
+  kUInt64 = 0x05,
+  kBool = 0x08,
+  kInt32 = 0x0c,
+  kInt64 = 0x0d,
+  kString = 0x18,
+  kByteArray = 0x42
+};
+
 #pragma pack(push, 1)
 struct KdbxHeader {
   uint32_t signature0;
@@ -95,7 +147,9 @@ struct KdbxHeaderField {
     kExcryptionInitVec = 7,
     kInnerRandomStreamKey = 8,
     kContentStreamStartBytes = 9,
-    kInnerRandomStreamId = 10
+    kInnerRandomStreamId = 10,
+    kKdfParameters = 11,
+    kPublicCustomData = 12
   } id = kEndOfHeader;
 
   uint16_t size = 0;
@@ -110,13 +164,480 @@ struct KdbxHeaderField {
 };
 static_assert(sizeof(KdbxHeaderField) == 3,
               "bad packing of bitfield header structure.");
+
+/** KDBX 4 header field, the fields may be larger than in earlier versions. */
+struct Kdbx4HeaderField {
+  KdbxHeaderField::Id id = KdbxHeaderField::kEndOfHeader;
+  uint32_t size = 0;
+
+  Kdbx4HeaderField() = default;
+  Kdbx4HeaderField(KdbxHeaderField::Id new_id, uint32_t new_size) :
+      id(new_id), size(new_size) {}
+};
+static_assert(sizeof(Kdbx4HeaderField) == 5,
+              "bad packing of bitfield header structure.");
+
+struct KdbxInnerHeaderField {
+  enum Id : uint8_t {
+    kEndOfHeader = 0,
+    kInnerRandomStreamId = 1,
+    kInnerRandomStreamKey = 2,
+    kBinary = 3
+  } id = kEndOfHeader;
+
+  int32_t size = 0;
+
+  KdbxInnerHeaderField() = default;
+  KdbxInnerHeaderField(Id new_id, int32_t new_size) :
+      id(new_id), size(new_size) {}
+};
+static_assert(sizeof(KdbxInnerHeaderField) == 5,
+              "bad packing of bitfield header structure.");
 #pragma pack(pop)
 
+/** Flag of binaries in the inner header that are protected in memory. */
+constexpr uint8_t kKdbxInnerBinaryProtected = 0x01;
+
+namespace {
+
+/**
+ * @brief Typed value in a KDBX variant dictionary.
+ */
+struct KdbxVariant {
+  kKdbxVariantType type;
+  std::vector<uint8_t> value;
+};
+
+typedef std::map<std::string, KdbxVariant> KdbxVariantMap;
+
+/**
+ * Reads a variant dictionary. Names and values are checked against the size
+ * of @a src before being allocated, so it must be seekable.
+ */
+KdbxVariantMap consume_variant_map(std::istream& src) {
+  uint16_t version = consume<uint16_t>(src);
+  if ((version & kKdbxVariantMapVersionCriticalMask) >
+      (kKdbxVariantMapVersion & kKdbxVariantMapVersionCriticalMask)) {
+    throw FormatError("Unsupported KDF parameters version in KDBX.");
+  }
+
+  KdbxVariantMap map;
+  while (true) {
+    kKdbxVariantType type = consume<kKdbxVariantType>(src);
+    if (type == kKdbxVariantType::kEnd)
+      break;
+
+    int32_t name_size = consume<int32_t>(src);
+    if (name_size < 0 ||
+        static_cast<uint64_t>(name_size) > remaining_size(src)) {
+      throw FormatError("Illegal KDF parameter name in KDBX.");
+    }
+    std::string name(name_size, '\0');
+    src.read(&name[0], name_size);
+
+    int32_t value_size = consume<int32_t>(src);
+    if (value_size < 0 ||
+        static_cast<uint64_t>(value_size) > remaining_size(src)) {
+      throw FormatError("Illegal KDF parameter value in KDBX.");
+    }
+    KdbxVariant& variant = map[name];
+    variant.type = type;
+    variant.value.resize(value_size);
+    src.read(reinterpret_cast<char*>(variant.value.data()), value_size);
+
+    if (!src.good())
+      throw IoError("Read error.");
+  }
+
+  return map;
+}
+
+void conserve_variant_map(std::ostream& dst, const KdbxVariantMap& map) {
+  conserve<uint16_t>(dst, kKdbxVariantMapVersion);
+  for (const auto& item : map) {
+    conserve<kKdbxVariantType>(dst, item.second.type);
+    conserve<int32_t>(dst, static_cast<int32_t>(item.first.size()));
+    dst.write(item.first.data(), item.first.size());
+    conserve<int32_t>(dst, static_cast<int32_t>(item.second.value.size()));
+    conserve<std::vector<uint8_t>>(dst, item.second.value);
+  }
+  conserve<kKdbxVariantType>(dst, kKdbxVariantType::kEnd);
+}
+
+template <typename T>
+T get_variant(const KdbxVariantMap& map, const std::string& name,
+              kKdbxVariantType type) {
+  auto it = map.find(name);
+  if (it == map.end() || it->second.type != type ||
+      it->second.value.size() != sizeof(T)) {
+    throw FormatError("Missing or illegal KDF parameter in KDBX.");
+  }
+
+  T val;
+  std::memcpy(&val, it->second.value.data(), sizeof(T));
+  return val;
+}
+
+template <typename T>
+void set_variant(KdbxVariantMap& map, const std::string& name,
+                 kKdbxVariantType type, const T& val) {
+  KdbxVariant& variant = map[name];
+  variant.type = type;
+  variant.value.resize(sizeof(T));
+  std::memcpy(variant.value.data(), &val, sizeof(T));
+}
+
+void parse_kdf_parameters(std::istream& src, Database& db) {
+  KdbxVariantMap map = consume_variant_map(src);
+
+  auto uuid = get_variant<std::array<uint8_t, 16>>(
+      map, "$UUID", kKdbxVariantType::kByteArray);
+  if (uuid == kKdbxKdfAes) {
+    db.set_kdf(Database::Kdf::kAes);
+    db.set_transform_rounds(get_variant<uint64_t>(
+        map, "R", kKdbxVariantType::kUInt64));
+  } else if (uuid == kKdbxKdfArgon2d || uuid == kKdbxKdfArgon2id) {
+    db.set_kdf(uuid == kKdbxKdfArgon2d ?
+        Database::Kdf::kArgon2d : Database::Kdf::kArgon2id);
+
+    if (get_variant<uint32_t>(map, "V", kKdbxVariantType::kUInt32) !=
+        Argon2::kVersion) {
+      throw FormatError("Unsupported Argon2 version in KDBX.");
+    }
+    if (map.count("K") != 0 || map.count("A") != 0)
+      throw FormatError("Unsupported Argon2 parameters in KDBX.");
+
+    uint64_t memory = get_variant<uint64_t>(
+        map, "M", kKdbxVariantType::kUInt64);
+    uint64_t iterations = get_variant<uint64_t>(
+        map, "I", kKdbxVariantType::kUInt64);
+    uint32_t parallelism = get_variant<uint32_t>(
+        map, "P", kKdbxVariantType::kUInt32);
+    if (memory % 1024 != 0 ||
+        memory / 1024 > std::numeric_limits<uint32_t>::max() ||
+        iterations < 1 ||
+        iterations > std::numeric_limits<uint32_t>::max() ||
+        parallelism < 1 || parallelism > Argon2::kMaxParallelism ||
+        memory / 1024 / Argon2::kMinMemoryPerLane < parallelism) {
+      throw FormatError("Illegal Argon2 parameters in KDBX.");
+    }
+
+    db.set_argon2_memory(memory);
+    db.set_argon2_iterations(iterations);
+    db.set_argon2_parallelism(parallelism);
+  } else {
+    throw FormatError("Unknown key derivation function in KDBX.");
+  }
+
+  db.set_transform_seed(get_variant<std::array<uint8_t, 32>>(
+      map, "S", kKdbxVariantType::kByteArray));
+}
+
+void write_kdf_parameters(std::ostream& dst, const Database& db) {
+  KdbxVariantMap map;
+  switch (db.kdf()) {
+    case Database::Kdf::kAes:
+      set_variant(map, "$UUID", kKdbxVariantType::kByteArray, kKdbxKdfAes);
+      set_variant(map, "R", kKdbxVariantType::kUInt64,
+                  db.transform_rounds());
+      break;
+    case Database::Kdf::kArgon2d:
+    case Database::Kdf::kArgon2id:
+      set_variant(map, "$UUID", kKdbxVariantType::kByteArray,
+                  db.kdf() == Database::Kdf::kArgon2d ?
+                      kKdbxKdfArgon2d : kKdbxKdfArgon2id);
+      set_variant(map, "V", kKdbxVariantType::kUInt32, Argon2::kVersion);
+      set_variant(map, "M", kKdbxVariantType::kUInt64, db.argon2_memory());
+      set_variant(map, "I", kKdbxVariantType::kUInt64,
+                  db.argon2_iterations());
+      set_variant(map, "P", kKdbxVariantType::kUInt32,
+                  db.argon2_parallelism());
+      break;
+  }
+  set_variant(map, "S", kKdbxVariantType::kByteArray, db.transform_seed());
+
+  conserve_variant_map(dst, map);
+}
+
+std::array<uint8_t, 32> transform_key(const Key& key, const Database& db,
+                                      const Progress& progress) {
+  switch (db.kdf()) {
+    case Database::Kdf::kArgon2d:
+    case Database::Kdf::kArgon2id: {
+      if (db.argon2_memory() / 1024 > std::numeric_limits<uint32_t>::max() ||
+          db.argon2_iterations() > std::numeric_limits<uint32_t>::max()) {
+        throw InternalError("Argon2 parameters out of range.");
+      }
+
+      Argon2 argon2(db.kdf() == Database::Kdf::kArgon2d ?
+                        Argon2::Type::kArgon2d : Argon2::Type::kArgon2id,
+                    static_cast<uint32_t>(db.argon2_iterations()),
+                    static_cast<uint32_t>(db.argon2_memory() / 1024),
+                    db.argon2_parallelism());
+      return key.Transform(db.transform_seed(), argon2,
+                           Key::SubKeyResolution::kHashSubKeys, progress);
+    }
+    case Database::Kdf::kAes:
+    default:
+      return key.Transform(db.transform_seed(), db.transform_rounds(),
+                           Key::SubKeyResolution::kHashSubKeys, progress);
+  }
+}
+
+/** Creates the stream used for (de)obfuscating protected XML values. */
+RandomObfuscator create_obfuscator(const Database& db) {
+  if (db.inner_random_stream() == Database::InnerRandomStream::kChaCha20) {
+    std::array<uint8_t, SHA512_DIGEST_LENGTH> hash;
+    SHA512(db.chacha20_inner_random_stream_key().data(),
+           db.chacha20_inner_random_stream_key().size(), hash.data());
+
+    std::array<uint8_t, 32> key;
+    std::array<uint8_t, 12> init_vec;
+    std::copy(hash.begin(), hash.begin() + 32, key.begin());
+    std::copy(hash.begin() + 32, hash.begin() + 44, init_vec.begin());
+
+    RandomObfuscator obfuscator(key, init_vec);
+    OPENSSL_cleanse(hash.data(), hash.size());
+    OPENSSL_cleanse(key.data(), key.size());
+    return obfuscator;
+  }
+
+  std::array<uint8_t, 32> key;
+  SHA256(db.inner_random_stream_key().data(),
+         db.inner_random_stream_key().size(), key.data());
+
+  RandomObfuscator obfuscator(key, kKdbxInnerRandomStreamInitVec);
+  OPENSSL_cleanse(key.data(), key.size());
+  return obfuscator;
+}
+
+/**
+ * Derives the key of the KDBX 4 HMAC block stream, which also authenticates
+ * the header.
+ */
+std::array<uint8_t, 64> get_hmac_key(
+    const Database& db, const std::array<uint8_t, 32>& transformed_key) {
+  static constexpr uint8_t kHmacKeySuffix = 0x01;
+
+  std::array<uint8_t, 64> hmac_key;
+
+  SHA512_CTX sha512;
+  SHA512_Init(&sha512);
+  SHA512_Update(&sha512, db.master_seed().data(), db.master_seed().size());
+  SHA512_Update(&sha512, transformed_key.data(), transformed_key.size());
+  SHA512_Update(&sha512, &kHmacKeySuffix, sizeof(kHmacKeySuffix));
+  SHA512_Final(hmac_key.data(), &sha512);
+  OPENSSL_cleanse(&sha512, sizeof(sha512));
+
+  return hmac_key;
+}
+
+std::array<uint8_t, 32> get_header_hmac(const std::array<uint8_t, 64>& hmac_key,
+                                        const std::string& header_data) {
+  std::array<uint8_t, 64> header_key =
+      hmac_block_key(hmac_key, std::numeric_limits<uint64_t>::max());
+  std::array<uint8_t, 32> header_hmac;
+
+  unsigned int header_hmac_size = 0;
+  uint8_t* res = HMAC(EVP_sha256(), header_key.data(), header_key.size(),
+                      reinterpret_cast<const uint8_t*>(header_data.data()),
+                      header_data.size(), header_hmac.data(),
+                      &header_hmac_size);
+  OPENSSL_cleanse(header_key.data(), header_key.size());
+  if (res == nullptr || header_hmac_size != header_hmac.size())
+    throw InternalError("Unable to compute HMAC.");
+
+  return header_hmac;
+}
+
+/**
+ * Writes the id and size of a header field, the size is wider in KDBX 4.
+ * @param [in] size Size of the field data that follows.
+ */
+void conserve_header_field(std::ostream& dst, KdbxHeaderField::Id id,
+                           std::size_t size, bool kdbx4) {
+  if (kdbx4) {
+    if (size > std::numeric_limits<uint32_t>::max())
+      throw InternalError("Header field size exceeds KDBX maximum.");
+    conserve<Kdbx4HeaderField>(dst, Kdbx4HeaderField(
+        id, static_cast<uint32_t>(size)));
+  } else {
+    if (size > std::numeric_limits<uint16_t>::max())
+      throw InternalError("Header field size exceeds KDBX maximum.");
+    conserve<KdbxHeaderField>(dst, KdbxHeaderField(
+        id, static_cast<uint16_t>(size)));
+  }
+}
+
+/**
+ * Checks whether a database uses features that only KDBX 4 can describe:
+ * other key derivation functions than AES, ChaCha20 for the content or the
+ * inner random stream, or inner random stream keys of other sizes than 32
+ * bytes.
+ */
+bool requires_kdbx4(const Database& db) {
+  return db.kdf() != Database::Kdf::kAes ||
+      db.cipher() == Database::Cipher::kChaCha20 ||
+      db.inner_random_stream() == Database::InnerRandomStream::kChaCha20;
+}
+
+/**
+ * Stores an inner random stream key read from a file as the key of the stream
+ * the database uses. Salsa20 keys are always 32 bytes.
+ */
+void set_inner_random_stream_key(Database& db, std::vector<uint8_t>& key) {
+  if (key.empty())
+    return;
+
+  if (db.inner_random_stream() == Database::InnerRandomStream::kChaCha20) {
+    db.set_chacha20_inner_random_stream_key(key);
+  } else {
+    if (key.size() != 32)
+      throw FormatError("Illegal protected stream key size in KDBX.");
+    std::array<uint8_t, 32> salsa20_key;
+    std::copy(key.begin(), key.end(), salsa20_key.begin());
+    db.set_inner_random_stream_key(salsa20_key);
+    OPENSSL_cleanse(salsa20_key.data(), salsa20_key.size());
+  }
+  OPENSSL_cleanse(key.data(), key.size());
+}
+
+std::array<uint8_t, 12> chacha20_init_vector(const Database& db) {
+  std::array<uint8_t, 12> init_vec;
+  std::copy(db.init_vector().begin(), db.init_vector().begin() + 12,
+            init_vec.begin());
+  return init_vec;
+}
+
+/** Maps the compression settings of @a db to gzip writer options. */
+GzipOptions get_gzip_options(const Database& db) {
+  GzipOptions options;
+  switch (db.compression_profile()) {
+    case Database::CompressionProfile::kFastest:
+      options.level = 1;
+      break;
+    case Database::CompressionProfile::kDefault:
+      options.level = 6;
+      break;
+    case Database::CompressionProfile::kSmallest:
+      options.level =
+          options.backend == DeflateBackend::kLibdeflate ? 12 : 9;
+      break;
+  }
+  options.chunk_size = db.compression_chunk_size();
+
+  return options;
+}
+
+/**
+ * Reads the rest of the current element into a tree. Used for the parts of the
+ * document that are small enough to be parsed as a whole.
+ * @param [in] reader Reader positioned at the start of the element.
+ * @param [in] node Node to add the attributes and content of the element to.
+ */
+void read_xml_subtree(XmlReader& reader, pugi::xml_node& node) {
+  for (const auto& attr : reader.attributes()) {
+    node.append_attribute(attr.first.c_str()).set_value(
+        attr.second.c_str());
+  }
+
+  while (reader.Next() != XmlReader::Node::kEndElement) {
+    if (reader.node() == XmlReader::Node::kText) {
+      node.append_child(pugi::node_pcdata).set_value(reader.text().c_str());
+    } else {
+      pugi::xml_node child = node.append_child(reader.name().c_str());
+      read_xml_subtree(reader, child);
+    }
+  }
+}
+
+/**
+ * Looks up an attribute of the current start element of a reader.
+ * @return Value of the attribute, or an empty string if it's missing.
+ */
+const std::string& find_xml_attribute(const XmlReader& reader,
+                                      const char* name) {
+  static const std::string kEmpty;
+  for (const auto& attr : reader.attributes()) {
+    if (attr.first == name)
+      return attr.second;
+  }
+
+  return kEmpty;
+}
+
+/** Interprets an attribute value as a boolean, the same way as pugixml. */
+bool xml_attribute_as_bool(const std::string& value) {
+  return !value.empty() && std::strchr("1tTyY", value[0]) != nullptr;
+}
+
+/**
+ * @brief Output stream buffer writing base64 encoded data to an XML element.
+ */
+class xml_base64_ostreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  XmlWriter& writer_;
+
+ public:
+  explicit xml_base64_ostreambuf(XmlWriter& writer) : writer_(writer) {}
+
+  virtual int overflow(int c) override {
+    if (c != std::char_traits<char>::eof()) {
+      char ch = static_cast<char>(c);
+      writer_.WriteBase64(&ch, 1);
+    }
+
+    return std::char_traits<char>::not_eof(c);
+  }
+
+  virtual std::streamsize xsputn(const char* s, std::streamsize n) override {
+    writer_.WriteBase64(s, static_cast<std::size_t>(n));
+    return n;
+  }
+};
+
+/**
+ * @brief Chain of input streams, each reading from the previous one.
+ *
+ * The streams are destroyed in reverse order of being added, so that none
+ * outlives the stream it reads from.
+ */
+class StreamChain final {
+ private:
+  std::vector<std::unique_ptr<std::streambuf>> streambufs_;
+  std::vector<std::unique_ptr<std::istream>> streams_;
+
+ public:
+  ~StreamChain() {
+    while (!streams_.empty()) {
+      streams_.pop_back();
+      streambufs_.pop_back();
+    }
+  }
+
+  /**
+   * Adds a stream buffer to the end of the chain.
+   * @param [in] streambuf Stream buffer to take ownership of.
+   * @return Stream reading from @a streambuf.
+   */
+  std::istream& Add(std::streambuf* streambuf) {
+    streambufs_.emplace_back(streambuf);
+    streams_.emplace_back(new std::istream(streambuf));
+    return *streams_.back();
+  }
+};
+
+}   // namespace
+
 void KdbxFile::Reset() {
   binary_pool_.clear();
   icon_pool_.clear();
   group_pool_.clear();
   header_hash_ = { 0 };
+  kdbx4_ = false;
+  inner_binaries_.clear();
+  lazy_obfuscator_.reset();
 }
 
 std::shared_ptr<Group> KdbxFile::GetGroup(const std::string& uuid_str) {
@@ -138,6 +659,21 @@ std::shared_ptr<Group> KdbxFile::GetGroup(const std::string& uuid_str) {
 }
 
 std::time_t KdbxFile::ParseDateTime(const char* text) const {
+  // KDBX 4 stores times as base64 encoded seconds since 0001-01-01, which
+  // unlike the ISO 8601 format never contains dashes.
+  if (kdbx4_ && std::strchr(text, '-') == nullptr) {
+    std::string data = base64_decode(text);
+    if (data.size() != sizeof(int64_t)) {
+      assert(false);
+      return 0;
+    }
+
+    int64_t seconds = 0;
+    std::memcpy(&seconds, data.data(), sizeof(seconds));
+    int64_t time = seconds - kKdbxTimeOffset;
+    return time == kKdbxNeverTime ? 0 : static_cast<std::time_t>(time);
+  }
+
   // Check for the special KeePass 1x "never" timestamp.
   if (std::string(text) == "2999-12-28T22:59:59Z")
     return 0;
@@ -156,6 +692,13 @@ std::time_t KdbxFile::ParseDateTime(const char* text) const {
 }
 
 std::string KdbxFile::WriteDateTime(std::time_t time) const {
+  if (kdbx4_) {
+    int64_t seconds = (time == 0 ? kKdbxNeverTime : time) + kKdbxTimeOffset;
+    std::array<uint8_t, sizeof(seconds)> data;
+    std::memcpy(data.data(), &seconds, sizeof(seconds));
+    return base64_encode(data.begin(), data.end());
+  }
+
   if (time == 0)
     return "2999-12-28T22:59:59Z";
 
@@ -174,6 +717,16 @@ protect<std::string> KdbxFile::ParseProtectedString(
     bool prot = val_node.attribute("Protected").as_bool();
     if (prot) {
       std::string val = base64_decode(val_node.text().as_string());
+      if (!val.empty() && lazy_obfuscator_) {
+        // Keep the value obfuscated and record where in the key stream it
+        // starts so that it can be deobfuscated when first accessed.
+        std::shared_ptr<LazyObfuscator> lazy_obfuscator = lazy_obfuscator_;
+        uint64_t offset = obfuscator.offset();
+        obfuscator.Skip(val.size());
+        return protect<std::string>::Lazy([lazy_obfuscator, offset, val]() {
+          return lazy_obfuscator->Process(offset, val);
+        }, true);
+      }
       if (!val.empty())
         return protect<std::string>(obfuscator.Process(val), true);
     }
@@ -186,19 +739,23 @@ protect<std::string> KdbxFile::ParseProtectedString(
   return protect<std::string>(std::string(), false);
 }
 
-void KdbxFile::WriteProtectedString(pugi::xml_node& node,
+void KdbxFile::WriteProtectedString(XmlWriter& writer,
+                                    const char* name,
                                     const protect<std::string>& str,
                                     RandomObfuscator& obfuscator) const {
+  writer.StartElement(name);
   if (str.is_protected()) {
-    node.append_attribute("Protected").set_value("True");
-    node.text().set(base64_encode(obfuscator.Process(*str)).c_str());
+    writer.WriteAttribute("Protected", "True");
+    std::string val = obfuscator.Process(*str);
+    writer.WriteBase64(val.data(), val.size());
   } else {
-    node.text().set(str->c_str());
+    writer.WriteText(*str);
   }
+  writer.EndElement();
 }
 
-std::shared_ptr<Metadata> KdbxFile::ParseMeta(const pugi::xml_node& meta_node,
-                                              RandomObfuscator& obfuscator) {
+std::shared_ptr<Metadata> KdbxFile::ParseMeta(
+    const pugi::xml_node& meta_node) {
   std::shared_ptr<Metadata> meta = std::make_shared<Metadata>();
 
   // Parse header hash and store in member for checking later.
@@ -277,44 +834,6 @@ std::shared_ptr<Metadata> KdbxFile::ParseMeta(const pugi::xml_node& meta_node,
     }
   }
 
-  pugi::xml_node bins_node = meta_node.child("Binaries");
-  if (bins_node) {
-    for (pugi::xml_node bin_node = bins_node.child("Binary"); bin_node;
-        bin_node = bin_node.next_sibling("Binary")) {
-      std::string id = bin_node.attribute("ID").value();
-
-      protect<std::string> data;
-
-      bool compressed = false;
-      if (bin_node.attribute("Protected").as_bool()) {
-        data = protect<std::string>(obfuscator.Process(
-            base64_decode(bin_node.text().as_string())), true);
-      } else {
-        if (bin_node.attribute("Compressed").as_bool()) {
-          compressed = true;
-          std::stringstream raw_stream(
-              base64_decode(bin_node.text().as_string()));
-          gzip_istreambuf gzip_streambuf(raw_stream);
-          std::istream gzip_stream(&gzip_streambuf);
-
-          data = protect<std::string>(
-              consume<std::string>(gzip_stream),
-              bin_node.attribute("ProtectedInMemory").as_bool());
-        } else {
-          data = protect<std::string>(
-              base64_decode(bin_node.text().as_string()),
-              bin_node.attribute("ProtectedInMemory").as_bool());
-        }
-      }
-
-      std::shared_ptr<Binary> binary = std::make_shared<Binary>(data);
-      binary->set_compress(compressed);
-      meta->AddBinary(binary);
-
-      binary_pool_.insert(std::make_pair(id, binary));
-    }
-  }
-
   pugi::xml_node data_node = meta_node.child("CustomData");
   if (data_node) {
     for (pugi::xml_node item_node = data_node.child("Item"); item_node;
@@ -333,131 +852,199 @@ std::shared_ptr<Metadata> KdbxFile::ParseMeta(const pugi::xml_node& meta_node,
   return meta;
 }
 
-void KdbxFile::WriteMeta(pugi::xml_node& meta_node,
+void KdbxFile::ParseBinaries(
+    XmlReader& reader,
+    RandomObfuscator& obfuscator,
+    std::vector<std::shared_ptr<Binary>>& binaries) {
+  while (reader.Next() != XmlReader::Node::kEndElement) {
+    if (reader.node() != XmlReader::Node::kStartElement)
+      continue;
+    if (reader.name() != "Binary") {
+      reader.Skip();
+      continue;
+    }
+
+    std::string id = find_xml_attribute(reader, "ID");
+    bool is_protected =
+        xml_attribute_as_bool(find_xml_attribute(reader, "Protected"));
+    bool compressed =
+        xml_attribute_as_bool(find_xml_attribute(reader, "Compressed"));
+    bool protected_in_memory =
+        xml_attribute_as_bool(find_xml_attribute(reader, "ProtectedInMemory"));
+
+    std::string text;
+    while (reader.Next() != XmlReader::Node::kEndElement) {
+      if (reader.node() == XmlReader::Node::kText)
+        text += reader.text();
+      else
+        reader.Skip();
+    }
+
+    protect<std::string> data;
+    if (is_protected) {
+      compressed = false;
+      data = protect<std::string>(obfuscator.Process(base64_decode(text)),
+                                  true);
+    } else if (compressed) {
+      std::stringstream raw_stream(base64_decode(text));
+      gzip_istreambuf gzip_streambuf(raw_stream);
+      std::istream gzip_stream(&gzip_streambuf);
+
+      data = protect<std::string>(consume<std::string>(gzip_stream),
+                                  protected_in_memory);
+    } else {
+      data = protect<std::string>(base64_decode(text), protected_in_memory);
+    }
+
+    std::shared_ptr<Binary> binary = std::make_shared<Binary>(data);
+    binary->set_compress(compressed);
+    binaries.push_back(binary);
+
+    binary_pool_.insert(std::make_pair(id, binary));
+  }
+}
+
+void KdbxFile::WriteMeta(XmlWriter& writer,
                          RandomObfuscator& obfuscator,
-                         std::shared_ptr<Metadata> meta) {
-  meta_node.append_child("HeaderHash").text().set(base64_encode(
-      header_hash_.begin(), header_hash_.end()).c_str());
-  meta_node.append_child("Generator").text().set(meta->generator().c_str());
-  meta_node.append_child("DatabaseName").text().set(
-      meta->database_name()->c_str());
-  meta_node.append_child("DatabaseNameChanged").text().set(WriteDateTime(
-      meta->database_name().time()).c_str());
-  meta_node.append_child("DatabaseDescription").text().set(
-      meta->database_desc()->c_str());
-  meta_node.append_child("DatabaseDescriptionChanged").text().set(
-      WriteDateTime(meta->database_desc().time()).c_str());
-  meta_node.append_child("DefaultUserName").text().set(
-      meta->default_username()->c_str());
-  meta_node.append_child("DefaultUserNameChanged").text().set(WriteDateTime(
-      meta->default_username().time()).c_str());
-  meta_node.append_child("MaintenanceHistoryDays").text().set(
-      meta->maintenance_hist_days());
-  meta_node.append_child("Color").text().set(meta->database_color().c_str());
-  meta_node.append_child("MasterKeyChanged").text().set(WriteDateTime(
-      meta->master_key_changed()).c_str());
-  meta_node.append_child("MasterKeyChangeRec").text().set(
-      static_cast<long long>(meta->master_key_change_rec()));
-  meta_node.append_child("MasterKeyChangeForce").text().set(
-      static_cast<long long>(meta->master_key_change_force()));
-
-  pugi::xml_node mp_node = meta_node.append_child("MemoryProtection");
-  mp_node.append_child("ProtectTitle").text().set(
-      meta->memory_protection().title());
-  mp_node.append_child("ProtectUserName").text().set(
-      meta->memory_protection().username());
-  mp_node.append_child("ProtectPassword").text().set(
-      meta->memory_protection().password());
-  mp_node.append_child("ProtectURL").text().set(
-      meta->memory_protection().url());
-  mp_node.append_child("ProtectNotes").text().set(
-      meta->memory_protection().notes());
+                         std::shared_ptr<Metadata> meta,
+                         const GzipOptions& gzip_options) {
+  // KDBX 4 authenticates the header itself, and stores the binaries in the
+  // inner header.
+  if (!kdbx4_) {
+    writer.WriteBase64Element("HeaderHash", header_hash_.data(),
+                              header_hash_.size());
+  }
+  writer.WriteElement("Generator", meta->generator());
+  writer.WriteElement("DatabaseName", *meta->database_name());
+  writer.WriteElement("DatabaseNameChanged", WriteDateTime(
+      meta->database_name().time()));
+  writer.WriteElement("DatabaseDescription", *meta->database_desc());
+  writer.WriteElement("DatabaseDescriptionChanged", WriteDateTime(
+      meta->database_desc().time()));
+  writer.WriteElement("DefaultUserName", *meta->default_username());
+  writer.WriteElement("DefaultUserNameChanged", WriteDateTime(
+      meta->default_username().time()));
+  writer.WriteElement("MaintenanceHistoryDays",
+                      meta->maintenance_hist_days());
+  writer.WriteElement("Color", meta->database_color());
+  writer.WriteElement("MasterKeyChanged", WriteDateTime(
+      meta->master_key_changed()));
+  writer.WriteElement("MasterKeyChangeRec",
+                      static_cast<long long>(meta->master_key_change_rec()));
+  writer.WriteElement("MasterKeyChangeForce",
+                      static_cast<long long>(meta->master_key_change_force()));
+
+  writer.StartElement("MemoryProtection");
+  writer.WriteElement("ProtectTitle", meta->memory_protection().title());
+  writer.WriteElement("ProtectUserName",
+                      meta->memory_protection().username());
+  writer.WriteElement("ProtectPassword",
+                      meta->memory_protection().password());
+  writer.WriteElement("ProtectURL", meta->memory_protection().url());
+  writer.WriteElement("ProtectNotes", meta->memory_protection().notes());
+  writer.EndElement();
 
   if (meta->recycle_bin()) {
-    meta_node.append_child("RecycleBinEnabled").text().set(true);
-    meta_node.append_child("RecycleBinUUID").text().set(base64_encode(
-        meta->recycle_bin()->uuid().begin(),
-        meta->recycle_bin()->uuid().end()).c_str());
+    writer.WriteElement("RecycleBinEnabled", true);
+    writer.WriteBase64Element("RecycleBinUUID",
+                              meta->recycle_bin()->uuid().data(),
+                              meta->recycle_bin()->uuid().size());
   } else {
-    meta_node.append_child("RecycleBinEnabled").text().set(false);
+    writer.WriteElement("RecycleBinEnabled", false);
   }
-  meta_node.append_child("RecycleBinChanged").text().set(WriteDateTime(
-      meta->recycle_bin_changed()).c_str());
+  writer.WriteElement("RecycleBinChanged", WriteDateTime(
+      meta->recycle_bin_changed()));
 
   if (meta->entry_templates()) {
-    meta_node.append_child("EntryTemplatesGroup").text().set(base64_encode(
-        meta->entry_templates()->uuid().begin(),
-        meta->entry_templates()->uuid().end()).c_str());
+    writer.WriteBase64Element("EntryTemplatesGroup",
+                              meta->entry_templates()->uuid().data(),
+                              meta->entry_templates()->uuid().size());
   } else {
     assert(false);
   }
-  meta_node.append_child("EntryTemplatesGroupChanged").text().set(
-      WriteDateTime(meta->entry_templates_changed()).c_str());
+  writer.WriteElement("EntryTemplatesGroupChanged", WriteDateTime(
+      meta->entry_templates_changed()));
 
-  meta_node.append_child("HistoryMaxItems").text().set(
-      meta->history_max_items());
-  meta_node.append_child("HistoryMaxSize").text().set(
-      static_cast<long long>(meta->history_max_size()));
+  writer.WriteElement("HistoryMaxItems", meta->history_max_items());
+  writer.WriteElement("HistoryMaxSize",
+                      static_cast<long long>(meta->history_max_size()));
 
   if (auto group = meta->last_selected_group().lock()) {
-    meta_node.append_child("LastSelectedGroup").text().set(base64_encode(
-        group->uuid().begin(), group->uuid().end()).c_str());
+    writer.WriteBase64Element("LastSelectedGroup", group->uuid().data(),
+                              group->uuid().size());
   }
 
   if (auto group = meta->last_visible_group().lock()) {
-    meta_node.append_child("LastTopVisibleGroup").text().set(base64_encode(
-        group->uuid().begin(), group->uuid().end()).c_str());
+    writer.WriteBase64Element("LastTopVisibleGroup", group->uuid().data(),
+                              group->uuid().size());
   }
 
-  pugi::xml_node icons_node = meta_node.append_child("CustomIcons");
+  writer.StartElement("CustomIcons");
   for (auto icon : meta->icons()) {
-    pugi::xml_node icon_node = icons_node.append_child("Icon");
-    icon_node.append_child("UUID").text().set(base64_encode(
-        icon->uuid().begin(), icon->uuid().end()).c_str());
-    icon_node.append_child("Data").text().set(base64_encode(
-        icon->data().begin(), icon->data().end()).c_str());
+    writer.StartElement("Icon");
+    writer.WriteBase64Element("UUID", icon->uuid().data(),
+                              icon->uuid().size());
+    writer.WriteBase64Element("Data", icon->data().data(),
+                              icon->data().size());
+    writer.EndElement();
   }
-
-  uint32_t binary_id = 0;
-  pugi::xml_node bins_node = meta_node.append_child("Binaries");
-  for (auto binary : meta->binaries()) {
-    pugi::xml_node bin_node = bins_node.append_child("Binary");
-    bin_node.append_attribute("ID").set_value(binary_id);
-
-    if (binary->data().is_protected()) {
-      bin_node.append_attribute("Protected").set_value("True");
-      bin_node.text().set(base64_encode(obfuscator.Process(
-          *binary->data())).c_str());
-    } else {
-      if (binary->compress()) {
-        bin_node.append_attribute("Compressed").set_value("True");
-        std::stringstream compressed_data;
-
-        gzip_ostreambuf gzip_streambuf(compressed_data);
-        std::ostream gzip_stream(&gzip_streambuf);
-        std::copy(binary->data()->begin(), binary->data()->end(),
-                  std::ostreambuf_iterator<char>(gzip_stream));
-        gzip_stream.flush();
-
-        bin_node.text().set(base64_encode(
-              std::istreambuf_iterator<char>(compressed_data), 
-              std::istreambuf_iterator<char>()).c_str());
+  writer.EndElement();
+
+  if (!kdbx4_) {
+    // Binaries are encoded and compressed piece by piece straight into the
+    // output to avoid holding a second copy of them in memory.
+    static constexpr std::size_t kBinaryChunkSize = 64 * 1024;
+
+    uint32_t binary_id = 0;
+    writer.StartElement("Binaries");
+    for (auto binary : meta->binaries()) {
+      const std::string& data = *binary->data();
+
+      writer.StartElement("Binary");
+      writer.WriteAttribute("ID", std::to_string(binary_id));
+
+      if (binary->data().is_protected()) {
+        writer.WriteAttribute("Protected", "True");
+
+        std::vector<uint8_t> chunk;
+        for (std::size_t i = 0; i < data.size(); i += kBinaryChunkSize) {
+          chunk.resize(std::min(kBinaryChunkSize, data.size() - i));
+          obfuscator.Process(reinterpret_cast<const uint8_t*>(data.data()) + i,
+                             chunk.data(), chunk.size());
+          writer.WriteBase64(chunk.data(), chunk.size());
+        }
+        OPENSSL_cleanse(chunk.data(), chunk.size());
       } else {
-        bin_node.text().set(base64_encode(*binary->data()).c_str());
+        if (binary->compress()) {
+          writer.WriteAttribute("Compressed", "True");
+
+          xml_base64_ostreambuf base64_streambuf(writer);
+          std::ostream base64_stream(&base64_streambuf);
+          parallel_gzip_ostreambuf gzip_streambuf(base64_stream, gzip_options);
+          std::ostream gzip_stream(&gzip_streambuf);
+          gzip_stream.write(data.data(), data.size());
+          gzip_stream.flush();
+        } else {
+          writer.WriteBase64(data.data(), data.size());
+        }
       }
-    }
+      writer.EndElement();
 
-    binary_pool_.insert(std::make_pair(std::to_string(binary_id), binary));
+      binary_pool_.insert(std::make_pair(std::to_string(binary_id), binary));
 
-    ++binary_id;
+      ++binary_id;
+    }
+    writer.EndElement();
   }
 
-  pugi::xml_node data_node = meta_node.append_child("CustomData");
+  writer.StartElement("CustomData");
   for (auto field : meta->fields()) {
-    pugi::xml_node item_node = data_node.append_child("Item");
-    item_node.append_child("Key").text().set(field.key().c_str());
-    item_node.append_child("Value").text().set(field.value().c_str());
+    writer.StartElement("Item");
+    writer.WriteElement("Key", field.key());
+    writer.WriteElement("Value", field.value());
+    writer.EndElement();
   }
+  writer.EndElement();
 }
 
 std::shared_ptr<Entry> KdbxFile::ParseEntry(
@@ -609,121 +1196,101 @@ std::shared_ptr<Entry> KdbxFile::ParseEntry(
   return entry;
 }
 
-void KdbxFile::WriteEntry(pugi::xml_node& entry_node,
+void KdbxFile::WriteEntry(XmlWriter& writer,
                           RandomObfuscator& obfuscator,
                           std::shared_ptr<Entry> entry) {
-  entry_node.append_child("UUID").text().set(base64_encode(
-      entry->uuid().begin(), entry->uuid().end()).c_str());
-  entry_node.append_child("IconID").text().set(entry->icon());
-  entry_node.append_child("ForegroundColor").text().set(
-      entry->fg_color().c_str());
-  entry_node.append_child("BackgroundColor").text().set(
-      entry->bg_color().c_str());
-  entry_node.append_child("OverrideURL").text().set(
-      entry->override_url().c_str());
-  entry_node.append_child("Tags").text().set(entry->tags().c_str());
+  writer.WriteBase64Element("UUID", entry->uuid().data(),
+                            entry->uuid().size());
+  writer.WriteElement("IconID", entry->icon());
+  writer.WriteElement("ForegroundColor", entry->fg_color());
+  writer.WriteElement("BackgroundColor", entry->bg_color());
+  writer.WriteElement("OverrideURL", entry->override_url());
+  writer.WriteElement("Tags", entry->tags());
 
   if (auto icon = entry->custom_icon().lock()) {
-    entry_node.append_child("CustomIconUUID").text().set(
-        base64_encode(icon->uuid().begin(), icon->uuid().end()).c_str());
-  }
-
-  pugi::xml_node times_node = entry_node.append_child("Times");
-  times_node.append_child("CreationTime").text().set(WriteDateTime(
-      entry->creation_time()).c_str());
-  times_node.append_child("LastModificationTime").text().set(WriteDateTime(
-      entry->modification_time()).c_str());
-  times_node.append_child("LastAccessTime").text().set(WriteDateTime(
-      entry->access_time()).c_str());
-  times_node.append_child("ExpiryTime").text().set(WriteDateTime(
-      entry->expiry_time()).c_str());
-  times_node.append_child("LocationChanged").text().set(WriteDateTime(
-      entry->move_time()).c_str());
-  times_node.append_child("Expires").text().set(entry->expires());
-  times_node.append_child("UsageCount").text().set(entry->usage_count());
-
-  pugi::xml_node autotype_node = entry_node.append_child("AutoType");
-  autotype_node.append_child("Enabled").text().set(entry->auto_type().enabled());
-  autotype_node.append_child("DataTransferObfuscation").text().set(
-      entry->auto_type().obfuscation());
-  autotype_node.append_child("DefaultSequence").text().set(
-      entry->auto_type().sequence().c_str());
+    writer.WriteBase64Element("CustomIconUUID", icon->uuid().data(),
+                              icon->uuid().size());
+  }
+
+  writer.StartElement("Times");
+  writer.WriteElement("CreationTime", WriteDateTime(entry->creation_time()));
+  writer.WriteElement("LastModificationTime", WriteDateTime(
+      entry->modification_time()));
+  writer.WriteElement("LastAccessTime", WriteDateTime(entry->access_time()));
+  writer.WriteElement("ExpiryTime", WriteDateTime(entry->expiry_time()));
+  writer.WriteElement("LocationChanged", WriteDateTime(entry->move_time()));
+  writer.WriteElement("Expires", entry->expires());
+  writer.WriteElement("UsageCount", entry->usage_count());
+  writer.EndElement();
+
+  writer.StartElement("AutoType");
+  writer.WriteElement("Enabled", entry->auto_type().enabled());
+  writer.WriteElement("DataTransferObfuscation",
+                      entry->auto_type().obfuscation());
+  writer.WriteElement("DefaultSequence", entry->auto_type().sequence());
 
   for (auto ass : entry->auto_type().associations()) {
-    pugi::xml_node ass_node = autotype_node.append_child("Association");
-    ass_node.append_child("Window").text().set(ass.window().c_str());
-    ass_node.append_child("KeystrokeSequence").text().set(
-        ass.sequence().c_str());
+    writer.StartElement("Association");
+    writer.WriteElement("Window", ass.window());
+    writer.WriteElement("KeystrokeSequence", ass.sequence());
+    writer.EndElement();
   }
+  writer.EndElement();
 
   // Write string fields.
-  pugi::xml_node str_node = entry_node.append_child("String");
-  str_node.append_child("Key").text().set("Title");
-  pugi::xml_node val_node = str_node.append_child("Value");
-  WriteProtectedString(val_node, entry->title(), obfuscator);
-
-  str_node = entry_node.append_child("String");
-  str_node.append_child("Key").text().set("URL");
-  val_node = str_node.append_child("Value");
-  WriteProtectedString(val_node, entry->url(), obfuscator);
-
-  str_node = entry_node.append_child("String");
-  str_node.append_child("Key").text().set("UserName");
-  val_node = str_node.append_child("Value");
-  WriteProtectedString(val_node, entry->username(), obfuscator);
-
-  str_node = entry_node.append_child("String");
-  str_node.append_child("Key").text().set("Password");
-  val_node = str_node.append_child("Value");
-  WriteProtectedString(val_node, entry->password(), obfuscator);
-
-  str_node = entry_node.append_child("String");
-  str_node.append_child("Key").text().set("Notes");
-  val_node = str_node.append_child("Value");
-  WriteProtectedString(val_node, entry->notes(), obfuscator);
-
-  for (auto field : entry->custom_fields()) {
-    str_node = entry_node.append_child("String");
-    str_node.append_child("Key").text().set(field.key().c_str());
-    val_node = str_node.append_child("Value");
-    WriteProtectedString(val_node, field.value(), obfuscator);
-  }
+  auto write_string = [&](const std::string& key,
+                          const protect<std::string>& value) {
+    writer.StartElement("String");
+    writer.WriteElement("Key", key);
+    WriteProtectedString(writer, "Value", value, obfuscator);
+    writer.EndElement();
+  };
+
+  write_string("Title", entry->title());
+  write_string("URL", entry->url());
+  write_string("UserName", entry->username());
+  write_string("Password", entry->password());
+  write_string("Notes", entry->notes());
+
+  for (auto field : entry->custom_fields())
+    write_string(field.key(), field.value());
 
   // Write binary fields.
   for (auto attachment : entry->attachments()) {
-    pugi::xml_node bin_node = entry_node.append_child("Binary");
-    bin_node.append_child("Key").text().set(attachment->name().c_str());
+    writer.StartElement("Binary");
+    writer.WriteElement("Key", attachment->name());
 
     bool found_in_pool = false;
     for (auto it : binary_pool_) {
       if (it.second == attachment->binary()) {
-        bin_node.append_child("Value").append_attribute("Ref").set_value(
-            it.first.c_str());
+        writer.StartElement("Value");
+        writer.WriteAttribute("Ref", it.first);
+        writer.EndElement();
         found_in_pool = true;
         break;
       }
     }
 
     if (!found_in_pool) {
-      bin_node.append_child("Value").text().set(base64_encode(
-          attachment->binary()->data()).c_str());
+      const std::string& data = *attachment->binary()->data();
+      writer.WriteBase64Element("Value", data.data(), data.size());
     }
+    writer.EndElement();
   }
 
   // Write history entries.
-  pugi::xml_node history_node = entry_node.append_child("History");
+  writer.StartElement("History");
   for (auto histentry : entry->history()) {
-    pugi::xml_node histentry_node = history_node.append_child("Entry");
-    WriteEntry(histentry_node, obfuscator, histentry);
+    writer.StartElement("Entry");
+    WriteEntry(writer, obfuscator, histentry);
+    writer.EndElement();
   }
+  writer.EndElement();
 }
 
-std::shared_ptr<Group> KdbxFile::ParseGroup(
-    const pugi::xml_node& group_node,
-    RandomObfuscator& obfuscator) {
-  std::shared_ptr<Group> group = std::make_shared<Group>();
-  group_pool_.insert(std::make_pair(group_node.child_value("UUID"), group));
-
+void KdbxFile::ParseGroupFields(const pugi::xml_node& group_node,
+                                std::shared_ptr<Group> group,
+                                std::array<uint8_t, 16>& last_visible_uuid) {
   std::array<uint8_t, 16> uuid = { 0 };
   base64_decode(group_node.child_value("UUID"), bounds_checked(uuid));
 
@@ -766,99 +1333,305 @@ std::shared_ptr<Group> KdbxFile::ParseGroup(
   group->set_search(group_node.child("EnableSearching").text().as_bool());
 
   base64_decode(group_node.child_value("LastTopVisibleEntry"),
-                bounds_checked(uuid));
+                bounds_checked(last_visible_uuid));
+}
 
-  for (pugi::xml_node entry_node = group_node.child("Entry"); entry_node;
-      entry_node = entry_node.next_sibling("Entry")) {
-    std::array<uint8_t, 16> entry_uuid = { 0 };
-    std::shared_ptr<Entry> entry = ParseEntry(entry_node, entry_uuid, obfuscator);
-    group->AddEntry(entry);
+std::shared_ptr<Group> KdbxFile::ParseGroup(XmlReader& reader,
+                                            RandomObfuscator& obfuscator) {
+  std::shared_ptr<Group> group = std::make_shared<Group>();
 
-    if (entry_uuid == uuid) {
-      assert(group->last_visible_entry().expired());
-      group->set_last_visible_entry(entry);
+  // The simple group fields usually precede the entries and subgroups. They
+  // are collected in a small tree of their own and parsed once the first
+  // entry or subgroup is reached. Fields may appear in any order though, so
+  // any later fields are collected as well and the group is parsed again at
+  // its end.
+  pugi::xml_document fields_doc;
+  pugi::xml_node fields_node = fields_doc.append_child("Group");
+  bool parsed_fields = false;
+  bool late_fields = false;
+  std::array<uint8_t, 16> last_visible_uuid = { 0 };
+  auto parse_fields = [&]() {
+    if (!parsed_fields) {
+      ParseGroupFields(fields_node, group, last_visible_uuid);
+      parsed_fields = true;
+    }
+  };
+
+  while (reader.Next() != XmlReader::Node::kEndElement) {
+    if (reader.node() != XmlReader::Node::kStartElement)
+      continue;
+
+    if (reader.name() == "Entry") {
+      parse_fields();
+
+      // Each entry, including its history, is parsed from a tree of its own
+      // that is released as soon as the entry has been built.
+      pugi::xml_document entry_doc;
+      pugi::xml_node entry_node = entry_doc.append_child("Entry");
+      read_xml_subtree(reader, entry_node);
+
+      std::array<uint8_t, 16> entry_uuid = { 0 };
+      std::shared_ptr<Entry> entry = ParseEntry(entry_node, entry_uuid,
+                                                obfuscator);
+      if (entry_callback_) {
+        entry_callback_(group, entry);
+        continue;
+      }
+
+      group->AddEntry(entry);
+    } else if (reader.name() == "Group") {
+      parse_fields();
+      group->AddGroup(ParseGroup(reader, obfuscator));
+    } else {
+      late_fields = late_fields || parsed_fields;
+      pugi::xml_node field_node =
+          fields_node.append_child(reader.name().c_str());
+      read_xml_subtree(reader, field_node);
     }
   }
 
-  for (pugi::xml_node subgroup_node = group_node.child("Group"); subgroup_node;
-      subgroup_node = subgroup_node.next_sibling("Group")) {
-    group->AddGroup(ParseGroup(subgroup_node, obfuscator));
+  if (!parsed_fields || late_fields)
+    ParseGroupFields(fields_node, group, last_visible_uuid);
+  group_pool_.insert(std::make_pair(fields_node.child_value("UUID"), group));
+
+  // The last visible entry is only known once all fields have been read.
+  for (auto entry : group->Entries()) {
+    if (entry->uuid() == last_visible_uuid) {
+      group->set_last_visible_entry(entry);
+      break;
+    }
   }
 
   return group;
 }
 
-void KdbxFile::WriteGroup(pugi::xml_node& group_node,
+void KdbxFile::WriteGroup(XmlWriter& writer,
                           RandomObfuscator& obfuscator,
                           std::shared_ptr<Group> group) {
-  group_node.append_child("UUID").text().set(base64_encode(
-      group->uuid().begin(), group->uuid().end()).c_str());
-  group_node.append_child("Name").text().set(group->name().c_str());
-  group_node.append_child("Notes").text().set(group->notes().c_str());
-  group_node.append_child("IconID").text().set(group->icon());
+  writer.WriteBase64Element("UUID", group->uuid().data(),
+                            group->uuid().size());
+  writer.WriteElement("Name", group->name());
+  writer.WriteElement("Notes", group->notes());
+  writer.WriteElement("IconID", group->icon());
 
   if (auto icon = group->custom_icon().lock()) {
-    group_node.append_child("CustomIconUUID").text().set(
-        base64_encode(icon->uuid().begin(), icon->uuid().end()).c_str());
-  }
-
-  pugi::xml_node times_node = group_node.append_child("Times");
-  times_node.append_child("CreationTime").text().set(WriteDateTime(
-      group->creation_time()).c_str());
-  times_node.append_child("LastModificationTime").text().set(WriteDateTime(
-      group->modification_time()).c_str());
-  times_node.append_child("LastAccessTime").text().set(WriteDateTime(
-      group->access_time()).c_str());
-  times_node.append_child("ExpiryTime").text().set(WriteDateTime(
-      group->expiry_time()).c_str());
-  times_node.append_child("LocationChanged").text().set(WriteDateTime(
-      group->move_time()).c_str());
-  times_node.append_child("Expires").text().set(group->expires());
-  times_node.append_child("UsageCount").text().set(group->usage_count());
-
-  group_node.append_child("IsExpanded").text().set(group->expanded());
-  group_node.append_child("DefaultAutoTypeSequence").text().set(
-      group->default_autotype_sequence().c_str());
-  group_node.append_child("EnableAutoType").text().set(group->autotype());
-  group_node.append_child("EnableSearching").text().set(group->search());
+    writer.WriteBase64Element("CustomIconUUID", icon->uuid().data(),
+                              icon->uuid().size());
+  }
+
+  writer.StartElement("Times");
+  writer.WriteElement("CreationTime", WriteDateTime(group->creation_time()));
+  writer.WriteElement("LastModificationTime", WriteDateTime(
+      group->modification_time()));
+  writer.WriteElement("LastAccessTime", WriteDateTime(group->access_time()));
+  writer.WriteElement("ExpiryTime", WriteDateTime(group->expiry_time()));
+  writer.WriteElement("LocationChanged", WriteDateTime(group->move_time()));
+  writer.WriteElement("Expires", group->expires());
+  writer.WriteElement("UsageCount", group->usage_count());
+  writer.EndElement();
+
+  writer.WriteElement("IsExpanded", group->expanded());
+  writer.WriteElement("DefaultAutoTypeSequence",
+                      group->default_autotype_sequence());
+  writer.WriteElement("EnableAutoType", group->autotype());
+  writer.WriteElement("EnableSearching", group->search());
 
   if (auto entry = group->last_visible_entry().lock()) {
-    group_node.append_child("LastTopVisibleEntry").text().set(
-        base64_encode(entry->uuid().begin(), entry->uuid().end()).c_str());
+    writer.WriteBase64Element("LastTopVisibleEntry", entry->uuid().data(),
+                              entry->uuid().size());
   }
 
   for (auto entry : group->Entries()) {
-    pugi::xml_node entry_node = group_node.append_child("Entry");
-    WriteEntry(entry_node, obfuscator, entry);
+    writer.StartElement("Entry");
+    WriteEntry(writer, obfuscator, entry);
+    writer.EndElement();
   }
 
   for (auto subgroup : group->Groups()) {
-    pugi::xml_node subgroup_node = group_node.append_child("Group");
-    WriteGroup(subgroup_node, obfuscator, subgroup);
+    writer.StartElement("Group");
+    WriteGroup(writer, obfuscator, subgroup);
+    writer.EndElement();
+  }
+}
+
+void KdbxFile::ParseInnerHeader(std::istream& src, Database& db) {
+  // The key is stored once the stream it belongs to is known.
+  std::vector<uint8_t> inner_random_stream_key;
+  while (true) {
+    KdbxInnerHeaderField field = consume<KdbxInnerHeaderField>(src);
+    if (field.size < 0)
+      throw FormatError("Illegal inner header field size in KDBX.");
+
+    switch (field.id) {
+      case KdbxInnerHeaderField::kEndOfHeader:
+        src.ignore(field.size);
+        if (!src.good())
+          throw IoError("Read error.");
+        set_inner_random_stream_key(db, inner_random_stream_key);
+        return;
+      case KdbxInnerHeaderField::kInnerRandomStreamId: {
+        if (field.size != 4)
+          throw FormatError("Illegal random stream size in KDBX.");
+        uint32_t inner_random_stream_id = consume<uint32_t>(src);
+        if (inner_random_stream_id ==
+            static_cast<uint32_t>(kKdbxRandomStream::kSalsa20)) {
+          db.set_inner_random_stream(Database::InnerRandomStream::kSalsa20);
+        } else if (inner_random_stream_id ==
+            static_cast<uint32_t>(kKdbxRandomStream::kChaCha20)) {
+          db.set_inner_random_stream(Database::InnerRandomStream::kChaCha20);
+        } else {
+          throw FormatError("Unknown random stream in KDBX.");
+        }
+        break;
+      }
+      case KdbxInnerHeaderField::kInnerRandomStreamKey: {
+        if (field.size == 0)
+          throw FormatError("Illegal protected stream key size in KDBX.");
+        OPENSSL_cleanse(inner_random_stream_key.data(),
+                        inner_random_stream_key.size());
+        inner_random_stream_key.resize(field.size);
+        src.read(reinterpret_cast<char*>(inner_random_stream_key.data()),
+                 inner_random_stream_key.size());
+        if (!src.good())
+          throw IoError("Read error.");
+        break;
+      }
+      case KdbxInnerHeaderField::kBinary: {
+        if (field.size == 0)
+          throw FormatError("Illegal binary size in KDBX.");
+        uint8_t flags = consume<uint8_t>(src);
+
+        std::string data(field.size - 1, '\0');
+        src.read(&data[0], data.size());
+        if (!src.good())
+          throw IoError("Read error.");
+
+        // Binaries are referred to by their index in the inner header.
+        bool protected_in_memory = (flags & kKdbxInnerBinaryProtected) != 0;
+        std::shared_ptr<Binary> binary = std::make_shared<Binary>(
+            protect<std::string>(data, protected_in_memory));
+        binary_pool_.insert(std::make_pair(
+            std::to_string(inner_binaries_.size()), binary));
+        inner_binaries_.push_back(binary);
+        break;
+      }
+      default:
+        throw FormatError("Illegal inner header field in KDBX.");
+    }
+  }
+}
+
+void KdbxFile::WriteInnerHeader(std::ostream& dst, const Database& db) {
+  conserve<KdbxInnerHeaderField>(dst, KdbxInnerHeaderField(
+      KdbxInnerHeaderField::kInnerRandomStreamId, 4));
+  conserve<uint32_t>(dst, static_cast<uint32_t>(
+      db.inner_random_stream() == Database::InnerRandomStream::kChaCha20 ?
+          kKdbxRandomStream::kChaCha20 : kKdbxRandomStream::kSalsa20));
+
+  if (db.inner_random_stream() == Database::InnerRandomStream::kChaCha20) {
+    conserve<KdbxInnerHeaderField>(dst, KdbxInnerHeaderField(
+        KdbxInnerHeaderField::kInnerRandomStreamKey,
+        static_cast<int32_t>(db.chacha20_inner_random_stream_key().size())));
+    conserve<std::vector<uint8_t>>(dst, db.chacha20_inner_random_stream_key());
+  } else {
+    conserve<KdbxInnerHeaderField>(dst, KdbxInnerHeaderField(
+        KdbxInnerHeaderField::kInnerRandomStreamKey, 32));
+    conserve<std::array<uint8_t, 32>>(dst, db.inner_random_stream_key());
   }
+
+  uint32_t binary_id = 0;
+  for (auto binary : db.meta()->binaries()) {
+    const std::string& data = *binary->data();
+    if (data.size() >=
+        static_cast<std::size_t>(std::numeric_limits<int32_t>::max())) {
+      throw InternalError("Binary size exceeds KDBX maximum.");
+    }
+
+    conserve<KdbxInnerHeaderField>(dst, KdbxInnerHeaderField(
+        KdbxInnerHeaderField::kBinary, static_cast<int32_t>(data.size() + 1)));
+    conserve<uint8_t>(dst, binary->data().is_protected() ?
+        kKdbxInnerBinaryProtected : 0);
+    dst.write(data.data(), data.size());
+    if (!dst.good())
+      throw IoError("Write error.");
+
+    binary_pool_.insert(std::make_pair(std::to_string(binary_id), binary));
+
+    ++binary_id;
+  }
+
+  conserve<KdbxInnerHeaderField>(dst, KdbxInnerHeaderField(
+      KdbxInnerHeaderField::kEndOfHeader, 0));
 }
 
 void KdbxFile::ParseXml(std::istream& src,
                         RandomObfuscator& obfuscator,
                         Database& db) {
-  pugi::xml_document doc;
-  if (!doc.load(src, pugi::parse_default | pugi::parse_trim_pcdata))
-    throw FormatError("Malformed XML in KDBX.");
-
-  pugi::xml_node kpf_node = doc.child("KeePassFile");
-  if (!kpf_node)
+  XmlReader reader(src);
+  if (reader.Next() != XmlReader::Node::kStartElement ||
+      reader.name() != "KeePassFile") {
     throw FormatError("No \"KeePassFile\" element in KDBX XML.");
+  }
 
-  pugi::xml_node meta_node = kpf_node.child("Meta");
-  if (!meta_node)
-    throw FormatError("No \"Meta\" element in KDBX XML.");
+  std::shared_ptr<Metadata> meta;
+  std::shared_ptr<Group> root;
+  std::string last_selected_group;
+  std::string last_visible_group;
+
+  while (reader.Next() != XmlReader::Node::kEndElement) {
+    if (reader.node() != XmlReader::Node::kStartElement)
+      continue;
+
+    if (reader.name() == "Meta" && !meta) {
+      // The binaries are the bulk of the meta data, so they are parsed one at
+      // a time as they are read. The remaining fields are small enough to be
+      // collected in a tree.
+      pugi::xml_document meta_doc;
+      pugi::xml_node meta_node = meta_doc.append_child("Meta");
+      std::vector<std::shared_ptr<Binary>> binaries;
+      while (reader.Next() != XmlReader::Node::kEndElement) {
+        if (reader.node() != XmlReader::Node::kStartElement)
+          continue;
+
+        if (reader.name() == "Binaries") {
+          ParseBinaries(reader, obfuscator, binaries);
+        } else {
+          pugi::xml_node field_node =
+              meta_node.append_child(reader.name().c_str());
+          read_xml_subtree(reader, field_node);
+        }
+      }
 
-  pugi::xml_node group_node = kpf_node.child("Root").child("Group");
-  if (!group_node)
-    throw FormatError("No \"Root\" or \"Group\" element in KDBX XML.");
+      meta = ParseMeta(meta_node);
+      for (const auto& binary : inner_binaries_)
+        meta->AddBinary(binary);
+      for (const auto& binary : binaries)
+        meta->AddBinary(binary);
+      last_selected_group = meta_node.child_value("LastSelectedGroup");
+      last_visible_group = meta_node.child_value("LastTopVisibleGroup");
+    } else if (reader.name() == "Root" && !root) {
+      // Entries refer to icons and binaries in the meta data.
+      if (!meta)
+        throw FormatError("No \"Meta\" element in KDBX XML.");
+
+      while (reader.Next() != XmlReader::Node::kEndElement) {
+        if (reader.node() != XmlReader::Node::kStartElement)
+          continue;
+
+        if (reader.name() == "Group" && !root)
+          root = ParseGroup(reader, obfuscator);
+        else
+          reader.Skip();
+      }
+    } else {
+      reader.Skip();
+    }
+  }
 
-  std::shared_ptr<Metadata> meta = ParseMeta(meta_node, obfuscator);
-  std::shared_ptr<Group> root = ParseGroup(group_node, obfuscator);
+  if (!meta)
+    throw FormatError("No \"Meta\" element in KDBX XML.");
+  if (!root)
+    throw FormatError("No \"Root\" or \"Group\" element in KDBX XML.");
 
   db.set_meta(meta);
   db.set_root(root);
@@ -866,14 +1639,14 @@ void KdbxFile::ParseXml(std::istream& src,
   // When first parsing the meta data we haven't yet parsed all groups so we
   // have to wait until every group is parsed before parsing the final parts of
   // the meta data.
-  auto it = group_pool_.find(meta_node.child_value("LastSelectedGroup"));
+  auto it = group_pool_.find(last_selected_group);
   if (it != group_pool_.end()) {
     meta->set_last_selected_group(it->second);
   } else {
     assert(false);
   }
 
-  it = group_pool_.find(meta_node.child_value("LastTopVisibleGroup"));
+  it = group_pool_.find(last_visible_group);
   if (it != group_pool_.end()) {
     meta->set_last_visible_group(it->second);
   } else {
@@ -907,34 +1680,82 @@ void KdbxFile::PrintXml(pugi::xml_document& doc) {
 
 void KdbxFile::WriteXml(std::ostream& dst, RandomObfuscator& obfuscator,
                         const Database& db) {
-  pugi::xml_document doc;
-
-  pugi::xml_node kpf_node = doc.append_child("KeePassFile");
-  pugi::xml_node meta_node = kpf_node.append_child("Meta");
-  pugi::xml_node group_node =
-      kpf_node.append_child("Root").append_child("Group");
-
-  WriteMeta(meta_node, obfuscator, db.meta());
-  WriteGroup(group_node, obfuscator, db.root());
-
-  doc.save(dst);
+  XmlWriter writer(dst, compact_xml_ ? XmlWriter::Format::kCompact :
+                                       XmlWriter::Format::kIndented);
+  writer.WriteDeclaration();
+
+  writer.StartElement("KeePassFile");
+  writer.StartElement("Meta");
+  WriteMeta(writer, obfuscator, db.meta(), get_gzip_options(db));
+  writer.EndElement();
+
+  writer.StartElement("Root");
+  writer.StartElement("Group");
+  WriteGroup(writer, obfuscator, db.root());
+  writer.EndElement();
+  writer.EndElement();
+  writer.EndElement();
+
+  writer.Finish();
 }
 
 std::unique_ptr<Database> KdbxFile::Import(const std::string& path,
                                            const Key& key) {
-  Reset();
+  return Import(path, key, Progress());
+}
+
+std::unique_ptr<Database> KdbxFile::Import(const std::string& path,
+                                           const Key& key,
+                                           const Progress& progress) {
+  // Regular files are mapped and parsed in place.
+  MappedFile file(path);
+  if (file.mapped())
+    return Import(file.data(), file.size(), key, progress);
 
   std::ifstream src(path, std::ios::binary);
   if (!src.is_open())
     throw FileNotFoundError();
 
-  // Read header.
+  return Import(src, key, progress);
+}
+
+std::unique_ptr<Database> KdbxFile::Import(const uint8_t* data,
+                                           std::size_t size,
+                                           const Key& key) {
+  return Import(data, size, key, Progress());
+}
+
+std::unique_ptr<Database> KdbxFile::Import(const uint8_t* data,
+                                           std::size_t size,
+                                           const Key& key,
+                                           const Progress& progress) {
+  span_istreambuf streambuf(data, size);
+  std::istream src(&streambuf);
+  return Import(src, key, progress);
+}
+
+std::unique_ptr<Database> KdbxFile::Import(std::istream& src,
+                                           const Key& key) {
+  return Import(src, key, Progress());
+}
+
+std::unique_ptr<Database> KdbxFile::Import(std::istream& src,
+                                           const Key& key,
+                                           const Progress& progress) {
+  Reset();
+
+  // Read header. The header is hashed as it's read since the source may not
+  // be seekable.
+  SHA256_CTX header_sha256;
+  SHA256_Init(&header_sha256);
+
   KdbxHeader header;
   try {
     header = consume<KdbxHeader>(src);
   } catch (std::exception& e) {
     throw FormatError("Not a KDBX database.");
   }
+  SHA256_Update(&header_sha256, &header, sizeof(header));
   if (header.signature0 != kKdbxSignature0 ||
       header.signature1 != kKdbxSignature1) {
     throw FormatError("Not a KDBX database.");
@@ -943,42 +1764,116 @@ std::unique_ptr<Database> KdbxFile::Import(const std::string& path,
   uint32_t kdb_ver =
       header.version & kKdbxVersionCriticalMask;
   uint32_t req_ver =
-      kKdbxVersionCriticalMin & kKdbxVersionCriticalMask;
+      kKdbxVersion4 & kKdbxVersionCriticalMask;
   if (kdb_ver > req_ver) {
     throw FormatError(
         Format() << "KDBX version " << header.version << " is not supported.");
   }
+  kdbx4_ = kdb_ver == req_ver;
+
+  // KDBX 4 authenticates the header with a key derived from the header
+  // itself, so it's kept until the key is known.
+  std::string header_data;
+  auto hash_header = [&](const void* data, std::size_t size) {
+    SHA256_Update(&header_sha256, data, size);
+    if (kdbx4_)
+      header_data.append(static_cast<const char*>(data), size);
+  };
+  if (kdbx4_)
+    header_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
 
   std::array<uint8_t, 32> content_start_bytes = { { 0 } };
+  std::size_t init_vec_size = 16;
 
   std::unique_ptr<Database> db(new Database());
 
   // Read header fields.
+  span_istreambuf* src_span = span_istreambuf::From(src);
+  std::string field_data;
+  std::vector<uint8_t> inner_random_stream_key;
+  bool has_kdf_parameters = false;
   bool done = false;
   while (!done && src.good()) {
-    KdbxHeaderField header_field = consume<KdbxHeaderField>(src);
-
-    // Read the header field into a separate buffer before parsing. This is to
-    // guard against reading outside the field as well as for making sure to
-    // read the complete field regardless of how much of it that we parse.
-    std::stringstream field;
-    std::generate_n(std::ostreambuf_iterator<char>(field),
-                    header_field.size,
-                    [&src]() { return src.get(); });
-    if (!src.good())
-      throw IoError("Read error.");
+    // Fields are read the same way regardless of version, only the size is
+    // wider in KDBX 4.
+    Kdbx4HeaderField header_field;
+    if (kdbx4_) {
+      header_field = consume<Kdbx4HeaderField>(src);
+      hash_header(&header_field, sizeof(header_field));
+    } else {
+      KdbxHeaderField kdbx3_header_field = consume<KdbxHeaderField>(src);
+      hash_header(&kdbx3_header_field, sizeof(kdbx3_header_field));
+      header_field.id = kdbx3_header_field.id;
+      header_field.size = kdbx3_header_field.size;
+    }
+
+    // Parse the header field from a separate stream. This is to guard against
+    // reading outside the field as well as for making sure to read the
+    // complete field regardless of how much of it that we parse. Fields in a
+    // span are parsed in place, others are read into a buffer first. The
+    // buffer only grows as data is read, a corrupt KDBX 4 field size must not
+    // allocate gigabytes up front.
+    const uint8_t* field_ptr = nullptr;
+    if (src_span != nullptr) {
+      std::size_t field_size = 0;
+      field_ptr = src_span->Consume(header_field.size, field_size);
+      if (field_size != header_field.size)
+        throw IoError("Read error.");
+    } else {
+      field_data.clear();
+      while (field_data.size() < header_field.size) {
+        std::size_t offset = field_data.size();
+        std::size_t num_read = std::min<std::size_t>(
+            header_field.size - offset, kKdbxHeaderFieldChunkSize);
+        field_data.resize(offset + num_read);
+        src.read(&field_data[offset], num_read);
+        if (!src.good())
+          throw IoError("Read error.");
+      }
+      field_ptr = reinterpret_cast<const uint8_t*>(field_data.data());
+    }
+
+    hash_header(field_ptr, header_field.size);
+
+    // Fields describing the key derivation and the inner random stream moved
+    // to the KDF parameters and the inner header in KDBX 4.
+    switch (header_field.id) {
+      case KdbxHeaderField::kTransformSeed:
+      case KdbxHeaderField::kTransformRounds:
+      case KdbxHeaderField::kInnerRandomStreamKey:
+      case KdbxHeaderField::kContentStreamStartBytes:
+      case KdbxHeaderField::kInnerRandomStreamId:
+        if (kdbx4_)
+          throw FormatError("Illegal header field in KDBX.");
+        break;
+      case KdbxHeaderField::kKdfParameters:
+      case KdbxHeaderField::kPublicCustomData:
+        if (!kdbx4_)
+          throw FormatError("Illegal header field in KDBX.");
+        break;
+      default:
+        break;
+    }
 
-    assert(field.str().size() == header_field.size);
+    span_istreambuf field_streambuf(field_ptr, header_field.size);
+    std::istream field(&field_streambuf);
 
     switch (header_field.id) {
       case KdbxHeaderField::kEndOfHeader:
         done = true;
         break;
-      case KdbxHeaderField::kCipherId:
-        if (consume<std::array<uint8_t, 16>>(field) != kKdbxCipherAes)
+      case KdbxHeaderField::kCipherId: {
+        std::array<uint8_t, 16> cipher_id =
+            consume<std::array<uint8_t, 16>>(field);
+        if (cipher_id == kKdbxCipherAes) {
+          db->set_cipher(Database::Cipher::kAes);
+        } else if (cipher_id == kKdbxCipherChaCha20) {
+          db->set_cipher(Database::Cipher::kChaCha20);
+        } else {
           throw FormatError("Unknown cipher in KDBX.");
-        db->set_cipher(Database::Cipher::kAes);
+        }
         break;
+      }
       case KdbxHeaderField::kCompressionFlags: {
         uint32_t comp_flags = consume<uint32_t>(field);
         if (comp_flags > static_cast<uint32_t>(kKdbxCompressionFlags::kCount))
@@ -998,26 +1893,46 @@ std::unique_ptr<Database> KdbxFile::Import(const std::string& path,
       case KdbxHeaderField::kTransformRounds:
         db->set_transform_rounds(consume<uint64_t>(field));
         break;
-      case KdbxHeaderField::kExcryptionInitVec:
-        if (header_field.size != 16)
+      case KdbxHeaderField::kExcryptionInitVec: {
+        // ChaCha20 uses a 12 byte nonce, it's stored zero padded.
+        if (header_field.size != 12 && header_field.size != 16)
           throw FormatError("Illegal initialization vector size in KDBX.");
-        db->set_init_vector(consume<std::array<uint8_t, 16>>(field));
+        std::array<uint8_t, 16> init_vec = { { 0 } };
+        field.read(reinterpret_cast<char*>(init_vec.data()),
+                   header_field.size);
+        db->set_init_vector(init_vec);
+        init_vec_size = header_field.size;
         break;
-      case KdbxHeaderField::kInnerRandomStreamKey:
+      }
+      case KdbxHeaderField::kInnerRandomStreamKey: {
         if (header_field.size != 32)
           throw FormatError("Illegal protected stream key size in KDBX.");
-        db->set_inner_random_stream_key(
-            consume<std::array<uint8_t, 32>>(field));
+        std::array<uint8_t, 32> key = consume<std::array<uint8_t, 32>>(field);
+        inner_random_stream_key.assign(key.begin(), key.end());
+        OPENSSL_cleanse(key.data(), key.size());
         break;
+      }
       case KdbxHeaderField::kContentStreamStartBytes:
         if (header_field.size != 32)
           throw FormatError("Illegal stream start sequence size in KDBX.");
         content_start_bytes = consume<std::array<uint8_t, 32>>(field);
         break;
+      case KdbxHeaderField::kKdfParameters:
+        parse_kdf_parameters(field, *db);
+        has_kdf_parameters = true;
+        break;
+      case KdbxHeaderField::kPublicCustomData:
+        // Plugin data that isn't needed for opening the database.
+        break;
       case KdbxHeaderField::kInnerRandomStreamId: {
         uint32_t inner_random_stream_id = consume<uint32_t>(field);
-        if (inner_random_stream_id !=
+        if (inner_random_stream_id ==
             static_cast<uint32_t>(kKdbxRandomStream::kSalsa20)) {
+          db->set_inner_random_stream(Database::InnerRandomStream::kSalsa20);
+        } else if (inner_random_stream_id ==
+            static_cast<uint32_t>(kKdbxRandomStream::kChaCha20)) {
+          db->set_inner_random_stream(Database::InnerRandomStream::kChaCha20);
+        } else {
           throw FormatError("Unknown random stream in KDBX.");
         }
         break;
@@ -1028,83 +1943,147 @@ std::unique_ptr<Database> KdbxFile::Import(const std::string& path,
     }
   }
 
-  // Compute the header hash.
-  std::streampos header_end = src.tellg();
-  src.seekg(0, std::ios::beg);
-  std::vector<char> header_data;
-  header_data.resize(header_end);
-  src.read(header_data.data(), header_end);
+  if (init_vec_size !=
+      (db->cipher() == Database::Cipher::kChaCha20 ? 12u : 16u)) {
+    throw FormatError("Illegal initialization vector size in KDBX.");
+  }
+
+  if (kdbx4_ && !has_kdf_parameters)
+    throw FormatError("No KDF parameters in KDBX.");
+
+  // The key is stored once the stream it belongs to is known.
+  set_inner_random_stream_key(*db, inner_random_stream_key);
 
   std::array<uint8_t, 32> header_hash;
-  SHA256_CTX sha256;
-  SHA256_Init(&sha256);
-  SHA256_Update(&sha256, header_data.data(), header_data.size());
-  SHA256_Final(header_hash.data(), &sha256);
+  SHA256_Final(header_hash.data(), &header_sha256);
+
+  // KDBX 4 follows the header with its hash and HMAC.
+  std::array<uint8_t, 32> header_hmac = { { 0 } };
+  if (kdbx4_) {
+    std::array<uint8_t, 32> header_hash_tst;
+    try {
+      header_hash_tst = consume<std::array<uint8_t, 32>>(src);
+      header_hmac = consume<std::array<uint8_t, 32>>(src);
+    } catch (std::exception& e) {
+      throw FormatError("Header checksum error in KDBX.");
+    }
+    if (header_hash_tst != header_hash)
+      throw FormatError("Header checksum error in KDBX.");
+  }
 
   // Produce the final key used for encrypting the contents.
-  std::array<uint8_t, 32> transformed_key = key.Transform(
-      db->transform_seed(), db->transform_rounds(),
-      Key::SubKeyResolution::kHashSubKeys);
+  std::array<uint8_t, 32> transformed_key = transform_key(key, *db, progress);
   std::array<uint8_t, 32> final_key;
 
+  SHA256_CTX sha256;
   SHA256_Init(&sha256);
   SHA256_Update(&sha256, db->master_seed().data(), db->master_seed().size());
   SHA256_Update(&sha256, transformed_key.data(), transformed_key.size());
   SHA256_Final(final_key.data(), &sha256);
 
-  std::unique_ptr<Cipher<16>> cipher;
-  switch (db->cipher()) {
-    case Database::Cipher::kAes:
-      cipher.reset(new AesCipher(final_key, db->init_vector()));
-      break;
-    case Database::Cipher::kTwofish:
-      cipher.reset(new TwofishCipher(final_key, db->init_vector()));
-      break;
-    default:
-      assert(false);
-      break;
+  // The header HMAC is what tells a wrong key in KDBX 4.
+  std::array<uint8_t, 64> hmac_key = { { 0 } };
+  if (kdbx4_) {
+    hmac_key = get_hmac_key(*db, transformed_key);
+    if (get_header_hmac(hmac_key, header_data) != header_hmac)
+      throw PasswordError();
   }
 
-  // Decrypt the content.
-  std::stringstream content;
+  // The content is decrypted as it's parsed, progress is reported on the
+  // encrypted data consumed. Content in a span is decrypted in place.
+  uint64_t content_size = remaining_size(src);
+
+  progress.Report(Progress::Phase::kDecrypt, 0, content_size);
+  SourceProgress content_progress(progress, Progress::Phase::kParse,
+                                  content_size);
+
+  // In KDBX 4 the encrypted content is split into HMAC authenticated blocks,
+  // which are verified before being decrypted.
+  std::unique_ptr<std::streambuf> block_streambuf;
+  std::unique_ptr<std::istream> block_stream;
+  std::istream* encrypted = &src;
+  SourceProgress cipher_progress = content_progress;
+  if (kdbx4_) {
+    block_streambuf.reset(
+        new hmac_block_istreambuf(src, hmac_key, content_progress));
+    block_stream.reset(new std::istream(block_streambuf.get()));
+    encrypted = block_stream.get();
+    cipher_progress = SourceProgress();
+  }
 
-  try {
-    decrypt_cbc(src, content, *cipher);
-  } catch (std::exception& e) {
-    throw PasswordError();
+  std::unique_ptr<Cipher<16>> block_cipher;
+  std::unique_ptr<StreamCipher> stream_cipher;
+  std::unique_ptr<std::streambuf> content_streambuf;
+  if (db->cipher() == Database::Cipher::kChaCha20) {
+    stream_cipher.reset(
+        new ChaCha20Cipher(final_key, chacha20_init_vector(*db)));
+    content_streambuf.reset(new stream_cipher_istreambuf(
+        *encrypted, *stream_cipher, cipher_progress));
+  } else {
+    block_cipher.reset(new AesCipher(final_key, db->init_vector()));
+    content_streambuf.reset(
+        new cbc_istreambuf(*encrypted, *block_cipher, cipher_progress));
+  }
+  std::istream content(content_streambuf.get());
+
+  // Decryption errors, including bad padding of a content that fits in a
+  // single buffer, surface as a failure to read the start bytes.
+  if (!kdbx4_) {
+    std::array<uint8_t, 32> content_start_bytes_tst;
+    content.read(reinterpret_cast<char*>(content_start_bytes_tst.data()),
+                 content_start_bytes_tst.size());
+    if (!content.good() || content_start_bytes != content_start_bytes_tst) {
+      progress.CheckCancelled();
+      throw PasswordError();
+    }
   }
 
-  std::array<uint8_t, 32> content_start_bytes_tst;
-  content.read(reinterpret_cast<char*>(content_start_bytes_tst.data()),
-               content_start_bytes_tst.size());
-  if (!content.good() || content_start_bytes != content_start_bytes_tst)
-    throw PasswordError();
+  // Cancellation from within the stream buffers is swallowed by the streams,
+  // which only see it as a read failure, so check for it explicitly.
+  try {
+    // In pipelined mode each stage reads ahead from the previous one on its
+    // own thread: decryption, block verification and decompression.
+    StreamChain chain;
+    std::istream* stream = &content;
+    auto read_ahead = [&]() {
+      if (pipelined_import_)
+        stream = &chain.Add(new threaded_istreambuf(*stream));
+    };
+
+    read_ahead();
+    if (!kdbx4_) {
+      stream = &chain.Add(new hashed_istreambuf(*stream));
+      read_ahead();
+    }
+    if (db->compress()) {
+      stream = &chain.Add(new gzip_istreambuf(*stream,
+                                              decompression_buffer_size_));
+      read_ahead();
+    }
 
-  // Prepare deobfuscation stream.
-  std::array<uint8_t, 32> final_inner_random_stream_key;
-  SHA256_Init(&sha256);
-  SHA256_Update(&sha256,
-                db->inner_random_stream_key().data(),
-                db->inner_random_stream_key().size());
-  SHA256_Final(final_inner_random_stream_key.data(), &sha256);
-  RandomObfuscator obfuscator(final_inner_random_stream_key,
-                              kKdbxInnerRandomStreamInitVec);
-
-  // Parse XML content.
-  hashed_istreambuf hashed_streambuf(content);
-  std::istream hashed_stream(&hashed_streambuf);
-
-  if (db->compress()) {
-    gzip_istreambuf gzip_streambuf(hashed_stream);
-    std::istream gzip_stream(&gzip_streambuf);
-
-    ParseXml(gzip_stream, obfuscator, *db.get());
-  } else {
-    ParseXml(hashed_stream, obfuscator, *db.get());
+    // The KDBX 4 inner header holds the inner random stream settings and the
+    // binaries.
+    if (kdbx4_)
+      ParseInnerHeader(*stream, *db);
+
+    // Prepare deobfuscation stream. Lazily deobfuscated values are processed
+    // later by a separate obfuscator that can seek in the key stream.
+    RandomObfuscator obfuscator = create_obfuscator(*db);
+    if (lazy_deobfuscation_) {
+      lazy_obfuscator_ =
+          std::make_shared<LazyObfuscator>(create_obfuscator(*db));
+    }
+
+    // Parse XML content.
+    ParseXml(*stream, obfuscator, *db.get());
+  } catch (std::exception&) {
+    progress.CheckCancelled();
+    throw;
   }
+  progress.CheckCancelled();
 
-  // Validate header hash.
-  if (header_hash_ != header_hash)
+  // Validate header hash, KDBX 4 has already authenticated the header.
+  if (!kdbx4_ && header_hash_ != header_hash)
     throw FormatError("Header checksum error in KDBX.");
 
   return db;
@@ -1112,16 +2091,56 @@ std::unique_ptr<Database> KdbxFile::Import(const std::string& path,
 
 void KdbxFile::Export(const std::string& path, const Database& db,
                       const Key& key) {
-  Reset();
+  Export(path, db, key, Progress());
+}
+
+void KdbxFile::Export(const std::string& path, const Database& db,
+                      const Key& key, const Progress& progress) {
+  // Write to a temporary file and rename it over the target once complete so
+  // that a failed export never leaves a partially written database behind.
+  AtomicFile file(path);
+  Export(file.fd(), db, key, progress);
+  file.Commit();
+}
+
+void KdbxFile::Export(int fd, const Database& db, const Key& key) {
+  Export(fd, db, key, Progress());
+}
+
+void KdbxFile::Export(int fd, const Database& db, const Key& key,
+                      const Progress& progress) {
+  fd_ostreambuf streambuf(fd);
+  std::ostream dst(&streambuf);
+  Export(dst, db, key, progress);
+
+  dst.flush();
+  if (!dst.good())
+    throw IoError("Write error.");
+}
+
+void KdbxFile::Export(std::vector<uint8_t>& dst, const Database& db,
+                      const Key& key) {
+  Export(dst, db, key, Progress());
+}
+
+void KdbxFile::Export(std::vector<uint8_t>& dst, const Database& db,
+                      const Key& key, const Progress& progress) {
+  vector_ostreambuf streambuf(dst);
+  std::ostream stream(&streambuf);
+  Export(stream, db, key, progress);
+}
+
+void KdbxFile::Export(std::ostream& dst, const Database& db,
+                      const Key& key) {
+  Export(dst, db, key, Progress());
+}
 
-  std::ofstream dst(path, std::ios::out | std::ios::binary);
-  if (!dst.is_open())
-    throw IoError("Unable to open database for writing.");
+void KdbxFile::Export(std::ostream& dst, const Database& db,
+                      const Key& key, const Progress& progress) {
+  Reset();
 
   // Produce the final key used for encrypting the contents.
-  std::array<uint8_t, 32> transformed_key = key.Transform(
-      db.transform_seed(), db.transform_rounds(),
-      Key::SubKeyResolution::kHashSubKeys);
+  std::array<uint8_t, 32> transformed_key = transform_key(key, db, progress);
   std::array<uint8_t, 32> final_key;
 
   SHA256_CTX sha256;
@@ -1130,66 +2149,88 @@ void KdbxFile::Export(const std::string& path, const Database& db,
   SHA256_Update(&sha256, transformed_key.data(), transformed_key.size());
   SHA256_Final(final_key.data(), &sha256);
 
-  assert(db.cipher() == Database::Cipher::kAes);
-  std::unique_ptr<Cipher<16>> cipher(
-      new AesCipher(final_key, db.init_vector()));
+  if (db.cipher() == Database::Cipher::kTwofish)
+    throw InternalError("Twofish is not supported by KDBX.");
 
   // Write header to temporary stream so that we can compute the hash of it.
+  // KDBX 3.1 is written unless the database needs KDBX 4.
+  kdbx4_ = requires_kdbx4(db);
+
   KdbxHeader header;
   header.signature0 = kKdbxSignature0;
   header.signature1 = kKdbxSignature1;
-  header.version = kKdbxVersionCriticalMin;
+  header.version = kdbx4_ ? kKdbxVersion4 : kKdbxVersionCriticalMin;
 
   std::stringstream header_stream;
   conserve<KdbxHeader>(header_stream, header);
 
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kCipherId, 16));
-  conserve<std::array<uint8_t, 16>>(header_stream, kKdbxCipherAes);
+  conserve_header_field(header_stream, KdbxHeaderField::kCipherId, 16,
+                        kdbx4_);
+  conserve<std::array<uint8_t, 16>>(header_stream,
+      db.cipher() == Database::Cipher::kChaCha20 ?
+          kKdbxCipherChaCha20 : kKdbxCipherAes);
 
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kCompressionFlags, 4));
+  conserve_header_field(header_stream, KdbxHeaderField::kCompressionFlags, 4,
+                        kdbx4_);
   conserve<uint32_t>(header_stream, db.compress() ?
       static_cast<uint32_t>(kKdbxCompressionFlags::kGzip) : 0);
 
-  if (db.master_seed().size() >
-      std::numeric_limits<decltype(KdbxHeaderField::size)>::max()) {
-    assert(false);
-    throw InternalError("Master seed size exceeds KDBX maximum.");
-  }
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kMasterSeed, db.master_seed().size()));
+  conserve_header_field(header_stream, KdbxHeaderField::kMasterSeed,
+                        db.master_seed().size(), kdbx4_);
   conserve<std::vector<uint8_t>>(header_stream, db.master_seed());
 
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kTransformSeed, 32));
-  conserve<std::array<uint8_t, 32>>(header_stream, db.transform_seed());
+  if (kdbx4_) {
+    std::stringstream kdf_params;
+    write_kdf_parameters(kdf_params, db);
 
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kTransformRounds, 8));
-  conserve<uint64_t>(header_stream, db.transform_rounds());
+    std::string kdf_params_data = kdf_params.str();
+    conserve_header_field(header_stream, KdbxHeaderField::kKdfParameters,
+                          kdf_params_data.size(), kdbx4_);
+    header_stream.write(kdf_params_data.data(), kdf_params_data.size());
+  } else {
+    conserve_header_field(header_stream, KdbxHeaderField::kTransformSeed, 32,
+                          kdbx4_);
+    conserve<std::array<uint8_t, 32>>(header_stream, db.transform_seed());
 
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kExcryptionInitVec, 16));
-  conserve<std::array<uint8_t, 16>>(header_stream, db.init_vector());
+    conserve_header_field(header_stream, KdbxHeaderField::kTransformRounds, 8,
+                          kdbx4_);
+    conserve<uint64_t>(header_stream, db.transform_rounds());
+  }
 
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kInnerRandomStreamKey, 32));
-  conserve<std::array<uint8_t, 32>>(header_stream,
-      db.inner_random_stream_key());
+  if (db.cipher() == Database::Cipher::kChaCha20) {
+    conserve_header_field(header_stream, KdbxHeaderField::kExcryptionInitVec,
+                          12, kdbx4_);
+    conserve<std::array<uint8_t, 12>>(header_stream,
+                                      chacha20_init_vector(db));
+  } else {
+    conserve_header_field(header_stream, KdbxHeaderField::kExcryptionInitVec,
+                          16, kdbx4_);
+    conserve<std::array<uint8_t, 16>>(header_stream, db.init_vector());
+  }
 
+  // KDBX 4 moves the inner random stream settings to the inner header, and
+  // replaces the start bytes with the header HMAC.
   std::array<uint8_t, 32> content_start_bytes = random_array<32>();
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kContentStreamStartBytes, 32));
-  conserve<std::array<uint8_t, 32>>(header_stream, content_start_bytes);
-
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kInnerRandomStreamId, 4));
-  conserve<uint32_t>(header_stream,
-      static_cast<uint32_t>(kKdbxRandomStream::kSalsa20));
+  if (!kdbx4_) {
+    conserve_header_field(header_stream,
+                          KdbxHeaderField::kInnerRandomStreamKey, 32, kdbx4_);
+    conserve<std::array<uint8_t, 32>>(header_stream,
+                                      db.inner_random_stream_key());
+
+    conserve_header_field(header_stream,
+                          KdbxHeaderField::kContentStreamStartBytes, 32,
+                          kdbx4_);
+    conserve<std::array<uint8_t, 32>>(header_stream, content_start_bytes);
+
+    conserve_header_field(header_stream, KdbxHeaderField::kInnerRandomStreamId,
+                          4, kdbx4_);
+    conserve<uint32_t>(header_stream, static_cast<uint32_t>(
+        db.inner_random_stream() == Database::InnerRandomStream::kChaCha20 ?
+            kKdbxRandomStream::kChaCha20 : kKdbxRandomStream::kSalsa20));
+  }
 
-  conserve<KdbxHeaderField>(header_stream, KdbxHeaderField(
-      KdbxHeaderField::kEndOfHeader, 0));
+  conserve_header_field(header_stream, KdbxHeaderField::kEndOfHeader, 0,
+                        kdbx4_);
 
   // Compute the header hash.
   std::string header_data = header_stream.str();
@@ -1202,37 +2243,118 @@ void KdbxFile::Export(const std::string& path, const Database& db,
             std::istreambuf_iterator<char>(),
             std::ostreambuf_iterator<char>(dst));
 
+  // KDBX 4 follows the header with its hash and HMAC, and splits the
+  // encrypted content into HMAC authenticated blocks.
+  std::array<uint8_t, 64> hmac_key = { { 0 } };
+  if (kdbx4_) {
+    hmac_key = get_hmac_key(db, transformed_key);
+    conserve<std::array<uint8_t, 32>>(dst, header_hash_);
+    conserve<std::array<uint8_t, 32>>(dst, get_header_hmac(hmac_key,
+                                                           header_data));
+  }
+
   // Prepare deobfuscation stream.
-  std::array<uint8_t, 32> final_inner_random_stream_key;
-  SHA256_Init(&sha256);
-  SHA256_Update(&sha256,
-                db.inner_random_stream_key().data(),
-                db.inner_random_stream_key().size());
-  SHA256_Final(final_inner_random_stream_key.data(), &sha256);
-  RandomObfuscator obfuscator(final_inner_random_stream_key,
-                              kKdbxInnerRandomStreamInitVec);
+  RandomObfuscator obfuscator = create_obfuscator(db);
+
+  // The content is encrypted and written as it's serialized.
+  std::streampos content_begin = dst.tellp();
+
+  std::unique_ptr<std::streambuf> block_streambuf;
+  std::unique_ptr<std::ostream> block_stream;
+  std::ostream* encrypted = &dst;
+  if (kdbx4_) {
+    block_streambuf.reset(new hmac_block_ostreambuf(dst, hmac_key));
+    block_stream.reset(new std::ostream(block_streambuf.get()));
+    encrypted = block_stream.get();
+  }
 
-  // Write content to content stream.
-  std::stringstream content_stream;
-  conserve<std::array<uint8_t, 32>>(content_stream, content_start_bytes);
+  std::unique_ptr<Cipher<16>> block_cipher;
+  std::unique_ptr<StreamCipher> stream_cipher;
+  std::unique_ptr<std::streambuf> content_streambuf;
+  if (db.cipher() == Database::Cipher::kChaCha20) {
+    stream_cipher.reset(
+        new ChaCha20Cipher(final_key, chacha20_init_vector(db)));
+    content_streambuf.reset(
+        new stream_cipher_ostreambuf(*encrypted, *stream_cipher));
+  } else {
+    block_cipher.reset(new AesCipher(final_key, db.init_vector()));
+    content_streambuf.reset(new cbc_ostreambuf(*encrypted, *block_cipher));
+  }
+  std::ostream content_stream(content_streambuf.get());
+  if (!kdbx4_)
+    conserve<std::array<uint8_t, 32>>(content_stream, content_start_bytes);
+
+  progress.Report(Progress::Phase::kSerialize, 0, 0);
+  progress_ostreambuf progress_streambuf(content_stream, progress,
+                                         Progress::Phase::kSerialize);
+  std::ostream progress_stream(&progress_streambuf);
+
+  // KDBX 4 has no hashed blocks, the content is authenticated by the HMAC
+  // blocks instead.
+  std::unique_ptr<std::streambuf> hashed_streambuf;
+  std::unique_ptr<std::ostream> hashed_stream;
+  std::ostream* payload_stream = &progress_stream;
+  if (!kdbx4_) {
+    hashed_streambuf.reset(new hashed_ostreambuf(progress_stream));
+    hashed_stream.reset(new std::ostream(hashed_streambuf.get()));
+    payload_stream = hashed_stream.get();
+  }
 
-  hashed_ostreambuf hashed_streambuf(content_stream);
-  std::ostream hashed_stream(&hashed_streambuf);
+  auto write_payload = [&](std::ostream& stream) {
+    if (kdbx4_)
+      WriteInnerHeader(stream, db);
+    WriteXml(stream, obfuscator, db);
+  };
 
   if (db.compress()) {
-    gzip_ostreambuf gzip_streambuf(hashed_stream);
+    parallel_gzip_ostreambuf gzip_streambuf(*payload_stream,
+                                            get_gzip_options(db));
     std::ostream gzip_stream(&gzip_streambuf);
 
-    WriteXml(gzip_stream, obfuscator, db);
+    write_payload(gzip_stream);
     gzip_stream.flush();
   } else {
-    WriteXml(hashed_stream, obfuscator, db);
+    write_payload(*payload_stream);
   }
 
-  hashed_stream.flush();
+  if (hashed_stream)
+    hashed_stream->flush();
+  progress.CheckCancelled();
+
+  // Flushing the progress stream flushes the content stream as well, which
+  // encrypts the last block and, in KDBX 4, writes the last HMAC blocks.
+  progress_stream.flush();
+  progress.CheckCancelled();
+
+  if (block_stream && !block_stream->flush().good())
+    throw IoError("Write error.");
+  if (!dst.good())
+    throw IoError("Write error.");
+
+  // The amount of encrypted data is only known for seekable streams.
+  std::streampos content_end = dst.tellp();
+  uint64_t content_size = content_begin != std::streampos(-1) &&
+      content_end != std::streampos(-1) ?
+          static_cast<uint64_t>(content_end - content_begin) : 0;
+  progress.Report(Progress::Phase::kEncrypt, content_size, content_size);
+}
+
+std::future<std::unique_ptr<Database>> KdbxFile::ImportAsync(
+    const std::string& path, const Key& key, const Progress& progress) const {
+  KdbxFile file(*this);
+  return std::async(std::launch::async, [file, path, key, progress]() mutable {
+    return file.Import(path, key, progress);
+  });
+}
 
-  // Encrypt content.
-  encrypt_cbc(content_stream, dst, *cipher);
+std::future<void> KdbxFile::ExportAsync(const std::string& path,
+                                        const Database& db, const Key& key,
+                                        const Progress& progress) const {
+  KdbxFile file(*this);
+  return std::async(std::launch::async,
+                    [file, path, db, key, progress]() mutable {
+    file.Export(path, db, key, progress);
+  });
 }
 
 }   // namespace keepass
@@ -18,12 +18,17 @@
 
 #pragma once
 #include <cstdint>
+#include <functional>
+#include <future>
 #include <memory>
 #include <istream>
+#include <ostream>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "database.hh"
+#include "progress.hh"
 #include "security.hh"
 
 namespace pugi {
@@ -35,16 +40,32 @@ namespace keepass {
 
 class Binary;
 class Entry;
+struct GzipOptions;
 class Group;
 class Icon;
 class Key;
+class LazyObfuscator;
 class Metadata;
 class RandomObfuscator;
+class XmlReader;
+class XmlWriter;
 
 /**
  * @brief Keepass2 database file representation.
  */
 class KdbxFile final {
+ public:
+  /**
+   * Callback receiving imported entries.
+   * @param [in] group Group that the entry belongs to. Only the fields of the
+   *                   group itself have been parsed, not all of its entries
+   *                   and subgroups. Fields that follow the first entry or
+   *                   subgroup in the file are set once the group ends.
+   * @param [in] entry Fully parsed entry, including its history.
+   */
+  typedef std::function<void(std::shared_ptr<Group> group,
+                             std::shared_ptr<Entry> entry)> EntryCallback;
+
  private:
   typedef std::unordered_map<std::string, std::shared_ptr<Binary>> BinaryPool;
 
@@ -57,6 +78,16 @@ class KdbxFile final {
   IconPool icon_pool_;
   GroupPool group_pool_;
   std::array<uint8_t, 32> header_hash_ = { { 0 } }; 
+  /** Set while importing or exporting a KDBX 4 database. */
+  bool kdbx4_ = false;
+  /** Binaries of the KDBX 4 inner header, in header order. */
+  std::vector<std::shared_ptr<Binary>> inner_binaries_;
+  bool pipelined_import_ = false;
+  bool compact_xml_ = false;
+  EntryCallback entry_callback_;
+  bool lazy_deobfuscation_ = false;
+  std::shared_ptr<LazyObfuscator> lazy_obfuscator_;
+  std::size_t decompression_buffer_size_ = 16384;
 
   void Reset();
 
@@ -69,14 +100,30 @@ class KdbxFile final {
       const pugi::xml_node& node,
       const char* name,
       RandomObfuscator& obfuscator) const;
-  void WriteProtectedString(pugi::xml_node& node,
+  void WriteProtectedString(XmlWriter& writer,
+                            const char* name,
                             const protect<std::string>& str,
                             RandomObfuscator& obfuscator) const;
 
-  std::shared_ptr<Metadata> ParseMeta(const pugi::xml_node& meta_node,
-                                      RandomObfuscator& obfuscator);
-  void WriteMeta(pugi::xml_node& meta_node, RandomObfuscator& obfuscator,
-                 std::shared_ptr<Metadata> meta);
+  /**
+   * Parses the meta data fields, except for the binaries.
+   * @param [in] meta_node Meta XML node.
+   * @return Pointer to meta data object.
+   */
+  std::shared_ptr<Metadata> ParseMeta(const pugi::xml_node& meta_node);
+  /**
+   * Parses the binaries one at a time as they are read, and adds them to the
+   * binary pool.
+   * @param [in] reader Reader positioned at the start of the binaries element.
+   * @param [in] obfuscator Random stream obfuscator.
+   * @param [out] binaries Binaries in document order.
+   */
+  void ParseBinaries(XmlReader& reader,
+                     RandomObfuscator& obfuscator,
+                     std::vector<std::shared_ptr<Binary>>& binaries);
+  void WriteMeta(XmlWriter& writer, RandomObfuscator& obfuscator,
+                 std::shared_ptr<Metadata> meta,
+                 const GzipOptions& gzip_options);
 
   /**
    * Parses a an entry in the XML tree.
@@ -88,16 +135,34 @@ class KdbxFile final {
   std::shared_ptr<Entry> ParseEntry(const pugi::xml_node& entry_node,
                                     std::array<uint8_t, 16>& entry_uuid,
                                     RandomObfuscator& obfuscator);
-  void WriteEntry(pugi::xml_node& entry_node,
+  void WriteEntry(XmlWriter& writer,
                   RandomObfuscator& obfuscator,
                   std::shared_ptr<Entry> entry);
 
-  std::shared_ptr<Group> ParseGroup(const pugi::xml_node& group_node,
+  void ParseGroupFields(const pugi::xml_node& group_node,
+                        std::shared_ptr<Group> group,
+                        std::array<uint8_t, 16>& last_visible_uuid);
+  /**
+   * Parses a group as it's read, entries are built one at a time and either
+   * added to the group or passed to the entry callback.
+   * @param [in] reader Reader positioned at the start of the group element.
+   * @param [in] obfuscator Random stream obfuscator.
+   * @return Pointer to group object.
+   */
+  std::shared_ptr<Group> ParseGroup(XmlReader& reader,
                                     RandomObfuscator& obfuscator);
-  void WriteGroup(pugi::xml_node& group_node,
+  void WriteGroup(XmlWriter& writer,
                   RandomObfuscator& obfuscator,
                   std::shared_ptr<Group> group);
 
+  /**
+   * Parses the KDBX 4 inner header preceding the XML content.
+   * @param [in] src Stream positioned at the start of the inner header.
+   * @param [in] db Database to store the inner random stream settings in.
+   */
+  void ParseInnerHeader(std::istream& src, Database& db);
+  void WriteInnerHeader(std::ostream& dst, const Database& db);
+
   void ParseXml(std::istream& src, RandomObfuscator& obfuscator, Database& db);
 #ifdef DEBUG
   void PrintXml(pugi::xml_document& doc);
@@ -106,8 +171,164 @@ class KdbxFile final {
                 const Database& db);
 
  public:
+  /**
+   * Enables or disables pipelined import. When enabled, decryption, block
+   * verification and decompression of the content run concurrently on
+   * separate threads, and the progress callback is invoked from the
+   * decryption thread.
+   * @param [in] pipelined_import true to enable pipelined import.
+   */
+  void set_pipelined_import(bool pipelined_import) {
+    pipelined_import_ = pipelined_import;
+  }
+
+  /**
+   * Enables or disables compact XML output on export. Compact output has no
+   * indentation or line breaks, which makes the content slightly smaller.
+   * @param [in] compact_xml true to write compact XML.
+   */
+  void set_compact_xml(bool compact_xml) { compact_xml_ = compact_xml; }
+
+  /**
+   * Sets a callback that receives entries as soon as they have been parsed
+   * during import. Entries passed to the callback are not added to their
+   * groups, so the imported database only holds the group tree. This bounds
+   * the memory needed for databases with many entries.
+   *
+   * The header checksum of KDBX 3.1 databases is verified after the whole
+   * content has been parsed. An import may therefore still fail after entries
+   * have been passed to the callback, although the content blocks are
+   * verified before being parsed. KDBX 4 headers are verified up front.
+   * @param [in] callback Callback, or an empty function to retain entries in
+   *                      their groups.
+   */
+  void set_entry_callback(EntryCallback callback) {
+    entry_callback_ = callback;
+  }
+
+  /**
+   * Enables or disables lazy deobfuscation of protected strings on import.
+   * When enabled, protected strings are kept obfuscated and are only
+   * deobfuscated when first accessed, by seeking to their offset in the inner
+   * random stream. Protected binaries are always deobfuscated on import.
+   * @param [in] lazy_deobfuscation true to enable lazy deobfuscation.
+   */
+  void set_lazy_deobfuscation(bool lazy_deobfuscation) {
+    lazy_deobfuscation_ = lazy_deobfuscation;
+  }
+
+  /**
+   * Sets the size of the buffers used for decompressing the content on
+   * import. Larger buffers mean fewer calls into zlib for large databases.
+   * @param [in] decompression_buffer_size Buffer size in bytes, must not be
+   *                                       zero.
+   */
+  void set_decompression_buffer_size(std::size_t decompression_buffer_size) {
+    decompression_buffer_size_ = decompression_buffer_size;
+  }
+
   std::unique_ptr<Database> Import(const std::string& path, const Key& key);
+  std::unique_ptr<Database> Import(const std::string& path, const Key& key,
+                                   const Progress& progress);
+  /**
+   * Exports a database to a file. The database is written to a temporary file
+   * in the same directory, which replaces @a path once it has been flushed to
+   * disk. If the export fails, any existing file at @a path is left intact.
+   * @param [in] path Path to database file.
+   * @param [in] db Database to export.
+   * @param [in] key Key to lock the database with.
+   * @param [in] progress Progress callback and cancellation token.
+   */
   void Export(const std::string& path, const Database& db, const Key& key);
+  void Export(const std::string& path, const Database& db, const Key& key,
+              const Progress& progress);
+
+  /**
+   * Imports a database from a stream. The stream doesn't need to be seekable,
+   * it may for example be fed by a pipe.
+   * @param [in] src Stream positioned at the start of the database.
+   * @param [in] key Key to unlock the database with.
+   * @param [in] progress Progress callback and cancellation token. The total
+   *                      amount of work is unknown for streams that can't be
+   *                      seeked.
+   * @return Imported database.
+   */
+  std::unique_ptr<Database> Import(std::istream& src, const Key& key);
+  std::unique_ptr<Database> Import(std::istream& src, const Key& key,
+                                   const Progress& progress);
+  /**
+   * Imports a database held in memory. The database is parsed directly from
+   * the buffer, which must stay valid during the import.
+   * @param [in] data Start of the database.
+   * @param [in] size Size of the database in bytes.
+   * @param [in] key Key to unlock the database with.
+   * @param [in] progress Progress callback and cancellation token.
+   * @return Imported database.
+   */
+  std::unique_ptr<Database> Import(const uint8_t* data, std::size_t size,
+                                   const Key& key);
+  std::unique_ptr<Database> Import(const uint8_t* data, std::size_t size,
+                                   const Key& key, const Progress& progress);
+  /**
+   * Exports a database to a stream. The stream doesn't need to be seekable.
+   * @param [out] dst Stream to write the database to.
+   * @param [in] db Database to export.
+   * @param [in] key Key to lock the database with.
+   * @param [in] progress Progress callback and cancellation token.
+   */
+  void Export(std::ostream& dst, const Database& db, const Key& key);
+  void Export(std::ostream& dst, const Database& db, const Key& key,
+              const Progress& progress);
+  /**
+   * Exports a database to a file descriptor. The descriptor is left open and
+   * doesn't need to be seekable.
+   * @param [in] fd File descriptor to write the database to.
+   * @param [in] db Database to export.
+   * @param [in] key Key to lock the database with.
+   * @param [in] progress Progress callback and cancellation token.
+   */
+  void Export(int fd, const Database& db, const Key& key);
+  void Export(int fd, const Database& db, const Key& key,
+              const Progress& progress);
+  /**
+   * Exports a database to memory. The database is appended to @a dst.
+   * @param [out] dst Buffer to write the database to.
+   * @param [in] db Database to export.
+   * @param [in] key Key to lock the database with.
+   * @param [in] progress Progress callback and cancellation token.
+   */
+  void Export(std::vector<uint8_t>& dst, const Database& db, const Key& key);
+  void Export(std::vector<uint8_t>& dst, const Database& db, const Key& key,
+              const Progress& progress);
+
+  /**
+   * Imports a database on a separate thread. The import uses a copy of this
+   * object, so its settings apply as set at the time of the call. The entry
+   * callback is invoked on the importing thread.
+   * @param [in] path Path to database file.
+   * @param [in] key Key to unlock the database with.
+   * @param [in] progress Progress callback and cancellation token. The
+   *                      callback is invoked on the importing thread.
+   * @return Future database. If the operation is cancelled, the future will
+   *         throw CancelledError.
+   */
+  std::future<std::unique_ptr<Database>> ImportAsync(
+      const std::string& path, const Key& key, const Progress& progress) const;
+  /**
+   * Exports a database on a separate thread. The export uses a copy of this
+   * object, so its settings apply as set at the time of the call. The groups
+   * and entries of @a db must not be modified until the returned future is
+   * ready.
+   * @param [in] path Path to database file.
+   * @param [in] db Database to export.
+   * @param [in] key Key to lock the database with.
+   * @param [in] progress Progress callback and cancellation token. The
+   *                      callback is invoked on the exporting thread.
+   * @return Future completion. If the operation is cancelled, the future will
+   *         throw CancelledError.
+   */
+  std::future<void> ExportAsync(const std::string& path, const Database& db,
+                                const Key& key, const Progress& progress) const;
 };
 
 }   // keepass
@@ -20,17 +20,80 @@
 
 #include <algorithm>
 #include <fstream>
+#include <limits>
 #include <memory>
 
+#include <openssl/crypto.h>
 #include <openssl/sha.h>
 
 #include "base64.hh"
 #include "cipher.hh"
 #include "exception.hh"
 #include "pugixml.hh"
+#include "random.hh"
 
 namespace keepass {
 
+TransformCache::TransformCache(std::size_t capacity) :
+    capacity_(capacity) {
+}
+
+TransformCache::~TransformCache() {
+  Clear();
+}
+
+void TransformCache::Erase(std::list<Item>::iterator it) const {
+  OPENSSL_cleanse(it->key.data(), it->key.size());
+  items_.erase(it);
+}
+
+bool TransformCache::Lookup(const std::array<uint8_t, 32>& id,
+                            std::array<uint8_t, 32>& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto it = std::find_if(items_.begin(), items_.end(), [&](const Item& item) {
+    return item.id == id;
+  });
+  if (it == items_.end())
+    return false;
+
+  // Move the item to the front to mark it as most recently used.
+  items_.splice(items_.begin(), items_, it);
+  key = it->key;
+  return true;
+}
+
+void TransformCache::Insert(const std::array<uint8_t, 32>& id,
+                            const std::array<uint8_t, 32>& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (capacity_ == 0)
+    return;
+
+  auto it = std::find_if(items_.begin(), items_.end(), [&](const Item& item) {
+    return item.id == id;
+  });
+  if (it != items_.end())
+    Erase(it);
+
+  while (items_.size() >= capacity_)
+    Erase(std::prev(items_.end()));
+
+  items_.push_front(Item());
+  items_.front().id = id;
+  items_.front().key = key;
+}
+
+void TransformCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (!items_.empty())
+    Erase(items_.begin());
+}
+
+std::size_t TransformCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return items_.size();
+}
+
 std::array<uint8_t, 32> Key::CompositeKey::Resolve(
     SubKeyResolution resolution) const {
   static const std::array<uint8_t, 32> kEmptyKey = { { 0 } };
@@ -118,21 +181,213 @@ void Key::SetKeyFile(const std::string& path) {
   }
 }
 
+std::array<uint8_t, 32> Key::GetCacheId(
+    const std::array<uint8_t, 32>& resolved,
+    const std::array<uint8_t, 32>& seed,
+    uint64_t rounds) const {
+  std::array<uint8_t, 32> cache_id;
+
+  SHA256_CTX sha256;
+  SHA256_Init(&sha256);
+  SHA256_Update(&sha256, resolved.data(), resolved.size());
+  SHA256_Update(&sha256, seed.data(), seed.size());
+  SHA256_Update(&sha256, &rounds, sizeof(rounds));
+  SHA256_Final(cache_id.data(), &sha256);
+
+  return cache_id;
+}
+
+std::array<uint8_t, 32> Key::GetCacheId(
+    const std::array<uint8_t, 32>& resolved,
+    const std::array<uint8_t, 32>& seed,
+    const Argon2& argon2) const {
+  std::array<uint8_t, 32> cache_id;
+
+  uint32_t params[4] = {
+    static_cast<uint32_t>(argon2.type()),
+    argon2.iterations(),
+    argon2.memory(),
+    argon2.parallelism()
+  };
+
+  SHA256_CTX sha256;
+  SHA256_Init(&sha256);
+  SHA256_Update(&sha256, resolved.data(), resolved.size());
+  SHA256_Update(&sha256, seed.data(), seed.size());
+  SHA256_Update(&sha256, params, sizeof(params));
+  SHA256_Update(&sha256, argon2.secret().data(), argon2.secret().size());
+  SHA256_Update(&sha256, argon2.associated_data().data(),
+                argon2.associated_data().size());
+  SHA256_Final(cache_id.data(), &sha256);
+
+  return cache_id;
+}
+
 std::array<uint8_t, 32> Key::Transform(const std::array<uint8_t, 32>& seed,
                                        const uint64_t rounds,
                                        SubKeyResolution resolution) const {
-  AesCipher cipher(seed);
+  return Transform(seed, rounds, resolution, Progress());
+}
 
+std::array<uint8_t, 32> Key::Transform(const std::array<uint8_t, 32>& seed,
+                                       const uint64_t rounds,
+                                       SubKeyResolution resolution,
+                                       const Progress& progress) const {
   std::array<uint8_t, 32> transformed_key = key_.Resolve(resolution);
-  for (uint32_t i = 0; i < rounds; ++i)
-    transformed_key = encrypt_ecb(transformed_key, cipher);
+
+  std::array<uint8_t, 32> cache_id;
+  if (cache_) {
+    cache_id = GetCacheId(transformed_key, seed, rounds);
+    if (cache_->Lookup(cache_id, transformed_key)) {
+      progress.Report(Progress::Phase::kTransformKey, rounds, rounds);
+      return transformed_key;
+    }
+  }
+
+  AesTransformer transformer(seed);
+  transformer.Transform(transformed_key, rounds, progress);
 
   SHA256_CTX sha256;
   SHA256_Init(&sha256);
   SHA256_Update(&sha256, transformed_key.data(), transformed_key.size());
   SHA256_Final(transformed_key.data(), &sha256);
 
+  if (cache_)
+    cache_->Insert(cache_id, transformed_key);
+
   return transformed_key;
 }
 
+std::array<uint8_t, 32> Key::Transform(const std::array<uint8_t, 32>& seed,
+                                       const Argon2& argon2,
+                                       SubKeyResolution resolution) const {
+  return Transform(seed, argon2, resolution, Progress());
+}
+
+std::array<uint8_t, 32> Key::Transform(const std::array<uint8_t, 32>& seed,
+                                       const Argon2& argon2,
+                                       SubKeyResolution resolution,
+                                       const Progress& progress) const {
+  std::array<uint8_t, 32> resolved = key_.Resolve(resolution);
+
+  std::array<uint8_t, 32> transformed_key;
+  std::array<uint8_t, 32> cache_id;
+  if (cache_) {
+    cache_id = GetCacheId(resolved, seed, argon2);
+    if (cache_->Lookup(cache_id, transformed_key)) {
+      OPENSSL_cleanse(resolved.data(), resolved.size());
+      progress.Report(Progress::Phase::kTransformKey, 1, 1);
+      return transformed_key;
+    }
+  }
+
+  try {
+    transformed_key = argon2.Hash(
+        resolved, std::vector<uint8_t>(seed.begin(), seed.end()), progress);
+  } catch (...) {
+    OPENSSL_cleanse(resolved.data(), resolved.size());
+    throw;
+  }
+  OPENSSL_cleanse(resolved.data(), resolved.size());
+
+  if (cache_)
+    cache_->Insert(cache_id, transformed_key);
+
+  return transformed_key;
+}
+
+std::vector<std::array<uint8_t, 32>> Key::TransformBatch(
+    const std::vector<TransformJob>& jobs) {
+  std::vector<std::array<uint8_t, 32>> transformed_keys(jobs.size());
+  std::vector<std::array<uint8_t, 32>> cache_ids(jobs.size());
+
+  // Jobs that have to be run, cached results are picked up directly.
+  std::vector<std::size_t> pending;
+  std::vector<AesTransformer::Job> aes_jobs;
+  std::vector<std::unique_ptr<AesTransformer>> transformers;
+
+  // Growing the jobs would leave copies of the keys behind.
+  aes_jobs.reserve(jobs.size());
+
+  for (std::size_t i = 0; i < jobs.size(); ++i) {
+    const TransformJob& job = jobs[i];
+    std::array<uint8_t, 32> resolved = job.key->key_.Resolve(job.resolution);
+
+    if (job.key->cache_) {
+      cache_ids[i] = job.key->GetCacheId(resolved, job.seed, job.rounds);
+      if (job.key->cache_->Lookup(cache_ids[i], transformed_keys[i])) {
+        OPENSSL_cleanse(resolved.data(), resolved.size());
+        continue;
+      }
+    }
+
+    transformers.emplace_back(new AesTransformer(job.seed));
+
+    AesTransformer::Job aes_job;
+    aes_job.transformer = transformers.back().get();
+    aes_job.data = resolved;
+    aes_job.rounds = job.rounds;
+    OPENSSL_cleanse(resolved.data(), resolved.size());
+    aes_jobs.push_back(aes_job);
+    OPENSSL_cleanse(aes_job.data.data(), aes_job.data.size());
+    pending.push_back(i);
+  }
+
+  AesTransformer::TransformBatch(aes_jobs);
+
+  for (std::size_t j = 0; j < pending.size(); ++j) {
+    std::size_t i = pending[j];
+    std::array<uint8_t, 32>& transformed_key = transformed_keys[i];
+
+    SHA256_CTX sha256;
+    SHA256_Init(&sha256);
+    SHA256_Update(&sha256, aes_jobs[j].data.data(), aes_jobs[j].data.size());
+    SHA256_Final(transformed_key.data(), &sha256);
+    OPENSSL_cleanse(aes_jobs[j].data.data(), aes_jobs[j].data.size());
+
+    if (jobs[i].key->cache_)
+      jobs[i].key->cache_->Insert(cache_ids[i], transformed_key);
+  }
+
+  return transformed_keys;
+}
+
+uint64_t Key::CalibrateRounds(std::chrono::milliseconds target) {
+  static constexpr std::chrono::milliseconds kMaxBenchmarkTime(100);
+  static constexpr uint64_t kRoundsPerStep = 4096;
+
+  typedef std::chrono::steady_clock Clock;
+
+  AesTransformer transformer(random_array<32>());
+  std::array<uint8_t, 32> data = random_array<32>();
+
+  // Run the real transformation kernel in small steps until the benchmark
+  // window has passed. There is no need to benchmark for longer than the
+  // target time itself.
+  Clock::duration window = std::min(target, kMaxBenchmarkTime);
+  Clock::duration elapsed;
+  uint64_t rounds = 0;
+
+  Clock::time_point start = Clock::now();
+  do {
+    transformer.Transform(data, kRoundsPerStep);
+    rounds += kRoundsPerStep;
+    elapsed = Clock::now() - start;
+  } while (elapsed < window);
+
+  typedef std::chrono::duration<double> Seconds;
+  double rounds_per_sec = static_cast<double>(rounds) /
+      std::max(Seconds(elapsed).count(), 1e-9);
+  double target_rounds = rounds_per_sec * Seconds(target).count();
+
+  if (target_rounds < 1.0)
+    return 1;
+  if (target_rounds >= static_cast<double>(
+      std::numeric_limits<uint64_t>::max())) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+
+  return static_cast<uint64_t>(target_rounds);
+}
+
 }   // namespace keepass
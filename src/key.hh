@@ -18,12 +18,68 @@
 
 #pragma once
 #include <array>
+#include <chrono>
 #include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 
+#include "argon2.hh"
+#include "progress.hh"
+
 namespace keepass {
 
+/**
+ * @brief Bounded cache of transformed keys.
+ *
+ * Entries are identified by a SHA-256 digest of the resolved composite key,
+ * the transform seed and the number of transform rounds, so the composite key
+ * itself is never stored. The least recently used entry is evicted when the
+ * cache is full. All transformed keys are wiped from memory when evicted or
+ * when the cache is destroyed. The cache may be shared between threads.
+ */
+class TransformCache final {
+ public:
+  static constexpr std::size_t kDefaultCapacity = 16;
+
+ private:
+  struct Item {
+    std::array<uint8_t, 32> id;
+    std::array<uint8_t, 32> key;
+  };
+
+  const std::size_t capacity_;
+  mutable std::mutex mutex_;
+  /** Items in most recently used order. */
+  mutable std::list<Item> items_;
+
+  void Erase(std::list<Item>::iterator it) const;
+
+ public:
+  explicit TransformCache(std::size_t capacity = kDefaultCapacity);
+  ~TransformCache();
+
+  TransformCache(const TransformCache&) = delete;
+  TransformCache& operator=(const TransformCache&) = delete;
+
+  /**
+   * Looks up a transformed key.
+   * @param [in] id Entry identifier.
+   * @param [out] key Transformed key, only written on success.
+   * @return true if the key was found and false otherwise.
+   */
+  bool Lookup(const std::array<uint8_t, 32>& id,
+              std::array<uint8_t, 32>& key) const;
+  void Insert(const std::array<uint8_t, 32>& id,
+              const std::array<uint8_t, 32>& key);
+  void Clear();
+
+  std::size_t capacity() const { return capacity_; }
+  std::size_t size() const;
+};
+
 class Key final {
  public:
   /**
@@ -49,16 +105,92 @@ class Key final {
     std::array<uint8_t, 32> Resolve(SubKeyResolution resolution) const;
   } key_;
 
+  std::shared_ptr<TransformCache> cache_;
+
+  std::array<uint8_t, 32> GetCacheId(const std::array<uint8_t, 32>& resolved,
+                                     const std::array<uint8_t, 32>& seed,
+                                     uint64_t rounds) const;
+  std::array<uint8_t, 32> GetCacheId(const std::array<uint8_t, 32>& resolved,
+                                     const std::array<uint8_t, 32>& seed,
+                                     const Argon2& argon2) const;
+
  public:
+  /**
+   * @brief A single key transformation in a batch.
+   */
+  struct TransformJob {
+    const Key* key;
+    std::array<uint8_t, 32> seed;
+    uint64_t rounds;
+    SubKeyResolution resolution;
+  };
+
   Key() = default;
   Key(const std::string& password);
 
   void SetPassword(const std::string& password);
   void SetKeyFile(const std::string& path);
 
+  /**
+   * Attaches a cache of transformed keys. Once attached, Transform() will
+   * reuse earlier results for the same key, seed and number of rounds instead
+   * of running the key transformation again. No cache is used by default.
+   */
+  std::shared_ptr<TransformCache> transform_cache() const { return cache_; }
+  void set_transform_cache(std::shared_ptr<TransformCache> cache) {
+    cache_ = cache;
+  }
+
   std::array<uint8_t, 32> Transform(const std::array<uint8_t, 32>& seed,
                                     const uint64_t rounds,
                                     SubKeyResolution resolution) const;
+  /**
+   * Same as above but reports progress through, and can be cancelled
+   * through, @a progress.
+   * @throws CancelledError If the transformation was cancelled.
+   */
+  std::array<uint8_t, 32> Transform(const std::array<uint8_t, 32>& seed,
+                                    const uint64_t rounds,
+                                    SubKeyResolution resolution,
+                                    const Progress& progress) const;
+
+  /**
+   * Transforms the key with Argon2 instead of the AES key derivation. The
+   * result is the Argon2 output as is, without any additional hashing.
+   * @param [in] seed Argon2 salt.
+   * @param [in] argon2 Argon2 parameters.
+   * @param [in] resolution Sub key resolution strategy.
+   * @param [in] progress Progress and cancellation.
+   * @throws CancelledError If the transformation was cancelled.
+   */
+  std::array<uint8_t, 32> Transform(const std::array<uint8_t, 32>& seed,
+                                    const Argon2& argon2,
+                                    SubKeyResolution resolution) const;
+  std::array<uint8_t, 32> Transform(const std::array<uint8_t, 32>& seed,
+                                    const Argon2& argon2,
+                                    SubKeyResolution resolution,
+                                    const Progress& progress) const;
+
+  /**
+   * Runs several key transformations at once. This produces the same result
+   * as calling Transform() for each job, but the jobs are interleaved through
+   * the AES pipeline which gives a much higher aggregate throughput than
+   * running them one by one.
+   * @param [in] jobs Key transformations to run.
+   * @return Transformed keys, in the same order as @a jobs.
+   */
+  static std::vector<std::array<uint8_t, 32>> TransformBatch(
+      const std::vector<TransformJob>& jobs);
+
+  /**
+   * Benchmarks the key transformation function on the current host and
+   * computes how many transformation rounds it can run within a given time.
+   * The benchmark itself runs for at most a fraction of a second.
+   * @param [in] target Desired time for a single key transformation.
+   * @return Number of transformation rounds, suitable for
+   *         Database::set_transform_rounds(). Always at least one.
+   */
+  static uint64_t CalibrateRounds(std::chrono::milliseconds target);
 };
 
 }
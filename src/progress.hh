@@ -0,0 +1,125 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "exception.hh"
+
+namespace keepass {
+
+/**
+ * @brief Flag used for requesting that a running operation is aborted.
+ *
+ * The token may be cancelled from any thread. The operation polls it at
+ * regular intervals and throws CancelledError when it has been cancelled.
+ */
+class CancellationToken final {
+ private:
+  std::atomic<bool> cancelled_;
+
+ public:
+  CancellationToken() : cancelled_(false) {}
+
+  CancellationToken(const CancellationToken&) = delete;
+  CancellationToken& operator=(const CancellationToken&) = delete;
+
+  void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+  bool IsCancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+  }
+};
+
+/**
+ * @brief Progress reporting and cancellation for import and export.
+ *
+ * A default constructed object neither reports progress nor supports
+ * cancellation.
+ */
+class Progress final {
+ public:
+  /**
+   * Stages of an import or export operation, in the order in which they are
+   * normally reported.
+   */
+  enum class Phase {
+    /** Key transformation, progress is measured in rounds for the AES key
+     * derivation and in quarter passes for Argon2. */
+    kTransformKey,
+    /** Content decryption, progress is measured in bytes. KDBX content is
+     * decrypted while it's parsed, so only the start is reported. */
+    kDecrypt,
+    /** Content parsing, progress is measured in encrypted bytes for KDBX and
+     * in records for KDB. */
+    kParse,
+    /** Content serialization, progress is measured in bytes for KDBX and in
+     * records for KDB. */
+    kSerialize,
+    /** Content encryption, progress is measured in bytes. Content is
+     * encrypted while it's serialized, so only the end is reported. */
+    kEncrypt
+  };
+
+  /**
+   * Progress callback. It's called from the thread running the operation,
+   * or for pipelined KDBX imports from the decryption thread. It's never
+   * called concurrently.
+   * @param [in] phase Current phase.
+   * @param [in] done Amount of work done in @a phase.
+   * @param [in] total Total amount of work in @a phase, or zero if unknown.
+   */
+  typedef std::function<void(Phase phase, uint64_t done, uint64_t total)>
+      Callback;
+
+ private:
+  Callback callback_;
+  std::shared_ptr<const CancellationToken> token_;
+
+ public:
+  Progress() = default;
+  explicit Progress(const Callback& callback) :
+      callback_(callback) {}
+  Progress(const Callback& callback,
+           std::shared_ptr<const CancellationToken> token) :
+      callback_(callback), token_(token) {}
+
+  /**
+   * Throws CancelledError if the operation has been cancelled.
+   */
+  void CheckCancelled() const {
+    if (token_ && token_->IsCancelled())
+      throw CancelledError();
+  }
+
+  /**
+   * Reports progress to the callback and checks for cancellation. The token
+   * is checked after the callback so that the callback itself may cancel the
+   * operation.
+   * @throws CancelledError If the operation has been cancelled.
+   */
+  void Report(Phase phase, uint64_t done, uint64_t total) const {
+    if (callback_)
+      callback_(phase, done, total);
+    CheckCancelled();
+  }
+};
+
+}   // namespace keepass
@@ -18,48 +18,102 @@
 
 #include "random.hh"
 
+#include <algorithm>
+#include <cassert>
+
 namespace keepass {
 
 RandomObfuscator::RandomObfuscator(const std::array<uint8_t, 32>& key,
                                    const std::array<uint8_t, 8>& init_vec) :
-    cipher_(key, init_vec) {
+    cipher_(new Salsa20Cipher(key, init_vec)) {
 }
 
-void RandomObfuscator::FillBuffer() {
-  static constexpr std::array<uint8_t, 64> kZeroBlock = { 0 };
+RandomObfuscator::RandomObfuscator(const std::array<uint8_t, 32>& key,
+                                   const std::array<uint8_t, 12>& init_vec) :
+    cipher_(new ChaCha20Cipher(key, init_vec)) {
+}
 
+void RandomObfuscator::FillBuffer() {
   assert(buffer_pos_ == buffer_.size());
-  cipher_.Process(kZeroBlock, buffer_);
+  std::fill(buffer_.begin(), buffer_.end(), 0);
+  cipher_->Process(buffer_.data(), buffer_.data(), buffer_.size());
   buffer_pos_ = 0;
 }
 
-std::vector<uint8_t> RandomObfuscator::Process(
-    const std::vector<uint8_t>& data) {
-  std::vector<uint8_t> obfuscated_data;
-  obfuscated_data.resize(data.size());
+void RandomObfuscator::Process(const uint8_t* src, uint8_t* dst,
+                               std::size_t size) {
+  offset_ += size;
+
+  // Generate the key stream block that a seek ended up in the middle of.
+  if (seek_skip_ > 0 && size > 0) {
+    FillBuffer();
+    buffer_pos_ = seek_skip_;
+    seek_skip_ = 0;
+  }
+
+  while (size > 0) {
+    if (buffer_pos_ == buffer_.size()) {
+      // Whole blocks are xorred by the cipher directly, only the key stream
+      // of a trailing partial block needs to be buffered.
+      std::size_t direct_size = size - size % 64;
+      if (direct_size > 0) {
+        cipher_->Process(src, dst, direct_size);
+        src += direct_size;
+        dst += direct_size;
+        size -= direct_size;
+        continue;
+      }
 
-  for (std::size_t i = 0; i < data.size(); ++i) {
-    if (buffer_pos_ == buffer_.size())
       FillBuffer();
+    }
 
-    obfuscated_data[i] = data[i] ^ buffer_[buffer_pos_++];
+    std::size_t count = std::min(size, buffer_.size() - buffer_pos_);
+    for (std::size_t i = 0; i < count; ++i)
+      dst[i] = src[i] ^ buffer_[buffer_pos_ + i];
+
+    buffer_pos_ += count;
+    src += count;
+    dst += count;
+    size -= count;
   }
+}
 
-  return obfuscated_data;
+void RandomObfuscator::Seek(uint64_t offset) {
+  cipher_->Seek(offset / 64);
+  buffer_pos_ = buffer_.size();
+  seek_skip_ = static_cast<std::size_t>(offset % 64);
+  offset_ = offset;
 }
 
-std::string RandomObfuscator::Process(const std::string& data) {
-  std::string obfuscated_data;
-  obfuscated_data.resize(data.size());
+void RandomObfuscator::Skip(std::size_t size) {
+  // Skipping within the buffered key stream doesn't need the cipher.
+  if (seek_skip_ == 0 && size <= buffer_.size() - buffer_pos_) {
+    buffer_pos_ += size;
+    offset_ += size;
+    return;
+  }
 
-  for (std::size_t i = 0; i < data.size(); ++i) {
-    if (buffer_pos_ == buffer_.size())
-      FillBuffer();
+  Seek(offset_ + size);
+}
 
-    obfuscated_data[i] = data[i] ^ buffer_[buffer_pos_++];
-  }
+std::vector<uint8_t> RandomObfuscator::Process(
+    const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> obfuscated_data(data.size());
+  Process(data.data(), obfuscated_data.data(), data.size());
+  return obfuscated_data;
+}
 
+std::string RandomObfuscator::Process(const std::string& data) {
+  std::string obfuscated_data(data.size(), '\0');
+  Process(reinterpret_cast<const uint8_t*>(data.data()),
+          reinterpret_cast<uint8_t*>(&obfuscated_data[0]), data.size());
   return obfuscated_data;
 }
 
+std::string LazyObfuscator::Process(uint64_t offset, const std::string& data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  obfuscator_.Seek(offset);
+  return obfuscator_.Process(data);
+}
+
 }   // namespace keepass
@@ -19,31 +19,85 @@
 #pragma once
 #include "cipher.hh"
 
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <string>
 #include <vector>
 
 namespace keepass {
 
 /**
  * Obfuscates binary data by xorring each byte with psuedo random data
- * generated by a Salsa20 stream cipher.
+ * generated by a Salsa20 or ChaCha20 stream cipher.
  */
 class RandomObfuscator {
  private:
-  Salsa20Cipher cipher_;
+  std::unique_ptr<StreamCipher> cipher_;
 
-  std::array<uint8_t, 64> buffer_;
-  std::size_t buffer_pos_ = 64;
+  /** Buffered key stream, eight cipher blocks to match the widest kernel. */
+  std::array<uint8_t, 512> buffer_;
+  std::size_t buffer_pos_ = 512;
+  /** Bytes to skip of the first key stream block after a seek. */
+  std::size_t seek_skip_ = 0;
+  /** Offset of the next key stream byte. */
+  uint64_t offset_ = 0;
 
   void FillBuffer();
 
  public:
   RandomObfuscator(const std::array<uint8_t, 32>& key,
                    const std::array<uint8_t, 8>& init_vec);
+  RandomObfuscator(const std::array<uint8_t, 32>& key,
+                   const std::array<uint8_t, 12>& init_vec);
 
+  /**
+   * Obfuscates @a size bytes from @a src into @a dst, which may be the same
+   * buffer. Data may be processed in pieces, the key stream continues where
+   * the previous call left off.
+   */
+  void Process(const uint8_t* src, uint8_t* dst, std::size_t size);
   std::vector<uint8_t> Process(const std::vector<uint8_t>& data);
   std::string Process(const std::string& data);
+
+  /** @return Offset of the next key stream byte to be used. */
+  uint64_t offset() const { return offset_; }
+  /**
+   * Positions the key stream at an arbitrary offset. No key stream is
+   * generated until data is processed.
+   * @param [in] offset Offset of the next key stream byte to use.
+   */
+  void Seek(uint64_t offset);
+  /**
+   * Skips key stream as if @a size bytes had been processed.
+   * @param [in] size Number of bytes to skip.
+   */
+  void Skip(std::size_t size);
+};
+
+/**
+ * @brief Random access deobfuscation of values at recorded key stream offsets.
+ *
+ * Used for keeping values obfuscated until they're first accessed. Safe to use
+ * from several threads.
+ */
+class LazyObfuscator final {
+ private:
+  std::mutex mutex_;
+  RandomObfuscator obfuscator_;
+
+ public:
+  explicit LazyObfuscator(RandomObfuscator&& obfuscator)
+    : obfuscator_(std::move(obfuscator)) {}
+
+  /**
+   * Processes data that was obfuscated starting at a given key stream offset.
+   * @param [in] offset Key stream offset of the first byte of @a data.
+   * @param [in] data Data to process.
+   * @return Processed data.
+   */
+  std::string Process(uint64_t offset, const std::string& data);
 };
 
 template <std::size_t N>
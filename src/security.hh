@@ -17,60 +17,114 @@
  */
 
 #pragma once
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 namespace keepass {
 
 /**
  * @brief Tempalte class which encrypts the content bytes in memory.
  *
+ * Values can also be lazy, in which case they are produced on first access.
+ * Lazy values are safe to access from several threads.
+ *
  * FIXME: Implement protection.
  */
 template <typename T>
 class protect {
  private:
+  /** Value that is produced on first access. Shared between copies. */
+  struct LazyValue {
+    std::once_flag loaded;
+    std::atomic<bool> is_loaded;
+    std::function<T()> load;
+    T value;
+  };
+
   T value_;
+  std::shared_ptr<LazyValue> lazy_;
   bool protected_ = false;
 
+  const T& get() const {
+    if (!lazy_)
+      return value_;
+
+    LazyValue& lazy = *lazy_;
+    std::call_once(lazy.loaded, [&lazy]() {
+      lazy.value = lazy.load();
+      lazy.load = nullptr;
+      lazy.is_loaded = true;
+    });
+    return lazy.value;
+  }
+
  public:
   protect() = default;
   protect(const T& val, bool prot) :
       value_(val), protected_(prot) {}
   protect(const protect<T>& other) {
     value_ = other.value_;
+    lazy_ = other.lazy_;
     protected_ = other.protected_;
   }
   protect(protect<T>&& other) {
     value_ = std::move(other.value_);
+    lazy_ = std::move(other.lazy_);
     protected_ = std::move(other.protected_);
   }
 
+  /**
+   * Creates a value that isn't produced until it's first accessed.
+   * @param [in] load Function producing the value. Called at most once, from
+   *                  the thread that first accesses the value.
+   * @param [in] prot true if the value is protected.
+   */
+  static protect<T> Lazy(std::function<T()> load, bool prot) {
+    protect<T> val;
+    val.lazy_ = std::make_shared<LazyValue>();
+    val.lazy_->is_loaded = false;
+    val.lazy_->load = std::move(load);
+    val.protected_ = prot;
+    return val;
+  }
+
   bool is_protected() const { return protected_; }
   void set_protected(bool prot) { protected_ = prot; }
 
-  const T& value() const { return value_; }
-  void set_value(const T& val) { value_ = val; }
+  /** @return false if the value is lazy and hasn't been accessed yet. */
+  bool is_loaded() const { return !lazy_ || lazy_->is_loaded; }
+
+  const T& value() const { return get(); }
+  void set_value(const T& val) {
+    value_ = val;
+    lazy_.reset();
+  }
 
   protect<T>& operator=(const protect<T>& other) {
     value_ = other.value_;
+    lazy_ = other.lazy_;
     protected_ = other.protected_;
     return *this;
   }
   protect<T>& operator=(protect<T>&& other) {
     value_ = std::move(other.value_);
+    lazy_ = std::move(other.lazy_);
     protected_ = std::move(other.protected_);
     return *this;
   }
   operator const T&() const {
-    return value_;
+    return get();
   }
   const T* operator->() const {
-    return &value_;
+    return &get();
   }
   const T& operator*() const {
-    return value_;
+    return get();
   }
   bool operator==(const protect<T>& other) const {
-    return value_ == other.value_ &&
+    return get() == other.get() &&
         protected_ == other.protected_;
   }
   bool operator!=(const protect<T>& other) const {
@@ -19,52 +19,304 @@
 #include "stream.hh"
 
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <thread>
 
+#include <unistd.h>
+
+#ifdef KEEPASS_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
 #include <openssl/sha.h>
 
 #include "exception.hh"
 #include "format.hh"
+#include "thread_pool.hh"
 
 namespace keepass {
 
-std::array<uint8_t, 32> hashed_basic_streambuf::GetBlockHash() const {
+std::streampos span_istreambuf::seekoff(std::streamoff off,
+                                        std::ios_base::seekdir way,
+                                        std::ios_base::openmode which) {
+  if (!(which & std::ios_base::in))
+    return std::streampos(std::streamoff(-1));
+
+  std::streamoff base = 0;
+  switch (way) {
+    case std::ios_base::beg:
+      base = 0;
+      break;
+    case std::ios_base::cur:
+      base = gptr() - eback();
+      break;
+    case std::ios_base::end:
+      base = egptr() - eback();
+      break;
+    default:
+      assert(false);
+      break;
+  }
+
+  return seekpos(base + off, which);
+}
+
+std::streampos span_istreambuf::seekpos(std::streampos sp,
+                                        std::ios_base::openmode which) {
+  if (!(which & std::ios_base::in) || sp < 0 ||
+      sp > static_cast<std::streampos>(egptr() - eback())) {
+    return std::streampos(std::streamoff(-1));
+  }
+
+  setg(eback(), eback() + static_cast<std::streamoff>(sp), egptr());
+  return sp;
+}
+
+std::streampos vector_ostreambuf::seekoff(std::streamoff off,
+                                          std::ios_base::seekdir way,
+                                          std::ios_base::openmode which) {
+  if (!(which & std::ios_base::out))
+    return std::streampos(std::streamoff(-1));
+
+  std::streamoff base = 0;
+  switch (way) {
+    case std::ios_base::beg:
+      base = 0;
+      break;
+    case std::ios_base::cur:
+      base = static_cast<std::streamoff>(pos_);
+      break;
+    case std::ios_base::end:
+      base = static_cast<std::streamoff>(dst_.size());
+      break;
+    default:
+      assert(false);
+      break;
+  }
+
+  return seekpos(base + off, which);
+}
+
+std::streampos vector_ostreambuf::seekpos(std::streampos sp,
+                                          std::ios_base::openmode which) {
+  if (!(which & std::ios_base::out) || sp < 0 ||
+      sp > static_cast<std::streampos>(dst_.size())) {
+    return std::streampos(std::streamoff(-1));
+  }
+
+  pos_ = static_cast<std::size_t>(static_cast<std::streamoff>(sp));
+  return sp;
+}
+
+int vector_ostreambuf::overflow(int c) {
+  if (c == std::char_traits<char>::eof())
+    return std::char_traits<char>::not_eof(c);
+
+  char ch = static_cast<char>(c);
+  xsputn(&ch, 1);
+  return c;
+}
+
+std::streamsize vector_ostreambuf::xsputn(const char* s, std::streamsize n) {
+  std::size_t size = static_cast<std::size_t>(n);
+
+  // Overwrite existing data first, then append the rest.
+  std::size_t overwrite = std::min(size, dst_.size() - pos_);
+  if (overwrite > 0)
+    std::memcpy(dst_.data() + pos_, s, overwrite);
+  dst_.insert(dst_.end(), reinterpret_cast<const uint8_t*>(s) + overwrite,
+              reinterpret_cast<const uint8_t*>(s) + size);
+
+  pos_ += size;
+  return n;
+}
+
+fd_ostreambuf::fd_ostreambuf(int fd, std::size_t buffer_size) :
+    fd_(fd), buffer_(buffer_size) {
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+fd_ostreambuf::~fd_ostreambuf() {
+  WriteBuffer();
+}
+
+bool fd_ostreambuf::Write(const char* data, std::size_t size) {
+  while (size > 0) {
+    ssize_t num_written = write(fd_, data, size);
+    if (num_written == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    data += num_written;
+    size -= static_cast<std::size_t>(num_written);
+  }
+
+  return true;
+}
+
+bool fd_ostreambuf::WriteBuffer() {
+  std::size_t size = static_cast<std::size_t>(pptr() - pbase());
+  if (size == 0)
+    return true;
+
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+  return Write(buffer_.data(), size);
+}
+
+std::streampos fd_ostreambuf::seekoff(std::streamoff off,
+                                      std::ios_base::seekdir way,
+                                      std::ios_base::openmode which) {
+  if (!(which & std::ios_base::out) || !WriteBuffer())
+    return std::streampos(std::streamoff(-1));
+
+  int whence = SEEK_SET;
+  switch (way) {
+    case std::ios_base::beg:
+      whence = SEEK_SET;
+      break;
+    case std::ios_base::cur:
+      whence = SEEK_CUR;
+      break;
+    case std::ios_base::end:
+      whence = SEEK_END;
+      break;
+    default:
+      assert(false);
+      break;
+  }
+
+  return std::streampos(std::streamoff(lseek(fd_, off, whence)));
+}
+
+std::streampos fd_ostreambuf::seekpos(std::streampos sp,
+                                      std::ios_base::openmode which) {
+  return seekoff(std::streamoff(sp), std::ios_base::beg, which);
+}
+
+int fd_ostreambuf::overflow(int c) {
+  if (!WriteBuffer())
+    return std::char_traits<char>::eof();
+
+  if (c != std::char_traits<char>::eof())
+    return sputc(static_cast<char>(c));
+
+  return std::char_traits<char>::not_eof(c);
+}
+
+std::streamsize fd_ostreambuf::xsputn(const char* s, std::streamsize n) {
+  std::size_t size = static_cast<std::size_t>(n);
+  if (size <= static_cast<std::size_t>(epptr() - pptr())) {
+    std::memcpy(pptr(), s, size);
+    pbump(static_cast<int>(size));
+    return n;
+  }
+
+  // Too large for the buffer, write the buffered data followed by the new data
+  // without copying it.
+  if (!WriteBuffer() || !Write(s, size))
+    return 0;
+
+  return n;
+}
+
+int fd_ostreambuf::sync() {
+  return WriteBuffer() ? 0 : -1;
+}
+
+std::array<uint8_t, 32> hashed_basic_streambuf::GetBlockHash(
+    const char* data, std::size_t size) {
   std::array<uint8_t, 32> block_hash;
 
   SHA256_CTX sha256;
   SHA256_Init(&sha256);
-  SHA256_Update(&sha256, block_.data(), block_.size());
+  SHA256_Update(&sha256, data, size);
   SHA256_Final(block_hash.data(), &sha256);
 
   return block_hash;
 }
 
-int hashed_istreambuf::underflow() {
+const std::size_t hashed_istreambuf::kMaxBatchBlocks;
+const std::size_t hashed_istreambuf::kMaxBatchSize;
+const std::size_t hashed_istreambuf::kMinParallelSize;
+
+bool hashed_istreambuf::ReadBlock() {
   static constexpr std::array<uint8_t, 32> kEmptyHash = { { 0 } };
 
-  if (gptr() == egptr()) {
-    BlockHeader header;
-    src_.read(reinterpret_cast<char*>(&header), sizeof(BlockHeader));
+  BlockHeader header;
+  src_.read(reinterpret_cast<char*>(&header), sizeof(BlockHeader));
+  if (!src_.good())
+    throw IoError("Read error.");
 
-    if (header.block_index != block_index_)
-      throw IoError("Block index mismatch.");
-    block_index_++;
+  if (header.block_index != block_index_)
+    throw IoError("Block index mismatch.");
+  block_index_++;
 
-    block_.clear();
-    std::generate_n(std::back_inserter(block_),
-                    header.block_size,
-                    [&]() { return src_.get(); });
+  if (header.block_size == 0) {
+    if (header.block_hash != kEmptyHash)
+      throw IoError("Corrupt EOS block.");
 
-    if (header.block_size == 0) {
-      if (header.block_hash != kEmptyHash)
-        throw IoError("Corrupt EOS block.");
+    done_ = true;
+    return false;
+  }
 
-      return std::char_traits<char>::eof();
+  BatchBlock block;
+  block.offset = block_.size();
+  block.size = header.block_size;
+  block.hash = header.block_hash;
+  batch_.push_back(block);
+
+  // Resizing keeps the capacity, so the buffer is only grown when a batch is
+  // larger than all previous ones.
+  block_.resize(block.offset + block.size);
+  src_.read(block_.data() + block.offset, block.size);
+  if (src_.gcount() != static_cast<std::streamsize>(block.size))
+    throw IoError("Read error.");
+
+  return true;
+}
+
+void hashed_istreambuf::VerifyBatch() const {
+  std::vector<std::array<uint8_t, 32>> hashes(batch_.size());
+  auto hash_blocks = [&](std::size_t first, std::size_t last) {
+    for (std::size_t i = first; i < last; ++i) {
+      hashes[i] = GetBlockHash(block_.data() + batch_[i].offset,
+                               batch_[i].size);
     }
+  };
+
+  ThreadPool& pool = shared_thread_pool();
+  std::size_t num_ranges = block_.size() < kMinParallelSize ? 1 :
+      std::min(pool.concurrency(), batch_.size());
+  std::size_t blocks_per_range =
+      (batch_.size() + num_ranges - 1) / num_ranges;
+
+  pool.ParallelFor(num_ranges, [&](std::size_t i) {
+    std::size_t first = std::min(i * blocks_per_range, batch_.size());
+    hash_blocks(first, std::min(first + blocks_per_range, batch_.size()));
+  });
 
-    // Verify the block integrity.
-    if (GetBlockHash() != header.block_hash)
+  for (std::size_t i = 0; i < batch_.size(); ++i) {
+    if (hashes[i] != batch_[i].hash)
       throw IoError("Block checksum error.");
+  }
+}
+
+int hashed_istreambuf::underflow() {
+  if (gptr() == egptr() && !done_) {
+    block_.clear();
+    batch_.clear();
+    while (batch_.size() < kMaxBatchBlocks && block_.size() < kMaxBatchSize &&
+           ReadBlock()) {
+    }
 
+    VerifyBatch();
     setg(block_.data(), block_.data(), block_.data() + block_.size());
   }
 
@@ -73,55 +325,308 @@ int hashed_istreambuf::underflow() {
       std::char_traits<char>::to_int_type(*gptr());
 }
 
-bool hashed_ostreambuf::FlushBlock() {
+std::streamsize hashed_istreambuf::xsgetn(char* s, std::streamsize n) {
+  std::streamsize num_read = 0;
+  while (num_read < n) {
+    if (gptr() == egptr() &&
+        underflow() == std::char_traits<char>::eof()) {
+      break;
+    }
+
+    std::streamsize num_copy = std::min<std::streamsize>(n - num_read,
+                                                         egptr() - gptr());
+    std::memcpy(s + num_read, gptr(), static_cast<std::size_t>(num_copy));
+    gbump(static_cast<int>(num_copy));
+    num_read += num_copy;
+  }
+
+  return num_read;
+}
+
+hashed_ostreambuf::hashed_ostreambuf(std::ostream& dst, uint32_t block_size)
+    : dst_(dst), block_size_(block_size) {
+  block_.resize(block_size_);
+  setp(block_.data(), block_.data() + block_.size());
+}
+
+bool hashed_ostreambuf::WriteBlock(const char* data, std::size_t size) {
   static constexpr std::array<uint8_t, 32> kEmptyHash = { { 0 } };
 
   // Write block header and data.
   BlockHeader header;
   header.block_index = block_index_++;
-  header.block_hash = block_.empty() ? kEmptyHash : GetBlockHash();
-  header.block_size = static_cast<uint32_t>(block_.size());
+  header.block_hash = size == 0 ? kEmptyHash : GetBlockHash(data, size);
+  header.block_size = static_cast<uint32_t>(size);
 
   dst_.write(reinterpret_cast<const char*>(&header), sizeof(BlockHeader));
-  dst_.write(block_.data(), block_.size());
-  if (!dst_.good())
-    return false;
+  dst_.write(data, size);
+  return dst_.good();
+}
 
-  block_.clear();
-  return true;
+bool hashed_ostreambuf::FlushBlock() {
+  std::size_t size = pptr() - pbase();
+  setp(block_.data(), block_.data() + block_.size());
+  return WriteBlock(block_.data(), size);
 }
 
 int hashed_ostreambuf::overflow(int c) {
-  if (c == std::char_traits<char>::eof())
-    return c;
+  if (done_ || !FlushBlock())
+    return std::char_traits<char>::eof();
 
-  if (c > 0xff) {
-    assert(false);
-    throw InternalError("Trying to write multiple bytes to stream.");
+  if (c != std::char_traits<char>::eof())
+    return sputc(static_cast<char>(c));
+
+  return std::char_traits<char>::not_eof(c);
+}
+
+std::streamsize hashed_ostreambuf::xsputn(const char* s, std::streamsize n) {
+  if (done_)
+    return 0;
+
+  std::streamsize num_written = 0;
+  while (num_written < n) {
+    std::size_t remaining = static_cast<std::size_t>(n - num_written);
+
+    // Whole blocks don't need to be copied into the put area.
+    if (pptr() == pbase() && remaining >= block_size_) {
+      if (!WriteBlock(s + num_written, block_size_))
+        break;
+
+      num_written += block_size_;
+      continue;
+    }
+
+    std::size_t num_copy = std::min<std::size_t>(remaining, epptr() - pptr());
+    std::memcpy(pptr(), s + num_written, num_copy);
+    pbump(static_cast<int>(num_copy));
+    num_written += num_copy;
+
+    if (pptr() == epptr() && !FlushBlock())
+      break;
   }
 
-  block_.push_back(static_cast<char>(c));
+  return num_written;
+}
+
+int hashed_ostreambuf::sync() {
+  if (done_)
+    return 0;
 
-  if (block_.size() == block_size_) {
+  done_ = true;
+  if (pptr() != pbase()) {
     if (!FlushBlock())
-      return std::char_traits<char>::eof();
+      return -1;
   }
 
-  return std::char_traits<char>::to_int_type(static_cast<char>(c));
+  // Write the trailing empty block, and prevent further writes from being
+  // buffered.
+  bool success = FlushBlock();
+  setp(nullptr, nullptr);
+  return success ? 0 : -1;
 }
 
-int hashed_ostreambuf::sync() {
-  if (!block_.empty()) {
+std::array<uint8_t, 64> hmac_block_key(const std::array<uint8_t, 64>& key,
+                                       uint64_t index) {
+  std::array<uint8_t, 64> block_key;
+
+  SHA512_CTX sha512;
+  SHA512_Init(&sha512);
+  SHA512_Update(&sha512, &index, sizeof(index));
+  SHA512_Update(&sha512, key.data(), key.size());
+  SHA512_Final(block_key.data(), &sha512);
+  OPENSSL_cleanse(&sha512, sizeof(sha512));
+
+  return block_key;
+}
+
+namespace {
+
+std::array<uint8_t, 32> get_hmac_block_hash(const std::array<uint8_t, 64>& key,
+                                            uint64_t index,
+                                            const char* data,
+                                            uint32_t size) {
+  std::array<uint8_t, 64> block_key = hmac_block_key(key, index);
+  std::array<uint8_t, 32> block_hash;
+
+  HMAC_CTX* hmac = HMAC_CTX_new();
+  if (hmac == nullptr)
+    throw InternalError("Unable to allocate HMAC context.");
+
+  unsigned int hash_size = 0;
+  bool success =
+      HMAC_Init_ex(hmac, block_key.data(), block_key.size(), EVP_sha256(),
+                   nullptr) == 1 &&
+      HMAC_Update(hmac, reinterpret_cast<const uint8_t*>(&index),
+                  sizeof(index)) == 1 &&
+      HMAC_Update(hmac, reinterpret_cast<const uint8_t*>(&size),
+                  sizeof(size)) == 1 &&
+      HMAC_Update(hmac, reinterpret_cast<const uint8_t*>(data), size) == 1 &&
+      HMAC_Final(hmac, block_hash.data(), &hash_size) == 1;
+  HMAC_CTX_free(hmac);
+  OPENSSL_cleanse(block_key.data(), block_key.size());
+
+  if (!success || hash_size != block_hash.size())
+    throw InternalError("Unable to compute HMAC.");
+
+  return block_hash;
+}
+
+}   // namespace
+
+hmac_block_istreambuf::~hmac_block_istreambuf() {
+  OPENSSL_cleanse(key_.data(), key_.size());
+}
+
+const char* hmac_block_istreambuf::Read(std::size_t size) {
+  if (span_ != nullptr) {
+    std::size_t read_bytes = 0;
+    const uint8_t* data = span_->Consume(size, read_bytes);
+    if (read_bytes != size)
+      throw IoError("Read error.");
+
+    return reinterpret_cast<const char*>(data);
+  }
+
+  // Resizing keeps the capacity, so the buffer is only grown for blocks
+  // larger than all previous ones.
+  block_.resize(size);
+  src_.read(block_.data(), size);
+  if (src_.gcount() != static_cast<std::streamsize>(size))
+    throw IoError("Read error.");
+
+  return block_.data();
+}
+
+int hmac_block_istreambuf::underflow() {
+  while (gptr() == egptr() && !done_) {
+    std::array<uint8_t, 32> block_hash;
+    int32_t block_size = 0;
+    std::memcpy(block_hash.data(), Read(block_hash.size()), block_hash.size());
+    std::memcpy(&block_size, Read(sizeof(block_size)), sizeof(block_size));
+    if (block_size < 0)
+      throw IoError("Corrupt block size.");
+
+    const char* data = Read(static_cast<std::size_t>(block_size));
+    if (get_hmac_block_hash(key_, block_index_++, data,
+                            static_cast<uint32_t>(block_size)) != block_hash) {
+      throw IoError("Block checksum error.");
+    }
+
+    progress_.done += block_hash.size() + sizeof(block_size) + block_size;
+    progress_.Report();
+
+    if (block_size == 0)
+      done_ = true;
+
+    char* begin = const_cast<char*>(data);
+    setg(begin, begin, begin + block_size);
+  }
+
+  return gptr() == egptr() ?
+      std::char_traits<char>::eof() :
+      std::char_traits<char>::to_int_type(*gptr());
+}
+
+hmac_block_ostreambuf::hmac_block_ostreambuf(std::ostream& dst,
+                                             const std::array<uint8_t, 64>& key,
+                                             uint32_t block_size)
+    : dst_(dst), key_(key), block_size_(block_size) {
+  if (block_size_ == 0 || block_size_ >
+      static_cast<uint32_t>(std::numeric_limits<int32_t>::max()))
+    throw InternalError("Invalid block size.");
+
+  block_.resize(block_size_);
+  setp(block_.data(), block_.data() + block_.size());
+}
+
+hmac_block_ostreambuf::~hmac_block_ostreambuf() {
+  OPENSSL_cleanse(key_.data(), key_.size());
+}
+
+bool hmac_block_ostreambuf::WriteBlock(const char* data, std::size_t size) {
+  uint32_t block_size = static_cast<uint32_t>(size);
+  std::array<uint8_t, 32> block_hash =
+      get_hmac_block_hash(key_, block_index_++, data, block_size);
+
+  dst_.write(reinterpret_cast<const char*>(block_hash.data()),
+             block_hash.size());
+  dst_.write(reinterpret_cast<const char*>(&block_size), sizeof(block_size));
+  dst_.write(data, size);
+  return dst_.good();
+}
+
+bool hmac_block_ostreambuf::FlushBlock() {
+  std::size_t size = pptr() - pbase();
+  setp(block_.data(), block_.data() + block_.size());
+  return WriteBlock(block_.data(), size);
+}
+
+int hmac_block_ostreambuf::overflow(int c) {
+  if (done_ || !FlushBlock())
+    return std::char_traits<char>::eof();
+
+  if (c != std::char_traits<char>::eof())
+    return sputc(static_cast<char>(c));
+
+  return std::char_traits<char>::not_eof(c);
+}
+
+std::streamsize hmac_block_ostreambuf::xsputn(const char* s,
+                                              std::streamsize n) {
+  if (done_)
+    return 0;
+
+  std::streamsize num_written = 0;
+  while (num_written < n) {
+    std::size_t remaining = static_cast<std::size_t>(n - num_written);
+
+    // Whole blocks don't need to be copied into the put area.
+    if (pptr() == pbase() && remaining >= block_size_) {
+      if (!WriteBlock(s + num_written, block_size_))
+        break;
+
+      num_written += block_size_;
+      continue;
+    }
+
+    std::size_t num_copy = std::min<std::size_t>(remaining, epptr() - pptr());
+    std::memcpy(pptr(), s + num_written, num_copy);
+    pbump(static_cast<int>(num_copy));
+    num_written += num_copy;
+
+    if (pptr() == epptr() && !FlushBlock())
+      break;
+  }
+
+  return num_written;
+}
+
+int hmac_block_ostreambuf::sync() {
+  if (done_)
+    return 0;
+
+  done_ = true;
+  if (pptr() != pbase()) {
     if (!FlushBlock())
       return -1;
   }
 
-  // Write the trailing empty block.
-  return FlushBlock() ? 0 : -1;
+  // Write the trailing empty block, and prevent further writes from being
+  // buffered.
+  bool success = FlushBlock();
+  setp(nullptr, nullptr);
+  if (!success)
+    return -1;
+
+  dst_.flush();
+  return dst_.good() ? 0 : -1;
 }
 
-gzip_istreambuf::gzip_istreambuf(std::istream& src) :
-    src_(src) {
+gzip_istreambuf::gzip_istreambuf(std::istream& src, std::size_t buffer_size) :
+    src_(src), input_(buffer_size), output_(buffer_size) {
+  if (buffer_size == 0)
+    throw InternalError("Invalid gzip buffer size.");
+
   z_stream_.zalloc = Z_NULL;
   z_stream_.zfree = Z_NULL;
   z_stream_.opaque = Z_NULL;
@@ -141,7 +646,10 @@ gzip_istreambuf::~gzip_istreambuf() {
 }
 
 int gzip_istreambuf::underflow() {
-  if (gptr() == egptr()) {
+  // Inflating may consume input without producing any output, like when
+  // reading the gzip header from a small input buffer, so keep feeding it.
+  int res = Z_OK;
+  while (gptr() == egptr() && res != Z_STREAM_END) {
     // Check if we need to feed the z-stream more input data.
     if (z_stream_.avail_in == 0) {
       if (!src_.good())
@@ -159,7 +667,7 @@ int gzip_istreambuf::underflow() {
     z_stream_.avail_out = output_.size();
     z_stream_.next_out = reinterpret_cast<uint8_t*>(output_.data());
 
-    int res = inflate(&z_stream_, Z_NO_FLUSH);
+    res = inflate(&z_stream_, Z_NO_FLUSH);
     assert(res != Z_STREAM_ERROR);
     if (res < 0) {
       throw IoError(Format() << "Gzip inflation error (" << res << ").");
@@ -174,8 +682,11 @@ int gzip_istreambuf::underflow() {
       std::char_traits<char>::to_int_type(*gptr());
 }
 
-gzip_ostreambuf::gzip_ostreambuf(std::ostream& dst) :
-    dst_(dst) {
+gzip_ostreambuf::gzip_ostreambuf(std::ostream& dst, int level,
+                                 std::size_t buffer_size) :
+    dst_(dst), buffer_(buffer_size), output_(buffer_size) {
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+
   z_stream_.zalloc = Z_NULL;
   z_stream_.zfree = Z_NULL;
   z_stream_.opaque = Z_NULL;
@@ -184,7 +695,7 @@ gzip_ostreambuf::gzip_ostreambuf(std::ostream& dst) :
   z_stream_.avail_out = 0;
   z_stream_.next_out = Z_NULL;
 
-  if (deflateInit2(&z_stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+  if (deflateInit2(&z_stream_, level, Z_DEFLATED,
                    16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
     assert(false);
     throw InternalError("Failed to initialize the gzip compressor.");
@@ -195,54 +706,759 @@ gzip_ostreambuf::~gzip_ostreambuf() {
   deflateEnd(&z_stream_);
 }
 
-bool gzip_ostreambuf::WriteOutput(bool flush) {
-  std::array<char, kBufferSize> out;
+bool gzip_ostreambuf::Deflate(const char* data, std::size_t size,
+                              bool flush) {
+  // Deflating nothing without finishing the stream is reported as an error.
+  if (size == 0 && !flush)
+    return true;
 
-  z_stream_.avail_in = buffer_.size();
-  z_stream_.next_in = reinterpret_cast<uint8_t*>(buffer_.data());
+  z_stream_.avail_in = static_cast<uInt>(size);
+  z_stream_.next_in = reinterpret_cast<uint8_t*>(const_cast<char*>(data));
 
   do {
-    z_stream_.avail_out = out.size();
-    z_stream_.next_out = reinterpret_cast<uint8_t*>(out.data());
+    z_stream_.avail_out = output_.size();
+    z_stream_.next_out = reinterpret_cast<uint8_t*>(output_.data());
 
     int res = deflate(&z_stream_, flush ? Z_FINISH : Z_NO_FLUSH);
     assert(res != Z_STREAM_ERROR);
     if (res < 0)
       return false;
 
-    std::size_t output_bytes = out.size() - z_stream_.avail_out;
-    dst_.write(out.data(), output_bytes);
+    std::size_t output_bytes = output_.size() - z_stream_.avail_out;
+    dst_.write(output_.data(), output_bytes);
     if (!dst_.good())
       return false;
   } while (z_stream_.avail_out == 0);
 
   assert(z_stream_.avail_in == 0);
-  buffer_.clear();
-
   return true;
 }
 
+bool gzip_ostreambuf::WriteOutput(bool flush) {
+  std::size_t size = pptr() - pbase();
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+  return Deflate(buffer_.data(), size, flush);
+}
+
 int gzip_ostreambuf::overflow(int c) {
-  if (c == std::char_traits<char>::eof())
-    return c;
+  if (!WriteOutput(false))
+    throw IoError("Gzip deflation error.");
 
-  if (c > 0xff) {
-    assert(false);
-    throw InternalError("Trying to write multiple bytes to stream.");
-  }
+  if (c != std::char_traits<char>::eof())
+    return sputc(static_cast<char>(c));
 
-  buffer_.push_back(static_cast<char>(c));
+  return std::char_traits<char>::not_eof(c);
+}
+
+std::streamsize gzip_ostreambuf::xsputn(const char* s, std::streamsize n) {
+  std::size_t size = static_cast<std::size_t>(n);
+  if (size <= static_cast<std::size_t>(epptr() - pptr())) {
+    std::memcpy(pptr(), s, size);
+    pbump(static_cast<int>(size));
+    return n;
+  }
 
-  if (buffer_.size() == kBufferSize) {
-    if (!WriteOutput(false))
+  // Too large for the put area, deflate the buffered data followed by the new
+  // data without copying it.
+  if (!WriteOutput(false))
+    throw IoError("Gzip deflation error.");
+  while (size > 0) {
+    // The size is limited to what fits in the z-stream's counter.
+    std::size_t chunk_size = std::min<std::size_t>(size, 1 << 30);
+    if (!Deflate(s, chunk_size, false))
       throw IoError("Gzip deflation error.");
+
+    s += chunk_size;
+    size -= chunk_size;
   }
 
-  return std::char_traits<char>::to_int_type(static_cast<char>(c));
+  return n;
 }
 
 int gzip_ostreambuf::sync() {
   return WriteOutput(true) ? 0 : -1;
 }
 
+namespace {
+
+/** Highest compression level of zlib and zlib-ng. */
+constexpr int kMaxZlibLevel = 9;
+
+/** Highest compression level of libdeflate. */
+constexpr int kMaxLibdeflateLevel = 12;
+
+/** Minimal gzip header without timestamp or file name. */
+constexpr std::array<char, 10> kGzipHeader = {
+  { 0x1f, static_cast<char>(0x8b), 0x08, 0, 0, 0, 0, 0, 0, 0x03 }
+};
+
+DeflateBackend resolve_deflate_backend() {
+  const char* env = std::getenv(kDeflateBackendEnv);
+  if (env != nullptr) {
+    std::string name = env;
+    if (name == "zlib" && deflate_backend_available(DeflateBackend::kZlib))
+      return DeflateBackend::kZlib;
+    if (name == "libdeflate" &&
+        deflate_backend_available(DeflateBackend::kLibdeflate)) {
+      return DeflateBackend::kLibdeflate;
+    }
+  }
+
+  return DeflateBackend::kZlib;
+}
+
+/** Independently deflated piece of the parallel gzip output. */
+struct GzipChunk {
+  const char* dict = nullptr;
+  std::size_t dict_size = 0;
+  const char* data = nullptr;
+  std::size_t size = 0;
+
+  std::vector<char> output;
+  uLong crc = 0;
+  bool ok = false;
+};
+
+/**
+ * Deflates @a chunk into a raw deflate stream. The stream is finished if
+ * @a last is true, otherwise it ends on a byte boundary with a sync flush.
+ */
+void deflate_chunk(GzipChunk& chunk, int level, bool last) {
+  chunk.crc = crc32(crc32(0L, Z_NULL, 0),
+                    reinterpret_cast<const Bytef*>(chunk.data),
+                    static_cast<uInt>(chunk.size));
+
+  z_stream z_stream;
+  z_stream.zalloc = Z_NULL;
+  z_stream.zfree = Z_NULL;
+  z_stream.opaque = Z_NULL;
+  if (deflateInit2(&z_stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return;
+  }
+
+  if (chunk.dict_size > 0 &&
+      deflateSetDictionary(&z_stream,
+                           reinterpret_cast<const Bytef*>(chunk.dict),
+                           static_cast<uInt>(chunk.dict_size)) != Z_OK) {
+    deflateEnd(&z_stream);
+    return;
+  }
+
+  z_stream.avail_in = static_cast<uInt>(chunk.size);
+  z_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(chunk.data));
+
+  // The bound covers finishing the stream, leave room for the sync flush.
+  chunk.output.resize(deflateBound(&z_stream, chunk.size) + 16);
+  std::size_t output_bytes = 0;
+
+  int res = Z_OK;
+  do {
+    if (output_bytes == chunk.output.size())
+      chunk.output.resize(2 * chunk.output.size());
+
+    z_stream.avail_out = static_cast<uInt>(chunk.output.size() - output_bytes);
+    z_stream.next_out =
+        reinterpret_cast<Bytef*>(chunk.output.data() + output_bytes);
+
+    res = deflate(&z_stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    assert(res != Z_STREAM_ERROR);
+    output_bytes = chunk.output.size() - z_stream.avail_out;
+  } while (res >= 0 &&
+           (last ? res != Z_STREAM_END : z_stream.avail_out == 0));
+
+  deflateEnd(&z_stream);
+
+  chunk.output.resize(output_bytes);
+  chunk.ok = res >= 0;
+}
+
+#ifdef KEEPASS_HAVE_LIBDEFLATE
+/**
+ * Makes the finished raw deflate stream in @a output continuable, as if it
+ * had ended with a sync flush. The final block flag is cleared and an empty
+ * stored block pads the stream to a byte boundary. The blocks are located by
+ * inflating the stream, like zlib's gzjoin example does.
+ */
+bool continue_deflate_stream(std::vector<char>& output) {
+  z_stream z_stream;
+  z_stream.zalloc = Z_NULL;
+  z_stream.zfree = Z_NULL;
+  z_stream.opaque = Z_NULL;
+  z_stream.avail_in = 0;
+  z_stream.next_in = Z_NULL;
+  if (inflateInit2(&z_stream, -MAX_WBITS) != Z_OK)
+    return false;
+
+  const Bytef* begin = reinterpret_cast<const Bytef*>(output.data());
+  z_stream.avail_in = static_cast<uInt>(output.size());
+  z_stream.next_in = const_cast<Bytef*>(begin);
+
+  // Positions are in bits, the first bit being the least significant one of
+  // the first byte.
+  std::vector<Bytef> scratch(32768);
+  uint64_t last_header = 0;
+  uint64_t end = 0;
+  int res = Z_OK;
+  while (res == Z_OK) {
+    z_stream.avail_out = static_cast<uInt>(scratch.size());
+    z_stream.next_out = scratch.data();
+
+    // Inflating stops at every block boundary. The flag telling that the
+    // final block was decoded is still set when stopping after it.
+    res = inflate(&z_stream, Z_BLOCK);
+    if (res == Z_OK && (z_stream.data_type & 128) != 0) {
+      uint64_t pos = 8 * static_cast<uint64_t>(z_stream.next_in - begin) -
+          (z_stream.data_type & 7);
+      if ((z_stream.data_type & 64) != 0)
+        end = pos;
+      else
+        last_header = pos;
+    }
+  }
+  inflateEnd(&z_stream);
+  if (res != Z_STREAM_END || end == 0)
+    return false;
+
+  output[last_header / 8] &= static_cast<char>(~(1 << (last_header % 8)));
+
+  // The empty stored block has a three bit header of zeros, followed by
+  // padding to the byte boundary and its length and inverted length.
+  output.resize((end + 7) / 8);
+  if (end % 8 != 0)
+    output.back() &= static_cast<char>((1 << (end % 8)) - 1);
+  output.resize((end + 3 + 7) / 8, 0);
+  const char kStoredLength[] = { 0, 0, static_cast<char>(0xff),
+                                 static_cast<char>(0xff) };
+  output.insert(output.end(), kStoredLength,
+                kStoredLength + sizeof(kStoredLength));
+  return true;
+}
+
+/**
+ * Deflates @a chunk into a raw deflate stream using libdeflate. libdeflate
+ * neither takes a dictionary nor flushes without finishing the stream, so the
+ * chunk is compressed on its own and then made continuable unless @a last is
+ * true.
+ */
+void libdeflate_chunk(GzipChunk& chunk, int level, bool last) {
+  chunk.crc = crc32(crc32(0L, Z_NULL, 0),
+                    reinterpret_cast<const Bytef*>(chunk.data),
+                    static_cast<uInt>(chunk.size));
+
+  libdeflate_compressor* compressor = libdeflate_alloc_compressor(level);
+  if (compressor == nullptr)
+    return;
+
+  chunk.output.resize(libdeflate_deflate_compress_bound(compressor,
+                                                        chunk.size));
+  std::size_t output_bytes = libdeflate_deflate_compress(
+      compressor, chunk.data, chunk.size, chunk.output.data(),
+      chunk.output.size());
+  libdeflate_free_compressor(compressor);
+  if (output_bytes == 0)
+    return;
+
+  chunk.output.resize(output_bytes);
+  chunk.ok = last || continue_deflate_stream(chunk.output);
+}
+#endif
+
+}   // namespace
+
+bool deflate_backend_available(DeflateBackend backend) {
+  switch (backend) {
+    case DeflateBackend::kZlib:
+      return true;
+#ifdef KEEPASS_HAVE_LIBDEFLATE
+    case DeflateBackend::kLibdeflate:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+DeflateBackend default_deflate_backend() {
+  static const DeflateBackend backend = resolve_deflate_backend();
+  return backend;
+}
+
+const std::size_t parallel_gzip_ostreambuf::kWindowSize;
+
+parallel_gzip_ostreambuf::parallel_gzip_ostreambuf(std::ostream& dst,
+                                                   const GzipOptions& options)
+    : dst_(dst), options_(options), crc_(crc32(0L, Z_NULL, 0)) {
+  if (options_.chunk_size == 0)
+    throw InternalError("Invalid gzip chunk size.");
+
+  std::size_t num_chunks = shared_thread_pool().concurrency();
+  buffer_.resize(kWindowSize + num_chunks * options_.chunk_size);
+  setp(buffer_.data() + kWindowSize, buffer_.data() + buffer_.size());
+}
+
+std::size_t parallel_gzip_ostreambuf::BufferedSize() const {
+  return pptr() - (buffer_.data() + kWindowSize);
+}
+
+bool parallel_gzip_ostreambuf::FlushChunks(bool last) {
+  const std::size_t chunk_size = options_.chunk_size;
+  const bool libdeflate = options_.backend == DeflateBackend::kLibdeflate;
+  const int level = std::min(options_.level,
+                             libdeflate ? kMaxLibdeflateLevel : kMaxZlibLevel);
+
+  const char* data = buffer_.data() + kWindowSize;
+  std::size_t size = BufferedSize();
+
+  // Split the put area into chunks, the last one may be empty.
+  std::vector<GzipChunk> chunks((size + chunk_size - 1) / chunk_size);
+  if (last && chunks.empty())
+    chunks.resize(1);
+
+  const char* dict_begin = data - dict_size_;
+  for (std::size_t i = 0; i < chunks.size(); ++i) {
+    GzipChunk& chunk = chunks[i];
+    chunk.data = data + i * chunk_size;
+    chunk.size = std::min(chunk_size, size - i * chunk_size);
+    chunk.dict = std::max(dict_begin, chunk.data - kWindowSize);
+    chunk.dict_size = chunk.data - chunk.dict;
+  }
+
+  shared_thread_pool().ParallelFor(chunks.size(), [&](std::size_t i) {
+    bool last_chunk = last && i + 1 == chunks.size();
+#ifdef KEEPASS_HAVE_LIBDEFLATE
+    if (libdeflate) {
+      libdeflate_chunk(chunks[i], level, last_chunk);
+      return;
+    }
+#endif
+    deflate_chunk(chunks[i], level, last_chunk);
+  });
+
+  if (!header_written_) {
+    dst_.write(kGzipHeader.data(), kGzipHeader.size());
+    header_written_ = true;
+  }
+
+  for (const GzipChunk& chunk : chunks) {
+    if (!chunk.ok)
+      return false;
+
+    dst_.write(chunk.output.data(), chunk.output.size());
+    crc_ = crc32_combine(crc_, chunk.crc, static_cast<z_off_t>(chunk.size));
+    size_ += chunk.size;
+  }
+
+  // Keep the end of the data as dictionary for the next chunks.
+  std::size_t new_dict_size = std::min(kWindowSize, dict_size_ + size);
+  char* dict = buffer_.data() + kWindowSize - new_dict_size;
+  std::memmove(dict, data + size - new_dict_size, new_dict_size);
+  dict_size_ = new_dict_size;
+  setp(buffer_.data() + kWindowSize, buffer_.data() + buffer_.size());
+
+  if (last) {
+    // The trailer holds the CRC-32 and the size modulo 2^32, little endian.
+    std::array<char, 8> trailer;
+    for (std::size_t i = 0; i < 4; ++i) {
+      trailer[i] = static_cast<char>((crc_ >> (8 * i)) & 0xff);
+      trailer[4 + i] = static_cast<char>((size_ >> (8 * i)) & 0xff);
+    }
+    dst_.write(trailer.data(), trailer.size());
+  }
+
+  return dst_.good();
+}
+
+int parallel_gzip_ostreambuf::overflow(int c) {
+  if (done_)
+    return std::char_traits<char>::eof();
+
+  if (!FlushChunks(false))
+    throw IoError("Gzip deflation error.");
+
+  if (c != std::char_traits<char>::eof())
+    return sputc(static_cast<char>(c));
+
+  return std::char_traits<char>::not_eof(c);
+}
+
+int parallel_gzip_ostreambuf::sync() {
+  if (done_)
+    return 0;
+
+  done_ = true;
+  if (!FlushChunks(true))
+    return -1;
+
+  // Prevent further writes from being buffered.
+  setp(nullptr, nullptr);
+  return 0;
+}
+
+cbc_istreambuf::~cbc_istreambuf() {
+  OPENSSL_cleanse(output_.data(), output_.size());
+}
+
+int cbc_istreambuf::underflow() {
+  if (gptr() == egptr()) {
+    if (done_ || !src_.good())
+      return std::char_traits<char>::eof();
+
+    if (output_.empty())
+      output_.resize(kBufferSize);
+
+    // Spans are decrypted in place, other sources are read into the input
+    // buffer first.
+    const uint8_t* input = nullptr;
+    std::size_t read_bytes = 0;
+    bool last = false;
+    if (span_ != nullptr) {
+      input = span_->Consume(kBufferSize, read_bytes);
+      last = span_->remaining() == 0;
+    } else {
+      if (input_.empty())
+        input_.resize(kBufferSize);
+
+      src_.read(reinterpret_cast<char*>(input_.data()), input_.size());
+      read_bytes = static_cast<std::size_t>(src_.gcount());
+      input = input_.data();
+
+      // Look ahead to find out if the buffer ends with the last block.
+      last = src_.peek() == std::char_traits<char>::eof();
+    }
+    progress_.done += read_bytes;
+    progress_.Report();
+
+    if (read_bytes % 16 != 0)
+      throw IoError("Decryption error.");
+
+    if (read_bytes == 0) {
+      done_ = true;
+      return std::char_traits<char>::eof();
+    }
+
+    uint8_t* output = reinterpret_cast<uint8_t*>(output_.data());
+    decrypt_cbc_blocks(input, output, read_bytes / 16, cipher_, iv_);
+
+    std::size_t output_bytes = read_bytes;
+    if (last) {
+      // Handle PKCS #7 padding for the last block.
+      uint32_t pad_len = output[read_bytes - 1];
+      if (pad_len == 0 || pad_len > 16)
+        throw IoError("Decryption error.");
+
+      for (std::size_t i = read_bytes - pad_len; i < read_bytes; ++i) {
+        if (output[i] != pad_len)
+          throw IoError("Decryption error.");
+      }
+
+      output_bytes -= pad_len;
+      done_ = true;
+    }
+
+    setg(output_.data(), output_.data(), output_.data() + output_bytes);
+  }
+
+  return gptr() == egptr() ?
+      std::char_traits<char>::eof() :
+      std::char_traits<char>::to_int_type(*gptr());
+}
+
+cbc_ostreambuf::cbc_ostreambuf(std::ostream& dst, const Cipher<16>& cipher)
+    : dst_(dst), cipher_(cipher), iv_(cipher.InitializationVector()),
+      buffer_(kBufferSize), output_(kBufferSize + 16) {
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+cbc_ostreambuf::~cbc_ostreambuf() {
+  OPENSSL_cleanse(buffer_.data(), buffer_.size());
+}
+
+bool cbc_ostreambuf::FlushBuffer(bool last) {
+  std::size_t size = pptr() - pbase();
+  std::size_t full_size = size - size % 16;
+  assert(last || full_size == size);
+
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(pbase());
+  cipher_.EncryptBlocksCbc(src, output_.data(), full_size / 16, iv_);
+
+  std::size_t output_bytes = full_size;
+  if (last) {
+    // Handle PKCS #7 padding, a full block of padding is added if the data
+    // ends on a block boundary.
+    uint8_t pad_len = static_cast<uint8_t>(16 - (size - full_size));
+
+    std::array<uint8_t, 16> src_block;
+    std::copy(src + full_size, src + size, src_block.begin());
+    std::fill(src_block.begin() + 16 - pad_len, src_block.end(), pad_len);
+
+    cipher_.EncryptBlocksCbc(src_block.data(), output_.data() + full_size, 1,
+                             iv_);
+    output_bytes += 16;
+  }
+
+  dst_.write(reinterpret_cast<const char*>(output_.data()), output_bytes);
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+  return dst_.good();
+}
+
+int cbc_ostreambuf::overflow(int c) {
+  if (done_)
+    return std::char_traits<char>::eof();
+
+  if (!FlushBuffer(false))
+    return std::char_traits<char>::eof();
+
+  if (c != std::char_traits<char>::eof())
+    return sputc(static_cast<char>(c));
+
+  return std::char_traits<char>::not_eof(c);
+}
+
+int cbc_ostreambuf::sync() {
+  if (done_)
+    return 0;
+
+  done_ = true;
+  if (!FlushBuffer(true))
+    return -1;
+
+  // Prevent further writes from being buffered.
+  setp(nullptr, nullptr);
+
+  dst_.flush();
+  return dst_.good() ? 0 : -1;
+}
+
+stream_cipher_istreambuf::~stream_cipher_istreambuf() {
+  OPENSSL_cleanse(buffer_.data(), buffer_.size());
+}
+
+int stream_cipher_istreambuf::underflow() {
+  if (gptr() == egptr()) {
+    if (!src_.good())
+      return std::char_traits<char>::eof();
+
+    if (buffer_.empty())
+      buffer_.resize(kBufferSize);
+
+    // Only the last read may end with a partial block, as required by the
+    // cipher. Spans are decrypted in place, other sources are read into the
+    // buffer first.
+    uint8_t* data = reinterpret_cast<uint8_t*>(buffer_.data());
+    std::size_t read_bytes = 0;
+    if (span_ != nullptr) {
+      const uint8_t* input = span_->Consume(buffer_.size(), read_bytes);
+      cipher_.Process(input, data, read_bytes);
+    } else {
+      src_.read(buffer_.data(), buffer_.size());
+      read_bytes = static_cast<std::size_t>(src_.gcount());
+      cipher_.Process(data, data, read_bytes);
+    }
+    progress_.done += read_bytes;
+    progress_.Report();
+
+    setg(buffer_.data(), buffer_.data(), buffer_.data() + read_bytes);
+  }
+
+  return gptr() == egptr() ?
+      std::char_traits<char>::eof() :
+      std::char_traits<char>::to_int_type(*gptr());
+}
+
+stream_cipher_ostreambuf::stream_cipher_ostreambuf(std::ostream& dst,
+                                                   StreamCipher& cipher)
+    : dst_(dst), cipher_(cipher), buffer_(kBufferSize) {
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+stream_cipher_ostreambuf::~stream_cipher_ostreambuf() {
+  OPENSSL_cleanse(buffer_.data(), buffer_.size());
+}
+
+bool stream_cipher_ostreambuf::FlushBuffer() {
+  std::size_t size = pptr() - pbase();
+
+  uint8_t* data = reinterpret_cast<uint8_t*>(pbase());
+  cipher_.Process(data, data, size);
+
+  dst_.write(pbase(), size);
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+  return dst_.good();
+}
+
+int stream_cipher_ostreambuf::overflow(int c) {
+  if (done_)
+    return std::char_traits<char>::eof();
+
+  if (!FlushBuffer())
+    return std::char_traits<char>::eof();
+
+  if (c != std::char_traits<char>::eof())
+    return sputc(static_cast<char>(c));
+
+  return std::char_traits<char>::not_eof(c);
+}
+
+int stream_cipher_ostreambuf::sync() {
+  if (done_)
+    return 0;
+
+  done_ = true;
+  if (!FlushBuffer())
+    return -1;
+
+  // Prevent further writes from being buffered.
+  setp(nullptr, nullptr);
+
+  dst_.flush();
+  return dst_.good() ? 0 : -1;
+}
+
+threaded_istreambuf::threaded_istreambuf(std::istream& src,
+                                         std::size_t block_size,
+                                         std::size_t num_blocks)
+    : src_(src), blocks_(num_blocks) {
+  for (Block& block : blocks_)
+    block.data.resize(block_size);
+
+  thread_ = std::thread(&threaded_istreambuf::Produce, this);
+}
+
+threaded_istreambuf::~threaded_istreambuf() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+
+  for (Block& block : blocks_)
+    OPENSSL_cleanse(block.data.data(), block.data.size());
+}
+
+void threaded_istreambuf::Produce() {
+  try {
+    bool eof = false;
+    while (!eof) {
+      std::size_t index = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]() {
+          return stop_ || num_full_ < blocks_.size();
+        });
+        if (stop_)
+          return;
+
+        index = (first_full_ + num_full_) % blocks_.size();
+      }
+
+      // The block isn't visible to the consumer until it's counted as full,
+      // so it's read without holding the lock. Reading the stream buffer
+      // directly lets its exceptions through.
+      Block& block = blocks_[index];
+      block.size = static_cast<std::size_t>(src_.rdbuf()->sgetn(
+          block.data.data(), block.data.size()));
+      eof = block.size < block.data.size();
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        num_full_++;
+        eof_ = eof;
+      }
+      cond_.notify_all();
+    }
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = std::current_exception();
+    }
+    cond_.notify_all();
+  }
+}
+
+int threaded_istreambuf::underflow() {
+  if (gptr() == egptr()) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // Hand the consumed block back to the producer.
+    if (holding_) {
+      first_full_ = (first_full_ + 1) % blocks_.size();
+      num_full_--;
+      holding_ = false;
+      cond_.notify_all();
+    }
+
+    cond_.wait(lock, [this]() {
+      return num_full_ > 0 || eof_ || error_;
+    });
+    if (num_full_ == 0) {
+      if (error_)
+        std::rethrow_exception(error_);
+      return std::char_traits<char>::eof();
+    }
+
+    Block& block = blocks_[first_full_];
+    holding_ = true;
+    setg(block.data.data(), block.data.data(),
+         block.data.data() + block.size);
+  }
+
+  return gptr() == egptr() ?
+      std::char_traits<char>::eof() :
+      std::char_traits<char>::to_int_type(*gptr());
+}
+
+int progress_istreambuf::underflow() {
+  if (gptr() == egptr()) {
+    progress_.Report(phase_, done_, total_);
+
+    if (!src_.good())
+      return std::char_traits<char>::eof();
+
+    src_.read(buffer_.data(), buffer_.size());
+
+    std::streamsize read_bytes = src_.gcount();
+    done_ += read_bytes;
+    setg(buffer_.data(), buffer_.data(), buffer_.data() + read_bytes);
+  }
+
+  return gptr() == egptr() ?
+      std::char_traits<char>::eof() :
+      std::char_traits<char>::to_int_type(*gptr());
+}
+
+bool progress_ostreambuf::FlushBuffer() {
+  std::ptrdiff_t size = pptr() - pbase();
+  if (size > 0) {
+    dst_.write(pbase(), size);
+    if (!dst_.good())
+      return false;
+
+    done_ += size;
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+
+  progress_.Report(phase_, done_, 0);
+  return true;
+}
+
+int progress_ostreambuf::overflow(int c) {
+  if (!FlushBuffer())
+    return std::char_traits<char>::eof();
+
+  if (c != std::char_traits<char>::eof())
+    return sputc(static_cast<char>(c));
+
+  return std::char_traits<char>::not_eof(c);
+}
+
+int progress_ostreambuf::sync() {
+  if (!FlushBuffer())
+    return -1;
+
+  dst_.flush();
+  return dst_.good() ? 0 : -1;
+}
+
 }   // namespace keepass
@@ -20,13 +20,19 @@
 #include <array>
 #include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <exception>
 #include <memory>
+#include <mutex>
 #include <istream>
 #include <ostream>
+#include <thread>
 #include <vector>
 
 #include <zlib.h>
 
+#include "cipher.hh"
+#include "progress.hh"
 #include "util.hh"
 
 namespace keepass {
@@ -93,6 +99,136 @@ class array_iostreambuf :
   }
 };
 
+/**
+ * @brief Read-only input stream buffer over a span of memory.
+ *
+ * The span is used as get area directly, so bulk reads are plain copies from
+ * it. Stream buffers reading from a span can also consume it in place,
+ * without copying. The span must outlive the stream buffer.
+ */
+class span_istreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ protected:
+  virtual std::streampos seekoff(std::streamoff off,
+                                 std::ios_base::seekdir way,
+                                 std::ios_base::openmode which) override;
+  virtual std::streampos seekpos(std::streampos sp,
+                                 std::ios_base::openmode which) override;
+
+ public:
+  span_istreambuf(const uint8_t* data, std::size_t size) {
+    char* begin = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+    setg(begin, begin, begin + size);
+  }
+
+  /**
+   * @return Span stream buffer of @a src, or nullptr if @a src reads from
+   *         another kind of stream buffer.
+   */
+  static span_istreambuf* From(std::istream& src) {
+    return dynamic_cast<span_istreambuf*>(src.rdbuf());
+  }
+
+  /** @return Number of bytes left to read. */
+  std::size_t remaining() const { return egptr() - gptr(); }
+
+  /**
+   * Consumes bytes from the span in place.
+   * @param [in] max_size Largest number of bytes to consume.
+   * @param [out] size Number of bytes consumed.
+   * @return Pointer to the consumed bytes within the span.
+   */
+  const uint8_t* Consume(std::size_t max_size, std::size_t& size) {
+    const char* data = gptr();
+    size = std::min(max_size, remaining());
+    setg(eback(), gptr() + size, egptr());
+    return reinterpret_cast<const uint8_t*>(data);
+  }
+};
+
+/**
+ * @brief Output stream buffer writing into a caller-owned vector.
+ *
+ * Writing starts at the end of the vector's current content. The buffer is
+ * seekable within the written data so that headers can be patched in place.
+ */
+class vector_ostreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  std::vector<uint8_t>& dst_;
+  std::size_t pos_;
+
+ protected:
+  virtual std::streampos seekoff(std::streamoff off,
+                                 std::ios_base::seekdir way,
+                                 std::ios_base::openmode which) override;
+  virtual std::streampos seekpos(std::streampos sp,
+                                 std::ios_base::openmode which) override;
+
+ public:
+  explicit vector_ostreambuf(std::vector<uint8_t>& dst)
+    : dst_(dst), pos_(dst.size()) {}
+
+  virtual int overflow(int c) override;
+  virtual std::streamsize xsputn(const char* s, std::streamsize n) override;
+};
+
+/**
+ * @brief Progress reporting of the bytes a stream buffer reads from its
+ * source. A default constructed object reports nothing.
+ */
+struct SourceProgress {
+  const Progress* progress = nullptr;
+  Progress::Phase phase = Progress::Phase::kParse;
+  uint64_t total = 0;
+  uint64_t done = 0;
+
+  SourceProgress() = default;
+  SourceProgress(const Progress& progress, Progress::Phase phase,
+                 uint64_t total)
+    : progress(&progress), phase(phase), total(total) {}
+
+  /** Reports the number of bytes read so far. */
+  void Report() const {
+    if (progress != nullptr)
+      progress->Report(phase, done, total);
+  }
+};
+
+/**
+ * @brief Buffered output stream buffer writing to a file descriptor.
+ *
+ * The descriptor is not owned and is left open. Seeking is supported when the
+ * descriptor is seekable.
+ */
+class fd_ostreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  static constexpr std::size_t kDefaultBufferSize = 64 * 1024;
+
+  const int fd_;
+  std::vector<char> buffer_;
+
+  bool Write(const char* data, std::size_t size);
+  bool WriteBuffer();
+
+ protected:
+  virtual std::streampos seekoff(std::streamoff off,
+                                 std::ios_base::seekdir way,
+                                 std::ios_base::openmode which) override;
+  virtual std::streampos seekpos(std::streampos sp,
+                                 std::ios_base::openmode which) override;
+
+ public:
+  explicit fd_ostreambuf(int fd) : fd_ostreambuf(fd, kDefaultBufferSize) {}
+  fd_ostreambuf(int fd, std::size_t buffer_size);
+  virtual ~fd_ostreambuf();
+
+  virtual int overflow(int c) override;
+  virtual std::streamsize xsputn(const char* s, std::streamsize n) override;
+  virtual int sync() override;
+};
+
 class hashed_basic_streambuf {
  protected:
   struct BlockHeader {
@@ -104,25 +240,64 @@ class hashed_basic_streambuf {
   uint32_t block_index_ = 0;
   std::vector<char> block_;
 
-  std::array<uint8_t, 32> GetBlockHash() const;
+  static std::array<uint8_t, 32> GetBlockHash(const char* data,
+                                              std::size_t size);
 
  public:
   virtual ~hashed_basic_streambuf() = default;
 };
 
+/**
+ * @brief Input stream buffer reading and verifying hashed blocks.
+ *
+ * Several blocks are read ahead into a buffer that is reused between
+ * batches. The blocks of a batch are hashed in parallel on separate threads
+ * and served once all of them have been verified. Bulk reads are served from
+ * the buffer without going through underflow() for every byte.
+ */
 class hashed_istreambuf final :
     private hashed_basic_streambuf,
     public std::basic_streambuf<char, std::char_traits<char>> {
  private:
+  /** Limits on the number of blocks and bytes read ahead in a batch. */
+  static const std::size_t kMaxBatchBlocks = 64;
+  static const std::size_t kMaxBatchSize = 8 * 1024 * 1024;
+  /** Batches smaller than this are verified on the calling thread. */
+  static const std::size_t kMinParallelSize = 256 * 1024;
+
+  /** Location and expected hash of a block read into the buffer. */
+  struct BatchBlock {
+    std::size_t offset;
+    std::size_t size;
+    std::array<uint8_t, 32> hash;
+  };
+
   std::istream& src_;
+  bool done_ = false;
+  std::vector<BatchBlock> batch_;
+
+  /**
+   * Reads the next block and appends its data to the buffer.
+   * @return false if the end of stream block was read and true otherwise.
+   */
+  bool ReadBlock();
+  /** Verifies the integrity of all blocks in the current batch. */
+  void VerifyBatch() const;
 
 public:
   hashed_istreambuf(std::istream& src)
     : src_(src) {}
 
   virtual int underflow() override;
+  virtual std::streamsize xsgetn(char* s, std::streamsize n) override;
 };
 
+/**
+ * @brief Output stream buffer writing hashed blocks.
+ *
+ * Data is buffered in the put area until a block is full. Bulk writes of
+ * whole blocks are hashed and written directly from the caller's buffer.
+ */
 class hashed_ostreambuf final :
     private hashed_basic_streambuf,
     public std::basic_streambuf<char, std::char_traits<char>> {
@@ -131,55 +306,492 @@ class hashed_ostreambuf final :
 
   std::ostream& dst_;
   const uint32_t block_size_;
+  bool done_ = false;
 
+  bool WriteBlock(const char* data, std::size_t size);
   bool FlushBlock();
 
 public:
   hashed_ostreambuf(std::ostream& dst)
-    : dst_(dst), block_size_(kDefaultBlockSize) {}
-  hashed_ostreambuf(std::ostream& dst, uint32_t block_size)
-    : dst_(dst), block_size_(block_size) {}
+    : hashed_ostreambuf(dst, kDefaultBlockSize) {}
+  hashed_ostreambuf(std::ostream& dst, uint32_t block_size);
 
   virtual int overflow(int c) override;
+  virtual std::streamsize xsputn(const char* s, std::streamsize n) override;
+  virtual int sync() override;
+};
+
+/**
+ * Derives the key of a block in a KDBX 4 HMAC block stream.
+ * @param [in] key HMAC key of the stream.
+ * @param [in] index Index of the block. The header of the database is
+ *                   authenticated with the largest possible index.
+ * @return HMAC-SHA-256 key of the block.
+ */
+std::array<uint8_t, 64> hmac_block_key(const std::array<uint8_t, 64>& key,
+                                       uint64_t index);
+
+/**
+ * @brief Input stream buffer reading and verifying KDBX 4 HMAC blocks.
+ *
+ * Every block, including the empty one ending the stream, is authenticated
+ * with a key derived from its index, so blocks can't be reordered, removed or
+ * truncated without being noticed. Blocks in a span source are verified and
+ * served in place.
+ */
+class hmac_block_istreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  std::istream& src_;
+  /** Set if the source is a span, which is then read in place. */
+  span_istreambuf* const span_;
+  std::array<uint8_t, 64> key_;
+  uint64_t block_index_ = 0;
+  bool done_ = false;
+
+  SourceProgress progress_;
+
+  std::vector<char> block_;
+
+  /** Reads @a size bytes from the source, in place if it's a span. */
+  const char* Read(std::size_t size);
+
+public:
+  hmac_block_istreambuf(std::istream& src, const std::array<uint8_t, 64>& key)
+    : hmac_block_istreambuf(src, key, SourceProgress()) {}
+  /**
+   * @param [in] key HMAC key of the stream.
+   * @param [in] progress Reporting of the number of bytes read.
+   */
+  hmac_block_istreambuf(std::istream& src, const std::array<uint8_t, 64>& key,
+                        const SourceProgress& progress)
+    : src_(src), span_(span_istreambuf::From(src)), key_(key),
+      progress_(progress) {}
+  ~hmac_block_istreambuf();
+
+  virtual int underflow() override;
+};
+
+/**
+ * @brief Output stream buffer writing KDBX 4 HMAC blocks.
+ *
+ * Syncing the buffer writes the last block and the empty block ending the
+ * stream, nothing may be written after that.
+ */
+class hmac_block_ostreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  static constexpr uint32_t kDefaultBlockSize = 1024 * 1024;
+
+  std::ostream& dst_;
+  std::array<uint8_t, 64> key_;
+  const uint32_t block_size_;
+  uint64_t block_index_ = 0;
+  bool done_ = false;
+
+  std::vector<char> block_;
+
+  bool WriteBlock(const char* data, std::size_t size);
+  bool FlushBlock();
+
+public:
+  hmac_block_ostreambuf(std::ostream& dst, const std::array<uint8_t, 64>& key)
+    : hmac_block_ostreambuf(dst, key, kDefaultBlockSize) {}
+  hmac_block_ostreambuf(std::ostream& dst, const std::array<uint8_t, 64>& key,
+                        uint32_t block_size);
+  ~hmac_block_ostreambuf();
+
+  virtual int overflow(int c) override;
+  virtual std::streamsize xsputn(const char* s, std::streamsize n) override;
   virtual int sync() override;
 };
 
 class gzip_istreambuf final :
     public std::basic_streambuf<char, std::char_traits<char>> {
  private:
-  static const std::size_t kBufferSize = 16384;
+  static const std::size_t kDefaultBufferSize = 16384;
 
   std::istream& src_;
   z_stream z_stream_;
 
   /** Input buffer for feeding the decompressor. */
-  std::array<char, kBufferSize> input_ = { { 0 } };
+  std::vector<char> input_;
   /** Output buffer for the decompressor to write to. */
-  std::array<char, kBufferSize> output_ = { { 0 } };
+  std::vector<char> output_;
 
 public:
-  gzip_istreambuf(std::istream& src);
+  gzip_istreambuf(std::istream& src)
+    : gzip_istreambuf(src, kDefaultBufferSize) {}
+  /**
+   * @param [in] buffer_size Size of the input and output buffers in bytes.
+   * @throws InternalError If @a buffer_size is zero.
+   */
+  gzip_istreambuf(std::istream& src, std::size_t buffer_size);
   ~gzip_istreambuf();
 
   virtual int underflow() override;
 };
 
+/**
+ * @brief Output stream buffer gzip compressing data as it's written.
+ *
+ * Small writes are gathered in the put area, bulk writes are passed to the
+ * compressor directly from the caller's buffer.
+ */
 class gzip_ostreambuf final :
     public std::basic_streambuf<char, std::char_traits<char>> {
  private:
-  static const std::size_t kBufferSize = 16384;
+  static const std::size_t kDefaultBufferSize = 16384;
 
   std::ostream& dst_;
   z_stream z_stream_;
 
+  /** Input buffer backing the put area. */
   std::vector<char> buffer_;
+  /** Output buffer for the compressor to write to. */
+  std::vector<char> output_;
 
+  bool Deflate(const char* data, std::size_t size, bool flush);
   bool WriteOutput(bool flush);
 
 public:
-  gzip_ostreambuf(std::ostream& dst);
+  gzip_ostreambuf(std::ostream& dst)
+    : gzip_ostreambuf(dst, Z_DEFAULT_COMPRESSION, kDefaultBufferSize) {}
+  /**
+   * @param [in] level zlib compression level.
+   * @param [in] buffer_size Size of the input and output buffers in bytes.
+   */
+  gzip_ostreambuf(std::ostream& dst, int level, std::size_t buffer_size);
   ~gzip_ostreambuf();
 
+  virtual int overflow(int c) override;
+  virtual std::streamsize xsputn(const char* s, std::streamsize n) override;
+  virtual int sync() override;
+};
+
+/** Deflate implementations that gzip data can be compressed with. */
+enum class DeflateBackend {
+  /**
+   * The zlib the library is linked with. zlib-ng is supported by linking its
+   * zlib compatible build in place of zlib, it's not a separate backend.
+   */
+  kZlib,
+  /**
+   * libdeflate, when built with LIBDEFLATE=YES. It doesn't support preset
+   * dictionaries, so chunks are compressed without the data preceding them
+   * and compress slightly worse. It's therefore never the default, but has to
+   * be selected through kDeflateBackendEnv or GzipOptions.
+   */
+  kLibdeflate
+};
+
+/**
+ * Environment variable overriding the default deflate backend with one of
+ * "zlib" or "libdeflate". Unavailable backends are ignored.
+ */
+constexpr const char* kDeflateBackendEnv = "KEEPASS_DEFLATE_BACKEND";
+
+/**
+ * Checks if the library was built with a deflate backend.
+ * @param [in] backend Backend to check.
+ * @return true if @a backend is available and false otherwise.
+ */
+bool deflate_backend_available(DeflateBackend backend);
+
+/**
+ * Gets the deflate backend to use unless told otherwise. It's resolved once,
+ * on first use, from kDeflateBackendEnv or else as the zlib implementation
+ * linked with.
+ * @return Default deflate backend.
+ */
+DeflateBackend default_deflate_backend();
+
+/** Settings for parallel_gzip_ostreambuf. */
+struct GzipOptions {
+  DeflateBackend backend;
+  /**
+   * Compression level from 1 to 9, or up to 12 with libdeflate. Levels above
+   * what the backend supports are clamped.
+   */
+  int level = 6;
+  /** Size of the chunks compressed in parallel, in bytes. */
+  std::size_t chunk_size = 128 * 1024;
+
+  GzipOptions() : backend(default_deflate_backend()) {}
+};
+
+/**
+ * @brief Output stream buffer gzip compressing data on several threads.
+ *
+ * Works like pigz. The data is split into chunks that are deflated
+ * independently, each using the 32 KiB of data preceding it as dictionary.
+ * All but the last chunk end like after a sync flush so that the compressed
+ * chunks can be concatenated into a single gzip member. Syncing the buffer
+ * finishes the member, nothing may be written after that.
+ */
+class parallel_gzip_ostreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  /** Size of the deflate window, and thereby the largest dictionary. */
+  static const std::size_t kWindowSize = 32768;
+
+  std::ostream& dst_;
+  const GzipOptions options_;
+  bool header_written_ = false;
+  bool done_ = false;
+
+  /** CRC-32 and size of all data compressed so far. */
+  uLong crc_;
+  uint64_t size_ = 0;
+
+  /**
+   * Dictionary followed by the put area. The put area holds one chunk per
+   * thread, and the dictionary the last data of the previous chunks.
+   */
+  std::vector<char> buffer_;
+  std::size_t dict_size_ = 0;
+
+  /** Data buffered after the dictionary. */
+  std::size_t BufferedSize() const;
+
+  bool FlushChunks(bool last);
+
+public:
+  parallel_gzip_ostreambuf(std::ostream& dst)
+    : parallel_gzip_ostreambuf(dst, GzipOptions()) {}
+  parallel_gzip_ostreambuf(std::ostream& dst, const GzipOptions& options);
+
+  virtual int overflow(int c) override;
+  virtual int sync() override;
+};
+
+/**
+ * @brief Input stream buffer decrypting CBC encrypted data as it's read.
+ *
+ * The source is read one buffer at a time. Looking one byte past each buffer
+ * tells whether it ends with the last block, from which the PKCS #7 padding
+ * is removed.
+ */
+class cbc_istreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  /** Large enough for decrypting a buffer on several threads. */
+  static const std::size_t kBufferSize = 1024 * 1024;
+
+  std::istream& src_;
+  /** Set if the source is a span, which is then decrypted in place. */
+  span_istreambuf* const span_;
+  const Cipher<16>& cipher_;
+  std::array<uint8_t, 16> iv_;
+  bool done_ = false;
+
+  SourceProgress progress_;
+
+  std::vector<uint8_t> input_;
+  std::vector<char> output_;
+
+public:
+  cbc_istreambuf(std::istream& src, const Cipher<16>& cipher)
+    : cbc_istreambuf(src, cipher, SourceProgress()) {}
+  /**
+   * @param [in] progress Reporting of the number of encrypted bytes read.
+   */
+  cbc_istreambuf(std::istream& src, const Cipher<16>& cipher,
+                 const SourceProgress& progress)
+    : src_(src), span_(span_istreambuf::From(src)), cipher_(cipher),
+      iv_(cipher.InitializationVector()), progress_(progress) {}
+  ~cbc_istreambuf();
+
+  virtual int underflow() override;
+};
+
+/**
+ * @brief Output stream buffer CBC encrypting data as it's written.
+ *
+ * Syncing the buffer pads and encrypts the last block, nothing may be written
+ * after that.
+ */
+class cbc_ostreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  static const std::size_t kBufferSize = 65536;
+
+  std::ostream& dst_;
+  const Cipher<16>& cipher_;
+  std::array<uint8_t, 16> iv_;
+  bool done_ = false;
+
+  std::vector<char> buffer_;
+  std::vector<uint8_t> output_;
+
+  bool FlushBuffer(bool last);
+
+public:
+  cbc_ostreambuf(std::ostream& dst, const Cipher<16>& cipher);
+  ~cbc_ostreambuf();
+
+  virtual int overflow(int c) override;
+  virtual int sync() override;
+};
+
+/**
+ * @brief Input stream buffer decrypting stream cipher encrypted data as it's
+ * read.
+ */
+class stream_cipher_istreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  static const std::size_t kBufferSize = 65536;
+
+  std::istream& src_;
+  /** Set if the source is a span, which is then decrypted in place. */
+  span_istreambuf* const span_;
+  StreamCipher& cipher_;
+
+  SourceProgress progress_;
+
+  std::vector<char> buffer_;
+
+public:
+  stream_cipher_istreambuf(std::istream& src, StreamCipher& cipher)
+    : stream_cipher_istreambuf(src, cipher, SourceProgress()) {}
+  /**
+   * @param [in] progress Reporting of the number of encrypted bytes read.
+   */
+  stream_cipher_istreambuf(std::istream& src, StreamCipher& cipher,
+                           const SourceProgress& progress)
+    : src_(src), span_(span_istreambuf::From(src)), cipher_(cipher),
+      progress_(progress) {}
+  ~stream_cipher_istreambuf();
+
+  virtual int underflow() override;
+};
+
+/**
+ * @brief Output stream buffer encrypting data with a stream cipher as it's
+ * written.
+ *
+ * Syncing the buffer encrypts the last partial block, nothing may be written
+ * after that.
+ */
+class stream_cipher_ostreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  static const std::size_t kBufferSize = 65536;
+
+  std::ostream& dst_;
+  StreamCipher& cipher_;
+  bool done_ = false;
+
+  std::vector<char> buffer_;
+
+  bool FlushBuffer();
+
+public:
+  stream_cipher_ostreambuf(std::ostream& dst, StreamCipher& cipher);
+  ~stream_cipher_ostreambuf();
+
+  virtual int overflow(int c) override;
+  virtual int sync() override;
+};
+
+/**
+ * @brief Input stream buffer reading its source ahead on a separate thread.
+ *
+ * The source is read into a bounded ring of blocks by a producer thread, so
+ * that the work done by the source's stream buffers overlaps with the work of
+ * the consumer. Chaining several of these buffers runs each stage of a stream
+ * pipeline on its own thread. Exceptions thrown by the source are rethrown to
+ * the consumer once the blocks read before them have been consumed.
+ */
+class threaded_istreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  static const std::size_t kDefaultBlockSize = 64 * 1024;
+  static const std::size_t kDefaultNumBlocks = 4;
+
+  struct Block {
+    std::vector<char> data;
+    std::size_t size = 0;
+  };
+
+  std::istream& src_;
+  std::vector<Block> blocks_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  /** Index of the oldest block not yet released by the consumer. */
+  std::size_t first_full_ = 0;
+  /** Number of blocks read, including the one held by the consumer. */
+  std::size_t num_full_ = 0;
+  bool holding_ = false;
+  bool eof_ = false;
+  bool stop_ = false;
+  std::exception_ptr error_;
+
+  std::thread thread_;
+
+  void Produce();
+
+public:
+  threaded_istreambuf(std::istream& src)
+    : threaded_istreambuf(src, kDefaultBlockSize, kDefaultNumBlocks) {}
+  threaded_istreambuf(std::istream& src, std::size_t block_size,
+                      std::size_t num_blocks);
+  ~threaded_istreambuf();
+
+  virtual int underflow() override;
+};
+
+/**
+ * @brief Pass-through input stream buffer reporting the number of bytes read.
+ */
+class progress_istreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  static const std::size_t kBufferSize = 65536;
+
+  std::istream& src_;
+  const Progress& progress_;
+  const Progress::Phase phase_;
+  const uint64_t total_;
+  uint64_t done_ = 0;
+
+  std::array<char, kBufferSize> buffer_ = { { 0 } };
+
+ public:
+  progress_istreambuf(std::istream& src, const Progress& progress,
+                      Progress::Phase phase, uint64_t total)
+    : src_(src), progress_(progress), phase_(phase), total_(total) {}
+
+  virtual int underflow() override;
+};
+
+/**
+ * @brief Pass-through output stream buffer reporting the number of bytes
+ * written.
+ */
+class progress_ostreambuf final :
+    public std::basic_streambuf<char, std::char_traits<char>> {
+ private:
+  static const std::size_t kBufferSize = 65536;
+
+  std::ostream& dst_;
+  const Progress& progress_;
+  const Progress::Phase phase_;
+  uint64_t done_ = 0;
+
+  std::array<char, kBufferSize> buffer_ = { { 0 } };
+
+  bool FlushBuffer();
+
+ public:
+  progress_ostreambuf(std::ostream& dst, const Progress& progress,
+                      Progress::Phase phase)
+    : dst_(dst), progress_(progress), phase_(phase) {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+
   virtual int overflow(int c) override;
   virtual int sync() override;
 };
@@ -0,0 +1,133 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "thread_pool.hh"
+
+#include <algorithm>
+#include <system_error>
+
+namespace keepass {
+
+ThreadPool::ThreadPool(std::size_t num_workers) {
+  threads_.reserve(num_workers);
+  for (std::size_t i = 0; i < num_workers; ++i) {
+    try {
+      threads_.emplace_back(&ThreadPool::Work, this);
+    } catch (const std::system_error&) {
+      break;
+    }
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  Stop();
+}
+
+void ThreadPool::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+
+  for (std::thread& thread : threads_)
+    thread.join();
+  threads_.clear();
+}
+
+void ThreadPool::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    work_cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+    if (stop_)
+      return;
+
+    std::shared_ptr<Job> job = jobs_.front();
+    RunTasks(*job, lock);
+  }
+}
+
+void ThreadPool::RunTasks(Job& job, std::unique_lock<std::mutex>& lock) {
+  while (job.next_task < job.num_tasks) {
+    std::size_t task = job.next_task++;
+    if (job.next_task == job.num_tasks) {
+      // All tasks are started, so there's nothing left for the workers.
+      auto it = std::find_if(jobs_.begin(), jobs_.end(),
+                             [&job](const std::shared_ptr<Job>& queued) {
+                               return queued.get() == &job;
+                             });
+      if (it != jobs_.end())
+        jobs_.erase(it);
+    }
+
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+      (*job.fn)(task);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+
+    if (error && !job.error)
+      job.error = error;
+    if (++job.done_tasks == job.num_tasks)
+      done_cv_.notify_all();
+  }
+}
+
+void ThreadPool::ParallelFor(std::size_t num_tasks,
+                             const std::function<void(std::size_t)>& fn) {
+  if (num_tasks == 0)
+    return;
+
+  if (num_tasks == 1 || threads_.empty()) {
+    for (std::size_t i = 0; i < num_tasks; ++i)
+      fn(i);
+    return;
+  }
+
+  std::shared_ptr<Job> job = std::make_shared<Job>();
+  job->fn = &fn;
+  job->num_tasks = num_tasks;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  jobs_.push_back(job);
+  if (num_tasks - 1 < threads_.size()) {
+    for (std::size_t i = 1; i < num_tasks; ++i)
+      work_cv_.notify_one();
+  } else {
+    work_cv_.notify_all();
+  }
+
+  // Tasks of this job may still be queued behind other jobs, so run them here
+  // rather than waiting for the workers to get to them.
+  RunTasks(*job, lock);
+  done_cv_.wait(lock, [&job] { return job->done_tasks == job->num_tasks; });
+
+  if (job->error)
+    std::rethrow_exception(job->error);
+}
+
+ThreadPool& shared_thread_pool() {
+  static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 1U) -
+                         1);
+  return pool;
+}
+
+}   // namespace keepass
@@ -0,0 +1,94 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace keepass {
+
+/**
+ * @brief Fixed set of worker threads running parallel loops.
+ *
+ * The calling thread takes part in running the tasks of its own loop, so a
+ * loop always completes, also when all workers are busy or the pool has no
+ * workers at all. This makes it safe to run loops from within tasks.
+ */
+class ThreadPool final {
+ private:
+  struct Job {
+    const std::function<void(std::size_t)>* fn;
+    std::size_t num_tasks;
+    std::size_t next_task = 0;
+    std::size_t done_tasks = 0;
+    std::exception_ptr error;
+  };
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::deque<std::shared_ptr<Job>> jobs_;
+  std::vector<std::thread> threads_;
+  bool stop_ = false;
+
+  void Work();
+  /** Runs tasks of @a job until all have been started. @a lock is held. */
+  void RunTasks(Job& job, std::unique_lock<std::mutex>& lock);
+  void Stop();
+
+ public:
+  /**
+   * Starts the worker threads. If a thread can't be created, the pool makes
+   * do with the threads started so far.
+   * @param [in] num_workers Number of worker threads.
+   */
+  explicit ThreadPool(std::size_t num_workers);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /** @return Number of threads running tasks, including the caller. */
+  std::size_t concurrency() const { return threads_.size() + 1; }
+
+  /**
+   * Calls @a fn once for each index below @a num_tasks and waits for all
+   * calls to return.
+   * @param [in] num_tasks Number of tasks.
+   * @param [in] fn Task function, called with the task index.
+   * @throws Rethrows the first exception thrown by @a fn, after all tasks
+   *         have finished.
+   */
+  void ParallelFor(std::size_t num_tasks,
+                   const std::function<void(std::size_t)>& fn);
+};
+
+/**
+ * @return Thread pool shared by the library, with one thread per hardware
+ *         thread. It's created on first use.
+ */
+ThreadPool& shared_thread_pool();
+
+}   // namespace keepass
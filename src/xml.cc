@@ -0,0 +1,575 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "xml.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include "exception.hh"
+
+namespace keepass {
+
+namespace {
+
+const char kBase64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "abcdefghijklmnopqrstuvwxyz"
+    "0123456789+/";
+
+}   // namespace
+
+XmlWriter::XmlWriter(std::ostream& dst, Format format) :
+    dst_(dst), format_(format) {
+}
+
+void XmlWriter::CloseStartTag() {
+  if (start_tag_open_) {
+    dst_.put('>');
+    start_tag_open_ = false;
+  }
+}
+
+void XmlWriter::WriteIndent() {
+  if (format_ != Format::kIndented || !wrote_node_)
+    return;
+
+  dst_.put('\n');
+  for (std::size_t i = 0; i < open_.size(); ++i)
+    dst_.put('\t');
+}
+
+void XmlWriter::WriteEscaped(const char* text, std::size_t size,
+                             bool attribute) {
+  // Write runs of characters that don't need escaping in one go.
+  const char* run = text;
+  const char* end = text + size;
+  for (const char* it = text; it != end; ++it) {
+    const char* entity = nullptr;
+    switch (*it) {
+      case '&':
+        entity = "&amp;";
+        break;
+      case '<':
+        entity = "&lt;";
+        break;
+      case '>':
+        entity = "&gt;";
+        break;
+      case '"':
+        entity = attribute ? "&quot;" : nullptr;
+        break;
+      case '\r':
+        entity = "&#13;";
+        break;
+      case '\n':
+        entity = attribute ? "&#10;" : nullptr;
+        break;
+      case '\t':
+        entity = attribute ? "&#9;" : nullptr;
+        break;
+      default:
+        break;
+    }
+
+    if (entity != nullptr) {
+      dst_.write(run, it - run);
+      dst_.write(entity, std::strlen(entity));
+      run = it + 1;
+    }
+  }
+
+  dst_.write(run, end - run);
+}
+
+void XmlWriter::WriteBase64Triplets(const uint8_t* data, std::size_t size) {
+  assert(size % 3 == 0);
+
+  char buffer[4 * 1024];
+  std::size_t buffer_size = 0;
+  for (std::size_t i = 0; i < size; i += 3) {
+    uint32_t bits24 = (static_cast<uint32_t>(data[i]) << 16) |
+                      (static_cast<uint32_t>(data[i + 1]) << 8) |
+                      static_cast<uint32_t>(data[i + 2]);
+    buffer[buffer_size++] = kBase64[(bits24 >> 18) & 0x3f];
+    buffer[buffer_size++] = kBase64[(bits24 >> 12) & 0x3f];
+    buffer[buffer_size++] = kBase64[(bits24 >> 6) & 0x3f];
+    buffer[buffer_size++] = kBase64[bits24 & 0x3f];
+
+    if (buffer_size == sizeof(buffer)) {
+      dst_.write(buffer, buffer_size);
+      buffer_size = 0;
+    }
+  }
+
+  dst_.write(buffer, buffer_size);
+}
+
+void XmlWriter::FinishBase64() {
+  if (base64_carry_size_ == 0)
+    return;
+
+  uint8_t c0 = base64_carry_[0];
+  uint8_t c1 = base64_carry_size_ > 1 ? base64_carry_[1] : 0;
+  char quad[4] = {
+    kBase64[c0 >> 2],
+    kBase64[((c0 & 0x3) << 4) | (c1 >> 4)],
+    base64_carry_size_ > 1 ? kBase64[(c1 & 0xf) << 2] : '=',
+    '='
+  };
+  dst_.write(quad, sizeof(quad));
+  base64_carry_size_ = 0;
+}
+
+void XmlWriter::WriteDeclaration() {
+  assert(!wrote_node_);
+  static const char kDeclaration[] = "<?xml version=\"1.0\"?>";
+  dst_.write(kDeclaration, sizeof(kDeclaration) - 1);
+  wrote_node_ = true;
+}
+
+void XmlWriter::StartElement(const char* name) {
+  assert(base64_carry_size_ == 0);
+  CloseStartTag();
+  WriteIndent();
+
+  if (!open_.empty())
+    open_.back().has_children = true;
+
+  dst_.put('<');
+  dst_.write(name, std::strlen(name));
+  open_.push_back({ name, false });
+  start_tag_open_ = true;
+  wrote_node_ = true;
+}
+
+void XmlWriter::EndElement() {
+  assert(!open_.empty());
+  FinishBase64();
+
+  OpenElement element = std::move(open_.back());
+  open_.pop_back();
+
+  if (start_tag_open_) {
+    dst_.write(" />", 3);
+    start_tag_open_ = false;
+    return;
+  }
+
+  // Only elements containing other elements have their end tag on a separate
+  // line, text content is kept inline.
+  if (element.has_children)
+    WriteIndent();
+
+  dst_.write("</", 2);
+  dst_.write(element.name.data(), element.name.size());
+  dst_.put('>');
+}
+
+void XmlWriter::WriteAttribute(const char* name, const char* value) {
+  assert(start_tag_open_);
+  dst_.put(' ');
+  dst_.write(name, std::strlen(name));
+  dst_.write("=\"", 2);
+  WriteEscaped(value, std::strlen(value), true);
+  dst_.put('"');
+}
+
+void XmlWriter::WriteText(const char* text, std::size_t size) {
+  assert(!open_.empty());
+  if (size == 0)
+    return;
+
+  CloseStartTag();
+  WriteEscaped(text, size, false);
+}
+
+void XmlWriter::WriteBase64(const void* data, std::size_t size) {
+  assert(!open_.empty());
+  if (size == 0)
+    return;
+
+  CloseStartTag();
+
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  if (base64_carry_size_ > 0) {
+    while (base64_carry_size_ < 2 && size > 0) {
+      base64_carry_[base64_carry_size_++] = *bytes++;
+      size--;
+    }
+    if (size == 0)
+      return;
+
+    uint8_t triplet[3] = { base64_carry_[0], base64_carry_[1], *bytes++ };
+    size--;
+    base64_carry_size_ = 0;
+    WriteBase64Triplets(triplet, sizeof(triplet));
+  }
+
+  std::size_t whole_size = size - size % 3;
+  WriteBase64Triplets(bytes, whole_size);
+
+  base64_carry_size_ = size - whole_size;
+  std::memcpy(base64_carry_, bytes + whole_size, base64_carry_size_);
+}
+
+void XmlWriter::WriteElement(const char* name, const char* text) {
+  StartElement(name);
+  WriteText(text, std::strlen(text));
+  EndElement();
+}
+
+void XmlWriter::WriteElement(const char* name, const std::string& text) {
+  StartElement(name);
+  WriteText(text);
+  EndElement();
+}
+
+void XmlWriter::WriteElement(const char* name, bool value) {
+  WriteElement(name, value ? "true" : "false");
+}
+
+void XmlWriter::WriteBase64Element(const char* name, const void* data,
+                                   std::size_t size) {
+  StartElement(name);
+  WriteBase64(data, size);
+  EndElement();
+}
+
+void XmlWriter::Finish() {
+  assert(open_.empty());
+  if (format_ == Format::kIndented)
+    dst_.put('\n');
+
+  if (!dst_.good())
+    throw IoError("Write error.");
+}
+
+const std::size_t XmlReader::kDefaultBufferSize;
+
+XmlReader::XmlReader(std::istream& src, std::size_t buffer_size) :
+    src_(src), buffer_(buffer_size) {
+}
+
+bool XmlReader::Fill() {
+  src_.read(buffer_.data(), buffer_.size());
+  pos_ = 0;
+  end_ = static_cast<std::size_t>(src_.gcount());
+  if (end_ == 0 && src_.bad())
+    throw IoError("Read error.");
+
+  return end_ > 0;
+}
+
+void XmlReader::Expect(char c) {
+  if (Get() != static_cast<unsigned char>(c))
+    throw FormatError("Malformed XML.");
+}
+
+bool XmlReader::Match(const char* str) {
+  // Only used for markup that can't be confused with anything else once the
+  // first character matches, so there is no need to back track.
+  if (Peek() != static_cast<unsigned char>(*str))
+    return false;
+
+  for (; *str != '\0'; ++str)
+    Expect(*str);
+  return true;
+}
+
+void XmlReader::SkipWhitespace() {
+  for (int c = Peek(); c == ' ' || c == '\t' || c == '\r' || c == '\n';
+       c = Peek()) {
+    ++pos_;
+  }
+}
+
+void XmlReader::SkipUntil(const char* terminator) {
+  std::size_t len = std::strlen(terminator);
+  std::string window;
+  while (window.size() < len || window.compare(window.size() - len, len,
+                                               terminator) != 0) {
+    int c = Get();
+    if (c == std::char_traits<char>::eof())
+      throw FormatError("Malformed XML.");
+
+    window.push_back(static_cast<char>(c));
+    if (window.size() > len)
+      window.erase(0, 1);
+  }
+}
+
+void XmlReader::ReadName(std::string& name) {
+  name.clear();
+  for (int c = Peek(); c != std::char_traits<char>::eof(); c = Peek()) {
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '/' ||
+        c == '>' || c == '=' || c == '<') {
+      break;
+    }
+
+    name.push_back(static_cast<char>(c));
+    ++pos_;
+  }
+
+  if (name.empty())
+    throw FormatError("Malformed XML.");
+}
+
+void XmlReader::ReadUntil(char terminator, std::string& text) {
+  text.clear();
+  while (pos_ < end_ || Fill()) {
+    const char* begin = buffer_.data() + pos_;
+    const char* found = static_cast<const char*>(
+        std::memchr(begin, terminator, end_ - pos_));
+    std::size_t size = found != nullptr ?
+        static_cast<std::size_t>(found - begin) : end_ - pos_;
+
+    text.append(begin, size);
+    pos_ += size;
+    if (found != nullptr)
+      return;
+  }
+}
+
+void XmlReader::Unescape(std::string& text, bool attribute) const {
+  if (text.find_first_of(attribute ? "&\r\n\t" : "&\r") == std::string::npos)
+    return;
+
+  std::string result;
+  result.reserve(text.size());
+  for (std::size_t i = 0; i < text.size(); ++i) {
+    char c = text[i];
+    if (c == '\r') {
+      // Line endings are normalized to line feeds.
+      if (i + 1 < text.size() && text[i + 1] == '\n')
+        ++i;
+      result.push_back(attribute ? ' ' : '\n');
+      continue;
+    }
+    if (attribute && (c == '\n' || c == '\t')) {
+      result.push_back(' ');
+      continue;
+    }
+    if (c != '&') {
+      result.push_back(c);
+      continue;
+    }
+
+    std::size_t semi = text.find(';', i);
+    if (semi == std::string::npos) {
+      result.push_back(c);
+      continue;
+    }
+
+    std::string entity = text.substr(i + 1, semi - i - 1);
+    if (entity == "lt") {
+      result.push_back('<');
+    } else if (entity == "gt") {
+      result.push_back('>');
+    } else if (entity == "amp") {
+      result.push_back('&');
+    } else if (entity == "quot") {
+      result.push_back('"');
+    } else if (entity == "apos") {
+      result.push_back('\'');
+    } else if (entity.size() > 1 && entity[0] == '#') {
+      bool hex = entity[1] == 'x';
+      const char* digits = entity.c_str() + (hex ? 2 : 1);
+      char* digits_end = nullptr;
+      unsigned long code = std::strtoul(digits, &digits_end, hex ? 16 : 10);
+      if (*digits == '\0' || *digits_end != '\0' || code > 0x10ffff) {
+        // Leave invalid character references as they are.
+        result.push_back(c);
+        continue;
+      }
+
+      // Encode the code point as UTF-8.
+      if (code < 0x80) {
+        result.push_back(static_cast<char>(code));
+      } else if (code < 0x800) {
+        result.push_back(static_cast<char>(0xc0 | (code >> 6)));
+        result.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+      } else if (code < 0x10000) {
+        result.push_back(static_cast<char>(0xe0 | (code >> 12)));
+        result.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+        result.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+      } else {
+        result.push_back(static_cast<char>(0xf0 | (code >> 18)));
+        result.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3f)));
+        result.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+        result.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+      }
+    } else {
+      // Unknown entities are kept as they are.
+      result.push_back(c);
+      continue;
+    }
+
+    i = semi;
+  }
+
+  text.swap(result);
+}
+
+XmlReader::Node XmlReader::Next() {
+  if (pending_end_) {
+    // End of an empty element.
+    pending_end_ = false;
+    open_.pop_back();
+    node_ = Node::kEndElement;
+    return node_;
+  }
+
+  while (true) {
+    int c = Peek();
+    if (c == std::char_traits<char>::eof()) {
+      if (!open_.empty() || !read_root_)
+        throw FormatError("Malformed XML.");
+
+      node_ = Node::kEnd;
+      return node_;
+    }
+
+    if (c != '<') {
+      ReadUntil('<', text_);
+      Unescape(text_, false);
+
+      static const char* kWhitespace = " \t\r\n";
+      std::size_t first = text_.find_first_not_of(kWhitespace);
+      if (first == std::string::npos)
+        continue;
+      if (open_.empty())
+        throw FormatError("Malformed XML.");
+
+      std::size_t last = text_.find_last_not_of(kWhitespace);
+      text_ = text_.substr(first, last - first + 1);
+      node_ = Node::kText;
+      return node_;
+    }
+
+    ++pos_;
+    c = Peek();
+    if (c == '?') {
+      SkipUntil("?>");
+      continue;
+    }
+
+    if (c == '!') {
+      ++pos_;
+      if (Match("--")) {
+        SkipUntil("-->");
+        continue;
+      }
+
+      if (Match("[CDATA[")) {
+        if (open_.empty())
+          throw FormatError("Malformed XML.");
+
+        text_.clear();
+        while (true) {
+          std::string part;
+          ReadUntil('>', part);
+          Expect('>');
+          if (part.size() >= 2 && part.compare(part.size() - 2, 2, "]]") == 0) {
+            text_.append(part, 0, part.size() - 2);
+            break;
+          }
+          text_.append(part).push_back('>');
+        }
+
+        if (text_.empty())
+          continue;
+        node_ = Node::kText;
+        return node_;
+      }
+
+      // Document type declaration.
+      SkipUntil(">");
+      continue;
+    }
+
+    if (c == '/') {
+      ++pos_;
+      ReadName(name_);
+      SkipWhitespace();
+      Expect('>');
+      if (open_.empty() || open_.back() != name_)
+        throw FormatError("Malformed XML.");
+
+      open_.pop_back();
+      node_ = Node::kEndElement;
+      return node_;
+    }
+
+    if (open_.empty() && read_root_)
+      throw FormatError("Malformed XML.");
+
+    ReadName(name_);
+    attributes_.clear();
+    while (true) {
+      SkipWhitespace();
+      c = Peek();
+      if (c == '/') {
+        ++pos_;
+        Expect('>');
+        pending_end_ = true;
+        break;
+      }
+      if (c == '>') {
+        ++pos_;
+        break;
+      }
+
+      std::string attr_name;
+      ReadName(attr_name);
+      SkipWhitespace();
+      Expect('=');
+      SkipWhitespace();
+
+      int quote = Get();
+      if (quote != '"' && quote != '\'')
+        throw FormatError("Malformed XML.");
+
+      std::string attr_value;
+      ReadUntil(static_cast<char>(quote), attr_value);
+      Expect(static_cast<char>(quote));
+      Unescape(attr_value, true);
+
+      attributes_.emplace_back(std::move(attr_name), std::move(attr_value));
+    }
+
+    open_.push_back(name_);
+    read_root_ = true;
+    node_ = Node::kStartElement;
+    return node_;
+  }
+}
+
+void XmlReader::Skip() {
+  assert(node_ == Node::kStartElement);
+
+  std::size_t depth = open_.size();
+  while (Next() != Node::kEnd) {
+    if (node_ == Node::kEndElement && open_.size() < depth)
+      return;
+  }
+}
+
+}   // namespace keepass
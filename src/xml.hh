@@ -0,0 +1,201 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace keepass {
+
+/**
+ * @brief Forward-only XML writer.
+ *
+ * Elements are written to the destination stream in document order as they
+ * are produced, so no document tree is kept in memory. Only the names of the
+ * currently open elements are tracked.
+ */
+class XmlWriter final {
+ public:
+  enum class Format {
+    kCompact,
+    kIndented
+  };
+
+ private:
+  struct OpenElement {
+    std::string name;
+    bool has_children;
+  };
+
+  std::ostream& dst_;
+  const Format format_;
+  std::vector<OpenElement> open_;
+  bool start_tag_open_ = false;
+  bool wrote_node_ = false;
+
+  /** Input bytes not yet base64 encoded since they don't form a triplet. */
+  uint8_t base64_carry_[2];
+  std::size_t base64_carry_size_ = 0;
+
+  void CloseStartTag();
+  void WriteIndent();
+  void WriteEscaped(const char* text, std::size_t size, bool attribute);
+  void WriteBase64Triplets(const uint8_t* data, std::size_t size);
+  void FinishBase64();
+
+ public:
+  XmlWriter(std::ostream& dst, Format format);
+
+  /** Writes the XML declaration. Must be called before any element. */
+  void WriteDeclaration();
+
+  void StartElement(const char* name);
+  /** Closes the most recently started element. */
+  void EndElement();
+
+  /**
+   * Writes an attribute of the most recently started element. Attributes
+   * must be written before any content of the element.
+   */
+  void WriteAttribute(const char* name, const char* value);
+  void WriteAttribute(const char* name, const std::string& value) {
+    WriteAttribute(name, value.c_str());
+  }
+
+  /** Writes escaped text content to the current element. */
+  void WriteText(const char* text, std::size_t size);
+  void WriteText(const std::string& text) {
+    WriteText(text.data(), text.size());
+  }
+
+  /**
+   * Writes base64 encoded content to the current element. May be called
+   * repeatedly to encode data in pieces, the padding is written when the
+   * element ends.
+   */
+  void WriteBase64(const void* data, std::size_t size);
+
+  /** Writes an element with text content. */
+  void WriteElement(const char* name, const char* text);
+  void WriteElement(const char* name, const std::string& text);
+  void WriteElement(const char* name, bool value);
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value>::type
+  WriteElement(const char* name, T value) {
+    WriteElement(name, std::to_string(value));
+  }
+  /** Writes an element with base64 encoded content. */
+  void WriteBase64Element(const char* name, const void* data,
+                          std::size_t size);
+
+  /**
+   * Ends the document. All elements must have been closed.
+   * @throws IoError If the destination stream failed.
+   */
+  void Finish();
+};
+
+/**
+ * @brief Forward-only XML reader.
+ *
+ * Pulls one node at a time from the source stream, so the document is never
+ * held in memory as a whole. Text is unescaped and trimmed of surrounding
+ * whitespace, and nodes without meaning to the reader, like comments,
+ * processing instructions and whitespace-only text, are skipped.
+ */
+class XmlReader final {
+ public:
+  enum class Node {
+    kStartElement,
+    kEndElement,
+    kText,
+    kEnd
+  };
+
+  typedef std::vector<std::pair<std::string, std::string>> Attributes;
+
+ private:
+  static constexpr std::size_t kDefaultBufferSize = 64 * 1024;
+
+  std::istream& src_;
+  std::vector<char> buffer_;
+  std::size_t pos_ = 0;
+  std::size_t end_ = 0;
+
+  std::vector<std::string> open_;
+  bool read_root_ = false;
+  bool pending_end_ = false;
+
+  Node node_ = Node::kEnd;
+  std::string name_;
+  Attributes attributes_;
+  std::string text_;
+
+  bool Fill();
+  int Peek() {
+    if (pos_ == end_ && !Fill())
+      return std::char_traits<char>::eof();
+    return static_cast<unsigned char>(buffer_[pos_]);
+  }
+  int Get() {
+    int c = Peek();
+    if (c != std::char_traits<char>::eof())
+      ++pos_;
+    return c;
+  }
+
+  void Expect(char c);
+  bool Match(const char* str);
+  void SkipWhitespace();
+  void SkipUntil(const char* terminator);
+  void ReadName(std::string& name);
+  void ReadUntil(char terminator, std::string& text);
+  void Unescape(std::string& text, bool attribute) const;
+
+ public:
+  explicit XmlReader(std::istream& src)
+    : XmlReader(src, kDefaultBufferSize) {}
+  XmlReader(std::istream& src, std::size_t buffer_size);
+
+  /**
+   * Reads the next node.
+   * @return Type of the node read, kEnd at the end of the document.
+   * @throws FormatError If the document is malformed.
+   * @throws IoError If the source stream failed.
+   */
+  Node Next();
+  /** Skips the rest of the current element including its children. */
+  void Skip();
+
+  Node node() const { return node_; }
+  /** @return Name of the current start or end element. */
+  const std::string& name() const { return name_; }
+  /** @return Attributes of the current start element. */
+  const Attributes& attributes() const { return attributes_; }
+  /** @return Content of the current text node. */
+  const std::string& text() const { return text_; }
+  /** @return Nesting depth of the current node, the root element is 1. */
+  std::size_t depth() const { return open_.size(); }
+};
+
+}   // namespace keepass
@@ -0,0 +1,85 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include "argon2.hh"
+#include "exception.hh"
+
+using namespace keepass;
+
+namespace {
+
+// Test vectors from RFC 9106, section 5.
+Argon2 GetRfcArgon2(Argon2::Type type) {
+  Argon2 argon2(type, 3, 32, 4);
+  argon2.set_secret(std::vector<uint8_t>(8, 0x03));
+  argon2.set_associated_data(std::vector<uint8_t>(12, 0x04));
+  return argon2;
+}
+
+std::array<uint8_t, 32> GetRfcPassword() {
+  std::array<uint8_t, 32> password;
+  password.fill(0x01);
+  return password;
+}
+
+}   // namespace
+
+TEST(Argon2Test, Argon2d) {
+  std::array<uint8_t, 32> tag = GetRfcArgon2(Argon2::Type::kArgon2d).Hash(
+      GetRfcPassword(), std::vector<uint8_t>(16, 0x02));
+
+  std::array<uint8_t, 32> exp_tag = { {
+    0x51, 0x2b, 0x39, 0x1b, 0x6f, 0x11, 0x62, 0x97,
+    0x53, 0x71, 0xd3, 0x09, 0x19, 0x73, 0x42, 0x94,
+    0xf8, 0x68, 0xe3, 0xbe, 0x39, 0x84, 0xf3, 0xc1,
+    0xa1, 0x3a, 0x4d, 0xb9, 0xfa, 0xbe, 0x4a, 0xcb
+  } };
+  EXPECT_EQ(tag, exp_tag);
+}
+
+TEST(Argon2Test, Argon2id) {
+  std::array<uint8_t, 32> tag = GetRfcArgon2(Argon2::Type::kArgon2id).Hash(
+      GetRfcPassword(), std::vector<uint8_t>(16, 0x02));
+
+  std::array<uint8_t, 32> exp_tag = { {
+    0x0d, 0x64, 0x0d, 0xf5, 0x8d, 0x78, 0x76, 0x6c,
+    0x08, 0xc0, 0x37, 0xa3, 0x4a, 0x8b, 0x53, 0xc9,
+    0xd0, 0x1e, 0xf0, 0x45, 0x2d, 0x75, 0xb6, 0x5e,
+    0xb5, 0x25, 0x20, 0xe9, 0x6b, 0x01, 0xe6, 0x59
+  } };
+  EXPECT_EQ(tag, exp_tag);
+}
+
+TEST(Argon2Test, Parameters) {
+  EXPECT_THROW(Argon2(Argon2::Type::kArgon2d, 0, 64, 1), InternalError);
+  EXPECT_THROW(Argon2(Argon2::Type::kArgon2d, 1, 64, 0), InternalError);
+  EXPECT_THROW(Argon2(Argon2::Type::kArgon2d, 1, 31, 4), InternalError);
+  EXPECT_NO_THROW(Argon2(Argon2::Type::kArgon2d, 1, 32, 4));
+
+  // Lanes are filled in parallel, the result must still be deterministic.
+  // The amount of memory is deliberately not a multiple of the lane count.
+  Argon2 argon2(Argon2::Type::kArgon2id, 2, 1000, 3);
+  std::array<uint8_t, 32> password = GetRfcPassword();
+  std::vector<uint8_t> salt(32, 0x05);
+  EXPECT_EQ(argon2.Hash(password, salt), argon2.Hash(password, salt));
+  EXPECT_NE(argon2.Hash(password, salt),
+            Argon2(Argon2::Type::kArgon2d, 2, 1000, 3).Hash(password, salt));
+}
@@ -16,7 +16,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <random>
+#include <sstream>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -70,6 +73,62 @@ void GetRandomStream(std::ostream& dst, std::size_t min_len,
   }
 }
 
+void ExpectBlocksMatchSingleBlocks(const Cipher<16>& cipher) {
+  constexpr std::size_t kNumBlocks = 37;
+
+  std::vector<uint8_t> src(kNumBlocks * 16);
+  for (std::size_t i = 0; i < kNumBlocks; ++i) {
+    std::array<uint8_t, 16> block = GetRandomBlock<16>();
+    std::copy(block.begin(), block.end(), src.begin() + 16 * i);
+  }
+
+  std::vector<uint8_t> ecb(src.size()), cbc(src.size()), tst(src.size());
+  cipher.EncryptBlocks(src.data(), ecb.data(), kNumBlocks);
+  std::array<uint8_t, 16> iv = cipher.InitializationVector();
+  cipher.EncryptBlocksCbc(src.data(), cbc.data(), kNumBlocks, iv);
+
+  std::array<uint8_t, 16> prv = cipher.InitializationVector();
+  for (std::size_t i = 0; i < kNumBlocks; ++i) {
+    std::array<uint8_t, 16> src_block, dst_block, ecb_block, cbc_block;
+    std::copy(src.begin() + 16 * i, src.begin() + 16 * (i + 1),
+              src_block.begin());
+    std::copy(ecb.begin() + 16 * i, ecb.begin() + 16 * (i + 1),
+              ecb_block.begin());
+    std::copy(cbc.begin() + 16 * i, cbc.begin() + 16 * (i + 1),
+              cbc_block.begin());
+
+    cipher.Encrypt(src_block, dst_block);
+    EXPECT_EQ(ecb_block, dst_block);
+
+    for (std::size_t j = 0; j < 16; ++j)
+      src_block[j] ^= prv[j];
+    cipher.Encrypt(src_block, prv);
+    EXPECT_EQ(cbc_block, prv);
+  }
+  EXPECT_EQ(iv, prv);
+
+  cipher.DecryptBlocks(ecb.data(), tst.data(), kNumBlocks);
+  EXPECT_EQ(src, tst);
+
+  // In place.
+  cipher.DecryptBlocks(ecb.data(), ecb.data(), kNumBlocks);
+  EXPECT_EQ(src, ecb);
+}
+
+void ExpectCbcRoundTrip(const Cipher<16>& cipher, std::size_t size) {
+  std::string data;
+  for (std::size_t i = 0; i < size; ++i)
+    data.push_back(static_cast<char>(i * 31));
+
+  std::stringstream src(data), dst, tst;
+  EXPECT_NO_THROW(encrypt_cbc(src, dst, cipher));
+  EXPECT_EQ(dst.str().size(), (data.size() / 16 + 1) * 16);
+
+  dst.seekg(0, std::ios::beg);
+  EXPECT_NO_THROW(decrypt_cbc(dst, tst, cipher));
+  EXPECT_TRUE(tst.str() == data);
+}
+
 }   // namespace
 
 TEST(CipherTest, AesRandomBlock) {
@@ -374,6 +433,110 @@ TEST(CipherTest, Salsa20KnownBlocks) {
   EXPECT_EQ(dst_block, exp_block4);
 }
 
+TEST(CipherTest, Salsa20Blocks) {
+  std::array<uint8_t, 32> key = GetRandomKey();
+  std::array<uint8_t, 8> iv;
+  std::array<uint8_t, 16> random_iv = GetRandomBlock<16>();
+  std::copy(random_iv.begin(), random_iv.begin() + iv.size(), iv.begin());
+
+  // Processing many blocks at once must give the same result as processing
+  // one block at a time.
+  std::vector<uint8_t> src(1000);
+  for (std::size_t i = 0; i < src.size(); ++i)
+    src[i] = static_cast<uint8_t>(i);
+
+  // The first call ends in the middle of the output of a multi-block kernel.
+  Salsa20Cipher multi_cipher(key, iv);
+  std::vector<uint8_t> multi_dst(src.size());
+  multi_cipher.Process(src.data(), multi_dst.data(), 384);
+  multi_cipher.Process(src.data() + 384, multi_dst.data() + 384,
+                       src.size() - 384);
+
+  Salsa20Cipher single_cipher(key, iv);
+  std::vector<uint8_t> single_dst(src.size());
+  for (std::size_t i = 0; i < src.size(); i += 64) {
+    single_cipher.Process(src.data() + i, single_dst.data() + i,
+                          std::min<std::size_t>(64, src.size() - i));
+  }
+  EXPECT_EQ(multi_dst, single_dst);
+}
+
+TEST(CipherTest, ChaCha20KnownBlocks) {
+  // Test vector from RFC 7539, section 2.4.2.
+  std::array<uint8_t, 32> key;
+  for (std::size_t i = 0; i < key.size(); ++i)
+    key[i] = static_cast<uint8_t>(i);
+  std::array<uint8_t, 12> iv = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00
+  };
+
+  std::string src =
+      "Ladies and Gentlemen of the class of '99: If I could offer you only "
+      "one tip for the future, sunscreen would be it.";
+  std::vector<uint8_t> exp = {
+    0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28,
+    0xdd, 0x0d, 0x69, 0x81, 0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2,
+    0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b, 0xf9, 0x1b, 0x65, 0xc5,
+    0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+    0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35,
+    0x9f, 0x08, 0x61, 0xd8, 0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61,
+    0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e, 0x52, 0xbc, 0x51, 0x4d,
+    0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+    0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed,
+    0xf2, 0x78, 0x5e, 0x42, 0x87, 0x4d
+  };
+
+  // The test vector starts at block counter 1.
+  ChaCha20Cipher cipher(key, iv);
+  std::array<uint8_t, 64> skip_block = { 0 };
+  cipher.Process(skip_block, skip_block);
+
+  std::vector<uint8_t> dst(src.size());
+  cipher.Process(reinterpret_cast<const uint8_t*>(src.data()), dst.data(),
+                 src.size());
+  EXPECT_EQ(dst, exp);
+}
+
+TEST(CipherTest, ChaCha20Blocks) {
+  std::array<uint8_t, 32> key = GetRandomKey();
+  std::array<uint8_t, 12> iv;
+  std::array<uint8_t, 16> random_iv = GetRandomBlock<16>();
+  std::copy(random_iv.begin(), random_iv.begin() + iv.size(), iv.begin());
+
+  // Processing many blocks at once must give the same result as processing
+  // one block at a time.
+  std::vector<uint8_t> src(1000);
+  for (std::size_t i = 0; i < src.size(); ++i)
+    src[i] = static_cast<uint8_t>(i);
+
+  // The first call ends in the middle of the output of a multi-block kernel.
+  ChaCha20Cipher multi_cipher(key, iv);
+  std::vector<uint8_t> multi_dst(src.size());
+  multi_cipher.Process(src.data(), multi_dst.data(), 384);
+  multi_cipher.Process(src.data() + 384, multi_dst.data() + 384,
+                       src.size() - 384);
+
+  ChaCha20Cipher single_cipher(key, iv);
+  std::vector<uint8_t> single_dst(src.size());
+  for (std::size_t i = 0; i < src.size(); i += 64) {
+    single_cipher.Process(src.data() + i, single_dst.data() + i,
+                          std::min<std::size_t>(64, src.size() - i));
+  }
+  EXPECT_EQ(multi_dst, single_dst);
+
+  // Round trip through the stream interface.
+  std::string data(reinterpret_cast<const char*>(src.data()), src.size());
+  std::stringstream src_stream(data), enc_stream, dec_stream;
+  ChaCha20Cipher enc_cipher(key, iv);
+  ChaCha20Cipher dec_cipher(key, iv);
+  encrypt_stream(src_stream, enc_stream, enc_cipher);
+  EXPECT_EQ(enc_stream.str(),
+            std::string(reinterpret_cast<const char*>(multi_dst.data()),
+                        multi_dst.size()));
+  decrypt_stream(enc_stream, dec_stream, dec_cipher);
+  EXPECT_EQ(dec_stream.str(), data);
+}
+
 TEST(CipherTest, Ecb) {
   AesCipher cipher(GetRandomKey());
 
@@ -388,6 +551,26 @@ TEST(CipherTest, Ecb) {
   EXPECT_EQ(src_blocks, tst_blocks);
 }
 
+TEST(CipherTest, AesTransformer) {
+  std::array<uint8_t, 32> key = GetRandomKey();
+  AesCipher cipher(key);
+  AesTransformer transformer(key);
+
+  std::array<uint8_t, 32> src_blocks = GetRandomBlock<32>();
+  std::array<uint8_t, 32> dst_blocks = src_blocks;
+  std::array<uint8_t, 32> tst_blocks = src_blocks;
+  for (std::size_t i = 0; i < 100; ++i)
+    tst_blocks = encrypt_ecb(tst_blocks, cipher);
+
+  transformer.Transform(dst_blocks, 100);
+  EXPECT_EQ(dst_blocks, tst_blocks);
+
+  // Zero rounds should leave the data untouched.
+  dst_blocks = src_blocks;
+  transformer.Transform(dst_blocks, 0);
+  EXPECT_EQ(dst_blocks, src_blocks);
+}
+
 TEST(CipherTest, CbcWithFullPadding) {
   AesCipher cipher(GetRandomKey());
 
@@ -425,3 +608,19 @@ TEST(CipherTest, CbcWithRandomPadding) {
   EXPECT_NO_THROW(decrypt_cbc(dst, tst, cipher));
   EXPECT_EQ(src.str(), tst.str());
 }
+
+TEST(CipherTest, Blocks) {
+  ExpectBlocksMatchSingleBlocks(
+      AesCipher(GetRandomKey(), GetRandomBlock<16>()));
+  ExpectBlocksMatchSingleBlocks(
+      TwofishCipher(GetRandomKey(), GetRandomBlock<16>()));
+}
+
+TEST(CipherTest, CbcLargePayload) {
+  // Large enough to be split between threads and to span several internal
+  // buffers, and ending with a partial block.
+  ExpectCbcRoundTrip(AesCipher(GetRandomKey(), GetRandomBlock<16>()),
+                     5 * 1024 * 1024 + 5);
+  ExpectCbcRoundTrip(TwofishCipher(GetRandomKey(), GetRandomBlock<16>()),
+                     600 * 1024 + 5);
+}
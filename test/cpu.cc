@@ -0,0 +1,64 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+#include "cpu.hh"
+
+using namespace keepass;
+
+namespace {
+
+uint32_t bit(CpuFeature feature) {
+  return static_cast<uint32_t>(feature);
+}
+
+}   // namespace
+
+TEST(CpuTest, ParseFeatures) {
+  EXPECT_EQ(parse_cpu_features(""), 0);
+  EXPECT_EQ(parse_cpu_features("portable"), 0);
+  EXPECT_EQ(parse_cpu_features("sse2"), bit(CpuFeature::kSse2));
+  EXPECT_EQ(parse_cpu_features("sse2,ssse3,unknown"),
+            bit(CpuFeature::kSse2) | bit(CpuFeature::kSsse3));
+  EXPECT_EQ(parse_cpu_features("avx2,aesni,vaes"),
+            bit(CpuFeature::kAvx2) | bit(CpuFeature::kAesni) |
+            bit(CpuFeature::kVaes));
+}
+
+TEST(CpuTest, DetectFeatures) {
+  uint32_t features = detect_cpu_features();
+  if (features & bit(CpuFeature::kVaes)) {
+    EXPECT_TRUE(features & bit(CpuFeature::kAvx2));
+    EXPECT_TRUE(features & bit(CpuFeature::kAesni));
+  }
+  if (features & (bit(CpuFeature::kSsse3) | bit(CpuFeature::kAesni))) {
+    EXPECT_TRUE(features & bit(CpuFeature::kSse2));
+  }
+
+  // Features not supported by the CPU are never enabled.
+  for (CpuFeature feature : { CpuFeature::kSse2, CpuFeature::kSsse3,
+                              CpuFeature::kAvx2, CpuFeature::kAesni,
+                              CpuFeature::kVaes }) {
+    if (cpu_has(feature)) {
+      EXPECT_TRUE(features & bit(feature));
+    }
+  }
+}
@@ -17,6 +17,7 @@
  */
 
 #include <fstream>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -62,6 +63,33 @@ std::string GetTestJson(const std::string& name) {
   return json;
 }
 
+/** Stream buffer over a string that, like a pipe, can't be seeked. */
+class PipeStreambuf final : public std::streambuf {
+ private:
+  std::string data_;
+
+ protected:
+  virtual int overflow(int c) override {
+    if (c != std::char_traits<char>::eof())
+      data_.push_back(static_cast<char>(c));
+    return std::char_traits<char>::not_eof(c);
+  }
+
+ public:
+  PipeStreambuf() = default;
+  explicit PipeStreambuf(const std::string& data) : data_(data) {
+    setg(&data_[0], &data_[0], &data_[0] + data_.size());
+  }
+
+  const std::string& data() const { return data_; }
+};
+
+std::string GetFileData(const std::string& path) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+}
+
 }   // namespace
 
 TEST(KdbTest, NonExistingFile) {
@@ -828,3 +856,89 @@ TEST(KdbTest, ExportComplex1KeyFileAndPassword) {
   EXPECT_NE(root, nullptr);
   EXPECT_EQ(root->ToJson(), json);
 }
+
+TEST(KdbTest, ImportAsyncWithProgress) {
+  Key key("password");
+
+  std::string json = GetTestJson("complex-1-pw-aes.json");
+
+  uint64_t parsed = 0, records = 0;
+  Progress progress([&](Progress::Phase phase, uint64_t done, uint64_t total) {
+    if (phase == Progress::Phase::kParse) {
+      parsed = done;
+      records = total;
+    }
+  });
+
+  KdbFile file;
+  std::future<std::unique_ptr<Database>> future = file.ImportAsync(
+      GetTestPath("complex-1-pw-aes.kdb"), key, progress);
+
+  std::unique_ptr<Database> db;
+  EXPECT_NO_THROW(db = future.get());
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(db->root()->ToJson(), json);
+  EXPECT_GT(records, 0);
+  EXPECT_EQ(parsed, records);
+}
+
+TEST(KdbTest, ImportAsyncCancelled) {
+  Key key("password");
+
+  std::shared_ptr<CancellationToken> token =
+      std::make_shared<CancellationToken>();
+  token->Cancel();
+
+  KdbFile file;
+  std::future<std::unique_ptr<Database>> future = file.ImportAsync(
+      GetTestPath("complex-1-pw-aes.kdb"), key, Progress(nullptr, token));
+  EXPECT_THROW(future.get(), CancelledError);
+}
+
+TEST(KdbTest, ImportExportPipe) {
+  Key key("password");
+  std::string json = GetTestJson("complex-1-pw-aes.json");
+
+  KdbFile file;
+  std::unique_ptr<Database> db;
+
+  PipeStreambuf src_streambuf(GetFileData(GetTestPath("complex-1-pw-aes.kdb")));
+  std::istream src(&src_streambuf);
+  EXPECT_NO_THROW({
+    db = file.Import(src, key);
+  });
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(db->root()->ToJson(), json);
+
+  PipeStreambuf dst_streambuf;
+  std::ostream dst(&dst_streambuf);
+  EXPECT_NO_THROW(file.Export(dst, *db, key));
+
+  PipeStreambuf tst_streambuf(dst_streambuf.data());
+  std::istream tst(&tst_streambuf);
+  EXPECT_NO_THROW({
+    db = file.Import(tst, key);
+  });
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(db->root()->ToJson(), json);
+}
+
+TEST(KdbTest, ExportToMemory) {
+  Key key("password");
+  std::string json = GetTestJson("complex-1-pw-aes.json");
+
+  KdbFile file;
+  std::unique_ptr<Database> db =
+      file.Import(GetTestPath("complex-1-pw-aes.kdb"), key);
+
+  // Existing content is kept and the database appended after it.
+  std::vector<uint8_t> data = { 1, 2, 3 };
+  EXPECT_NO_THROW(file.Export(data, *db, key));
+  ASSERT_GT(data.size(), 3);
+  EXPECT_EQ(data[0], 1);
+  EXPECT_NO_THROW({
+    db = file.Import(data.data() + 3, data.size() - 3, key);
+  });
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(db->root()->ToJson(), json);
+}
@@ -16,13 +16,22 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdio>
 #include <fstream>
+#include <functional>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <gtest/gtest.h>
 
 #include "exception.hh"
 #include "kdbx.hh"
 #include "key.hh"
+#include "metadata.hh"
 
 using namespace keepass;
 
@@ -62,6 +71,33 @@ std::string GetTestJson(const std::string& name) {
   return json;
 }
 
+/** Stream buffer over a string that, like a pipe, can't be seeked. */
+class PipeStreambuf final : public std::streambuf {
+ private:
+  std::string data_;
+
+ protected:
+  virtual int overflow(int c) override {
+    if (c != std::char_traits<char>::eof())
+      data_.push_back(static_cast<char>(c));
+    return std::char_traits<char>::not_eof(c);
+  }
+
+ public:
+  PipeStreambuf() = default;
+  explicit PipeStreambuf(const std::string& data) : data_(data) {
+    setg(&data_[0], &data_[0], &data_[0] + data_.size());
+  }
+
+  const std::string& data() const { return data_; }
+};
+
+std::string GetFileData(const std::string& path) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+}
+
 }   // namespace
 
 TEST(KdbxTest, NonExistingFile) {
@@ -906,3 +942,766 @@ TEST(KdbxTest, ExportComplex1KeyFileAndPassword) {
   EXPECT_NE(root, nullptr);
   EXPECT_EQ(root->ToJson(), json);
 }
+
+TEST(KdbxTest, ImportAsyncWithProgress) {
+  Key key("password");
+
+  std::string json = GetTestJson("complex-1-pw-aes.json");
+
+  std::vector<Progress::Phase> phases;
+  Progress progress([&](Progress::Phase phase, uint64_t done, uint64_t total) {
+    if (total != 0) {
+      EXPECT_LE(done, total);
+    }
+    if (phases.empty() || phases.back() != phase)
+      phases.push_back(phase);
+  });
+
+  KdbxFile file;
+  std::future<std::unique_ptr<Database>> future = file.ImportAsync(
+      GetTestPath("complex-1-pw-aes.kdbx"), key, progress);
+
+  std::unique_ptr<Database> db;
+  EXPECT_NO_THROW(db = future.get());
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(db->root()->ToJson(), json);
+
+  std::vector<Progress::Phase> exp_phases = {
+    Progress::Phase::kTransformKey,
+    Progress::Phase::kDecrypt,
+    Progress::Phase::kParse
+  };
+  EXPECT_EQ(phases, exp_phases);
+}
+
+TEST(KdbxTest, ImportAsyncCancelled) {
+  Key key("password");
+
+  std::shared_ptr<CancellationToken> token =
+      std::make_shared<CancellationToken>();
+  token->Cancel();
+
+  KdbxFile file;
+  std::future<std::unique_ptr<Database>> future = file.ImportAsync(
+      GetTestPath("complex-1-pw-aes.kdbx"), key, Progress(nullptr, token));
+  EXPECT_THROW(future.get(), CancelledError);
+}
+
+TEST(KdbxTest, ImportAsyncWithEntryCallback) {
+  Key key("password");
+
+  // The settings of the file object apply to the asynchronous import.
+  std::size_t num_entries = 0;
+  KdbxFile file;
+  file.set_entry_callback([&](std::shared_ptr<Group>, std::shared_ptr<Entry>) {
+    num_entries++;
+  });
+
+  std::unique_ptr<Database> db;
+  EXPECT_NO_THROW({
+    db = file.ImportAsync(GetTestPath("complex-1-pw-aes.kdbx"), key,
+                          Progress()).get();
+  });
+  ASSERT_NE(db, nullptr);
+  EXPECT_GT(num_entries, 0);
+  EXPECT_TRUE(db->root()->Entries().empty());
+}
+
+TEST(KdbxTest, ImportCancelledDuringParse) {
+  Key key("password");
+
+  // Cancel as soon as parsing starts, the import must not be reported as a
+  // password error.
+  std::shared_ptr<CancellationToken> token =
+      std::make_shared<CancellationToken>();
+  Progress progress([&](Progress::Phase phase, uint64_t, uint64_t) {
+    if (phase == Progress::Phase::kParse)
+      token->Cancel();
+  }, token);
+
+  KdbxFile file;
+  EXPECT_THROW(file.Import(GetTestPath("complex-1-pw-aes.kdbx"), key,
+                           progress), CancelledError);
+}
+
+TEST(KdbxTest, ExportAsync) {
+  Key key("password");
+
+  std::string src_path = GetTestPath("complex-1-pw-aes-gzip.kdbx");
+  std::string dst_path = GetTmpPath("complex-1-pw-aes-gzip-async.kdbx");
+  std::string json = GetTestJson("complex-1-pw-aes-gzip.json");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db;
+
+  EXPECT_NO_THROW({
+    db = file.Import(src_path, key);
+  });
+
+  bool encrypted = false;
+  Progress progress([&](Progress::Phase phase, uint64_t, uint64_t) {
+    if (phase == Progress::Phase::kEncrypt)
+      encrypted = true;
+  });
+  EXPECT_NO_THROW(file.ExportAsync(dst_path, *db, key, progress).get());
+  EXPECT_TRUE(encrypted);
+
+  EXPECT_NO_THROW({
+    db = file.Import(dst_path, key);
+  });
+  std::remove(dst_path.c_str());
+
+  std::shared_ptr<Group> root = db->root();
+  EXPECT_NE(root, nullptr);
+  EXPECT_EQ(root->ToJson(), json);
+}
+
+TEST(KdbxTest, ExportComplex1Argon2) {
+  Key key("password");
+
+  std::string src_path = GetTestPath("complex-1-pw-aes.kdbx");
+  std::string dst_path = GetTmpPath("complex-1-pw-argon2.kdbx");
+  std::string json = GetTestJson("complex-1-pw-aes.json");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db;
+
+  EXPECT_NO_THROW({
+    db = file.Import(src_path, key);
+  });
+
+  db->set_kdf(Database::Kdf::kArgon2id);
+  db->set_argon2_memory(1024 * 1024);
+  db->set_argon2_iterations(2);
+  db->set_argon2_parallelism(4);
+
+  EXPECT_NO_THROW({
+    file.Export(dst_path, *db, key);
+    db = file.Import(dst_path, key);
+  });
+
+  EXPECT_THROW(file.Import(dst_path, Key("wrong")), PasswordError);
+
+  // Argon2 is only described by KDBX 4.
+  std::string data = GetFileData(dst_path);
+  std::remove(dst_path.c_str());
+  ASSERT_GE(data.size(), 12);
+  EXPECT_EQ(data.substr(8, 4), std::string("\x00\x00\x04\x00", 4));
+
+  EXPECT_EQ(db->kdf(), Database::Kdf::kArgon2id);
+  EXPECT_EQ(db->argon2_memory(), 1024 * 1024);
+  EXPECT_EQ(db->argon2_iterations(), 2);
+  EXPECT_EQ(db->argon2_parallelism(), 4);
+
+  std::shared_ptr<Group> root = db->root();
+  EXPECT_NE(root, nullptr);
+  EXPECT_EQ(root->ToJson(), json);
+}
+
+TEST(KdbxTest, ImportKdbx4) {
+  Key key("password");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db;
+
+  EXPECT_NO_THROW({
+    db = file.Import(GetTestPath("kdbx4-pw-aes-gzip.kdbx"), key);
+  });
+  EXPECT_THROW(file.Import(GetTestPath("kdbx4-pw-aes-gzip.kdbx"),
+                           Key("wrong")), PasswordError);
+
+  EXPECT_EQ(db->kdf(), Database::Kdf::kAes);
+  EXPECT_EQ(db->transform_rounds(), 20);
+  EXPECT_EQ(db->cipher(), Database::Cipher::kAes);
+  EXPECT_EQ(db->compress(), true);
+  EXPECT_EQ(db->inner_random_stream(),
+            Database::InnerRandomStream::kChaCha20);
+  EXPECT_EQ(db->chacha20_inner_random_stream_key().size(), 64);
+  EXPECT_EQ(*db->meta()->database_name(), "kdbx4");
+  EXPECT_EQ(db->meta()->database_name().time(), 1496311200);
+  ASSERT_EQ(db->meta()->binaries().size(), 1);
+
+  std::shared_ptr<Group> root = db->root();
+  ASSERT_NE(root, nullptr);
+  EXPECT_EQ(root->name(), "Root");
+  ASSERT_EQ(root->Entries().size(), 1);
+
+  std::shared_ptr<Entry> entry = root->Entries()[0];
+  EXPECT_EQ(*entry->title(), "Entry");
+  EXPECT_EQ(*entry->password(), "secret");
+  EXPECT_EQ(entry->creation_time(), 1496311200);
+  EXPECT_EQ(entry->expiry_time(), 0);
+  ASSERT_EQ(entry->attachments().size(), 1);
+  EXPECT_EQ(entry->attachments()[0]->name(), "a.txt");
+  EXPECT_EQ(entry->attachments()[0]->binary(), db->meta()->binaries()[0]);
+  EXPECT_EQ(*entry->attachments()[0]->binary()->data(), "attachment data");
+  EXPECT_EQ(entry->attachments()[0]->binary()->data().is_protected(), true);
+
+  // The inner random stream key doesn't fit KDBX 3.1, so the database is
+  // written back as KDBX 4.
+  std::vector<uint8_t> data;
+  EXPECT_NO_THROW({
+    file.Export(data, *db, key);
+    db = file.Import(data.data(), data.size(), key);
+  });
+  ASSERT_GE(data.size(), 12);
+  EXPECT_EQ(data[10], 0x04);
+  EXPECT_EQ(*db->root()->Entries()[0]->password(), "secret");
+  EXPECT_EQ(db->root()->Entries()[0]->creation_time(), 1496311200);
+  EXPECT_EQ(db->root()->Entries()[0]->expiry_time(), 0);
+  EXPECT_EQ(*db->root()->Entries()[0]->attachments()[0]->binary()->data(),
+            "attachment data");
+
+  // Any change to the header or the content blocks is detected.
+  std::vector<uint8_t> bad_header = data;
+  bad_header[20] ^= 1;
+  EXPECT_THROW(file.Import(bad_header.data(), bad_header.size(), key),
+               FormatError);
+  std::vector<uint8_t> bad_content = data;
+  bad_content[bad_content.size() - 40] ^= 1;
+  EXPECT_THROW(file.Import(bad_content.data(), bad_content.size(), key),
+               IoError);
+
+  KdbxFile pipelined_file;
+  pipelined_file.set_pipelined_import(true);
+  EXPECT_NO_THROW({
+    db = pipelined_file.Import(data.data(), data.size(), key);
+  });
+  EXPECT_EQ(*db->root()->Entries()[0]->password(), "secret");
+}
+
+TEST(KdbxTest, ExportComplex1ChaCha20) {
+  Key key("password");
+
+  std::string src_path = GetTestPath("complex-1-pw-aes.kdbx");
+  std::string dst_path = GetTmpPath("complex-1-pw-chacha20.kdbx");
+  std::string json = GetTestJson("complex-1-pw-aes.json");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db;
+
+  EXPECT_NO_THROW({
+    db = file.Import(src_path, key);
+  });
+
+  db->set_cipher(Database::Cipher::kChaCha20);
+  db->set_inner_random_stream(Database::InnerRandomStream::kChaCha20);
+
+  EXPECT_NO_THROW({
+    file.Export(dst_path, *db, key);
+    db = file.Import(dst_path, key);
+  });
+
+  EXPECT_THROW(file.Import(dst_path, Key("wrong")), PasswordError);
+
+  // ChaCha20 is only described by KDBX 4.
+  std::string data = GetFileData(dst_path);
+  std::remove(dst_path.c_str());
+  ASSERT_GE(data.size(), 12);
+  EXPECT_EQ(data.substr(8, 4), std::string("\x00\x00\x04\x00", 4));
+
+  EXPECT_EQ(db->cipher(), Database::Cipher::kChaCha20);
+  EXPECT_EQ(db->inner_random_stream(),
+            Database::InnerRandomStream::kChaCha20);
+
+  std::shared_ptr<Group> root = db->root();
+  EXPECT_NE(root, nullptr);
+  EXPECT_EQ(root->ToJson(), json);
+}
+
+TEST(KdbxTest, ImportKdbx4MalformedHeader) {
+  Key key("password");
+  KdbxFile file;
+
+  // KDBX 4 signature and version followed by a header field.
+  std::string header("\x03\xd9\xa2\x9a\x67\xfb\x4b\xb5"
+                     "\x00\x00\x04\x00", 12);
+
+  // KDF parameters with a name claiming to be 2 GiB.
+  std::string variant_map("\x00\x01"
+                          "\x05" "\xff\xff\xff\x7f" "$UUID"
+                          "\x00", 11);
+  std::string oversized = header + std::string("\x0b\x0b\x00\x00\x00", 5) +
+      variant_map;
+  std::stringstream oversized_stream(oversized);
+  EXPECT_THROW(file.Import(oversized_stream, key), FormatError);
+  EXPECT_THROW(file.Import(reinterpret_cast<const uint8_t*>(oversized.data()),
+                           oversized.size(), key), FormatError);
+
+  // KDF parameters with a value running past the end of the field.
+  std::string truncated_map("\x00\x01"
+                            "\x05" "\x05\x00\x00\x00" "$UUID"
+                            "\x10\x00\x00\x00" "\x00\x00", 17);
+  std::string truncated = header + std::string("\x0b\x11\x00\x00\x00", 5) +
+      truncated_map;
+  std::stringstream truncated_stream(truncated);
+  EXPECT_THROW(file.Import(truncated_stream, key), FormatError);
+
+  // A header field claiming to be 4 GiB, but ending with the data.
+  std::string huge_field = header +
+      std::string("\x0b\xf0\xff\xff\xff", 5) + variant_map;
+  std::stringstream huge_field_stream(huge_field);
+  EXPECT_THROW(file.Import(huge_field_stream, key), IoError);
+  EXPECT_THROW(file.Import(reinterpret_cast<const uint8_t*>(huge_field.data()),
+                           huge_field.size(), key), IoError);
+}
+
+TEST(KdbxTest, ImportKdbx4ChaCha20) {
+  Key key("password");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db;
+
+  EXPECT_NO_THROW({
+    db = file.Import(GetTestPath("kdbx4-pw-chacha20-gzip.kdbx"), key);
+  });
+  EXPECT_THROW(file.Import(GetTestPath("kdbx4-pw-chacha20-gzip.kdbx"),
+                           Key("wrong")), PasswordError);
+
+  EXPECT_EQ(db->cipher(), Database::Cipher::kChaCha20);
+  EXPECT_EQ(db->inner_random_stream(),
+            Database::InnerRandomStream::kChaCha20);
+
+  std::shared_ptr<Group> root = db->root();
+  ASSERT_NE(root, nullptr);
+  ASSERT_EQ(root->Entries().size(), 1);
+  EXPECT_EQ(*root->Entries()[0]->title(), "Entry");
+  EXPECT_EQ(*root->Entries()[0]->password(), "secret");
+}
+
+TEST(KdbxTest, ExportChaCha20InnerRandomStream) {
+  Key key("password");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db;
+
+  EXPECT_NO_THROW({
+    db = file.Import(GetTestPath("complex-1-pw-aes.kdbx"), key);
+  });
+
+  // KDBX 3.1 only knows of Salsa20 for protecting values.
+  std::vector<uint8_t> data;
+  db->set_inner_random_stream(Database::InnerRandomStream::kChaCha20);
+  EXPECT_NO_THROW({
+    file.Export(data, *db, key);
+    db = file.Import(data.data(), data.size(), key);
+  });
+  ASSERT_GE(data.size(), 12);
+  EXPECT_EQ(data[10], 0x04);
+  EXPECT_EQ(db->cipher(), Database::Cipher::kAes);
+  EXPECT_EQ(db->inner_random_stream(),
+            Database::InnerRandomStream::kChaCha20);
+  EXPECT_EQ(db->root()->ToJson(), GetTestJson("complex-1-pw-aes.json"));
+
+  // Without any KDBX 4 features the database stays KDBX 3.1.
+  data.clear();
+  db->set_inner_random_stream(Database::InnerRandomStream::kSalsa20);
+  EXPECT_NO_THROW({
+    file.Export(data, *db, key);
+  });
+  ASSERT_GE(data.size(), 12);
+  EXPECT_EQ(data[8], 0x01);
+  EXPECT_EQ(data[10], 0x03);
+}
+
+TEST(KdbxTest, ExportComplex1CompressionProfiles) {
+  Key key("password");
+
+  std::string src_path = GetTestPath("complex-1-pw-aes-gzip.kdbx");
+  std::string dst_path = GetTmpPath("complex-1-pw-aes-gzip-profile.kdbx");
+  std::string json = GetTestJson("complex-1-pw-aes-gzip.json");
+
+  for (Database::CompressionProfile profile :
+       { Database::CompressionProfile::kFastest,
+         Database::CompressionProfile::kSmallest }) {
+    KdbxFile file;
+    std::unique_ptr<Database> db;
+
+    EXPECT_NO_THROW({
+      db = file.Import(src_path, key);
+    });
+
+    db->set_compression_profile(profile);
+    db->set_compression_chunk_size(0);
+    EXPECT_EQ(db->compression_chunk_size(),
+              Database::kMinCompressionChunkSize);
+    db->set_compression_chunk_size(std::size_t(-1));
+    EXPECT_EQ(db->compression_chunk_size(),
+              Database::kMaxCompressionChunkSize);
+
+    EXPECT_NO_THROW({
+      file.Export(dst_path, *db, key);
+      db = file.Import(dst_path, key);
+    });
+    std::remove(dst_path.c_str());
+
+    std::shared_ptr<Group> root = db->root();
+    EXPECT_NE(root, nullptr);
+    EXPECT_EQ(root->ToJson(), json);
+  }
+}
+
+TEST(KdbxTest, ImportDecompressionBufferSize) {
+  Key key("password");
+  std::string json = GetTestJson("complex-1-pw-aes-gzip.json");
+
+  for (std::size_t buffer_size : { 1, 1024 * 1024 }) {
+    KdbxFile file;
+    file.set_decompression_buffer_size(buffer_size);
+    std::unique_ptr<Database> db =
+        file.Import(GetTestPath("complex-1-pw-aes-gzip.kdbx"), key);
+    EXPECT_EQ(db->root()->ToJson(), json);
+  }
+
+  KdbxFile file;
+  file.set_decompression_buffer_size(0);
+  EXPECT_THROW(file.Import(GetTestPath("complex-1-pw-aes-gzip.kdbx"), key),
+               InternalError);
+}
+
+TEST(KdbxTest, ImportPipelined) {
+  Key key("password");
+
+  for (const char* name : { "complex-1-pw-aes", "complex-1-pw-aes-gzip" }) {
+    std::string src_path = GetTestPath(std::string(name) + ".kdbx");
+    std::string json = GetTestJson(std::string(name) + ".json");
+
+    KdbxFile file;
+    file.set_pipelined_import(true);
+
+    std::unique_ptr<Database> db;
+    EXPECT_NO_THROW({
+      db = file.Import(src_path, key);
+    });
+
+    std::shared_ptr<Group> root = db->root();
+    EXPECT_NE(root, nullptr);
+    EXPECT_EQ(root->ToJson(), json);
+
+    EXPECT_THROW(file.Import(src_path, Key("wrong")), PasswordError);
+  }
+}
+
+TEST(KdbxTest, ImportPipelinedCancelled) {
+  std::shared_ptr<CancellationToken> token =
+      std::make_shared<CancellationToken>();
+  Progress progress([&](Progress::Phase phase, uint64_t, uint64_t) {
+    if (phase == Progress::Phase::kParse)
+      token->Cancel();
+  }, token);
+
+  KdbxFile file;
+  file.set_pipelined_import(true);
+  EXPECT_THROW(file.Import(GetTestPath("complex-1-pw-aes-gzip.kdbx"),
+                           Key("password"), progress),
+               CancelledError);
+}
+
+TEST(KdbxTest, ImportFromMemory) {
+  Key key("password");
+
+  for (const char* name : { "complex-1-pw-aes", "complex-1-pw-aes-gzip" }) {
+    std::ifstream src(GetTestPath(std::string(name) + ".kdbx"),
+                      std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(src)),
+                              std::istreambuf_iterator<char>());
+
+    KdbxFile file;
+    std::unique_ptr<Database> db;
+    EXPECT_NO_THROW({
+      db = file.Import(data.data(), data.size(), key);
+    });
+
+    std::shared_ptr<Group> root = db->root();
+    EXPECT_NE(root, nullptr);
+    EXPECT_EQ(root->ToJson(), GetTestJson(std::string(name) + ".json"));
+
+    // A buffer cut off inside the header must be rejected, not read past.
+    EXPECT_THROW(file.Import(data.data(), 64, key), IoError);
+  }
+}
+
+TEST(KdbxTest, ImportExportPipe) {
+  Key key("password");
+  std::string json = GetTestJson("complex-1-pw-aes.json");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db;
+
+  PipeStreambuf src_streambuf(GetFileData(GetTestPath("complex-1-pw-aes.kdbx")));
+  std::istream src(&src_streambuf);
+  EXPECT_NO_THROW({
+    db = file.Import(src, key);
+  });
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(db->root()->ToJson(), json);
+
+  PipeStreambuf dst_streambuf;
+  std::ostream dst(&dst_streambuf);
+  EXPECT_NO_THROW(file.Export(dst, *db, key));
+
+  PipeStreambuf tst_streambuf(dst_streambuf.data());
+  std::istream tst(&tst_streambuf);
+  EXPECT_NO_THROW({
+    db = file.Import(tst, key);
+  });
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(db->root()->ToJson(), json);
+}
+
+TEST(KdbxTest, ExportToMemory) {
+  Key key("password");
+  std::string json = GetTestJson("complex-1-pw-aes.json");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db =
+      file.Import(GetTestPath("complex-1-pw-aes.kdbx"), key);
+
+  std::vector<uint8_t> data;
+  EXPECT_NO_THROW(file.Export(data, *db, key));
+  EXPECT_NO_THROW({
+    db = file.Import(data.data(), data.size(), key);
+  });
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(db->root()->ToJson(), json);
+}
+
+TEST(KdbxTest, ExportToFd) {
+  Key key("password");
+  std::string dst_path = GetTmpPath("complex-1-pw-aes-fd.kdbx");
+  std::string json = GetTestJson("complex-1-pw-aes.json");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db =
+      file.Import(GetTestPath("complex-1-pw-aes.kdbx"), key);
+
+  int fd = open(dst_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  ASSERT_NE(fd, -1);
+  EXPECT_NO_THROW(file.Export(fd, *db, key));
+  close(fd);
+
+  EXPECT_NO_THROW({
+    db = file.Import(dst_path, key);
+  });
+  std::remove(dst_path.c_str());
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(db->root()->ToJson(), json);
+}
+
+TEST(KdbxTest, ExportFailureKeepsFile) {
+  Key key("password");
+  std::string dst_path = GetTmpPath("complex-1-pw-aes-keep.kdbx");
+
+  {
+    std::ofstream dst(dst_path, std::ios::binary);
+    dst << "original";
+  }
+
+  KdbxFile file;
+  std::unique_ptr<Database> db =
+      file.Import(GetTestPath("complex-1-pw-aes.kdbx"), key);
+  db->set_cipher(Database::Cipher::kTwofish);
+  EXPECT_THROW(file.Export(dst_path, *db, key), InternalError);
+
+  // The existing file must be untouched and the temporary file removed.
+  EXPECT_EQ(GetFileData(dst_path), "original");
+  std::size_t num_files = 0;
+  DIR* dir = opendir(GetTmpPath("").c_str());
+  ASSERT_NE(dir, nullptr);
+  while (dirent* entry = readdir(dir)) {
+    if (std::string(entry->d_name).find("complex-1-pw-aes-keep") == 0)
+      num_files++;
+  }
+  closedir(dir);
+  EXPECT_EQ(num_files, 1);
+
+  std::remove(dst_path.c_str());
+}
+
+TEST(KdbxTest, ExportThroughSymlink) {
+  Key key("password");
+  std::string dst_path = GetTmpPath("complex-1-pw-aes-target.kdbx");
+  std::string link_path = GetTmpPath("complex-1-pw-aes-link.kdbx");
+
+  {
+    std::ofstream dst(dst_path, std::ios::binary);
+    dst << "original";
+  }
+  chmod(dst_path.c_str(), 0600);
+  std::remove(link_path.c_str());
+  ASSERT_EQ(symlink("complex-1-pw-aes-target.kdbx", link_path.c_str()), 0);
+
+  KdbxFile file;
+  std::unique_ptr<Database> db =
+      file.Import(GetTestPath("complex-1-pw-aes.kdbx"), key);
+  file.Export(link_path, *db, key);
+
+  // The link must be kept and the file it points to replaced.
+  struct stat st;
+  ASSERT_EQ(lstat(link_path.c_str(), &st), 0);
+  EXPECT_TRUE(S_ISLNK(st.st_mode));
+  ASSERT_EQ(stat(dst_path.c_str(), &st), 0);
+  EXPECT_EQ(st.st_mode & 07777, 0600);
+  EXPECT_NE(GetFileData(dst_path), "original");
+  EXPECT_NO_THROW(file.Import(link_path, key));
+
+  std::remove(link_path.c_str());
+  std::remove(dst_path.c_str());
+}
+
+TEST(KdbxTest, ExportNewFileMode) {
+  Key key("password");
+  std::string dst_path = GetTmpPath("complex-1-pw-aes-mode.kdbx");
+  std::remove(dst_path.c_str());
+
+  KdbxFile file;
+  std::unique_ptr<Database> db =
+      file.Import(GetTestPath("complex-1-pw-aes.kdbx"), key);
+  mode_t mask = umask(022);
+  file.Export(dst_path, *db, key);
+  umask(mask);
+
+  // New files get the same mode as if created through open().
+  struct stat st;
+  ASSERT_EQ(stat(dst_path.c_str(), &st), 0);
+  EXPECT_EQ(st.st_mode & 07777, 0644);
+
+  std::remove(dst_path.c_str());
+}
+
+TEST(KdbxTest, ExportCompactXml) {
+  Key key("password");
+
+  for (const char* name : { "complex-1-pw-aes", "complex-1-pw-aes-gzip" }) {
+    std::string json = GetTestJson(std::string(name) + ".json");
+
+    KdbxFile file;
+    std::unique_ptr<Database> db =
+        file.Import(GetTestPath(std::string(name) + ".kdbx"), key);
+
+    std::vector<uint8_t> indented;
+    file.Export(indented, *db, key);
+
+    file.set_compact_xml(true);
+    std::vector<uint8_t> compact;
+    EXPECT_NO_THROW(file.Export(compact, *db, key));
+    EXPECT_LT(compact.size(), indented.size());
+
+    EXPECT_NO_THROW({
+      db = file.Import(compact.data(), compact.size(), key);
+    });
+    ASSERT_NE(db, nullptr);
+    EXPECT_EQ(db->root()->ToJson(), json);
+  }
+}
+
+TEST(KdbxTest, ImportEntryCallback) {
+  Key key("password");
+  std::string src_path = GetTestPath("complex-1-pw-aes.kdbx");
+
+  KdbxFile file;
+  std::unique_ptr<Database> db = file.Import(src_path, key);
+
+  std::vector<std::string> titles;
+  std::function<void(std::shared_ptr<Group>)> collect_titles =
+      [&](std::shared_ptr<Group> group) {
+    for (auto entry : group->Entries())
+      titles.push_back(*entry->title());
+    for (auto subgroup : group->Groups())
+      collect_titles(subgroup);
+  };
+  collect_titles(db->root());
+  ASSERT_FALSE(titles.empty());
+
+  std::vector<std::string> callback_titles;
+  file.set_entry_callback([&](std::shared_ptr<Group> group,
+                              std::shared_ptr<Entry> entry) {
+    EXPECT_NE(group, nullptr);
+    callback_titles.push_back(*entry->title());
+  });
+  EXPECT_NO_THROW({
+    db = file.Import(src_path, key);
+  });
+  ASSERT_NE(db, nullptr);
+  EXPECT_EQ(callback_titles, titles);
+
+  // Entries handed to the callback aren't retained in the groups.
+  std::vector<std::string> retained_titles;
+  titles.swap(retained_titles);
+  collect_titles(db->root());
+  EXPECT_TRUE(titles.empty());
+}
+
+TEST(KdbxTest, ImportLateGroupFields) {
+  Key key("password");
+
+  // The group name, notes, icon and last visible entry follow its entry and
+  // subgroup.
+  KdbxFile file;
+  std::unique_ptr<Database> db;
+  EXPECT_NO_THROW({
+    db = file.Import(GetTestPath("late-group-fields-pw-aes.kdbx"), key);
+  });
+  ASSERT_NE(db, nullptr);
+
+  std::shared_ptr<Group> root = db->root();
+  ASSERT_NE(root, nullptr);
+  EXPECT_EQ(root->name(), "Late");
+  EXPECT_EQ(root->notes(), "Late notes");
+  EXPECT_EQ(root->icon(), 7);
+  ASSERT_EQ(root->Entries().size(), 1);
+  EXPECT_EQ(*root->Entries()[0]->title(), "Entry");
+  EXPECT_EQ(root->last_visible_entry().lock(), root->Entries()[0]);
+  ASSERT_EQ(root->Groups().size(), 1);
+  EXPECT_EQ(root->Groups()[0]->name(), "Sub");
+  EXPECT_EQ(db->meta()->last_selected_group().lock(), root);
+  EXPECT_EQ(db->meta()->last_visible_group().lock(), root->Groups()[0]);
+}
+
+TEST(KdbxTest, ImportLazyDeobfuscation) {
+  Key key("password");
+
+  for (const char* name : { "complex-1-pw-aes", "complex-1-pw-aes-gzip" }) {
+    std::string src_path = GetTestPath(std::string(name) + ".kdbx");
+
+    KdbxFile file;
+    std::unique_ptr<Database> exp_db = file.Import(src_path, key);
+
+    file.set_lazy_deobfuscation(true);
+    std::unique_ptr<Database> db;
+    EXPECT_NO_THROW({
+      db = file.Import(src_path, key);
+    });
+    ASSERT_NE(db, nullptr);
+
+    // Protected values stay obfuscated until accessed, and only the accessed
+    // value is deobfuscated.
+    std::vector<std::shared_ptr<Entry>> entries;
+    std::function<void(std::shared_ptr<Group>)> collect_entries =
+        [&](std::shared_ptr<Group> group) {
+      for (auto entry : group->Entries())
+        entries.push_back(entry);
+      for (auto subgroup : group->Groups())
+        collect_entries(subgroup);
+    };
+    collect_entries(db->root());
+
+    std::vector<std::shared_ptr<Entry>> protected_entries;
+    for (auto entry : entries) {
+      if (entry->password().is_protected() && !entry->password().is_loaded())
+        protected_entries.push_back(entry);
+    }
+    ASSERT_GE(protected_entries.size(), 2);
+
+    // Access the last value first to make sure that it doesn't depend on the
+    // order of access.
+    std::string last_password = *protected_entries.back()->password();
+    EXPECT_TRUE(protected_entries.back()->password().is_loaded());
+    EXPECT_FALSE(protected_entries.front()->password().is_loaded());
+
+    EXPECT_EQ(db->root()->ToJson(), exp_db->root()->ToJson());
+    EXPECT_EQ(db->root()->ToJson(),
+              GetTestJson(std::string(name) + ".json"));
+    EXPECT_FALSE(last_password.empty());
+  }
+}
@@ -0,0 +1,126 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include "key.hh"
+
+using namespace keepass;
+
+TEST(KeyTest, CalibrateRounds) {
+  uint64_t rounds = 0;
+  EXPECT_NO_THROW(rounds = Key::CalibrateRounds(std::chrono::milliseconds(20)));
+  EXPECT_GT(rounds, 0);
+
+  // Even a zero target must yield a usable round count.
+  EXPECT_EQ(Key::CalibrateRounds(std::chrono::milliseconds(0)), 1);
+}
+
+TEST(KeyTest, TransformCache) {
+  TransformCache cache(2);
+  std::array<uint8_t, 32> id0 = { { 0 } }, id1 = { { 1 } }, id2 = { { 2 } };
+  std::array<uint8_t, 32> key0 = { { 10 } }, key1 = { { 11 } },
+      key2 = { { 12 } };
+
+  std::array<uint8_t, 32> tst;
+  EXPECT_FALSE(cache.Lookup(id0, tst));
+
+  cache.Insert(id0, key0);
+  cache.Insert(id1, key1);
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_TRUE(cache.Lookup(id0, tst));
+  EXPECT_EQ(tst, key0);
+
+  // Entry 1 is now the least recently used and should be evicted.
+  cache.Insert(id2, key2);
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_FALSE(cache.Lookup(id1, tst));
+  EXPECT_TRUE(cache.Lookup(id0, tst));
+  EXPECT_TRUE(cache.Lookup(id2, tst));
+  EXPECT_EQ(tst, key2);
+
+  cache.Clear();
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_FALSE(cache.Lookup(id0, tst));
+}
+
+TEST(KeyTest, TransformWithCache) {
+  std::array<uint8_t, 32> seed0 = { { 1, 2, 3 } }, seed1 = { { 4, 5, 6 } };
+
+  Key key("password");
+  std::array<uint8_t, 32> exp0 = key.Transform(
+      seed0, 1000, Key::SubKeyResolution::kHashSubKeys);
+  std::array<uint8_t, 32> exp1 = key.Transform(
+      seed1, 1000, Key::SubKeyResolution::kHashSubKeys);
+
+  std::shared_ptr<TransformCache> cache = std::make_shared<TransformCache>();
+  key.set_transform_cache(cache);
+  EXPECT_EQ(key.Transform(seed0, 1000, Key::SubKeyResolution::kHashSubKeys),
+            exp0);
+  EXPECT_EQ(cache->size(), 1);
+  EXPECT_EQ(key.Transform(seed0, 1000, Key::SubKeyResolution::kHashSubKeys),
+            exp0);
+  EXPECT_EQ(cache->size(), 1);
+  EXPECT_EQ(key.Transform(seed1, 1000, Key::SubKeyResolution::kHashSubKeys),
+            exp1);
+  EXPECT_EQ(cache->size(), 2);
+
+  // A different number of rounds must not hit the cache.
+  EXPECT_NE(key.Transform(seed0, 999, Key::SubKeyResolution::kHashSubKeys),
+            exp0);
+  EXPECT_EQ(cache->size(), 3);
+
+  // Neither must a different password.
+  Key other_key("other password");
+  other_key.set_transform_cache(cache);
+  EXPECT_NE(other_key.Transform(seed0, 1000,
+                                Key::SubKeyResolution::kHashSubKeys), exp0);
+}
+
+TEST(KeyTest, TransformBatch) {
+  // Use more jobs than lanes and different round counts to make sure that
+  // lanes are refilled properly.
+  std::vector<Key> keys;
+  for (std::size_t i = 0; i < 11; ++i)
+    keys.push_back(Key("password" + std::to_string(i)));
+
+  std::vector<Key::TransformJob> jobs;
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    Key::TransformJob job;
+    job.key = &keys[i];
+    job.seed = { { static_cast<uint8_t>(i), 0xaa } };
+    job.rounds = 100 + 37 * i;
+    job.resolution = i % 2 ? Key::SubKeyResolution::kHashSubKeys :
+        Key::SubKeyResolution::kHashSubKeysOnlyIfCompositeKey;
+    jobs.push_back(job);
+  }
+
+  // Zero rounds is a valid, if not very useful, configuration.
+  jobs[3].rounds = 0;
+
+  std::vector<std::array<uint8_t, 32>> transformed_keys;
+  EXPECT_NO_THROW(transformed_keys = Key::TransformBatch(jobs));
+  ASSERT_EQ(transformed_keys.size(), jobs.size());
+
+  for (std::size_t i = 0; i < jobs.size(); ++i) {
+    EXPECT_EQ(transformed_keys[i], jobs[i].key->Transform(
+        jobs[i].seed, jobs[i].rounds, jobs[i].resolution));
+  }
+
+  EXPECT_TRUE(Key::TransformBatch(std::vector<Key::TransformJob>()).empty());
+}
@@ -0,0 +1,110 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "random.hh"
+
+using namespace keepass;
+
+TEST(RandomTest, ObfuscatorChunks) {
+  std::array<uint8_t, 32> key = random_array<32>();
+  std::array<uint8_t, 8> iv = random_array<8>();
+
+  std::string data(5000, '\0');
+  for (std::size_t i = 0; i < data.size(); ++i)
+    data[i] = static_cast<char>(i);
+
+  RandomObfuscator obfuscator0(key, iv);
+  std::string exp = obfuscator0.Process(data);
+  EXPECT_NE(exp, data);
+
+  // Obfuscating in pieces of varying size must continue the same key stream.
+  RandomObfuscator obfuscator1(key, iv);
+  std::string tst;
+  std::size_t pos = 0;
+  for (std::size_t size = 1; pos < data.size(); size = size * 3 + 1) {
+    tst += obfuscator1.Process(data.substr(pos, size));
+    pos += std::min(size, data.size() - pos);
+  }
+  EXPECT_EQ(tst, exp);
+
+  RandomObfuscator obfuscator2(key, iv);
+  std::vector<uint8_t> bin(exp.begin(), exp.end());
+  std::vector<uint8_t> res = obfuscator2.Process(bin);
+  EXPECT_EQ(std::string(res.begin(), res.end()), data);
+}
+
+TEST(RandomTest, ObfuscatorSeek) {
+  std::array<uint8_t, 32> key = random_array<32>();
+
+  std::string data(5000, '\0');
+  for (std::size_t i = 0; i < data.size(); ++i)
+    data[i] = static_cast<char>(i);
+
+  RandomObfuscator salsa20(key, random_array<8>());
+  RandomObfuscator chacha20(key, random_array<12>());
+  for (RandomObfuscator* obfuscator : { &salsa20, &chacha20 }) {
+    std::string exp = obfuscator->Process(data);
+    EXPECT_EQ(obfuscator->offset(), data.size());
+
+    // Seeking backwards and forwards, to block boundaries and into blocks.
+    for (std::size_t offset : { 0, 1, 63, 64, 65, 511, 512, 1000, 4999 }) {
+      obfuscator->Seek(offset);
+      std::size_t size = std::min<std::size_t>(700, data.size() - offset);
+      EXPECT_EQ(obfuscator->Process(data.substr(offset, size)),
+                exp.substr(offset, size)) << offset;
+      EXPECT_EQ(obfuscator->offset(), offset + size);
+    }
+
+    // Skipping must leave the key stream where processing would have.
+    obfuscator->Seek(0);
+    std::string tst;
+    std::size_t pos = 0;
+    for (std::size_t size = 1; pos < data.size(); size = size * 3 + 1) {
+      std::size_t count = std::min(size, data.size() - pos);
+      if (size % 2 == 0) {
+        obfuscator->Skip(count);
+        tst += exp.substr(pos, count);
+      } else {
+        tst += obfuscator->Process(data.substr(pos, count));
+      }
+      pos += count;
+    }
+    EXPECT_EQ(tst, exp);
+  }
+}
+
+TEST(RandomTest, LazyObfuscator) {
+  std::array<uint8_t, 32> key = random_array<32>();
+  std::array<uint8_t, 8> iv = random_array<8>();
+
+  std::string data(1000, 'x');
+  RandomObfuscator obfuscator(key, iv);
+  std::string exp = obfuscator.Process(data);
+
+  LazyObfuscator lazy_obfuscator(RandomObfuscator(key, iv));
+  EXPECT_EQ(lazy_obfuscator.Process(900, data.substr(900)), exp.substr(900));
+  EXPECT_EQ(lazy_obfuscator.Process(10, data.substr(10, 20)),
+            exp.substr(10, 20));
+}
@@ -18,6 +18,7 @@
 
 #include <fstream>
 #include <random>
+#include <sstream>
 
 #include <gtest/gtest.h>
 
@@ -61,6 +62,114 @@ std::string GetFileAsText(const std::string& path) {
                      std::istreambuf_iterator<char>());
 }
 
+std::string GetRandomData(std::size_t size) {
+  std::mt19937 engine(static_cast<std::mt19937::result_type>(size));
+  std::uniform_int_distribution<int> uniform_dist(0, 255);
+
+  std::string data(size, '\0');
+  for (char& c : data)
+    c = static_cast<char>(uniform_dist(engine));
+  return data;
+}
+
+/**
+ * Checks that data compressed by parallel_gzip_ostreambuf decompresses to the
+ * original data, with every available deflate backend.
+ */
+void ExpectParallelGzipStream(const std::string& data, std::size_t chunk_size) {
+  for (DeflateBackend backend :
+       { DeflateBackend::kZlib, DeflateBackend::kLibdeflate }) {
+    if (!deflate_backend_available(backend))
+      continue;
+
+    GzipOptions options;
+    options.backend = backend;
+    options.chunk_size = chunk_size;
+
+    std::stringstream arc;
+    parallel_gzip_ostreambuf ostreambuf(arc, options);
+    std::ostream ostream(&ostreambuf);
+    ostream.write(data.data(), data.size());
+    ostream.flush();
+    EXPECT_TRUE(ostream.good());
+
+    // The chunks must make up a single gzip member, which is all that some
+    // readers decompress.
+    std::string compressed = arc.str();
+    std::string member(data.size() + 1, '\0');
+    z_stream z_stream;
+    z_stream.zalloc = Z_NULL;
+    z_stream.zfree = Z_NULL;
+    z_stream.opaque = Z_NULL;
+    ASSERT_EQ(inflateInit2(&z_stream, 16 + MAX_WBITS), Z_OK);
+    z_stream.avail_in = static_cast<uInt>(compressed.size());
+    z_stream.next_in = reinterpret_cast<Bytef*>(&compressed[0]);
+    z_stream.avail_out = static_cast<uInt>(member.size());
+    z_stream.next_out = reinterpret_cast<Bytef*>(&member[0]);
+    EXPECT_EQ(inflate(&z_stream, Z_FINISH), Z_STREAM_END);
+    EXPECT_EQ(z_stream.avail_in, 0);
+    member.resize(z_stream.total_out);
+    inflateEnd(&z_stream);
+    EXPECT_EQ(member, data);
+
+    gzip_istreambuf istreambuf(arc);
+    std::istream istream(&istreambuf);
+    std::string tst = std::string(std::istreambuf_iterator<char>(istream),
+                                  std::istreambuf_iterator<char>());
+    EXPECT_EQ(tst, data);
+  }
+}
+
+/**
+ * Checks that the CBC stream buffers produce the same output as
+ * encrypt_cbc() and decrypt_cbc().
+ */
+void ExpectCbcStream(std::size_t size) {
+  std::array<uint8_t, 32> key;
+  std::array<uint8_t, 16> iv;
+  key.fill(0x2a);
+  iv.fill(0x17);
+  AesCipher cipher(key, iv);
+
+  std::string data = GetRandomData(size);
+
+  std::stringstream exp_src(data), exp_dst;
+  encrypt_cbc(exp_src, exp_dst, cipher);
+
+  std::stringstream enc;
+  cbc_ostreambuf enc_streambuf(enc, cipher);
+  std::ostream enc_stream(&enc_streambuf);
+  enc_stream.write(data.data(), data.size());
+  enc_stream.flush();
+  EXPECT_TRUE(enc_stream.good());
+  EXPECT_EQ(enc.str(), exp_dst.str());
+
+  cbc_istreambuf dec_streambuf(enc, cipher);
+  std::istream dec_stream(&dec_streambuf);
+  std::string dec = std::string(std::istreambuf_iterator<char>(dec_stream),
+                                std::istreambuf_iterator<char>());
+  EXPECT_EQ(dec, data);
+
+  // Spans are decrypted in place, with progress reported on the span.
+  std::string enc_data = enc.str();
+  span_istreambuf span_streambuf(
+      reinterpret_cast<const uint8_t*>(enc_data.data()), enc_data.size());
+  std::istream span_stream(&span_streambuf);
+  uint64_t done = 0;
+  Progress progress([&done](Progress::Phase, uint64_t d, uint64_t) {
+    done = d;
+  });
+  cbc_istreambuf span_dec_streambuf(
+      span_stream, cipher,
+      SourceProgress(progress, Progress::Phase::kDecrypt, enc_data.size()));
+  std::istream span_dec_stream(&span_dec_streambuf);
+  std::string span_dec = std::string(
+      std::istreambuf_iterator<char>(span_dec_stream),
+      std::istreambuf_iterator<char>());
+  EXPECT_EQ(span_dec, data);
+  EXPECT_EQ(done, enc_data.size());
+}
+
 }   // namespace
 
 TEST(StreamTest, ReadEmptyHashedStream) {
@@ -147,6 +256,54 @@ TEST(StreamTest, ReadBadHashedStream) {
   }, IoError);
 }
 
+TEST(StreamTest, ReadHashedStreamInBulk) {
+  std::string data = GetRandomData(1000);
+
+  std::stringstream hashed;
+  hashed_ostreambuf enc_streambuf(hashed, 128);
+  std::ostream enc_stream(&enc_streambuf);
+  enc_stream.write(data.data(), data.size());
+  enc_stream.flush();
+  EXPECT_TRUE(enc_stream.good());
+
+  // Reads spanning several blocks, ending with a partial read at the end.
+  hashed_istreambuf dec_streambuf(hashed);
+  std::string dec(data.size() + 100, '\0');
+  EXPECT_EQ(dec_streambuf.sgetn(&dec[0], 300), 300);
+  EXPECT_EQ(dec_streambuf.sgetn(&dec[300], 5), 5);
+  EXPECT_EQ(dec_streambuf.sgetn(&dec[305], 795), 695);
+  EXPECT_EQ(dec_streambuf.sgetn(&dec[0], 1), 0);
+  dec.resize(data.size());
+  EXPECT_EQ(dec, data);
+}
+
+TEST(StreamTest, ReadLargeHashedStream) {
+  // Enough blocks for several batches that are verified in parallel.
+  std::string data = GetRandomData(20 * 1024 * 1024 + 5);
+
+  std::stringstream hashed;
+  hashed_ostreambuf enc_streambuf(hashed, 64 * 1024);
+  std::ostream enc_stream(&enc_streambuf);
+  enc_stream.write(data.data(), data.size());
+  enc_stream.flush();
+  EXPECT_TRUE(enc_stream.good());
+  std::string encoded = hashed.str();
+
+  hashed_istreambuf dec_streambuf(hashed);
+  std::istream dec_stream(&dec_streambuf);
+  std::string dec = std::string(std::istreambuf_iterator<char>(dec_stream),
+                                std::istreambuf_iterator<char>());
+  EXPECT_EQ(dec, data);
+
+  // Corrupt the data of a block in the middle of a batch.
+  encoded[encoded.size() / 2] ^= 1;
+  std::stringstream corrupt(encoded);
+  hashed_istreambuf corrupt_streambuf(corrupt);
+  EXPECT_THROW({
+    while (corrupt_streambuf.sbumpc() != std::char_traits<char>::eof()) {}
+  }, IoError);
+}
+
 TEST(StreamTest, WriteEmptyHashedStream) {
   const std::string dst_path = GetTmpPath("hashed_stream-0");
   const std::string tst_path = GetTestPath("hashed_stream-0");
@@ -244,6 +401,168 @@ TEST(StreamTest, Write260BytesHashedStream) {
   std::remove(dst_path.c_str());
 }
 
+TEST(StreamTest, WriteHashedStreamInBulk) {
+  std::string data = GetRandomData(1000);
+
+  // Byte by byte writes go through the put area only.
+  std::stringstream exp;
+  hashed_ostreambuf exp_streambuf(exp, 128);
+  for (char c : data)
+    exp_streambuf.sputc(c);
+  exp_streambuf.pubsync();
+
+  // Mix of writes smaller than, spanning and covering whole blocks.
+  std::stringstream tst;
+  hashed_ostreambuf tst_streambuf(tst, 128);
+  EXPECT_EQ(tst_streambuf.sputn(&data[0], 5), 5);
+  EXPECT_EQ(tst_streambuf.sputn(&data[5], 300), 300);
+  EXPECT_EQ(tst_streambuf.sputn(&data[305], 695), 695);
+  tst_streambuf.pubsync();
+
+  EXPECT_EQ(tst.str(), exp.str());
+}
+
+TEST(StreamTest, FlushHashedStreamTwice) {
+  std::string data = GetRandomData(1000);
+
+  std::stringstream hashed;
+  hashed_ostreambuf enc_streambuf(hashed, 128);
+  std::ostream enc_stream(&enc_streambuf);
+  enc_stream.write(data.data(), data.size());
+  enc_stream.flush();
+  std::string encoded = hashed.str();
+
+  // Only the first flush ends the stream, later writes are rejected.
+  enc_stream.flush();
+  EXPECT_TRUE(enc_stream.good());
+  EXPECT_EQ(enc_streambuf.sputn(data.data(), 1), 0);
+  EXPECT_EQ(hashed.str(), encoded);
+
+  hashed_istreambuf dec_streambuf(hashed);
+  std::istream dec_stream(&dec_streambuf);
+  std::string dec = std::string(std::istreambuf_iterator<char>(dec_stream),
+                                std::istreambuf_iterator<char>());
+  EXPECT_EQ(dec, data);
+}
+
+TEST(StreamTest, ReadHmacBlockStream) {
+  std::array<uint8_t, 64> key;
+  for (std::size_t i = 0; i < key.size(); ++i)
+    key[i] = static_cast<uint8_t>(i);
+
+  std::ifstream file(GetTestPath("hmac_block_stream-26"),
+                     std::ios::in | std::ios::binary);
+  EXPECT_EQ(file.is_open(), true);
+
+  hmac_block_istreambuf streambuf(file, key);
+  std::istream stream(&streambuf);
+
+  std::string str = std::string(std::istreambuf_iterator<char>(stream),
+                                std::istreambuf_iterator<char>());
+  EXPECT_EQ(stream.good(), true);
+  EXPECT_EQ(str, "abcdefghijklmnopqrstuvwxyz");
+}
+
+TEST(StreamTest, ReadBadHmacBlockStream) {
+  std::array<uint8_t, 64> key;
+  for (std::size_t i = 0; i < key.size(); ++i)
+    key[i] = static_cast<uint8_t>(i);
+
+  std::ifstream file(GetTestPath("hmac_block_stream-26-bad"),
+                     std::ios::in | std::ios::binary);
+  EXPECT_EQ(file.is_open(), true);
+
+  hmac_block_istreambuf streambuf(file, key);
+  std::istream stream(&streambuf);
+
+  EXPECT_THROW({
+    std::string str = std::string(std::istreambuf_iterator<char>(stream),
+                                  std::istreambuf_iterator<char>());
+  }, IoError);
+
+  // A different key or a missing last block must be noticed as well.
+  std::string data = GetFileAsText(GetTestPath("hmac_block_stream-26"));
+  std::array<uint8_t, 64> bad_key = key;
+  bad_key[0] ^= 1;
+
+  std::stringstream bad_key_src(data);
+  hmac_block_istreambuf bad_key_streambuf(bad_key_src, bad_key);
+  std::istream bad_key_stream(&bad_key_streambuf);
+  EXPECT_THROW({
+    std::string str = std::string(
+        std::istreambuf_iterator<char>(bad_key_stream),
+        std::istreambuf_iterator<char>());
+  }, IoError);
+
+  std::stringstream truncated_src(data.substr(0, data.size() - 36));
+  hmac_block_istreambuf truncated_streambuf(truncated_src, key);
+  std::istream truncated_stream(&truncated_streambuf);
+  EXPECT_THROW({
+    std::string str = std::string(
+        std::istreambuf_iterator<char>(truncated_stream),
+        std::istreambuf_iterator<char>());
+  }, IoError);
+}
+
+TEST(StreamTest, WriteHmacBlockStream) {
+  const std::string dst_path = GetTmpPath("hmac_block_stream-26");
+  const std::string tst_path = GetTestPath("hmac_block_stream-26");
+
+  std::array<uint8_t, 64> key;
+  for (std::size_t i = 0; i < key.size(); ++i)
+    key[i] = static_cast<uint8_t>(i);
+
+  std::ofstream file(dst_path, std::ios::out | std::ios::binary);
+  EXPECT_EQ(file.is_open(), true);
+
+  hmac_block_ostreambuf streambuf(file, key, 16);
+  std::ostream stream(&streambuf);
+  stream << "abcdefghijklmnopqrstuvwxyz";
+  stream.flush();
+  EXPECT_EQ(stream.good(), true);
+
+  // Nothing may follow the last block.
+  stream.flush();
+  stream << "a";
+  stream.flush();
+  EXPECT_EQ(stream.good(), false);
+  file.close();
+
+  EXPECT_EQ(FilesEqual(tst_path, dst_path), true);
+  std::remove(dst_path.c_str());
+}
+
+TEST(StreamTest, HmacBlockStreamInBulk) {
+  std::array<uint8_t, 64> key;
+  key.fill(0x2a);
+
+  std::string data = GetRandomData(1000);
+
+  std::stringstream enc;
+  hmac_block_ostreambuf enc_streambuf(enc, key, 128);
+  std::ostream enc_stream(&enc_streambuf);
+  enc_stream.write(data.data(), data.size());
+  enc_stream.flush();
+  EXPECT_TRUE(enc_stream.good());
+  std::string encoded = enc.str();
+
+  hmac_block_istreambuf dec_streambuf(enc, key);
+  std::istream dec_stream(&dec_streambuf);
+  std::string dec = std::string(std::istreambuf_iterator<char>(dec_stream),
+                                std::istreambuf_iterator<char>());
+  EXPECT_EQ(dec, data);
+
+  span_istreambuf span_streambuf(
+      reinterpret_cast<const uint8_t*>(encoded.data()), encoded.size());
+  std::istream span_stream(&span_streambuf);
+  hmac_block_istreambuf span_dec_streambuf(span_stream, key);
+  std::istream span_dec_stream(&span_dec_streambuf);
+  std::string span_dec = std::string(
+      std::istreambuf_iterator<char>(span_dec_stream),
+      std::istreambuf_iterator<char>());
+  EXPECT_EQ(span_dec, data);
+}
+
 TEST(StreamTest, ReadEmptyGzipStream) {
   std::ifstream file(GetTestPath("gzip_stream-0.gzip"),
                      std::ios::in | std::ios::binary);
@@ -494,3 +813,141 @@ TEST(StreamTest, Write16511BytesGzipStream) {
   std::remove(arc_path.c_str());
   std::remove(tst_path.c_str());
 }
+
+TEST(StreamTest, WriteGzipStreamInBulk) {
+  std::string data = GetRandomData(100000);
+
+  // Mix of writes fitting in and exceeding the internal buffer.
+  std::stringstream arc;
+  gzip_ostreambuf ostreambuf(arc);
+  EXPECT_EQ(ostreambuf.sputn(&data[0], 10), 10);
+  EXPECT_EQ(ostreambuf.sputn(&data[10], 50000), 50000);
+  EXPECT_EQ(ostreambuf.sputn(&data[50010], 49990), 49990);
+  ostreambuf.pubsync();
+
+  gzip_istreambuf istreambuf(arc);
+  std::istream istream(&istreambuf);
+  std::string tst = std::string(std::istreambuf_iterator<char>(istream),
+                                std::istreambuf_iterator<char>());
+  EXPECT_EQ(tst, data);
+}
+
+TEST(StreamTest, ParallelGzipStream) {
+  ExpectParallelGzipStream("", 1000);
+  ExpectParallelGzipStream(GetRandomData(500), 1000);
+  ExpectParallelGzipStream(GetRandomData(1000), 1000);
+  ExpectParallelGzipStream(GetRandomData(100000), 1000);
+
+  // Repetitive data compresses well only with the previous chunks as
+  // dictionary.
+  std::string text;
+  while (text.size() < 200000)
+    text += "abcdefghijklmnopqrstuvwxyz0123456789";
+  ExpectParallelGzipStream(text, 1000);
+  ExpectParallelGzipStream(text, 128 * 1024);
+}
+
+TEST(StreamTest, ThreadedStream) {
+  std::string data = GetRandomData(100000);
+
+  // Blocks small enough for the producer to wait for the consumer.
+  std::stringstream src(data);
+  threaded_istreambuf streambuf(src, 1000, 3);
+  std::istream stream(&streambuf);
+  std::string tst = std::string(std::istreambuf_iterator<char>(stream),
+                                std::istreambuf_iterator<char>());
+  EXPECT_EQ(tst, data);
+}
+
+TEST(StreamTest, ThreadedStreamError) {
+  std::ifstream file(GetTestPath("hashed_stream-260-bad"),
+                     std::ios::in | std::ios::binary);
+  EXPECT_EQ(file.is_open(), true);
+
+  hashed_istreambuf hashed_streambuf(file);
+  std::istream hashed_stream(&hashed_streambuf);
+
+  // The checksum error is thrown on the producer thread.
+  threaded_istreambuf streambuf(hashed_stream, 16, 2);
+  EXPECT_THROW({
+    while (streambuf.sbumpc() != std::char_traits<char>::eof()) {}
+  }, IoError);
+}
+
+TEST(StreamTest, ThreadedStreamDestroyedEarly) {
+  std::string data = GetRandomData(100000);
+
+  std::stringstream src(data);
+  threaded_istreambuf streambuf(src, 1000, 3);
+  EXPECT_EQ(streambuf.sbumpc(), static_cast<uint8_t>(data[0]));
+}
+
+TEST(StreamTest, CbcStream) {
+  ExpectCbcStream(0);
+  ExpectCbcStream(15);
+  ExpectCbcStream(16);
+  ExpectCbcStream(100000);
+  // Ends exactly on a read buffer boundary once padded, and spans two read
+  // buffers.
+  ExpectCbcStream(1024 * 1024 - 1);
+  ExpectCbcStream(1024 * 1024 + 17);
+}
+
+TEST(StreamTest, ReadBadCbcStream) {
+  std::array<uint8_t, 32> key;
+  std::array<uint8_t, 16> iv;
+  key.fill(0x2a);
+  iv.fill(0x17);
+  AesCipher cipher(key, iv);
+
+  // Not a multiple of the block size.
+  std::stringstream src(GetRandomData(33));
+  cbc_istreambuf streambuf(src, cipher);
+  std::istream stream(&streambuf);
+
+  EXPECT_THROW({
+    std::string str = std::string(std::istreambuf_iterator<char>(stream),
+                                  std::istreambuf_iterator<char>());
+  }, IoError);
+}
+
+TEST(StreamTest, StreamCipherStream) {
+  std::array<uint8_t, 32> key;
+  std::array<uint8_t, 12> iv;
+  key.fill(0x2a);
+  iv.fill(0x17);
+
+  std::string data = GetRandomData(200000 + 13);
+
+  ChaCha20Cipher exp_cipher(key, iv);
+  std::string exp(data.size(), '\0');
+  exp_cipher.Process(reinterpret_cast<const uint8_t*>(data.data()),
+                     reinterpret_cast<uint8_t*>(&exp[0]), data.size());
+
+  ChaCha20Cipher enc_cipher(key, iv);
+  std::stringstream enc;
+  stream_cipher_ostreambuf enc_streambuf(enc, enc_cipher);
+  std::ostream enc_stream(&enc_streambuf);
+  enc_stream.write(data.data(), data.size());
+  enc_stream.flush();
+  EXPECT_TRUE(enc_stream.good());
+  EXPECT_EQ(enc.str(), exp);
+
+  ChaCha20Cipher dec_cipher(key, iv);
+  stream_cipher_istreambuf dec_streambuf(enc, dec_cipher);
+  std::istream dec_stream(&dec_streambuf);
+  std::string dec = std::string(std::istreambuf_iterator<char>(dec_stream),
+                                std::istreambuf_iterator<char>());
+  EXPECT_EQ(dec, data);
+
+  ChaCha20Cipher span_dec_cipher(key, iv);
+  span_istreambuf span_streambuf(reinterpret_cast<const uint8_t*>(exp.data()),
+                                 exp.size());
+  std::istream span_stream(&span_streambuf);
+  stream_cipher_istreambuf span_dec_streambuf(span_stream, span_dec_cipher);
+  std::istream span_dec_stream(&span_dec_streambuf);
+  std::string span_dec = std::string(
+      std::istreambuf_iterator<char>(span_dec_stream),
+      std::istreambuf_iterator<char>());
+  EXPECT_EQ(span_dec, data);
+}
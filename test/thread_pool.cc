@@ -0,0 +1,69 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "thread_pool.hh"
+
+using namespace keepass;
+
+TEST(ThreadPoolTest, ParallelFor) {
+  for (std::size_t num_workers : { 0, 1, 4 }) {
+    ThreadPool pool(num_workers);
+    EXPECT_EQ(pool.concurrency(), num_workers + 1);
+
+    std::vector<std::atomic<int>> calls(100);
+    for (std::atomic<int>& call : calls)
+      call = 0;
+    pool.ParallelFor(calls.size(), [&calls](std::size_t i) { calls[i]++; });
+    for (const std::atomic<int>& call : calls)
+      EXPECT_EQ(call, 1);
+
+    pool.ParallelFor(0, [](std::size_t) { FAIL(); });
+  }
+}
+
+TEST(ThreadPoolTest, Nested) {
+  ThreadPool pool(2);
+  std::atomic<int> calls(0);
+  pool.ParallelFor(8, [&pool, &calls](std::size_t) {
+    pool.ParallelFor(8, [&calls](std::size_t) { calls++; });
+  });
+  EXPECT_EQ(calls, 64);
+}
+
+TEST(ThreadPoolTest, Exception) {
+  ThreadPool pool(2);
+  std::atomic<int> calls(0);
+  EXPECT_THROW(pool.ParallelFor(16, [&calls](std::size_t i) {
+    calls++;
+    if (i == 3)
+      throw std::runtime_error("task");
+  }), std::runtime_error);
+
+  // All tasks run even if one of them fails.
+  EXPECT_EQ(calls, 16);
+
+  calls = 0;
+  pool.ParallelFor(16, [&calls](std::size_t) { calls++; });
+  EXPECT_EQ(calls, 16);
+}
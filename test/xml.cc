@@ -0,0 +1,195 @@
+/*
+ * libkeepass - KeePass key database importer/exporter
+ * Copyright (C) 2014 Christian Kindahl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "base64.hh"
+#include "exception.hh"
+#include "xml.hh"
+
+using namespace keepass;
+
+TEST(XmlTest, Indented) {
+  std::stringstream dst;
+  XmlWriter writer(dst, XmlWriter::Format::kIndented);
+  writer.WriteDeclaration();
+  writer.StartElement("Root");
+  writer.WriteElement("Text", "abc");
+  writer.WriteElement("Empty", "");
+  writer.StartElement("Nested");
+  writer.WriteAttribute("ID", "1");
+  writer.WriteElement("Value", 42);
+  writer.EndElement();
+  writer.EndElement();
+  writer.Finish();
+
+  EXPECT_EQ(dst.str(),
+            "<?xml version=\"1.0\"?>\n"
+            "<Root>\n"
+            "\t<Text>abc</Text>\n"
+            "\t<Empty />\n"
+            "\t<Nested ID=\"1\">\n"
+            "\t\t<Value>42</Value>\n"
+            "\t</Nested>\n"
+            "</Root>\n");
+}
+
+TEST(XmlTest, Compact) {
+  std::stringstream dst;
+  XmlWriter writer(dst, XmlWriter::Format::kCompact);
+  writer.StartElement("Root");
+  writer.WriteElement("True", true);
+  writer.WriteElement("False", false);
+  writer.EndElement();
+  writer.Finish();
+
+  EXPECT_EQ(dst.str(),
+            "<Root><True>true</True><False>false</False></Root>");
+}
+
+TEST(XmlTest, Escaping) {
+  std::stringstream dst;
+  XmlWriter writer(dst, XmlWriter::Format::kCompact);
+  writer.StartElement("Root");
+  writer.WriteAttribute("A", "<\"&\">\n");
+  writer.WriteText("<a href=\"x\">&amp;</a>\r\n\t");
+  writer.EndElement();
+  writer.Finish();
+
+  EXPECT_EQ(dst.str(),
+            "<Root A=\"&lt;&quot;&amp;&quot;&gt;&#10;\">"
+            "&lt;a href=\"x\"&gt;&amp;amp;&lt;/a&gt;&#13;\n\t</Root>");
+}
+
+TEST(XmlTest, Base64InPieces) {
+  std::string data;
+  for (int i = 0; i < 10000; ++i)
+    data.push_back(static_cast<char>(i * 7));
+
+  // Feed the data in uneven pieces to exercise the carry between calls.
+  for (std::size_t piece : { 1, 2, 3, 4, 5, 4096, 10000 }) {
+    std::stringstream dst;
+    XmlWriter writer(dst, XmlWriter::Format::kCompact);
+    writer.StartElement("Data");
+    for (std::size_t i = 0; i < data.size(); i += piece) {
+      writer.WriteBase64(data.data() + i,
+                         std::min(piece, data.size() - i));
+    }
+    writer.EndElement();
+    writer.Finish();
+
+    EXPECT_EQ(dst.str(), "<Data>" + base64_encode(data) + "</Data>");
+  }
+}
+
+TEST(XmlTest, Read) {
+  std::stringstream src(
+      "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\n"
+      "<!-- Comment -->\n"
+      "<Root>\n"
+      "\t<Text a='1' b=\"&lt;2&gt;\"> x &amp; y </Text>\n"
+      "\t<Empty/>\n"
+      "\t<Data><![CDATA[<raw>]]></Data>\n"
+      "</Root>\n");
+  XmlReader reader(src, 7);   // Small buffer to cross buffer boundaries.
+
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kStartElement);
+  EXPECT_EQ(reader.name(), "Root");
+  EXPECT_EQ(reader.depth(), 1);
+
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kStartElement);
+  EXPECT_EQ(reader.name(), "Text");
+  ASSERT_EQ(reader.attributes().size(), 2);
+  EXPECT_EQ(reader.attributes()[0].first, "a");
+  EXPECT_EQ(reader.attributes()[0].second, "1");
+  EXPECT_EQ(reader.attributes()[1].first, "b");
+  EXPECT_EQ(reader.attributes()[1].second, "<2>");
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kText);
+  EXPECT_EQ(reader.text(), "x & y");
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kEndElement);
+  EXPECT_EQ(reader.name(), "Text");
+
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kStartElement);
+  EXPECT_EQ(reader.name(), "Empty");
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kEndElement);
+  EXPECT_EQ(reader.name(), "Empty");
+
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kStartElement);
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kText);
+  EXPECT_EQ(reader.text(), "<raw>");
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kEndElement);
+
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kEndElement);
+  EXPECT_EQ(reader.name(), "Root");
+  EXPECT_EQ(reader.depth(), 0);
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kEnd);
+}
+
+TEST(XmlTest, ReadCharacterReferences) {
+  std::stringstream src("<a>&#65;&#x42;&#xe5;&#x20ac;&#x1f600;&foo;</a>");
+  XmlReader reader(src);
+  reader.Next();
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kText);
+  EXPECT_EQ(reader.text(), "AB\xc3\xa5\xe2\x82\xac\xf0\x9f\x98\x80&foo;");
+}
+
+TEST(XmlTest, ReadSkip) {
+  std::stringstream src("<a><b><c>1</c><d/></b><e>2</e></a>");
+  XmlReader reader(src);
+  reader.Next();
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kStartElement);
+  EXPECT_EQ(reader.name(), "b");
+  reader.Skip();
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kStartElement);
+  EXPECT_EQ(reader.name(), "e");
+}
+
+TEST(XmlTest, ReadMalformed) {
+  for (const char* xml : { "", "<a>", "<a></b>", "<a/><b/>", "text",
+                           "<a x=1/>", "<a><!-- </a>" }) {
+    std::stringstream src(xml);
+    XmlReader reader(src);
+    EXPECT_THROW({
+      while (reader.Next() != XmlReader::Node::kEnd) {}
+    }, FormatError) << xml;
+  }
+}
+
+TEST(XmlTest, WriteRead) {
+  std::string text = "  <&>\"'\r\n\ttext\xc3\xa5  ";
+
+  std::stringstream dst;
+  XmlWriter writer(dst, XmlWriter::Format::kIndented);
+  writer.WriteDeclaration();
+  writer.StartElement("Root");
+  writer.WriteAttribute("Attr", text);
+  writer.WriteText(text);
+  writer.EndElement();
+  writer.Finish();
+
+  XmlReader reader(dst);
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kStartElement);
+  ASSERT_EQ(reader.attributes().size(), 1);
+  EXPECT_EQ(reader.attributes()[0].second, text);
+  EXPECT_EQ(reader.Next(), XmlReader::Node::kText);
+  EXPECT_EQ(reader.text(), "<&>\"'\r\n\ttext\xc3\xa5");
+}